@@ -4,7 +4,7 @@ def create_files(path):
     files = []
     if not os.path.exists(path):
         os.makedirs(path)
-    for i in xrange(20):
+    for i in range(20):
         filepath = os.path.join(path, "file%02d.txt" % i)
         with open(filepath, 'wb') as f:
             pass
@@ -16,7 +16,7 @@ def create_dirs( path, numbers ):
     if not numbers:
         return create_files(path)
     
-    newdirs = ["dir%02d" % i for i in xrange(numbers[0])]
+    newdirs = ["dir%02d" % i for i in range(numbers[0])]
     
     new_files = []
     for dir in newdirs:
@@ -25,4 +25,4 @@ def create_dirs( path, numbers ):
 
 
 files = create_dirs('tmp', [30, 10, 10, 3])
-print "Created %d files" % len(files)
+print("Created %d files" % len(files))
@@ -8,6 +8,8 @@
 #pragma once
 
 #include <stdint.h>
+#include <limits.h>
+#include <stdlib.h>
 
 #if defined(_MSC_VER)
 	#define DLL_EXPORT __declspec(dllexport)
@@ -21,6 +23,8 @@ enum EFileEvents
 {
 	FE_CREATED		= 0x00000001,
 	FE_REMOVED		= 0x00000002,
+	//!< Linux: A move within the watched paths is one event with both the old and the new path (see SFileEvent::m_TargetOffset and fe_rename_callback).
+	//!< A move to/from a path that isn't watched is reported as FE_REMOVED/FE_CREATED
 	FE_RENAMED		= 0x00000004,
 	FE_MODIFIED		= 0x00000008,
 
@@ -28,14 +32,41 @@ enum EFileEvents
 	//!< Linux: IN_ATTRIB
 	FE_ATTRIBUTE	= 0x00000010,
 
+	//!< Events were lost. It's always sent, whatever the mask of the watch.
+	//!< Linux: The kernel queue overflowed. Sent with the path of each watch, and followed by the changes found by rescanning it (see m_RescanOnOverflow)
+	//!< Darwin: kFSEventStreamEventFlagMustScanSubDirs, kFSEventStreamEventFlagUserDropped, kFSEventStreamEventFlagKernelDropped
+	//!< Ring buffer: Events didn't fit in the ring, or an event's paths didn't fit in the strings buffer of fe_poll_events(). Sent with an empty path and the watch id -1.
+	FE_OVERFLOW		= 0x00000020,
+
 	FE_IS_FILE 		= 0x00010000,
 	FE_IS_DIR 		= 0x00020000,
 	FE_IS_SYMLINK	= 0x00040000,
 
+	//!< Watch flag, passed in the mask to fe_add_watch(). Also watches all sub directories, including the ones created later.
+	//!< Darwin: The FSEvents streams are always recursive
+	FE_RECURSIVE	= 0x01000000,
+
 	FE_ALL = FE_CREATED | FE_REMOVED | FE_RENAMED | FE_MODIFIED
 };
 
 
+/** The OS facility used for watching the files
+ */
+enum EFileEventsBackend
+{
+	FE_BACKEND_DEFAULT	= 0,	//!< Linux: inotify. Darwin: FSEvents. Windows: ReadDirectoryChangesW
+
+	//!< Linux: fanotify, with one mark per file system (FAN_MARK_FILESYSTEM). The kernel memory doesn't grow with the number
+	//!< of directories, so it can watch trees of any size. It needs CAP_SYS_ADMIN (and Linux 5.9), otherwise inotify is used.
+	FE_BACKEND_FANOTIFY	= 1,
+
+	//!< Linux: Polls all the watches with stat() (see m_PollIntervalMs), e.g. for overlay mounts whose lower layers change.
+	//!< The default backend already polls the watches on network and FUSE file systems (NFS, SMB, 9p, Ceph...), since inotify
+	//!< doesn't see the changes made by other machines.
+	FE_BACKEND_POLL		= 2
+};
+
+
 /* Windows: http://msdn.microsoft.com/en-us/library/cc246556.aspx
  * Darwin: https://developer.apple.com/library/mac/#documentation/Darwin/Reference/FSEvents_Ref/Reference/reference.html#//apple_ref/c/func/FSEventStreamCreate
  *
@@ -57,6 +88,37 @@ typedef int64_t HFESWatchID;
 typedef int (*fe_callback)( const char* path, EFileEvents flags, void* ctx );
 
 
+/** The rename callback function type
+ * @param srcpath	The old path of the file/folder
+ * @param dstpath	The new path of the file/folder
+ * @param flags		The flags making up the type of the event (FE_RENAMED and the type of the file)
+ * @param ctx		The user supplied context that was registered to fe_init()
+ */
+typedef int (*fe_rename_callback)( const char* srcpath, const char* dstpath, EFileEvents flags, void* ctx );
+
+
+/** A file event, as sent to the batch callback
+ */
+struct SFileEvent
+{
+	HFESWatchID	m_WatchID;		//!< The watch that caught the event (the first one, if several watches overlap)
+	uint32_t	m_Flags;		//!< The EFileEvents flags
+	uint32_t	m_PathOffset;	//!< The offset of the path in the string arena
+	uint32_t	m_PathLength;	//!< The length of the path. The path is also null terminated.
+	uint32_t	m_TargetOffset;	//!< Renames: The offset of the new path in the string arena (the path is the old path)
+	uint32_t	m_TargetLength;	//!< Renames: The length of the new path. 0 if the event only has one path.
+	uint32_t	_pad;
+};
+
+/** The batch callback function type
+ * @param events	The events, in the order they happened
+ * @param count		The number of events
+ * @param strings	The string arena that holds the paths of the events. It's only valid during the call.
+ * @param ctx		The user supplied context that was registered to fe_init()
+ */
+typedef int (*fe_batch_callback)( const SFileEvent* events, uint32_t count, const char* strings, void* ctx );
+
+
 /** Used for initialization of the system
  */
 struct SFileEventsCreateParams
@@ -64,9 +126,21 @@ struct SFileEventsCreateParams
 	SFileEventsCreateParams();
 
 	fe_callback	m_Callback;		//!< The callback that receives file events
+	fe_batch_callback m_BatchCallback;	//!< If set, it receives the events in batches (one per read from the OS), instead of m_Callback
+	fe_rename_callback m_RenameCallback;	//!< If set, it receives the renames that have both paths, instead of m_Callback. Otherwise m_Callback gets one FE_RENAMED event for each path.
 	void*		m_CallbackCtx;	//!< A user specified context that is passed on to the callback with each event.
+	const char*	m_JournalPath;	//!< Linux: If set, the snapshot of the watched paths is loaded from this file by fe_init(), and saved to it by fe_close(). When a watch is added for a path that is in the journal, the changes since it was saved are sent as events. Only the paths watched by the run are saved. Not used with the other backends.
+	uint32_t	m_EventRingSize;	//!< If non zero, the events are put in a lock free ring buffer of (at least) this many bytes, instead of being sent to the callbacks. See fe_poll_events()
+	uint32_t	m_CoalesceMs;	//!< If non zero, the events are held for this many milliseconds, and the events for the same path are merged into one (the flags are or:ed). A path that is created and then removed within the window isn't reported at all.
+	uint32_t	m_Backend;		//!< The EFileEventsBackend to use
+	uint32_t	m_DispatchThreads;	//!< If more than 1, the callbacks are called from this many threads, so that slow callbacks don't hold up the reading of events. The events for a path are always delivered in order, by the same thread, but the callbacks must be thread safe.
+	uint32_t	m_PollIntervalMs;	//!< Linux: How often the polled watches (see FE_BACKEND_POLL) are scanned, at most. A directory that doesn't change is scanned less and less often, down to 64 times less. Default: 500
+	uint32_t	m_PollStatsPerSecond;	//!< Linux: The most files the polled watches stat per second, so that large trees cost a bounded amount of CPU (they're scanned less often instead). Default: 20000
 	bool 		m_Verbose;		//!< Enables debug print outs
-	bool		_padding[7];
+	bool 		m_RescanOnOverflow;	//!< Linux: Keeps a snapshot of the watched paths (a stat per event), so that when events are lost, the watches are rescanned and the differences are sent as events
+	bool 		m_SharedEngine;	//!< Linux: Uses one inotify instance and one thread for all the systems created with this flag, instead of one each. The kernel watches are shared as well. A callback may create or close other shared systems, but not close its own.
+	bool 		m_ContentHash;	//!< Linux: A file's FE_MODIFIED is sent when it's closed after writing, and only if its content changed (a hash of each written file is kept, by path). Rewriting a file with the same bytes gives no event. The files aren't hashed when they're watched, so the first write of each file is always sent.
+	bool 		m_IoUring;		//!< Linux: Reads the inotify events with io_uring instead of epoll (not with m_SharedEngine or fanotify), and stats the files found by the crawls in batches. Falls back to epoll (and fstatat) if the kernel doesn't have io_uring (Linux 5.11+).
 };
 
 
@@ -90,16 +164,121 @@ DLL_EXPORT void fe_close(HFES handle);
 /** Registers a path to the watch list
  *
  * @note:	It is not a requirement to remove all watchers before closing down
- * @note:	It is possible to update the event mask for a previously registered path by calling this function a second time
+ * @note:	It is possible to update the event mask for a previously registered path by calling this function a second time.
+ *			Adding or dropping FE_RECURSIVE that way crawls the tree again (nothing is reported for what's already there).
  *
  * @param handle	The file events system
  * @param path		The path to watch (folder or file)
- * @param mask		The events that should be caught for the path. 0 means all events.
+ * @param mask		The events that should be caught for the path. 0 means all events. Add FE_RECURSIVE to watch all sub directories.
+ * 					Only the events in the mask are reported, and on Linux and Windows the OS is only asked for those.
+ * 					A watch without FE_RENAMED gets a rename as FE_REMOVED and FE_CREATED (if it asked for them).
  * @return:	On success, it returns a watch descriptor (ID). On failure, it returns -1.
  */
 DLL_EXPORT HFESWatchID fe_add_watch(HFES handle, const char* path, uint32_t mask);
 
 
+/** The parameters of a watch, for fe_add_watch_ex()
+ * The patterns use the gitignore syntax, and they're matched against the paths relative to the watched path.
+ * E.g. "build/", ".git/objects" or "*.o". The directories that are excluded aren't watched at all.
+ */
+struct SFileEventsWatchParams
+{
+	SFileEventsWatchParams();
+
+	const char**	m_Include;		//!< If set, only the files that match one of these patterns are reported (the directories are reported unless they're excluded)
+	const char**	m_Exclude;		//!< The files and directories that match these are not reported. A pattern that starts with '!' includes them again.
+	uint32_t		m_NumInclude;
+	uint32_t		m_NumExclude;
+	uint32_t		m_Mask;			//!< The events that should be caught for the path, as for fe_add_watch()
+	uint32_t		_pad;
+};
+
+/** Registers a path to the watch list, with include/exclude patterns
+ *
+ * @note:	Linux only. The patterns are ignored on the other platforms.
+ * @note:	If the path is already watched, only its mask is updated.
+ *
+ * @param handle	The file events system
+ * @param path		The path to watch (folder or file)
+ * @param params	The mask, and the patterns (they're copied)
+ * @return:	On success, it returns a watch descriptor (ID). On failure, it returns -1.
+ */
+DLL_EXPORT HFESWatchID fe_add_watch_ex(HFES handle, const char* path, const SFileEventsWatchParams& params);
+
+
+/** Registers many paths at once, as fe_add_watch() does for each of them.
+ * The lock is only taken once, and the paths are added sorted by directory (so the kernel watches
+ * of a directory are shared by the paths inside it), which makes the startup of large trees a lot faster.
+ *
+ * @param handle	The file events system
+ * @param paths		The paths to watch
+ * @param masks		The mask of each path (as for fe_add_watch()). If null, all paths get all events.
+ * @param count		The number of paths
+ * @param ids		Receives the watch descriptor of each path, in the same order as the paths (-1 for the ones that failed)
+ * @return:	The number of paths that were added (or were already watched). On failure, it returns -1
+ */
+DLL_EXPORT int32_t fe_add_watches(HFES handle, const char** paths, const uint32_t* masks, uint32_t count, HFESWatchID* ids);
+
+/** The callback of fe_add_watches_async(), called once the watches are added
+ * @param ids		The watch descriptors, in the same order as the paths (-1 for the ones that failed, or for all of them if the system was closed first)
+ * @param count		The number of paths
+ * @param ctx		The context that was passed to fe_add_watches_async()
+ */
+typedef void (*fe_add_watches_callback)( const HFESWatchID* ids, uint32_t count, void* ctx );
+
+/** Registers many paths at once, like fe_add_watches(), but returns right away. The paths are added by the thread
+ * that reads the events (together with any other pending paths), and the callback is called from that thread when they're done.
+ *
+ * @note:	The callback may be called before this function returns
+ *
+ * @param handle	The file events system
+ * @param paths		The paths to watch (they're copied)
+ * @param masks		The mask of each path (as for fe_add_watch()). If null, all paths get all events.
+ * @param count		The number of paths
+ * @param callback	Called with the watch descriptors once the paths are added. May be null.
+ * @param ctx		Passed on to the callback
+ * @return:	On success, it returns 0. On failure, it returns -1 (and the callback isn't called)
+ */
+DLL_EXPORT int32_t fe_add_watches_async(HFES handle, const char** paths, const uint32_t* masks, uint32_t count, fe_add_watches_callback callback, void* ctx);
+
+
+// The longest path of an event, including the terminating zero (PATH_MAX, or MAX_PATH on Windows)
+#if defined(PATH_MAX)
+	#define FE_MAX_PATH		PATH_MAX
+#elif defined(_MAX_PATH)
+	#define FE_MAX_PATH		_MAX_PATH
+#else
+	#define FE_MAX_PATH		4096
+#endif
+
+// The smallest strings buffer for fe_poll_events() that fits any event (a rename with two paths of FE_MAX_PATH)
+#define FE_POLL_MIN_STRINGS_SIZE	(2 * (FE_MAX_PATH + 1))
+
+/** Reads the queued events, when the system was created with a non zero m_EventRingSize.
+ * Events that don't fit in the ring are dropped, so the ring should be drained regularly.
+ * An event whose paths don't fit in the strings buffer on their own is dropped as well, and an FE_OVERFLOW event
+ * is returned in its place, so use a buffer of at least FE_POLL_MIN_STRINGS_SIZE bytes.
+ *
+ * @note:	Must only be called from one thread at a time
+ *
+ * @param handle		The file events system
+ * @param events		Receives the events. The path offsets are into the strings buffer.
+ * @param max			The max number of events to read
+ * @param strings		Receives the (null terminated) paths of the events
+ * @param stringssize	The size of the strings buffer
+ * @return:	The number of events read. 0 if there were no events.
+ */
+DLL_EXPORT uint32_t fe_poll_events(HFES handle, SFileEvent* events, uint32_t max, char* strings, uint32_t stringssize);
+
+/** Gets a file descriptor that becomes readable when there are events to read with fe_poll_events().
+ * It can be added to the application's own poll()/epoll set. It's reset by fe_poll_events().
+ *
+ * @param handle	The file events system
+ * @return:	The file descriptor (Linux: an eventfd). -1 if there is none (e.g. if there's no ring buffer, or on Windows/Darwin)
+ */
+DLL_EXPORT int fe_get_event_fd(HFES handle);
+
+
 /** Removes a previously registered path from the watch list
  *
  * @param handle	The file events system
@@ -108,5 +287,40 @@ DLL_EXPORT HFESWatchID fe_add_watch(HFES handle, const char* path, uint32_t mask
  */
 DLL_EXPORT int32_t fe_remove_watch(HFES handle, HFESWatchID id);
 
+
+#define FE_STATS_HISTOGRAM_SIZE 16
+
+/** The counters of a file events system, since it was created (see fe_get_stats())
+ */
+struct SFileEventsStats
+{
+	uint64_t	m_EventsRead;		//!< Events read from the OS (Linux: with a shared engine, all the events of the shared instance)
+	uint64_t	m_EventsDispatched;	//!< Events sent to the callbacks, or to the ring
+	uint64_t	m_EventsFiltered;	//!< Events that none of the watches asked for (see their masks and patterns)
+	uint64_t	m_EventsCoalesced;	//!< Events merged into an earlier event for the same path (see m_CoalesceMs)
+	uint64_t	m_EventsDropped;	//!< Events that didn't fit in the ring (see m_EventRingSize)
+	uint64_t	m_Overflows;		//!< The number of times the OS lost events (see FE_OVERFLOW)
+	uint64_t	m_Reads;			//!< Reads from the OS
+	uint64_t	m_BytesRead;		//!< Bytes read from the OS (m_BytesRead / m_Reads is the average size of a read)
+	uint64_t	m_CallbackCalls;
+	uint64_t	m_CallbackTimeUs;	//!< The total time spent in the callbacks
+	uint64_t	m_CallbackHistogram[FE_STATS_HISTOGRAM_SIZE];	//!< Bucket i counts the calls that took less than 2^i microseconds (the last bucket counts the rest)
+	uint32_t	m_KernelWatches;	//!< Linux: inotify watches (or fanotify marks). Windows: directory handles. Darwin: watched paths
+	uint32_t	m_QueuedEvents;		//!< Events waiting to be delivered (held back for m_CoalesceMs, or queued for the dispatch threads)
+	uint32_t	m_RingBytes;		//!< Bytes in the ring, waiting for fe_poll_events()
+	uint32_t	_pad;
+};
+
+/** Reads the counters of the system. The counters are updated with relaxed atomics, so they're cheap to
+ * keep, and they may be slightly behind each other.
+ *
+ * @note:	It can be called from any thread, including from the callbacks
+ *
+ * @param handle	The file events system
+ * @param stats		Receives the counters
+ * @return:	On success, it returns 0. On failure, it returns -1
+ */
+DLL_EXPORT int fe_get_stats(HFES handle, SFileEventsStats* stats);
+
 } // extern C
 
@@ -1,27 +1,120 @@
+#include <stdio.h>
 #include <string.h>
+#include <algorithm>
+#include <chrono>
+#if defined(__linux__)
+	#include <unistd.h>
+	#include <sys/eventfd.h>
+#endif
 #include "fileevents.h"
 #include "fileevents_internal.h"
+#include "fileevents_snapshot.h"
+#include "fileevents_dispatch.h"
+#include "fileevents_filter.h"
 
 SFileEventsCreateParams::SFileEventsCreateParams()
 {
 	memset(this, 0, sizeof(SFileEventsCreateParams));
 }
 
+SFileEventsWatchParams::SFileEventsWatchParams()
+{
+	memset(this, 0, sizeof(SFileEventsWatchParams));
+}
+
+static void reset_stats(SEventStats* stats)
+{
+	stats->m_EventsRead = 0;
+	stats->m_EventsDispatched = 0;
+	stats->m_EventsFiltered = 0;
+	stats->m_EventsCoalesced = 0;
+	stats->m_Overflows = 0;
+	stats->m_Reads = 0;
+	stats->m_BytesRead = 0;
+	stats->m_CallbackCalls = 0;
+	stats->m_CallbackTimeNs = 0;
+	for( uint32_t i = 0; i < FE_STATS_HISTOGRAM_SIZE; ++i )
+		stats->m_CallbackHistogram[i] = 0;
+	stats->m_CoalescedEvents = 0;
+	stats->m_DispatchQueued = 0;
+}
+
+// Calls the callbacks of the requests, with the ids laid out in the same order as the requests
+static void send_watch_results(const std::vector<SWatchRequest>& requests, const std::vector<HFESWatchID>& ids)
+{
+	size_t offset = 0;
+	for( const SWatchRequest& request : requests )
+	{
+		if( request.m_Callback )
+			request.m_Callback(ids.empty() ? 0 : &ids[offset], (uint32_t)request.m_Paths.size(), request.m_CallbackCtx);
+		offset += request.m_Paths.size();
+	}
+}
+
 HFES fe_init(const SFileEventsCreateParams& params)//fe_callback callback, void* ctx)
 {
 	SFileEventSystem* hfes = new SFileEventSystem;
 
 	hfes->m_Callback = params.m_Callback;
+	hfes->m_BatchCallback = params.m_BatchCallback;
+	hfes->m_RenameCallback = params.m_RenameCallback;
 	hfes->m_CallbackCtx = params.m_CallbackCtx;
 	hfes->m_Cancel = false;
 	hfes->m_Updated = false;
 	hfes->m_Verbose = params.m_Verbose;
+	hfes->m_RescanOnOverflow = params.m_RescanOnOverflow;
+#if defined(__linux__)
+	hfes->m_ContentHash = params.m_ContentHash;
+	hfes->m_IoUring = params.m_IoUring;
+#else
+	hfes->m_ContentHash = false;
+	hfes->m_IoUring = false;
+#endif
+	// The other backends don't keep the snapshot up to date, so a journal saved by them would replay stale changes
+	const bool journal = params.m_JournalPath && params.m_Backend == FE_BACKEND_DEFAULT;
+	if( params.m_JournalPath && !journal )
+		fprintf(stderr, "The journal '%s' is only used with the default backend\n", params.m_JournalPath);
+	hfes->m_Snapshot = (params.m_RescanOnOverflow || journal) ? new SSnapshot : 0;
+	if( journal )
+	{
+		hfes->m_JournalPath = params.m_JournalPath;
+		fe_snapshot_load(hfes->m_Snapshot, params.m_JournalPath);
+	}
+
+	hfes->m_Ring = 0;
+	hfes->m_EventFd = -1;
+	hfes->m_RingDropped = 0;
+	hfes->m_RingOverflowed = false;
+	reset_stats(&hfes->m_Stats);
+	hfes->m_CoalesceMs = params.m_CoalesceMs;
+	hfes->m_Backend = params.m_Backend;
+	hfes->m_PollIntervalMs = params.m_PollIntervalMs;
+	hfes->m_PollStatsPerSecond = params.m_PollStatsPerSecond;
+#if defined(__linux__)
+	// The fanotify backend already uses one mark for a whole file system, and the polling backend doesn't use inotify
+	hfes->m_SharedEngine = params.m_SharedEngine && params.m_Backend == FE_BACKEND_DEFAULT;
+#else
+	hfes->m_SharedEngine = false;
+#endif
+	hfes->m_CoalesceDeadline = 0;
+	if( params.m_EventRingSize )
+	{
+		hfes->m_Ring = new SEventRing(params.m_EventRingSize);
+#if defined(__linux__)
+		hfes->m_EventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+	}
+
+	hfes->m_Dispatch = 0;
+	if( params.m_DispatchThreads > 1 && !hfes->m_Ring )
+		hfes->m_Dispatch = fe_dispatch_pool_create(hfes, params.m_DispatchThreads);
 
 	hfes->m_WatchCounter = 0;
 
 	hfes->m_PlatformData = fe_platform_init(hfes);
 
-	hfes->m_Thread = std::thread(platform_thread_run, hfes);
+	if( !hfes->m_SharedEngine )
+		hfes->m_Thread = std::thread(platform_thread_run, hfes);
 
 	return hfes;
 }
@@ -29,69 +122,596 @@ HFES fe_init(const SFileEventsCreateParams& params)//fe_callback callback, void*
 void fe_close(SFileEventSystem* hfes)
 {
 	hfes->m_Cancel = true;
-	hfes->m_Thread.join();
+	fe_platform_wakeup(hfes);
+	if( hfes->m_Thread.joinable() )
+		hfes->m_Thread.join();
 	fe_platform_close(hfes);
+
+	// The asynchronous registrations that never got added
+	size_t pending = 0;
+	for( const SWatchRequest& request : hfes->m_PendingWatches )
+		pending += request.m_Paths.size();
+	send_watch_results(hfes->m_PendingWatches, std::vector<HFESWatchID>(pending, -1));
+
+	if( hfes->m_Dispatch )
+		fe_dispatch_pool_destroy(hfes->m_Dispatch);
+	if( !hfes->m_JournalPath.empty() )
+		fe_snapshot_save(hfes->m_Snapshot, hfes->m_JournalPath.c_str());
+	for( SWatch& watch : hfes->m_Watches )
+		fe_filter_destroy(watch.m_Filter);
+#if defined(__linux__)
+	if( hfes->m_EventFd >= 0 )
+		close(hfes->m_EventFd);
+#endif
+	delete hfes->m_Ring;
+	delete hfes->m_Snapshot;
 	delete hfes;
 }
 
-HFESWatchID fe_add_watch(SFileEventSystem* hfes, const char* path, uint32_t mask)
+char* fe_batch_add(SEventBatch* batch, HFESWatchID watchid, uint32_t flags, uint32_t length)
+{
+	SFileEvent event;
+	event.m_WatchID = watchid;
+	event.m_Flags = flags;
+	event.m_PathOffset = (uint32_t)batch->m_Strings.size();
+	event.m_PathLength = length;
+	event.m_TargetOffset = 0;
+	event.m_TargetLength = 0;
+	event._pad = 0;
+	batch->m_Events.push_back(event);
+
+	batch->m_Strings.resize(batch->m_Strings.size() + length + 1);
+	char* out = &batch->m_Strings[event.m_PathOffset];
+	out[length] = 0;
+	return out;
+}
+
+void fe_batch_add(SEventBatch* batch, HFESWatchID watchid, uint32_t flags, const char* path)
+{
+	uint32_t length = (uint32_t)strlen(path);
+	memcpy(fe_batch_add(batch, watchid, flags, length), path, length);
+}
+
+char* fe_batch_add_target(SEventBatch* batch, uint32_t length)
+{
+	SFileEvent& event = batch->m_Events.back();
+	event.m_TargetOffset = (uint32_t)batch->m_Strings.size();
+	event.m_TargetLength = length;
+
+	batch->m_Strings.resize(batch->m_Strings.size() + length + 1);
+	char* out = &batch->m_Strings[event.m_TargetOffset];
+	out[length] = 0;
+	return out;
+}
+
+void fe_batch_pop(SEventBatch* batch)
+{
+	batch->m_Strings.resize(batch->m_Events.back().m_PathOffset);
+	batch->m_Events.pop_back();
+}
+
+void fe_batch_clear(SEventBatch* batch)
+{
+	// Keeps the memory, for the next batch
+	batch->m_Events.clear();
+	batch->m_Strings.clear();
+}
+
+static void send_events(SFileEventSystem* hfes, const SEventBatch* batch)
+{
+	if( batch->m_Events.empty() )
+		return;
+
+	const SFileEvent* events = &batch->m_Events[0];
+	const uint32_t count = (uint32_t)batch->m_Events.size();
+	const char* strings = &batch->m_Strings[0];
+
+	fe_stats_add(hfes->m_Stats.m_EventsDispatched, count);
+
+	if( hfes->m_Ring )
+	{
+		// No locks and no callbacks. If the consumer can't keep up, the events are dropped,
+		// and the consumer is told so as soon as there's room in the ring again
+		for( uint32_t i = 0; i < count; ++i )
+		{
+			if( hfes->m_RingOverflowed && hfes->m_Ring->push(-1, FE_OVERFLOW, "", 0, "", 0) )
+				hfes->m_RingOverflowed = false;
+
+			const SFileEvent& event = events[i];
+			if( hfes->m_RingOverflowed || !hfes->m_Ring->push(event.m_WatchID, event.m_Flags, strings + event.m_PathOffset, event.m_PathLength, strings + event.m_TargetOffset, event.m_TargetLength) )
+			{
+				hfes->m_RingDropped.fetch_add(1, std::memory_order_relaxed);
+				hfes->m_RingOverflowed = true;
+			}
+		}
+
+#if defined(__linux__)
+		uint64_t value = 1;
+		ssize_t result = write(hfes->m_EventFd, &value, sizeof(value));
+		(void)result;
+#endif
+		return;
+	}
+
+	if( hfes->m_Dispatch )
+	{
+		fe_dispatch_pool_push(hfes->m_Dispatch, batch);
+		return;
+	}
+
+	fe_send_to_callbacks(hfes, batch);
+}
+
+static uint64_t get_time_ns()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Adds the time of a callback call to the histogram
+static void add_callback_time(SEventStats* stats, uint64_t start)
+{
+	uint64_t ns = get_time_ns() - start;
+	uint64_t us = ns / 1000;
+	uint32_t bucket = 0;
+	while( us && bucket < FE_STATS_HISTOGRAM_SIZE - 1 )
+	{
+		us >>= 1;
+		++bucket;
+	}
+	fe_stats_add(stats->m_CallbackHistogram[bucket], 1);
+	fe_stats_add(stats->m_CallbackTimeNs, ns);
+	fe_stats_add(stats->m_CallbackCalls, 1);
+}
+
+void fe_send_to_callbacks(SFileEventSystem* hfes, const SEventBatch* batch)
+{
+	fe_send_to_callbacks(hfes, &batch->m_Events[0], (uint32_t)batch->m_Events.size(), &batch->m_Strings[0]);
+}
+
+void fe_send_to_callbacks(SFileEventSystem* hfes, const SFileEvent* events, uint32_t count, const char* strings)
+{
+	if( hfes->m_BatchCallback )
+	{
+		uint64_t start = get_time_ns();
+		hfes->m_BatchCallback( events, count, strings, hfes->m_CallbackCtx );
+		add_callback_time(&hfes->m_Stats, start);
+		return;
+	}
+
+	for( uint32_t i = 0; i < count; ++i )
+	{
+		const SFileEvent& event = events[i];
+		const char* path = strings + event.m_PathOffset;
+		uint64_t start = get_time_ns();
+		if( event.m_TargetLength == 0 )
+		{
+			hfes->m_Callback( path, (EFileEvents)event.m_Flags, hfes->m_CallbackCtx );
+			add_callback_time(&hfes->m_Stats, start);
+			continue;
+		}
+
+		const char* target = strings + event.m_TargetOffset;
+		if( hfes->m_RenameCallback )
+		{
+			hfes->m_RenameCallback( path, target, (EFileEvents)event.m_Flags, hfes->m_CallbackCtx );
+		}
+		else
+		{
+			hfes->m_Callback( path, (EFileEvents)event.m_Flags, hfes->m_CallbackCtx );
+			hfes->m_Callback( target, (EFileEvents)event.m_Flags, hfes->m_CallbackCtx );
+		}
+		add_callback_time(&hfes->m_Stats, start);
+	}
+}
+
+uint64_t fe_get_time_ms()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t find_coalesced(SFileEventSystem* hfes, const char* path, uint32_t length, uint32_t hash)
+{
+	const SEventBatch& coalesced = hfes->m_Coalesced;
+	return hfes->m_CoalescedByPath.find(hash, [&](uint32_t i) {
+		const SFileEvent& other = coalesced.m_Events[i];
+		return other.m_PathLength == length && memcmp(&coalesced.m_Strings[other.m_PathOffset], path, length) == 0;
+	});
+}
+
+static void coalesce_events(SFileEventSystem* hfes, const SEventBatch* batch)
+{
+	SEventBatch& coalesced = hfes->m_Coalesced;
+	const char* strings = &batch->m_Strings[0];
+
+	for( const SFileEvent& event : batch->m_Events )
+	{
+		const char* path = strings + event.m_PathOffset;
+		const uint32_t length = event.m_PathLength;
+		const uint32_t hash = fe_hash_string(path, length);
+
+		if( event.m_TargetLength )
+		{
+			// A rename isn't merged with anything. The events for either path that come after it get new entries (after the rename).
+			const char* target = strings + event.m_TargetOffset;
+			const uint32_t targethash = fe_hash_string(target, event.m_TargetLength);
+			uint32_t index = find_coalesced(hfes, path, length, hash);
+			if( index != FE_HASH_INVALID )
+				hfes->m_CoalescedByPath.erase(hash, [=](uint32_t i) { return i == index; });
+			index = find_coalesced(hfes, target, event.m_TargetLength, targethash);
+			if( index != FE_HASH_INVALID )
+				hfes->m_CoalescedByPath.erase(targethash, [=](uint32_t i) { return i == index; });
+
+			hfes->m_CoalescedCreatedFirst.push_back(0);
+			memcpy(fe_batch_add(&coalesced, event.m_WatchID, event.m_Flags, length), path, length);
+			memcpy(fe_batch_add_target(&coalesced, event.m_TargetLength), target, event.m_TargetLength);
+			continue;
+		}
+
+		uint32_t index = find_coalesced(hfes, path, length, hash);
+
+		if( index == FE_HASH_INVALID )
+		{
+			hfes->m_CoalescedByPath.insert(hash, (uint32_t)coalesced.m_Events.size());
+			hfes->m_CoalescedCreatedFirst.push_back( (event.m_Flags & FE_CREATED) ? 1 : 0 );
+			memcpy(fe_batch_add(&coalesced, event.m_WatchID, event.m_Flags, length), path, length);
+			continue;
+		}
+
+		SFileEvent& merged = coalesced.m_Events[index];
+		if( event.m_Flags & FE_REMOVED )
+		{
+			if( hfes->m_CoalescedCreatedFirst[index] )
+			{
+				// It came and went within the window. If it shows up again, it gets a new entry (last in the list)
+				merged.m_Flags = 0;
+				hfes->m_CoalescedByPath.erase(hash, [=](uint32_t i) { return i == index; });
+				fe_stats_add(hfes->m_Stats.m_EventsCoalesced, 1);
+				continue;
+			}
+			merged.m_Flags &= ~(uint32_t)FE_CREATED;
+		}
+		merged.m_Flags |= event.m_Flags;
+		fe_stats_add(hfes->m_Stats.m_EventsCoalesced, 1);
+	}
+	hfes->m_Stats.m_CoalescedEvents.store((uint32_t)coalesced.m_Events.size(), std::memory_order_relaxed);
+}
+
+void fe_dispatch(SFileEventSystem* hfes, const SEventBatch* batch)
+{
+	if( batch->m_Events.empty() )
+		return;
+
+	if( hfes->m_CoalesceMs == 0 )
+	{
+		send_events(hfes, batch);
+		return;
+	}
+
+	if( hfes->m_CoalesceDeadline == 0 )
+		hfes->m_CoalesceDeadline = fe_get_time_ms() + hfes->m_CoalesceMs;
+	coalesce_events(hfes, batch);
+}
+
+int fe_flush_events(SFileEventSystem* hfes, bool force)
+{
+	if( hfes->m_CoalesceDeadline == 0 )
+		return -1;
+
+	uint64_t now = fe_get_time_ms();
+	if( !force && now < hfes->m_CoalesceDeadline )
+		return (int)(hfes->m_CoalesceDeadline - now);
+
+	// Remove the events that cancelled out (the paths stay where they are in the string arena)
+	std::vector<SFileEvent>& events = hfes->m_Coalesced.m_Events;
+	events.erase( std::remove_if(events.begin(), events.end(), [](const SFileEvent& event) { return event.m_Flags == 0; }), events.end() );
+
+	send_events(hfes, &hfes->m_Coalesced);
+
+	fe_batch_clear(&hfes->m_Coalesced);
+	hfes->m_CoalescedByPath.clear();
+	hfes->m_CoalescedCreatedFirst.clear();
+	hfes->m_CoalesceDeadline = 0;
+	hfes->m_Stats.m_CoalescedEvents.store(0, std::memory_order_relaxed);
+	return -1;
+}
+
+uint32_t fe_poll_events(HFES hfes, SFileEvent* events, uint32_t max, char* strings, uint32_t stringssize)
+{
+	// Nothing could be read, so the event fd is left as it is
+	if( !hfes || !hfes->m_Ring || !events || max == 0 || !strings || stringssize == 0 )
+		return 0;
+
+#if defined(__linux__)
+	// Reset it before reading, so that events pushed after this point wakes the user up again
+	uint64_t value;
+	ssize_t result = read(hfes->m_EventFd, &value, sizeof(value));
+	(void)result;
+#endif
+
+	uint32_t dropped = 0;
+	uint32_t count = hfes->m_Ring->pop(events, max, strings, stringssize, &dropped);
+	if( dropped )
+		hfes->m_RingDropped.fetch_add(dropped, std::memory_order_relaxed);
+
+#if defined(__linux__)
+	// The buffers were too small to read all of them
+	if( !hfes->m_Ring->empty() )
+	{
+		value = 1;
+		result = write(hfes->m_EventFd, &value, sizeof(value));
+	}
+#endif
+	return count;
+}
+
+int fe_get_event_fd(HFES hfes)
 {
 	if( !hfes )
 		return -1;
-	if( !path )
+	return hfes->m_EventFd;
+}
+
+int fe_get_stats(HFES hfes, SFileEventsStats* stats)
+{
+	if( !hfes || !stats )
 		return -1;
 
-	std::lock_guard<std::mutex> lock(hfes->m_Lock);
+	const SEventStats& counters = hfes->m_Stats;
+	memset(stats, 0, sizeof(SFileEventsStats));
+	stats->m_EventsRead = counters.m_EventsRead.load(std::memory_order_relaxed);
+	stats->m_EventsDispatched = counters.m_EventsDispatched.load(std::memory_order_relaxed);
+	stats->m_EventsFiltered = counters.m_EventsFiltered.load(std::memory_order_relaxed);
+	stats->m_EventsCoalesced = counters.m_EventsCoalesced.load(std::memory_order_relaxed);
+	stats->m_EventsDropped = hfes->m_RingDropped.load(std::memory_order_relaxed);
+	stats->m_Overflows = counters.m_Overflows.load(std::memory_order_relaxed);
+	stats->m_Reads = counters.m_Reads.load(std::memory_order_relaxed);
+	stats->m_BytesRead = counters.m_BytesRead.load(std::memory_order_relaxed);
+	stats->m_CallbackCalls = counters.m_CallbackCalls.load(std::memory_order_relaxed);
+	stats->m_CallbackTimeUs = counters.m_CallbackTimeNs.load(std::memory_order_relaxed) / 1000;
+	for( uint32_t i = 0; i < FE_STATS_HISTOGRAM_SIZE; ++i )
+		stats->m_CallbackHistogram[i] = counters.m_CallbackHistogram[i].load(std::memory_order_relaxed);
+	stats->m_QueuedEvents = counters.m_CoalescedEvents.load(std::memory_order_relaxed) + counters.m_DispatchQueued.load(std::memory_order_relaxed);
+	if( hfes->m_Ring )
+		stats->m_RingBytes = (uint32_t)(hfes->m_Ring->m_Head.load(std::memory_order_relaxed) - hfes->m_Ring->m_Tail.load(std::memory_order_relaxed));
 
-	if( mask == 0 )
-		mask = FE_ALL;
+	{
+		std::lock_guard<std::mutex> lock(hfes->m_Lock);
+		stats->m_KernelWatches = fe_platform_num_kernel_watches(hfes);
+	}
+	return 0;
+}
+
+bool fe_is_in_dir(const std::string& path, const std::string& dir, bool recursive)
+{
+	if( path.compare(0, dir.size(), dir) != 0 )
+		return false;
+	if( path.size() == dir.size() )
+		return true;
+	size_t start = dir.size();
+	if( dir.empty() || dir[dir.size()-1] != '/' )
+	{
+		if( path[start] != '/' )
+			return false;
+		start++;
+	}
+	return recursive || path.find('/', start) == std::string::npos;
+}
+
+static uint32_t find_watch_by_path(const SFileEventSystem* hfes, const char* path, uint32_t hash)
+{
+	uint32_t node = hfes->m_WatchPaths.find(path, (uint32_t)strlen(path));
+	if( node == FE_PATH_NONE )
+		return FE_HASH_INVALID;
+	return hfes->m_WatchesByPath.find(hash, [&](uint32_t index) { return hfes->m_Watches[index].m_Path == node; });
+}
+
+static uint32_t find_watch_by_id(const SFileEventSystem* hfes, HFESWatchID watchid)
+{
+	return hfes->m_WatchesByID.find(fe_hash_int((uint64_t)watchid), [&](uint32_t index) { return hfes->m_Watches[index].m_ID == watchid; });
+}
+
+SWatch* fe_find_watch(SFileEventSystem* hfes, HFESWatchID watchid)
+{
+	uint32_t index = find_watch_by_id(hfes, watchid);
+	return index == FE_HASH_INVALID ? 0 : &hfes->m_Watches[index];
+}
+
+HFESWatchID fe_add_watch(SFileEventSystem* hfes, const char* path, uint32_t mask)
+{
+	SFileEventsWatchParams params;
+	params.m_Mask = mask;
+	return fe_add_watch_ex(hfes, path, params);
+}
+
+// Adds the watch (or updates its mask). The caller holds m_Lock, and wakes up the platform thread if m_Updated was set.
+static HFESWatchID add_watch(SFileEventSystem* hfes, const char* path, const SFileEventsWatchParams& params)
+{
+	uint32_t mask = params.m_Mask;
+
+	if( (mask & ~(uint32_t)FE_RECURSIVE) == 0 )
+		mask |= FE_ALL;
 
 	// Check if it already exists, then update the mask
-	int i = 0;
-    for(auto &pair : hfes->m_PathsToWatch)
-    {
-    	if( pair.second.first == path )
-    	{
-    		// Only trigger an update if the mask actually changed
-    		hfes->m_Updated = mask != pair.second.second;
-    		pair.second.second = mask;
-    		return i;
-    	}
-
-        ++i;
-    }
-
-    // never count down
+	uint32_t hash = fe_hash_string(path);
+	uint32_t index = find_watch_by_path(hfes, path, hash);
+	if( index != FE_HASH_INVALID )
+	{
+		SWatch& watch = hfes->m_Watches[index];
+		// Only trigger an update if the mask actually changed
+		if( watch.m_Mask != mask )
+		{
+			watch.m_Mask = mask;
+			fe_platform_update_watch(hfes, watch.m_ID, mask);
+			hfes->m_Updated = true;
+		}
+		return watch.m_ID;
+	}
+
+	// never count down
 	hfes->m_WatchCounter++;
 
 	HFESWatchID watchid = (HFESWatchID)hfes->m_WatchCounter;
-	hfes->m_PathsToWatch[watchid] = std::pair<std::string, uint32_t>(path, mask);
 
-	int result = fe_platform_add_watch(hfes, watchid, path, mask);
+	SFileFilter* filter = fe_filter_create(params.m_Include, params.m_NumInclude, params.m_Exclude, params.m_NumExclude);
+	int result = fe_platform_add_watch(hfes, watchid, path, mask, filter);
 	if( result != 0 )
 	{
-		hfes->m_PathsToWatch.erase(watchid);
-		return 0;
+		fe_filter_destroy(filter);
+		return -1;
 	}
 
+	index = (uint32_t)hfes->m_Watches.size();
+	hfes->m_Watches.push_back(SWatch());
+	SWatch& watch = hfes->m_Watches.back();
+	watch.m_Path = hfes->m_WatchPaths.intern(path, (uint32_t)strlen(path));
+	watch._pad = 0;
+	watch.m_ID = watchid;
+	watch.m_Mask = mask;
+	watch.m_PathHash = hash;
+	watch.m_Filter = filter;
+	hfes->m_WatchesByPath.insert(hash, index);
+	hfes->m_WatchesByID.insert(fe_hash_int((uint64_t)watchid), index);
+
 	hfes->m_Updated = true;
+	return watchid;
+}
+
+HFESWatchID fe_add_watch_ex(SFileEventSystem* hfes, const char* path, const SFileEventsWatchParams& params)
+{
+	if( !hfes )
+		return -1;
+	if( !path )
+		return -1;
+
+	std::lock_guard<std::mutex> lock(hfes->m_Lock);
+	HFESWatchID watchid = add_watch(hfes, path, params);
+	if( hfes->m_Updated )
+		fe_platform_wakeup(hfes);
+	return watchid;
+}
+
+// Orders the paths by directory: a directory comes right before the paths inside it (i.e. '/' sorts before any other character)
+static bool path_less(const char* a, const char* b)
+{
+	for( ; *a && *a == *b; ++a, ++b )
+		;
+	uint32_t ca = *a == '/' ? 1 : (*a ? (uint8_t)*a + 1u : 0);
+	uint32_t cb = *b == '/' ? 1 : (*b ? (uint8_t)*b + 1u : 0);
+	return ca < cb;
+}
+
+// Adds the watches, sorted by directory. The caller holds m_Lock. Returns the number of watches that were added.
+static int32_t add_watches(SFileEventSystem* hfes, const char** paths, const uint32_t* masks, uint32_t count, HFESWatchID* ids)
+{
+	std::vector<uint32_t> order(count);
+	for( uint32_t i = 0; i < count; ++i )
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [=](uint32_t a, uint32_t b) { return path_less(paths[a], paths[b]); });
+
+	int32_t added = 0;
+	SFileEventsWatchParams params;
+	for( uint32_t i : order )
+	{
+		params.m_Mask = masks ? masks[i] : 0;
+		ids[i] = paths[i] ? add_watch(hfes, paths[i], params) : -1;
+		if( ids[i] != -1 )
+			added++;
+	}
+	return added;
+}
+
+int32_t fe_add_watches(SFileEventSystem* hfes, const char** paths, const uint32_t* masks, uint32_t count, HFESWatchID* ids)
+{
+	if( !hfes || (count && (!paths || !ids)) )
+		return -1;
 
-	return hfes->m_WatchCounter;
+	std::lock_guard<std::mutex> lock(hfes->m_Lock);
+	int32_t added = add_watches(hfes, paths, masks, count, ids);
+	if( hfes->m_Updated )
+		fe_platform_wakeup(hfes);
+	return added;
+}
+
+int32_t fe_add_watches_async(SFileEventSystem* hfes, const char** paths, const uint32_t* masks, uint32_t count, fe_add_watches_callback callback, void* ctx)
+{
+	if( !hfes || (count && !paths) )
+		return -1;
+
+	SWatchRequest request;
+	request.m_Paths.reserve(count);
+	request.m_Masks.reserve(count);
+	for( uint32_t i = 0; i < count; ++i )
+	{
+		request.m_Paths.push_back(paths[i] ? paths[i] : "");
+		request.m_Masks.push_back(masks ? masks[i] : 0);
+	}
+	request.m_Callback = callback;
+	request.m_CallbackCtx = ctx;
+
+	std::lock_guard<std::mutex> lock(hfes->m_Lock);
+	hfes->m_PendingWatches.push_back(SWatchRequest());
+	std::swap(hfes->m_PendingWatches.back(), request);
+	fe_platform_wakeup(hfes);
+	return 0;
+}
+
+void fe_add_pending_watches(SFileEventSystem* hfes)
+{
+	std::vector<SWatchRequest> requests;
+	std::vector<HFESWatchID> ids;
+	{
+		std::lock_guard<std::mutex> lock(hfes->m_Lock);
+		if( hfes->m_PendingWatches.empty() )
+			return;
+		requests.swap(hfes->m_PendingWatches);
+
+		// All the pending paths are added as one batch
+		std::vector<const char*> paths;
+		std::vector<uint32_t> masks;
+		for( const SWatchRequest& request : requests )
+		{
+			for( size_t i = 0; i < request.m_Paths.size(); ++i )
+			{
+				paths.push_back(request.m_Paths[i].empty() ? 0 : request.m_Paths[i].c_str());
+				masks.push_back(request.m_Masks[i]);
+			}
+		}
+		ids.resize(paths.size());
+		add_watches(hfes, paths.data(), masks.data(), (uint32_t)paths.size(), ids.data());
+	}
+	send_watch_results(requests, ids);
 }
 
 int32_t fe_remove_watch(SFileEventSystem* hfes, HFESWatchID id)
 {
 	std::lock_guard<std::mutex> lock(hfes->m_Lock);
 
-	std::map< HFESWatchID, std::pair<std::string, uint32_t> >::iterator it = hfes->m_PathsToWatch.find( id );
-	if( it != hfes->m_PathsToWatch.end() )
+	uint32_t index = find_watch_by_id(hfes, id);
+	if( index == FE_HASH_INVALID )
+		return -1;
+
+	fe_platform_remove_watch(hfes, id);
+
+	SWatch& watch = hfes->m_Watches[index];
+	fe_filter_destroy(watch.m_Filter);
+	hfes->m_WatchPaths.release(watch.m_Path);
+	hfes->m_WatchesByPath.erase(watch.m_PathHash, [=](uint32_t i) { return i == index; });
+	hfes->m_WatchesByID.erase(fe_hash_int((uint64_t)id), [=](uint32_t i) { return i == index; });
+
+	// Move the last watch into the hole
+	uint32_t last = (uint32_t)hfes->m_Watches.size() - 1;
+	if( index != last )
 	{
-		fe_platform_remove_watch(hfes, id);
-		hfes->m_PathsToWatch.erase(it);
-		hfes->m_Updated = true;
-		return 0;
+		SWatch& moved = hfes->m_Watches[last];
+		hfes->m_WatchesByPath.replace(moved.m_PathHash, last, index);
+		hfes->m_WatchesByID.replace(fe_hash_int((uint64_t)moved.m_ID), last, index);
+		hfes->m_Watches[index] = moved;
 	}
-	return -1;
+	hfes->m_Watches.pop_back();
+
+	hfes->m_Updated = true;
+	fe_platform_wakeup(hfes);
+	return 0;
 }
 
 
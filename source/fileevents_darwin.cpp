@@ -25,8 +25,15 @@ struct SPlatformData
 	// Used when restarting the stream from a given point
 	FSEventStreamEventId m_LastId;
 
+	// The events of one callback from the stream
+	SEventBatch m_Batch;
+
+	// The event types that any of the watches want. FSEvents can't be asked for fewer events,
+	// and it doesn't tell which watch an event belongs to.
+	uint32_t m_Mask;
+
 	bool m_IsRunning;
-	bool _padding[7];
+	bool _padding[3];
 };
 
 
@@ -88,6 +95,9 @@ static void handle_event(ConstFSEventStreamRef stream,
 	(void)stream;
 
 	SFileEventSystem* hfes = (SFileEventSystem*)ctx;
+	SEventBatch& batch = hfes->m_PlatformData->m_Batch;
+	fe_stats_add(hfes->m_Stats.m_Reads, 1);
+	fe_stats_add(hfes->m_Stats.m_EventsRead, numEvents);
 	for( size_t i = 0; i < numEvents; ++i )
 	{
 		if( eventFlags[i] & kFSEventStreamEventFlagHistoryDone)
@@ -100,14 +110,25 @@ static void handle_event(ConstFSEventStreamRef stream,
 		}
 
 		// We mask out meta events that we don't support
-		EFileEvents flags = convert_flags(eventFlags[i] & 0xFFFFFF00);
+		uint32_t flags = convert_flags(eventFlags[i] & 0xFFFFFF00);
+		if( eventFlags[i] & (kFSEventStreamEventFlagMustScanSubDirs | kFSEventStreamEventFlagUserDropped | kFSEventStreamEventFlagKernelDropped) )
+		{
+			flags |= FE_OVERFLOW;
+			fe_stats_add(hfes->m_Stats.m_Overflows, 1);
+		}
 
 		// now, check if the user wanted the event, then send it
-		if( flags & FE_ALL )
-			hfes->m_Callback( paths[i], flags, hfes->m_CallbackCtx );
+		uint32_t types = flags & hfes->m_PlatformData->m_Mask;
+		if( types || (flags & FE_OVERFLOW) )
+			fe_batch_add(&batch, -1, types | (flags & ~(uint32_t)FE_EVENT_TYPES), paths[i]);
+		else
+			fe_stats_add(hfes->m_Stats.m_EventsFiltered, 1);
 
 		hfes->m_PlatformData->m_LastId = eventIds[i];
 	}
+
+	fe_dispatch(hfes, &batch);
+	fe_batch_clear(&batch);
 }
 
 static void stop_stream(SFileEventSystem* hfes)
@@ -126,20 +147,24 @@ static void stop_stream(SFileEventSystem* hfes)
 
 static void start_stream(SFileEventSystem* hfes)
 {
-	if( hfes->m_PathsToWatch.empty() )
+	if( hfes->m_Watches.empty() )
 		return;
 
 	FSEventStreamContext context = {0, (void*)hfes, NULL, NULL, NULL};
 
 	CFMutableArrayRef cfpaths;
-	cfpaths = CFArrayCreateMutable(kCFAllocatorDefault, (CFIndex)hfes->m_PathsToWatch.size(), &kCFTypeArrayCallBacks);
+	cfpaths = CFArrayCreateMutable(kCFAllocatorDefault, (CFIndex)hfes->m_Watches.size(), &kCFTypeArrayCallBacks);
 	if( cfpaths == 0 )
 		return;
 
 	int i = 0;
-    for(const auto &pair : hfes->m_PathsToWatch)
+	hfes->m_PlatformData->m_Mask = 0;
+	std::string watchpath;
+    for(const SWatch& watch : hfes->m_Watches)
     {
-    	const char* path = pair.second.first.c_str();
+    	hfes->m_PlatformData->m_Mask |= watch.m_Mask & FE_EVENT_TYPES;
+    	hfes->m_WatchPaths.get_path(watch.m_Path, watchpath);
+    	const char* path = watchpath.c_str();
     	CFStringRef cfstr = CFStringCreateWithCString(kCFAllocatorDefault, path, kCFStringEncodingUTF8);
         CFArraySetValueAtIndex(cfpaths, i, cfstr);
         CFRelease(cfstr);
@@ -183,6 +208,7 @@ void platform_thread_run(SFileEventSystem* hfes)
 {
 	while( !hfes->m_Cancel )
 	{
+		fe_add_pending_watches(hfes);
 		if( hfes->m_Updated )
 		{
 			std::lock_guard<std::mutex> lock(hfes->m_Lock);
@@ -193,7 +219,9 @@ void platform_thread_run(SFileEventSystem* hfes)
 		}
 
 		CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.1, false);
+		fe_flush_events(hfes, false);
 	}
+	fe_flush_events(hfes, true);
 	CFRunLoopStop(CFRunLoopGetCurrent());
 	std::lock_guard<std::mutex> lock(hfes->m_Lock);
 	stop_stream(hfes);
@@ -206,6 +234,7 @@ SPlatformData* fe_platform_init(const SFileEventSystem* hfes)
 	SPlatformData* pfdata = new SPlatformData;
 	pfdata->m_Stream = 0;
 	pfdata->m_LastId = FSEventsGetCurrentEventId();
+	pfdata->m_Mask = FE_ALL;
 	pfdata->m_IsRunning = false;
 	return pfdata;
 }
@@ -220,7 +249,35 @@ bool fe_is_running(const SFileEventSystem* hfes)
 	return hfes->m_PlatformData->m_IsRunning;
 }
 
-int fe_platform_add_watch(const SFileEventSystem* hfes, HFESWatchID watchid, const char* path, uint32_t mask)
+int fe_platform_add_watch(const SFileEventSystem* hfes, HFESWatchID watchid, const char* path, uint32_t mask, const SFileFilter* filter)
 {
+	if( filter )
+		fprintf(stderr, "The include/exclude patterns aren't supported on this platform: '%s'\n", path);
 	return 0;
 }
+
+void fe_platform_update_watch(const SFileEventSystem* hfes, HFESWatchID watchid, uint32_t mask)
+{
+	// The stream is restarted (with the new mask) when m_Updated is set
+	(void)hfes;
+	(void)watchid;
+	(void)mask;
+}
+
+void fe_platform_remove_watch(const SFileEventSystem* hfes, HFESWatchID watchid)
+{
+	(void)hfes;
+	(void)watchid;
+}
+
+void fe_platform_wakeup(const SFileEventSystem* hfes)
+{
+	// The run loop is polled every 0.1s, and the stream is restarted when m_Updated is set
+	(void)hfes;
+}
+
+uint32_t fe_platform_num_kernel_watches(const SFileEventSystem* hfes)
+{
+	// One stream, with all the paths
+	return (uint32_t)hfes->m_Watches.size();
+}
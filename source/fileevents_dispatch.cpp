@@ -0,0 +1,229 @@
+#include <string.h>
+#include <condition_variable>
+
+#include "fileevents.h"
+#include "fileevents_internal.h"
+#include "fileevents_dispatch.h"
+
+// The events a worker may have waiting, before the platform thread waits for it to catch up
+// (the events then wait in the kernel queue instead, which overflows if it must)
+#define DISPATCH_MAX_QUEUED	( 64 * 1024 )
+
+// A point in the events of a worker, where it waits until another worker has sent a number of events.
+// A rename is delivered by the worker of its new path, after the events queued before it for the old path,
+// and the events queued after it for the old path are delivered after it.
+struct SDispatchBarrier
+{
+	uint64_t m_Sent;	// The number of events the other worker has to have sent
+	uint32_t m_Event;	// The index of the event that waits, in the pending events
+	uint32_t m_Worker;	// The other worker
+};
+
+struct SDispatchWorker
+{
+	std::thread 					m_Thread;
+	std::mutex 						m_Lock;
+	std::condition_variable 		m_Cond;
+	std::condition_variable 		m_Drained;	// Signalled when the worker takes the pending events
+	SEventBatch 					m_Pending;	// Protected by m_Lock
+	std::vector<SDispatchBarrier> 	m_Barriers;	// Protected by m_Lock
+	uint64_t 						m_Queued;	// The number of events queued so far. Only used by the platform thread.
+	uint64_t 						m_Sent;		// The number of events sent so far. Protected by SDispatchPool::m_SentLock.
+	bool 							m_Stop;		// Protected by m_Lock
+	bool 							_padding[7];
+};
+
+struct SDispatchPool
+{
+	SFileEventSystem* 				m_System;
+	std::vector<SDispatchWorker*> 	m_Workers;
+	std::vector<SEventBatch> 		m_Shards;	// The events of a push, per worker. Only used by the platform thread.
+	std::vector<std::vector<SDispatchBarrier> > m_ShardBarriers;
+	std::mutex 						m_SentLock;
+	std::condition_variable 		m_SentCond;	// Signalled when a worker has sent more events
+	bool 							m_SplitRenames;	// Does m_Callback get renames as one call per path?
+	bool 							_padding[7];
+};
+
+// Sends the events [begin, end) of the batch, and lets the workers waiting for them know
+static void send_events(SDispatchPool* pool, SDispatchWorker* worker, const SEventBatch* batch, uint32_t begin, uint32_t end)
+{
+	if( begin == end )
+		return;
+	SFileEventSystem* hfes = pool->m_System;
+	fe_send_to_callbacks(hfes, &batch->m_Events[begin], end - begin, &batch->m_Strings[0]);
+	hfes->m_Stats.m_DispatchQueued.fetch_sub(end - begin, std::memory_order_relaxed);
+	{
+		std::lock_guard<std::mutex> lock(pool->m_SentLock);
+		worker->m_Sent += end - begin;
+	}
+	pool->m_SentCond.notify_all();
+}
+
+static void worker_run(SDispatchPool* pool, SDispatchWorker* worker)
+{
+	SEventBatch batch;
+	std::vector<SDispatchBarrier> barriers;
+	while( true )
+	{
+		{
+			std::unique_lock<std::mutex> lock(worker->m_Lock);
+			worker->m_Cond.wait(lock, [=]() { return worker->m_Stop || !worker->m_Pending.m_Events.empty() || !worker->m_Barriers.empty(); });
+			if( worker->m_Pending.m_Events.empty() && worker->m_Barriers.empty() )
+				break;
+			// The buffers are swapped back and forth, so they stop growing after a while
+			std::swap(batch, worker->m_Pending);
+			std::swap(barriers, worker->m_Barriers);
+		}
+		worker->m_Drained.notify_one();
+
+		// The events are sent a run at a time, up to the next barrier. A barrier only waits for events that were queued
+		// before it, and that are sent before their own worker gets to any later barrier, so they can't wait for each other.
+		uint32_t start = 0;
+		for( const SDispatchBarrier& barrier : barriers )
+		{
+			send_events(pool, worker, &batch, start, barrier.m_Event);
+			start = barrier.m_Event;
+			const SDispatchWorker* other = pool->m_Workers[barrier.m_Worker];
+			std::unique_lock<std::mutex> lock(pool->m_SentLock);
+			pool->m_SentCond.wait(lock, [&]() { return other->m_Sent >= barrier.m_Sent; });
+		}
+		send_events(pool, worker, &batch, start, (uint32_t)batch.m_Events.size());
+		fe_batch_clear(&batch);
+		barriers.clear();
+	}
+}
+
+SDispatchPool* fe_dispatch_pool_create(SFileEventSystem* hfes, uint32_t numthreads)
+{
+	SDispatchPool* pool = new SDispatchPool;
+	pool->m_System = hfes;
+	pool->m_Shards.resize(numthreads);
+	pool->m_ShardBarriers.resize(numthreads);
+	pool->m_SplitRenames = !hfes->m_BatchCallback && !hfes->m_RenameCallback;
+	for( uint32_t i = 0; i < numthreads; ++i )
+	{
+		SDispatchWorker* worker = new SDispatchWorker;
+		worker->m_Queued = 0;
+		worker->m_Sent = 0;
+		worker->m_Stop = false;
+		pool->m_Workers.push_back(worker);
+	}
+	// The workers look at each other, so they're started once they're all there
+	for( SDispatchWorker* worker : pool->m_Workers )
+		worker->m_Thread = std::thread(worker_run, pool, worker);
+	return pool;
+}
+
+void fe_dispatch_pool_destroy(SDispatchPool* pool)
+{
+	for( SDispatchWorker* worker : pool->m_Workers )
+	{
+		{
+			std::lock_guard<std::mutex> lock(worker->m_Lock);
+			worker->m_Stop = true;
+		}
+		worker->m_Cond.notify_one();
+	}
+	for( SDispatchWorker* worker : pool->m_Workers )
+		worker->m_Thread.join();
+	for( SDispatchWorker* worker : pool->m_Workers )
+		delete worker;
+	delete pool;
+}
+
+static uint32_t get_shard(const SDispatchPool* pool, const char* path, uint32_t length)
+{
+	return fe_hash_string(path, length) % (uint32_t)pool->m_Workers.size();
+}
+
+// Appends the events of one batch to another
+static void append_batch(SEventBatch* out, const SEventBatch* batch)
+{
+	const uint32_t offset = (uint32_t)out->m_Strings.size();
+	out->m_Strings.insert(out->m_Strings.end(), batch->m_Strings.begin(), batch->m_Strings.end());
+	for( SFileEvent event : batch->m_Events )
+	{
+		event.m_PathOffset += offset;
+		if( event.m_TargetLength )
+			event.m_TargetOffset += offset;
+		out->m_Events.push_back(event);
+	}
+}
+
+// Makes the next event of a shard wait until another worker has sent everything that's queued for it so far
+static void add_barrier(SDispatchPool* pool, uint32_t shard, uint32_t other)
+{
+	SDispatchBarrier barrier;
+	barrier.m_Sent = pool->m_Workers[other]->m_Queued + pool->m_Shards[other].m_Events.size();
+	barrier.m_Event = (uint32_t)pool->m_Shards[shard].m_Events.size();
+	barrier.m_Worker = other;
+	pool->m_ShardBarriers[shard].push_back(barrier);
+}
+
+void fe_dispatch_pool_push(SDispatchPool* pool, const SEventBatch* batch)
+{
+	const char* strings = &batch->m_Strings[0];
+	for( const SFileEvent& event : batch->m_Events )
+	{
+		const char* path = strings + event.m_PathOffset;
+		uint32_t pathshard = get_shard(pool, path, event.m_PathLength);
+		if( event.m_TargetLength == 0 )
+		{
+			SEventBatch& shard = pool->m_Shards[pathshard];
+			memcpy(fe_batch_add(&shard, event.m_WatchID, event.m_Flags, event.m_PathLength), path, event.m_PathLength);
+			continue;
+		}
+
+		const char* target = strings + event.m_TargetOffset;
+		uint32_t targetshard = get_shard(pool, target, event.m_TargetLength);
+		if( pool->m_SplitRenames )
+		{
+			// The callback gets one call per path anyway, so each of them is ordered with the other events for its path
+			SEventBatch& shard = pool->m_Shards[pathshard];
+			memcpy(fe_batch_add(&shard, event.m_WatchID, event.m_Flags, event.m_PathLength), path, event.m_PathLength);
+			memcpy(fe_batch_add(&pool->m_Shards[targetshard], event.m_WatchID, event.m_Flags, event.m_TargetLength), target, event.m_TargetLength);
+			continue;
+		}
+
+		// The rename waits for the events of the old path, and the next events of the old path wait for the rename
+		if( pathshard != targetshard )
+			add_barrier(pool, targetshard, pathshard);
+		SEventBatch& shard = pool->m_Shards[targetshard];
+		memcpy(fe_batch_add(&shard, event.m_WatchID, event.m_Flags, event.m_PathLength), path, event.m_PathLength);
+		memcpy(fe_batch_add_target(&shard, event.m_TargetLength), target, event.m_TargetLength);
+		if( pathshard != targetshard )
+			add_barrier(pool, pathshard, targetshard);
+	}
+
+	for( size_t i = 0; i < pool->m_Workers.size(); ++i )
+	{
+		SEventBatch& shard = pool->m_Shards[i];
+		std::vector<SDispatchBarrier>& barriers = pool->m_ShardBarriers[i];
+		if( shard.m_Events.empty() && barriers.empty() )
+			continue;
+
+		SDispatchWorker* worker = pool->m_Workers[i];
+		worker->m_Queued += shard.m_Events.size();
+		pool->m_System->m_Stats.m_DispatchQueued.fetch_add((uint32_t)shard.m_Events.size(), std::memory_order_relaxed);
+		{
+			// A slow callback holds up the platform thread (rather than letting the queue grow without bounds)
+			std::unique_lock<std::mutex> lock(worker->m_Lock);
+			worker->m_Drained.wait(lock, [=]() { return worker->m_Pending.m_Events.size() < DISPATCH_MAX_QUEUED; });
+
+			uint32_t offset = (uint32_t)worker->m_Pending.m_Events.size();
+			for( SDispatchBarrier& barrier : barriers )
+			{
+				barrier.m_Event += offset;
+				worker->m_Barriers.push_back(barrier);
+			}
+			if( worker->m_Pending.m_Events.empty() )
+				std::swap(worker->m_Pending, shard);
+			else
+				append_batch(&worker->m_Pending, &shard);
+		}
+		worker->m_Cond.notify_one();
+		fe_batch_clear(&shard);
+		barriers.clear();
+	}
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "fileevents.h"
+
+struct SFileEventSystem;
+struct SEventBatch;
+struct SDispatchPool;
+
+/** A pool of threads that call the callbacks (m_DispatchThreads), so that a slow callback doesn't hold up
+ * the platform thread. The events are sharded by the hash of their path, and each shard is handled by one
+ * thread, so the events for a path are always delivered in order. A rename goes to the shard of its new path
+ * (unless m_Callback gets it as two calls, one per path), and it's ordered with the events of its old path too.
+ * If a thread falls too far behind, fe_dispatch_pool_push() waits for it.
+ */
+
+SDispatchPool* fe_dispatch_pool_create(SFileEventSystem* hfes, uint32_t numthreads);
+// Delivers the events that are queued, then stops the threads
+void fe_dispatch_pool_destroy(SDispatchPool* pool);
+// Queues the events. Only called by the platform thread.
+void fe_dispatch_pool_push(SDispatchPool* pool, const SEventBatch* batch);
@@ -0,0 +1,551 @@
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/statfs.h>
+#include <linux/fanotify.h>
+
+#include "fileevents.h"
+#include "fileevents_internal.h"
+#include "fileevents_fanotify.h"
+#include "fileevents_filter.h"
+
+// The system calls are made directly, since not all C libraries have <sys/fanotify.h>
+
+#define FANOTIFY_BUF_LEN	( 256 * 1024 )
+// The mark covers the whole file system, so the cache of directory paths is bounded (the least recently used ones are dropped)
+#define FANOTIFY_MAX_DIRS	( 16 * 1024 )
+
+// The events we always ask the kernel for (plus the renames, see mark_filesystem()), since the directory cache needs them
+static const uint64_t s_FanotifyMask = FAN_CREATE | FAN_DELETE | FAN_ONDIR;
+
+// The other events, if the mask of a watch wants them
+static uint64_t to_fanotify_mask(uint32_t mask)
+{
+	uint64_t out = 0;
+	if( mask & FE_MODIFIED ) 	out |= FAN_MODIFY;
+	if( mask & FE_ATTRIBUTE ) 	out |= FAN_ATTRIB;
+	return out;
+}
+
+// A registered watch. The kernel only knows about the file systems, the paths are filtered here.
+struct SFanotifyWatch
+{
+	std::string 	m_Root;		// The real path
+	std::string 	m_Path;		// The path it was registered with (the events are reported with it)
+	const SFileFilter* m_Filter;	// Owned by the watch
+	HFESWatchID 	m_ID;
+	__kernel_fsid_t m_Fsid;
+	int 			m_MountFd;	// The root, opened. Needed to open the file handles of its file system.
+	uint32_t 		m_Mask;
+};
+
+// The path of a directory, by its file handle (prefixed with the file system id)
+struct SFanotifyDir
+{
+	std::string m_Key;
+	std::string m_Path;
+	uint32_t 	m_Hash;		// Of the key
+	bool 		m_Used;		// Looked up since the clock hand last passed it
+	bool 		_padding[3];
+};
+
+struct SFanotifyData
+{
+	int 	m_Fd;			// the fanotify instance
+	bool 	m_HasRename;	// Are the renames reported as one event? (FAN_RENAME, Linux 5.17)
+	bool 	_padding[3];
+
+	std::vector<SFanotifyWatch> m_Watches;
+
+	// The paths of the directories, with an index by file handle. When it's full, a clock hand looks for one that hasn't been used lately.
+	std::vector<SFanotifyDir> 	m_Dirs;
+	SHashIndex 					m_DirsByKey;
+	uint32_t 					m_DirsHand;
+	uint32_t 					_pad;
+
+	std::vector<char> 	m_Buffer;
+
+	// Events decoded while holding the lock, sent once the lock is released
+	SEventBatch 		m_Batch;
+
+	// Scratch buffers for the decoding
+	std::string 		m_Key;
+	std::string 		m_Path;
+	std::string 		m_Target;
+	std::string 		m_WatchPath;
+};
+
+static void _print_flags(uint64_t mask)
+{
+	if( mask & FAN_CREATE ) 		printf("Create, ");
+	if( mask & FAN_DELETE ) 		printf("Delete, ");
+	if( mask & FAN_MODIFY ) 		printf("Modify, ");
+	if( mask & FAN_ATTRIB ) 		printf("Attrib, ");
+	if( mask & FAN_MOVED_FROM ) 	printf("MovedFrom, ");
+	if( mask & FAN_MOVED_TO ) 		printf("MovedTo, ");
+	if( mask & FAN_RENAME ) 		printf("Rename, ");
+	if( mask & FAN_ONDIR ) 			printf("IsDir, ");
+	if( mask & FAN_Q_OVERFLOW ) 	printf("QueueOverflow, ");
+
+	printf("\n");
+}
+
+// FAN_MARK_ADD adds the events to the mark the file system already has.
+// The file system is found from an open file, since the path of a watch may be gone by the time it's removed.
+static int mark_filesystem(SFanotifyData* data, unsigned int flags, int fd, uint64_t events)
+{
+	uint64_t mask = s_FanotifyMask | events | (data->m_HasRename ? FAN_RENAME : (FAN_MOVED_FROM | FAN_MOVED_TO));
+	int result = (int)syscall(SYS_fanotify_mark, data->m_Fd, flags | FAN_MARK_FILESYSTEM, mask, fd, (const char*)0);
+	if( result != 0 && errno == EINVAL && data->m_HasRename )
+	{
+		// Older kernels only report the two halves of a rename
+		data->m_HasRename = false;
+		return mark_filesystem(data, flags, fd, events);
+	}
+	return result;
+}
+
+static const SFanotifyWatch* find_fs_watch(const SFanotifyData* data, const __kernel_fsid_t& fsid)
+{
+	for( const SFanotifyWatch& watch : data->m_Watches )
+	{
+		if( memcmp(&watch.m_Fsid, &fsid, sizeof(fsid)) == 0 )
+			return &watch;
+	}
+	return 0;
+}
+
+// Takes the events that none of the watches of the file system want any more out of its mark
+static void narrow_filesystem(SFanotifyData* data, const __kernel_fsid_t& fsid, int fd)
+{
+	uint64_t wanted = 0;
+	for( const SFanotifyWatch& watch : data->m_Watches )
+	{
+		if( memcmp(&watch.m_Fsid, &fsid, sizeof(fsid)) == 0 )
+			wanted |= to_fanotify_mask(watch.m_Mask);
+	}
+	uint64_t unused = to_fanotify_mask(FE_EVENT_TYPES) & ~wanted;
+	if( unused )
+		syscall(SYS_fanotify_mark, data->m_Fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, unused, fd, (const char*)0);
+}
+
+// The kernel reports the real paths, the events of a watch have the path it was registered with
+static const char* watch_path(SFanotifyData* data, const SFanotifyWatch& watch, const std::string& path)
+{
+	if( watch.m_Path == watch.m_Root )
+		return path.c_str();
+	std::string& out = data->m_WatchPath;
+	out = watch.m_Path;
+	if( path.size() > watch.m_Root.size() )
+	{
+		size_t offset = watch.m_Root.size() - (watch.m_Root[watch.m_Root.size()-1] == '/' ? 1 : 0);
+		out.append(path, offset, std::string::npos);
+	}
+	return out.c_str();
+}
+
+// Does the watch want events for the path?
+static bool wants_path(const SFanotifyWatch& watch, const std::string& path, bool isdir)
+{
+	if( !fe_is_in_dir(path, watch.m_Root, (watch.m_Mask & FE_RECURSIVE) != 0) )
+		return false;
+	if( watch.m_Filter && path.size() > watch.m_Root.size() )
+	{
+		size_t offset = watch.m_Root.size() + (watch.m_Root[watch.m_Root.size()-1] == '/' ? 0 : 1);
+		return fe_filter_match_path(watch.m_Filter, path.c_str() + offset, (uint32_t)(path.size() - offset), isdir);
+	}
+	return true;
+}
+
+// Caches the path of a directory, in place of one that hasn't been used lately if the cache is full
+static void cache_dir(SFanotifyData* data, const std::string& key, uint32_t hash, const std::string& path)
+{
+	uint32_t index = (uint32_t)data->m_Dirs.size();
+	if( index < FANOTIFY_MAX_DIRS )
+	{
+		data->m_Dirs.push_back(SFanotifyDir());
+	}
+	else
+	{
+		while( data->m_Dirs[data->m_DirsHand].m_Used )
+		{
+			data->m_Dirs[data->m_DirsHand].m_Used = false;
+			data->m_DirsHand = (data->m_DirsHand + 1) % index;
+		}
+		index = data->m_DirsHand;
+		data->m_DirsHand = (data->m_DirsHand + 1) % (uint32_t)data->m_Dirs.size();
+		data->m_DirsByKey.erase(data->m_Dirs[index].m_Hash, [=](uint32_t i) { return i == index; });
+	}
+
+	SFanotifyDir& dir = data->m_Dirs[index];
+	dir.m_Key = key;
+	dir.m_Path = path;
+	dir.m_Hash = hash;
+	dir.m_Used = false;
+	data->m_DirsByKey.insert(hash, index);
+}
+
+// Looks up the path of a directory from its file handle
+static bool resolve_dir(SFanotifyData* data, const struct fanotify_event_info_fid* fid, std::string& out)
+{
+	const struct file_handle* handle = (const struct file_handle*)fid->handle;
+	std::string& key = data->m_Key;
+	key.assign((const char*)&fid->fsid, sizeof(fid->fsid));
+	key.append((const char*)handle, sizeof(struct file_handle) + handle->handle_bytes);
+
+	uint32_t hash = fe_hash_string(key.c_str(), key.size());
+	uint32_t index = data->m_DirsByKey.find(hash, [&](uint32_t i) { return data->m_Dirs[i].m_Key == key; });
+	if( index != FE_HASH_INVALID )
+	{
+		data->m_Dirs[index].m_Used = true;
+		out = data->m_Dirs[index].m_Path;
+		return true;
+	}
+
+	const SFanotifyWatch* watch = find_fs_watch(data, fid->fsid);
+	if( !watch )
+		return false;
+
+	int fd = open_by_handle_at(watch->m_MountFd, (struct file_handle*)handle, O_PATH | O_CLOEXEC);
+	if( fd < 0 )
+		return false; // It's already gone
+
+	char link[64];
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+	char path[PATH_MAX];
+	ssize_t length = readlink(link, path, sizeof(path) - 1);
+	close(fd);
+	if( length <= 0 )
+		return false;
+
+	static const char s_Deleted[] = " (deleted)";
+	if( (size_t)length >= sizeof(s_Deleted) && memcmp(path + length - (sizeof(s_Deleted) - 1), s_Deleted, sizeof(s_Deleted) - 1) == 0 )
+		return false;
+
+	out.assign(path, (size_t)length);
+	cache_dir(data, key, hash, out);
+	return true;
+}
+
+// The cached paths of the directory (and the directories inside it) are no longer valid
+static void forget_dirs(SFanotifyData* data, const std::string& path)
+{
+	for( uint32_t i = 0; i < (uint32_t)data->m_Dirs.size(); )
+	{
+		if( !fe_is_in_dir(data->m_Dirs[i].m_Path, path, true) )
+		{
+			++i;
+			continue;
+		}
+
+		// Move the last one into the hole
+		data->m_DirsByKey.erase(data->m_Dirs[i].m_Hash, [=](uint32_t index) { return index == i; });
+		uint32_t last = (uint32_t)data->m_Dirs.size() - 1;
+		if( i != last )
+		{
+			data->m_DirsByKey.replace(data->m_Dirs[last].m_Hash, last, i);
+			std::swap(data->m_Dirs[i], data->m_Dirs[last]);
+		}
+		data->m_Dirs.pop_back();
+	}
+	if( data->m_DirsHand >= data->m_Dirs.size() )
+		data->m_DirsHand = 0;
+}
+
+static void decode_event(SFileEventSystem* hfes, SFanotifyData* data, const struct fanotify_event_metadata* metadata)
+{
+	const uint64_t mask = metadata->mask;
+	if( mask & FAN_Q_OVERFLOW )
+	{
+		if( hfes->m_Verbose )
+			_print_flags(mask);
+		fe_stats_add(hfes->m_Stats.m_Overflows, 1);
+		for( const SFanotifyWatch& watch : data->m_Watches )
+			fe_batch_add(&data->m_Batch, watch.m_ID, FE_OVERFLOW, watch.m_Path.c_str());
+		return;
+	}
+
+	// The info records hold the file handle of the directory, followed by the name
+	std::string& path = data->m_Path;
+	std::string& target = data->m_Target;
+	bool haspath = false;
+	bool hastarget = false;
+
+	const char* info = (const char*)metadata + metadata->metadata_len;
+	const char* end = (const char*)metadata + metadata->event_len;
+	while( info + sizeof(struct fanotify_event_info_header) <= end )
+	{
+		const struct fanotify_event_info_header* header = (const struct fanotify_event_info_header*)info;
+		if( header->len == 0 )
+			break;
+
+		uint8_t type = header->info_type;
+		if( type == FAN_EVENT_INFO_TYPE_DFID_NAME || type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME || type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME )
+		{
+			const struct fanotify_event_info_fid* fid = (const struct fanotify_event_info_fid*)info;
+			const struct file_handle* handle = (const struct file_handle*)fid->handle;
+			const char* name = (const char*)handle->f_handle + handle->handle_bytes;
+
+			std::string& out = type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME ? target : path;
+			if( resolve_dir(data, fid, out) )
+			{
+				if( !(name[0] == '.' && name[1] == 0) )
+				{
+					if( out.empty() || out[out.size()-1] != '/' )
+						out += '/';
+					out += name;
+				}
+				if( type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME )
+					hastarget = true;
+				else
+					haspath = true;
+			}
+		}
+		info += header->len;
+	}
+
+	if( hfes->m_Verbose )
+	{
+		printf("fanotify path: %s  target: %s   ", haspath ? path.c_str() : "", hastarget ? target.c_str() : "");
+		_print_flags(mask);
+	}
+
+	const uint32_t type = (mask & FAN_ONDIR) ? FE_IS_DIR : FE_IS_FILE;
+
+	if( mask & FAN_RENAME )
+	{
+		if( haspath && (mask & FAN_ONDIR) )
+			forget_dirs(data, path);
+
+		// Any watch of the old path makes it a rename (rather than a new file) for the watches of the new path
+		bool watchedsrc = false;
+		for( const SFanotifyWatch& watch : data->m_Watches )
+			watchedsrc = watchedsrc || (haspath && wants_path(watch, path, type == FE_IS_DIR));
+
+		// Moves to/from a path that isn't watched only have one side, and so do the renames for a watch that doesn't want them
+		for( const SFanotifyWatch& watch : data->m_Watches )
+		{
+			bool src = haspath && wants_path(watch, path, type == FE_IS_DIR);
+			bool dst = hastarget && wants_path(watch, target, type == FE_IS_DIR);
+			if( dst && watchedsrc && (watch.m_Mask & FE_RENAMED) )
+			{
+				fe_batch_add(&data->m_Batch, watch.m_ID, FE_RENAMED | type, watch_path(data, watch, path));
+				const char* mapped = watch_path(data, watch, target);
+				size_t length = strlen(mapped);
+				memcpy(fe_batch_add_target(&data->m_Batch, (uint32_t)length), mapped, length);
+				continue;
+			}
+			if( src && (watch.m_Mask & FE_REMOVED) )
+				fe_batch_add(&data->m_Batch, watch.m_ID, FE_REMOVED | type, watch_path(data, watch, path));
+			if( dst && (watch.m_Mask & FE_CREATED) )
+				fe_batch_add(&data->m_Batch, watch.m_ID, FE_CREATED | type, watch_path(data, watch, target));
+		}
+		return;
+	}
+
+	if( !haspath )
+		return;
+
+	if( (mask & FAN_ONDIR) && (mask & (FAN_DELETE | FAN_MOVED_FROM)) )
+		forget_dirs(data, path);
+
+	// Without FAN_RENAME, the halves of a rename can't be paired (there's no cookie)
+	uint32_t flags = type;
+	if( mask & FAN_CREATE ) 		flags |= FE_CREATED;
+	if( mask & FAN_DELETE ) 		flags |= FE_REMOVED;
+	if( mask & FAN_MOVED_FROM ) 	flags |= FE_REMOVED;
+	if( mask & FAN_MOVED_TO ) 		flags |= FE_CREATED;
+	if( mask & FAN_MODIFY ) 		flags |= FE_MODIFIED;
+	if( mask & FAN_ATTRIB ) 		flags |= FE_ATTRIBUTE;
+
+	// Every watch of the path gets the event (the watches may overlap), if it wants that type of event
+	bool sent = false;
+	for( const SFanotifyWatch& watch : data->m_Watches )
+	{
+		uint32_t types = flags & watch.m_Mask & FE_EVENT_TYPES;
+		if( types && wants_path(watch, path, type == FE_IS_DIR) )
+		{
+			fe_batch_add(&data->m_Batch, watch.m_ID, types | type, watch_path(data, watch, path));
+			sent = true;
+		}
+	}
+	if( !sent )
+		fe_stats_add(hfes->m_Stats.m_EventsFiltered, 1);
+}
+
+void fe_fanotify_read_events(SFileEventSystem* hfes, SFanotifyData* data)
+{
+	char* buffer = &data->m_Buffer[0];
+	while( true )
+	{
+		ssize_t length = read(data->m_Fd, buffer, data->m_Buffer.size());
+		if( length < 0 && errno == EINTR )
+			continue;
+		if( length <= 0 )
+			break;
+
+		{
+			std::lock_guard<std::mutex> lock(hfes->m_Lock);
+
+			fe_stats_add(hfes->m_Stats.m_Reads, 1);
+			fe_stats_add(hfes->m_Stats.m_BytesRead, (uint64_t)length);
+
+			ssize_t i = 0;
+			while( i + (ssize_t)FAN_EVENT_METADATA_LEN <= length )
+			{
+				const struct fanotify_event_metadata* metadata = (const struct fanotify_event_metadata*)&buffer[i];
+				if( metadata->vers != FANOTIFY_METADATA_VERSION )
+				{
+					fprintf(stderr, "fanotify metadata version mismatch: %u\n", (uint32_t)metadata->vers);
+					break;
+				}
+				if( metadata->event_len < FAN_EVENT_METADATA_LEN || i + (ssize_t)metadata->event_len > length )
+					break;
+
+				decode_event(hfes, data, metadata);
+				fe_stats_add(hfes->m_Stats.m_EventsRead, 1);
+				// The events that report file handles have no file descriptor, but just in case
+				if( metadata->fd >= 0 )
+					close(metadata->fd);
+				i += (ssize_t)metadata->event_len;
+			}
+		}
+
+		// The callbacks are called without holding the lock, so that they may add/remove watches
+		fe_dispatch(hfes, &data->m_Batch);
+		fe_batch_clear(&data->m_Batch);
+	}
+}
+
+SFanotifyData* fe_fanotify_init(const SFileEventSystem* hfes)
+{
+	(void)hfes;
+	int fd = (int)syscall(SYS_fanotify_init, FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME, O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+	if( fd < 0 )
+	{
+		fprintf(stderr, "fanotify_init failed: %s\n", strerror(errno));
+		return 0;
+	}
+
+	SFanotifyData* data = new SFanotifyData;
+	data->m_Fd = fd;
+	data->m_HasRename = true;
+	data->m_DirsHand = 0;
+	data->m_Buffer.resize(FANOTIFY_BUF_LEN);
+	return data;
+}
+
+void fe_fanotify_close(SFanotifyData* data)
+{
+	for( const SFanotifyWatch& watch : data->m_Watches )
+		close(watch.m_MountFd);
+	close(data->m_Fd);
+	delete data;
+}
+
+int fe_fanotify_get_fd(const SFanotifyData* data)
+{
+	return data->m_Fd;
+}
+
+int fe_fanotify_add_watch(SFanotifyData* data, HFESWatchID watchid, const char* path, uint32_t mask, const SFileFilter* filter)
+{
+	// The kernel reports the real paths
+	char* root = realpath(path, 0);
+	if( !root )
+	{
+		fprintf(stderr, "realpath failed for '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	SFanotifyWatch watch;
+	watch.m_Root = root;
+	watch.m_Path = path;
+	while( watch.m_Path.size() > 1 && watch.m_Path[watch.m_Path.size()-1] == '/' )
+		watch.m_Path.erase(watch.m_Path.size()-1);
+	watch.m_Filter = filter;
+	watch.m_ID = watchid;
+	watch.m_Mask = mask;
+	free(root);
+
+	struct statfs st;
+	if( statfs(watch.m_Root.c_str(), &st) != 0 )
+	{
+		fprintf(stderr, "statfs failed for '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	memcpy(&watch.m_Fsid, &st.f_fsid, sizeof(watch.m_Fsid));
+
+	// Without it, none of the paths of the events could be resolved
+	watch.m_MountFd = open(watch.m_Root.c_str(), O_RDONLY | O_CLOEXEC);
+	if( watch.m_MountFd < 0 )
+	{
+		fprintf(stderr, "open failed for '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	// One mark per file system, with the events of all its watches
+	if( mark_filesystem(data, FAN_MARK_ADD, watch.m_MountFd, to_fanotify_mask(mask)) != 0 )
+	{
+		fprintf(stderr, "fanotify_mark failed for '%s': %s\n", path, strerror(errno));
+		close(watch.m_MountFd);
+		return -1;
+	}
+
+	data->m_Watches.push_back(watch);
+	return 0;
+}
+
+void fe_fanotify_update_watch(SFanotifyData* data, HFESWatchID watchid, uint32_t mask)
+{
+	for( SFanotifyWatch& watch : data->m_Watches )
+	{
+		if( watch.m_ID != watchid )
+			continue;
+		// The paths are matched against the root when the events are read, so FE_RECURSIVE can change too
+		watch.m_Mask = mask;
+		mark_filesystem(data, FAN_MARK_ADD, watch.m_MountFd, to_fanotify_mask(mask));
+		narrow_filesystem(data, watch.m_Fsid, watch.m_MountFd);
+		return;
+	}
+}
+
+uint32_t fe_fanotify_num_marks(const SFanotifyData* data)
+{
+	// One mark per file system
+	uint32_t count = 0;
+	for( size_t i = 0; i < data->m_Watches.size(); ++i )
+	{
+		if( find_fs_watch(data, data->m_Watches[i].m_Fsid) == &data->m_Watches[i] )
+			++count;
+	}
+	return count;
+}
+
+void fe_fanotify_remove_watch(SFanotifyData* data, HFESWatchID watchid)
+{
+	for( size_t i = 0; i < data->m_Watches.size(); ++i )
+	{
+		if( data->m_Watches[i].m_ID != watchid )
+			continue;
+
+		SFanotifyWatch watch = data->m_Watches[i];
+		data->m_Watches.erase(data->m_Watches.begin() + (ptrdiff_t)i);
+
+		// The mark goes with the last watch of the file system, the other watches may want fewer events
+		if( !find_fs_watch(data, watch.m_Fsid) )
+			mark_filesystem(data, FAN_MARK_REMOVE, watch.m_MountFd, to_fanotify_mask(FE_EVENT_TYPES));
+		else
+			narrow_filesystem(data, watch.m_Fsid, watch.m_MountFd);
+		close(watch.m_MountFd);
+		return;
+	}
+}
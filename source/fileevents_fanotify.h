@@ -0,0 +1,25 @@
+#pragma once
+
+#include "fileevents.h"
+
+struct SFileEventSystem;
+struct SFanotifyData;
+struct SFileFilter;
+
+/** The fanotify backend (FE_BACKEND_FANOTIFY). It's driven by the Linux backend, which owns the
+ * platform thread and waits for the fanotify instance together with its other file descriptors.
+ */
+
+// Returns 0 if fanotify isn't available (e.g. the process doesn't have CAP_SYS_ADMIN)
+SFanotifyData* fe_fanotify_init(const SFileEventSystem* hfes);
+void fe_fanotify_close(SFanotifyData* data);
+// The fanotify instance, to wait for
+int fe_fanotify_get_fd(const SFanotifyData* data);
+// The filter is owned by the watch, and outlives it
+int fe_fanotify_add_watch(SFanotifyData* data, HFESWatchID watchid, const char* path, uint32_t mask, const SFileFilter* filter);
+void fe_fanotify_update_watch(SFanotifyData* data, HFESWatchID watchid, uint32_t mask);
+void fe_fanotify_remove_watch(SFanotifyData* data, HFESWatchID watchid);
+// The number of marks in the kernel
+uint32_t fe_fanotify_num_marks(const SFanotifyData* data);
+// Drains the fanotify queue, and dispatches the events
+void fe_fanotify_read_events(SFileEventSystem* hfes, SFanotifyData* data);
@@ -0,0 +1,334 @@
+#include <string.h>
+
+#include "fileevents_filter.h"
+
+// A path is matched one segment (file or directory name) at a time
+struct SSegment
+{
+	const char* m_Str;
+	uint32_t 	m_Length;
+	uint32_t 	_pad;
+};
+
+// The segments of a path. Paths deeper than this are rare, and go to the heap.
+#define FILTER_STACK_DEPTH	128
+
+struct SSegments
+{
+	SSegment 				m_Stack[FILTER_STACK_DEPTH];
+	std::vector<SSegment> 	m_Heap;
+	SSegment* 				m_Segments;
+	uint32_t 				m_Count;
+	uint32_t 				_pad;
+
+	SSegments() : m_Segments(m_Stack), m_Count(0), _pad(0) {}
+
+	void push(const char* str, uint32_t length)
+	{
+		if( length == 0 )
+			return;
+		if( m_Count == FILTER_STACK_DEPTH && m_Heap.empty() )
+			m_Heap.assign(m_Stack, m_Stack + FILTER_STACK_DEPTH);
+		SSegment segment = { str, length, 0 };
+		if( !m_Heap.empty() )
+		{
+			m_Heap.push_back(segment);
+			m_Segments = &m_Heap[0];
+		}
+		else
+		{
+			m_Stack[m_Count] = segment;
+		}
+		m_Count++;
+	}
+
+	void split(const char* path, uint32_t length)
+	{
+		uint32_t start = 0;
+		for( uint32_t i = 0; i <= length; ++i )
+		{
+			if( i == length || path[i] == '/' )
+			{
+				push(path + start, i - start);
+				start = i + 1;
+			}
+		}
+	}
+};
+
+// Matches a bracket expression ("[abc]", "[a-z]", "[!0-9]") at p. Returns the end of it, or 0 if it isn't terminated.
+static const char* match_class(const char* p, const char* pend, char c, bool* matched)
+{
+	bool negated = p < pend && (*p == '!' || *p == '^');
+	if( negated )
+		++p;
+
+	bool found = false;
+	bool first = true;
+	while( p < pend && (*p != ']' || first) )
+	{
+		char lo = *p++;
+		if( lo == '\\' && p < pend )
+			lo = *p++;
+		char hi = lo;
+		if( p + 1 < pend && *p == '-' && p[1] != ']' )
+		{
+			hi = p[1];
+			p += 2;
+		}
+		if( c >= lo && c <= hi )
+			found = true;
+		first = false;
+	}
+	if( p == pend )
+		return 0;
+	*matched = found != negated;
+	return p + 1;
+}
+
+// Matches one segment of a pattern against one segment of a path ('*' never crosses a '/', since there are none)
+static bool match_glob(const char* p, const char* pend, const char* s, const char* send)
+{
+	const char* starp = 0;
+	const char* stars = 0;
+	while( s < send )
+	{
+		if( p < pend && *p == '*' )
+		{
+			starp = ++p;
+			stars = s;
+			continue;
+		}
+
+		bool matched = false;
+		const char* next = p + 1;
+		if( p < pend )
+		{
+			if( *p == '?' )
+				matched = true;
+			else if( *p == '[' )
+			{
+				next = match_class(p + 1, pend, *s, &matched);
+				if( !next )
+				{
+					// Not terminated, so it's just a '['
+					matched = *s == '[';
+					next = p + 1;
+				}
+			}
+			else if( *p == '\\' && p + 1 < pend )
+			{
+				matched = p[1] == *s;
+				next = p + 2;
+			}
+			else
+				matched = *p == *s;
+		}
+
+		if( matched )
+		{
+			p = next;
+			++s;
+		}
+		else if( starp )
+		{
+			// Let the last star eat one more character
+			p = starp;
+			s = ++stars;
+		}
+		else
+			return false;
+	}
+	while( p < pend && *p == '*' )
+		++p;
+	return p == pend;
+}
+
+static bool match_segment(const SFilterPattern& pattern, const std::string& segment, const SSegment& name)
+{
+	if( pattern.m_Literal )
+		return segment.size() == name.m_Length && memcmp(segment.c_str(), name.m_Str, name.m_Length) == 0;
+	return match_glob(segment.c_str(), segment.c_str() + segment.size(), name.m_Str, name.m_Str + name.m_Length);
+}
+
+static bool match_segments(const SFilterPattern& pattern, size_t pi, const SSegment* segments, uint32_t count, uint32_t si)
+{
+	const size_t numpattern = pattern.m_Segments.size();
+	while( pi < numpattern )
+	{
+		const std::string& segment = pattern.m_Segments[pi];
+		if( segment == "**" )
+		{
+			// "a/**" matches everything inside a
+			if( pi + 1 == numpattern )
+				return si < count;
+			for( uint32_t i = si; i < count; ++i )
+			{
+				if( match_segments(pattern, pi + 1, segments, count, i) )
+					return true;
+			}
+			return false;
+		}
+		if( si == count || !match_segment(pattern, segment, segments[si]) )
+			return false;
+		++pi;
+		++si;
+	}
+	return si == count;
+}
+
+static bool match_pattern(const SFilterPattern& pattern, const SSegment* segments, uint32_t count, bool isdir)
+{
+	if( pattern.m_DirOnly && !isdir )
+		return false;
+	if( !pattern.m_Anchored )
+		return match_segment(pattern, pattern.m_Segments[0], segments[count - 1]);
+	return match_segments(pattern, 0, segments, count, 0);
+}
+
+// The last pattern that matches decides
+static bool match_ordered(const std::vector<SFilterPattern>& patterns, const SSegment* segments, uint32_t count, bool isdir)
+{
+	bool matched = false;
+	for( const SFilterPattern& pattern : patterns )
+	{
+		if( matched == pattern.m_Negated && match_pattern(pattern, segments, count, isdir) )
+			matched = !pattern.m_Negated;
+	}
+	return matched;
+}
+
+static bool is_excluded(const SFileFilter* filter, const SSegment* segments, uint32_t count, bool isdir)
+{
+	if( filter->m_HasNegations )
+		return match_ordered(filter->m_Exclude, segments, count, isdir);
+
+	// Any match will do, and the plain names are found with a single lookup
+	const SSegment& name = segments[count - 1];
+	if( filter->m_ExcludeNames.m_Count )
+	{
+		uint32_t found = filter->m_ExcludeNames.find(fe_hash_string(name.m_Str, name.m_Length), [&](uint32_t i) {
+			const SFilterPattern& pattern = filter->m_Exclude[i];
+			return (!pattern.m_DirOnly || isdir) && match_segment(pattern, pattern.m_Segments[0], name);
+		});
+		if( found != FE_HASH_INVALID )
+			return true;
+	}
+
+	for( const SFilterPattern& pattern : filter->m_Exclude )
+	{
+		if( pattern.m_Literal && !pattern.m_Anchored )
+			continue; // In m_ExcludeNames
+		if( match_pattern(pattern, segments, count, isdir) )
+			return true;
+	}
+	return false;
+}
+
+static bool is_wanted(const SFileFilter* filter, const SSegment* segments, uint32_t count, bool isdir)
+{
+	if( count == 0 )
+		return true;
+	if( is_excluded(filter, segments, count, isdir) )
+		return false;
+	// The include patterns only apply to files, the directories have to be watched to find them
+	if( filter->m_Include.empty() || isdir )
+		return true;
+	return match_ordered(filter->m_Include, segments, count, isdir);
+}
+
+static bool parse_pattern(const char* text, SFilterPattern& pattern)
+{
+	std::string str = text;
+	while( !str.empty() && (str[str.size()-1] == ' ' || str[str.size()-1] == '\r' || str[str.size()-1] == '\n') &&
+		   !(str.size() > 1 && str[str.size()-2] == '\\') )
+		str.erase(str.size() - 1);
+	if( str.empty() || str[0] == '#' )
+		return false;
+
+	pattern.m_Negated = str[0] == '!';
+	if( pattern.m_Negated )
+		str.erase(0, 1);
+	else if( str.size() > 1 && str[0] == '\\' && (str[1] == '!' || str[1] == '#') )
+		str.erase(0, 1);
+
+	pattern.m_DirOnly = false;
+	while( !str.empty() && str[str.size()-1] == '/' )
+	{
+		pattern.m_DirOnly = true;
+		str.erase(str.size() - 1);
+	}
+
+	pattern.m_Anchored = str.find('/') != std::string::npos;
+	pattern.m_Literal = str.find_first_of("*?[\\") == std::string::npos;
+
+	size_t start = 0;
+	while( start <= str.size() )
+	{
+		size_t end = str.find('/', start);
+		if( end == std::string::npos )
+			end = str.size();
+		if( end > start )
+			pattern.m_Segments.push_back(str.substr(start, end - start));
+		start = end + 1;
+	}
+	return !pattern.m_Segments.empty();
+}
+
+static void parse_patterns(const char** patterns, uint32_t count, std::vector<SFilterPattern>& out)
+{
+	for( uint32_t i = 0; i < count; ++i )
+	{
+		SFilterPattern pattern;
+		if( patterns[i] && parse_pattern(patterns[i], pattern) )
+			out.push_back(pattern);
+	}
+}
+
+SFileFilter* fe_filter_create(const char** include, uint32_t numinclude, const char** exclude, uint32_t numexclude)
+{
+	SFileFilter* filter = new SFileFilter;
+	parse_patterns(include, numinclude, filter->m_Include);
+	parse_patterns(exclude, numexclude, filter->m_Exclude);
+	if( filter->m_Include.empty() && filter->m_Exclude.empty() )
+	{
+		delete filter;
+		return 0;
+	}
+
+	filter->m_HasNegations = false;
+	for( uint32_t i = 0; i < (uint32_t)filter->m_Exclude.size(); ++i )
+	{
+		const SFilterPattern& pattern = filter->m_Exclude[i];
+		if( pattern.m_Negated )
+			filter->m_HasNegations = true;
+		if( pattern.m_Literal && !pattern.m_Anchored )
+			filter->m_ExcludeNames.insert(fe_hash_string(pattern.m_Segments[0].c_str(), pattern.m_Segments[0].size()), i);
+	}
+	return filter;
+}
+
+void fe_filter_destroy(SFileFilter* filter)
+{
+	delete filter;
+}
+
+bool fe_filter_match(const SFileFilter* filter, const char* dir, uint32_t dirlength, const char* name, uint32_t namelength, bool isdir)
+{
+	SSegments segments;
+	segments.split(dir, dirlength);
+	segments.push(name, namelength);
+	return is_wanted(filter, segments.m_Segments, segments.m_Count, isdir);
+}
+
+bool fe_filter_match_path(const SFileFilter* filter, const char* path, uint32_t length, bool isdir)
+{
+	SSegments segments;
+	segments.split(path, length);
+	for( uint32_t i = 1; i < segments.m_Count; ++i )
+	{
+		if( is_excluded(filter, segments.m_Segments, i, true) )
+			return false;
+	}
+	return is_wanted(filter, segments.m_Segments, segments.m_Count, isdir);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "fileevents_hash.h"
+
+/** The include/exclude patterns of a watch (see SFileEventsWatchParams), in gitignore syntax:
+ *
+ * - "name" (no slash) matches a file or directory with that name, at any depth
+ * - "a/b" or "/name" (a slash at the start or in the middle) matches the path, relative to the watch root
+ * - "name/" only matches directories
+ * - "!pattern" includes what a previous pattern excluded (the last pattern that matches wins)
+ * - "*" and "?" match anything but '/', "[a-z]" matches a range, and "**" matches any number of directories
+ *
+ * As in git, nothing inside an excluded directory can be included again.
+ */
+struct SFilterPattern
+{
+	std::vector<std::string> 	m_Segments;	// The pattern, split at '/'
+	bool 	m_Negated;
+	bool 	m_DirOnly;
+	bool 	m_Anchored;	// Matched against the whole path, and not only the name
+	bool 	m_Literal;	// No wildcards
+	bool 	_padding[4];
+};
+
+struct SFileFilter
+{
+	std::vector<SFilterPattern> m_Exclude;
+	std::vector<SFilterPattern> m_Include;
+	// The exclude patterns that are plain names (e.g. "node_modules"), by the hash of the name.
+	// Only used if there are no negated patterns, since then the order doesn't matter.
+	SHashIndex 					m_ExcludeNames;
+	bool 						m_HasNegations;
+	bool 						_padding[7];
+};
+
+// Returns 0 if there are no patterns
+SFileFilter* fe_filter_create(const char** include, uint32_t numinclude, const char** exclude, uint32_t numexclude);
+void fe_filter_destroy(SFileFilter* filter);
+
+/** Is the entry wanted? The directory it's in is assumed to be wanted.
+ * @param dir		The path of the directory the entry is in, relative to the watch root (empty for the root itself)
+ * @param name 		The name of the entry
+ */
+bool fe_filter_match(const SFileFilter* filter, const char* dir, uint32_t dirlength, const char* name, uint32_t namelength, bool isdir);
+
+// Are the path (relative to the watch root) and all of its parent directories wanted?
+bool fe_filter_match_path(const SFileFilter* filter, const char* path, uint32_t length, bool isdir);
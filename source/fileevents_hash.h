@@ -0,0 +1,287 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#define FE_HASH_INVALID	0xFFFFFFFF
+
+static inline uint32_t fe_hash_string(const char* str, size_t len)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for( size_t i = 0; i < len; ++i )
+	{
+		hash ^= (uint8_t)str[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static inline uint32_t fe_hash_string(const char* str)
+{
+	return fe_hash_string(str, strlen(str));
+}
+
+static inline uint32_t fe_hash_int(uint64_t key)
+{
+	// The MurmurHash3 finalizer
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdull;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ull;
+	key ^= key >> 33;
+	return (uint32_t)key;
+}
+
+/** An open addressing (linear probing) hash index, from a key to a uint32_t value (usually an index into an array).
+ * The keys are stored by the owner of the index, and each lookup passes a functor that compares
+ * the key it's looking for with the key of a value: bool equal(uint32_t value)
+ *
+ * Each slot is 8 bytes: the hash of the key, and the value + 1 (0 means an empty slot)
+ */
+struct SHashIndex
+{
+	std::vector<uint64_t> 	m_Slots;
+	uint32_t 				m_Count;
+	uint32_t 				_pad;
+
+	SHashIndex() : m_Count(0), _pad(0) {}
+
+	template<typename Equal>
+	uint32_t find(uint32_t hash, Equal equal) const
+	{
+		if( m_Slots.empty() )
+			return FE_HASH_INVALID;
+
+		const size_t mask = m_Slots.size() - 1;
+		for( size_t i = hash & mask; ; i = (i + 1) & mask )
+		{
+			uint64_t slot = m_Slots[i];
+			if( slot == 0 )
+				return FE_HASH_INVALID;
+			if( (uint32_t)(slot >> 32) == hash && equal((uint32_t)slot - 1) )
+				return (uint32_t)slot - 1;
+		}
+	}
+
+	// The caller makes sure the key isn't already in the index
+	void insert(uint32_t hash, uint32_t value)
+	{
+		// Keep the load factor below 0.75
+		if( (m_Count + 1) * 4 > m_Slots.size() * 3 )
+			grow();
+		put(hash, value);
+		m_Count++;
+	}
+
+	template<typename Equal>
+	bool erase(uint32_t hash, Equal equal)
+	{
+		if( m_Slots.empty() )
+			return false;
+
+		const size_t mask = m_Slots.size() - 1;
+		size_t i = hash & mask;
+		for( ; ; i = (i + 1) & mask )
+		{
+			uint64_t slot = m_Slots[i];
+			if( slot == 0 )
+				return false;
+			if( (uint32_t)(slot >> 32) == hash && equal((uint32_t)slot - 1) )
+				break;
+		}
+
+		// Backward shift deletion, so there's no need for tombstones
+		size_t hole = i;
+		for( size_t j = (i + 1) & mask; m_Slots[j] != 0; j = (j + 1) & mask )
+		{
+			size_t home = (uint32_t)(m_Slots[j] >> 32) & mask;
+			// Can the entry at j move into the hole? (i.e. is its home slot not in the range (hole, j])
+			bool movable = hole <= j ? (home <= hole || home > j) : (home <= hole && home > j);
+			if( movable )
+			{
+				m_Slots[hole] = m_Slots[j];
+				hole = j;
+			}
+		}
+		m_Slots[hole] = 0;
+		m_Count--;
+		return true;
+	}
+
+	// Changes the value of a key (e.g. when the item moves in its array)
+	void replace(uint32_t hash, uint32_t oldvalue, uint32_t newvalue)
+	{
+		const size_t mask = m_Slots.size() - 1;
+		for( size_t i = hash & mask; m_Slots[i] != 0; i = (i + 1) & mask )
+		{
+			if( m_Slots[i] == ((uint64_t)hash << 32 | (uint64_t)(oldvalue + 1)) )
+			{
+				m_Slots[i] = (uint64_t)hash << 32 | (uint64_t)(newvalue + 1);
+				return;
+			}
+		}
+	}
+
+	// Keeps the memory
+	void clear()
+	{
+		std::fill(m_Slots.begin(), m_Slots.end(), 0);
+		m_Count = 0;
+	}
+
+private:
+	void put(uint32_t hash, uint32_t value)
+	{
+		const size_t mask = m_Slots.size() - 1;
+		size_t i = hash & mask;
+		while( m_Slots[i] != 0 )
+			i = (i + 1) & mask;
+		m_Slots[i] = (uint64_t)hash << 32 | (uint64_t)(value + 1);
+	}
+
+	void grow()
+	{
+		std::vector<uint64_t> old;
+		old.swap(m_Slots);
+		m_Slots.resize(old.empty() ? 16 : old.size() * 2, 0);
+		for( uint64_t slot : old )
+		{
+			if( slot != 0 )
+				put((uint32_t)(slot >> 32), (uint32_t)slot - 1);
+		}
+	}
+};
+
+/** A streaming hash of the content of a file (XXH64, seed 0). It reads 32 bytes per round in four independent lanes,
+ * so it runs at several GB/s, which is well above what the file is read at.
+ */
+struct SContentHash
+{
+	uint64_t 	m_Lanes[4];
+	uint64_t 	m_Total;
+	uint8_t 	m_Pending[32];	// The bytes that didn't fill a round yet
+	uint32_t 	m_NumPending;
+	uint32_t 	_pad;
+
+	static const uint64_t PRIME1 = 0x9E3779B185EBCA87ull;
+	static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4Full;
+	static const uint64_t PRIME3 = 0x165667B19E3779F9ull;
+	static const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ull;
+	static const uint64_t PRIME5 = 0x27D4EB2F165667C5ull;
+
+	SContentHash()
+	{
+		m_Lanes[0] = PRIME1 + PRIME2;
+		m_Lanes[1] = PRIME2;
+		m_Lanes[2] = 0;
+		m_Lanes[3] = 0 - PRIME1;
+		m_Total = 0;
+		m_NumPending = 0;
+		_pad = 0;
+	}
+
+	void update(const void* data, size_t length)
+	{
+		const uint8_t* p = (const uint8_t*)data;
+		const uint8_t* end = p + length;
+		m_Total += length;
+
+		if( m_NumPending + length < 32 )
+		{
+			memcpy(m_Pending + m_NumPending, p, length);
+			m_NumPending += (uint32_t)length;
+			return;
+		}
+		if( m_NumPending )
+		{
+			uint32_t fill = 32 - m_NumPending;
+			memcpy(m_Pending + m_NumPending, p, fill);
+			consume(m_Pending);
+			p += fill;
+			m_NumPending = 0;
+		}
+		for( ; p + 32 <= end; p += 32 )
+			consume(p);
+		m_NumPending = (uint32_t)(end - p);
+		memcpy(m_Pending, p, m_NumPending);
+	}
+
+	uint64_t digest() const
+	{
+		uint64_t h;
+		if( m_Total >= 32 )
+		{
+			h = rotl(m_Lanes[0], 1) + rotl(m_Lanes[1], 7) + rotl(m_Lanes[2], 12) + rotl(m_Lanes[3], 18);
+			for( int i = 0; i < 4; ++i )
+			{
+				h ^= round(0, m_Lanes[i]);
+				h = h * PRIME1 + PRIME4;
+			}
+		}
+		else
+		{
+			h = PRIME5;
+		}
+		h += m_Total;
+
+		const uint8_t* p = m_Pending;
+		const uint8_t* end = m_Pending + m_NumPending;
+		for( ; p + 8 <= end; p += 8 )
+		{
+			h ^= round(0, read64(p));
+			h = rotl(h, 27) * PRIME1 + PRIME4;
+		}
+		if( p + 4 <= end )
+		{
+			uint32_t v;
+			memcpy(&v, p, sizeof(v));
+			h ^= (uint64_t)v * PRIME1;
+			h = rotl(h, 23) * PRIME2 + PRIME3;
+			p += 4;
+		}
+		for( ; p < end; ++p )
+		{
+			h ^= (uint64_t)*p * PRIME5;
+			h = rotl(h, 11) * PRIME1;
+		}
+
+		h ^= h >> 33;
+		h *= PRIME2;
+		h ^= h >> 29;
+		h *= PRIME3;
+		h ^= h >> 32;
+		return h;
+	}
+
+private:
+	static uint64_t rotl(uint64_t x, int r)
+	{
+		return (x << r) | (x >> (64 - r));
+	}
+
+	// The platforms we run on are all little endian
+	static uint64_t read64(const uint8_t* p)
+	{
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	static uint64_t round(uint64_t acc, uint64_t input)
+	{
+		acc += input * PRIME2;
+		acc = rotl(acc, 31);
+		return acc * PRIME1;
+	}
+
+	void consume(const uint8_t* p)
+	{
+		m_Lanes[0] = round(m_Lanes[0], read64(p));
+		m_Lanes[1] = round(m_Lanes[1], read64(p + 8));
+		m_Lanes[2] = round(m_Lanes[2], read64(p + 16));
+		m_Lanes[3] = round(m_Lanes[3], read64(p + 24));
+	}
+};
@@ -1,37 +1,176 @@
+#include <atomic>
 #include <thread>
 #include <mutex>
-#include <map>
+#include <vector>
 #include <string>
 
+#include "fileevents_hash.h"
+#include "fileevents_ring.h"
+#include "fileevents_pathtree.h"
+
 struct SPlatformData;
+struct SSnapshot;
+struct SDispatchPool;
+struct SFileFilter;
+
+// The event types a watch can ask for in its mask (FE_ALL, the default, leaves out FE_ATTRIBUTE)
+static const uint32_t FE_EVENT_TYPES = FE_ALL | FE_ATTRIBUTE;
+
+// The counters behind fe_get_stats(). They're only updated with relaxed atomics, so they cost next to nothing.
+struct SEventStats
+{
+	std::atomic<uint64_t> m_EventsRead;
+	std::atomic<uint64_t> m_EventsDispatched;
+	std::atomic<uint64_t> m_EventsFiltered;
+	std::atomic<uint64_t> m_EventsCoalesced;
+	std::atomic<uint64_t> m_Overflows;
+	std::atomic<uint64_t> m_Reads;
+	std::atomic<uint64_t> m_BytesRead;
+	std::atomic<uint64_t> m_CallbackCalls;
+	std::atomic<uint64_t> m_CallbackTimeNs;
+	std::atomic<uint64_t> m_CallbackHistogram[FE_STATS_HISTOGRAM_SIZE];
+	std::atomic<uint32_t> m_CoalescedEvents;	// Held back right now
+	std::atomic<uint32_t> m_DispatchQueued;		// Queued for the dispatch threads right now
+};
+
+static inline void fe_stats_add(std::atomic<uint64_t>& counter, uint64_t value)
+{
+	counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+// A registered path
+struct SWatch
+{
+	HFESWatchID m_ID;
+	uint32_t	m_Path;		// A node in SFileEventSystem::m_WatchPaths
+	uint32_t	m_Mask;
+	uint32_t	m_PathHash;
+	uint32_t	_pad;
+	SFileFilter* m_Filter;	// The include/exclude patterns, or 0
+};
+
+// Paths passed to fe_add_watches_async(), waiting for the platform thread
+struct SWatchRequest
+{
+	std::vector<std::string> 	m_Paths;
+	std::vector<uint32_t> 		m_Masks;
+	fe_add_watches_callback 	m_Callback;
+	void* 						m_CallbackCtx;
+};
+
+// A batch of events, with the paths in one string arena
+struct SEventBatch
+{
+	std::vector<SFileEvent> m_Events;
+	std::vector<char>		m_Strings;
+};
 
 struct SFileEventSystem
 {
 	std::thread m_Thread;
 	fe_callback m_Callback;
+	fe_batch_callback m_BatchCallback;
+	fe_rename_callback m_RenameCallback;
 	void*		m_CallbackCtx;
 
+	// Calls the callbacks, if m_DispatchThreads is set
+	SDispatchPool* m_Dispatch;
+
+	// Used instead of the callbacks when the user polls for events
+	SEventRing* m_Ring;
+	int 		m_EventFd;
+	int 		_pad;
+	std::atomic<uint64_t> m_RingDropped;
+
+	SEventStats m_Stats;
+
+	// The events held back for m_CoalesceMs, with an index by path. Only used by the platform thread.
+	SEventBatch 			m_Coalesced;
+	SHashIndex 				m_CoalescedByPath;
+	std::vector<uint8_t>	m_CoalescedCreatedFirst;	// Was the first event of the path a create?
+	uint64_t 				m_CoalesceDeadline;			// When to send them (ms). 0 if there are no events.
+	uint32_t 				m_CoalesceMs;
+	uint32_t 				m_Backend;	// EFileEventsBackend
+	uint32_t 				m_PollIntervalMs;		// The polled watches (0 means the default)
+	uint32_t 				m_PollStatsPerSecond;
+
 	SPlatformData* m_PlatformData;
 
+	// What the watched paths look like, as of the last event (only used if m_RescanOnOverflow or a journal is set). Protected by m_Lock.
+	SSnapshot* m_Snapshot;
+	// Where the snapshot is persisted between runs (empty if it isn't)
+	std::string m_JournalPath;
+
 	// Lock for the data below
 	std::mutex 	m_Lock;
 	int64_t 	m_WatchCounter;
 
-	std::map< HFESWatchID, std::pair<std::string, uint32_t> > m_PathsToWatch;
+	// The registered paths, with an index by path and by id. The paths are interned (nested watches share their parents),
+	// in the same tree as the paths the backend watches (the Linux kernel watches and the polled directories).
+	std::vector<SWatch> m_Watches;
+	SHashIndex 			m_WatchesByPath;
+	SHashIndex 			m_WatchesByID;
+	SPathTree 			m_WatchPaths;
+
+	// The asynchronous registrations that the platform thread hasn't got to yet
+	std::vector<SWatchRequest> m_PendingWatches;
 
 	// Have the path list changed?
-	bool m_Updated;
-	bool m_Cancel;
+	std::atomic<bool> m_Updated;
+	std::atomic<bool> m_Cancel;
 	bool m_Verbose;
+	bool m_RescanOnOverflow;
+	bool m_RingOverflowed;	// Events were dropped, and nobody's been told yet (only used by the platform thread)
+	bool m_SharedEngine;	// The platform thread is shared with other systems (and m_Thread isn't used)
+	bool m_ContentHash;		// Only report the writes that change the content of a file
+	bool m_IoUring;			// Use io_uring, if the kernel has it
 
-	bool _padding[5];
+	bool _padding[2];
 };
 
 SPlatformData* fe_platform_init(const SFileEventSystem* hfes);
 void fe_platform_close(const SFileEventSystem* hfes);
 void platform_thread_run(SFileEventSystem* hfes);
-int fe_platform_add_watch(const SFileEventSystem* hfes, HFESWatchID watchid, const char* path, uint32_t mask);
+// The filter is owned by the watch, and lives until after fe_platform_remove_watch()
+int fe_platform_add_watch(const SFileEventSystem* hfes, HFESWatchID watchid, const char* path, uint32_t mask, const SFileFilter* filter);
+// Called when fe_add_watch() is called again for a watched path, with a new mask
+void fe_platform_update_watch(const SFileEventSystem* hfes, HFESWatchID watchid, uint32_t mask);
 void fe_platform_remove_watch(const SFileEventSystem* hfes, HFESWatchID watchid);
+// The number of watches the OS keeps for the system (the caller holds m_Lock)
+uint32_t fe_platform_num_kernel_watches(const SFileEventSystem* hfes);
+// Wakes up the platform thread, so that it picks up m_Updated/m_Cancel without delay
+void fe_platform_wakeup(const SFileEventSystem* hfes);
+
+// Adds an event with room for a path of the given length, and returns where to write the path (the null terminator is added)
+char* fe_batch_add(SEventBatch* batch, HFESWatchID watchid, uint32_t flags, uint32_t length);
+void fe_batch_add(SEventBatch* batch, HFESWatchID watchid, uint32_t flags, const char* path);
+// Adds room for the new path of the last event (a rename), and returns where to write it
+char* fe_batch_add_target(SEventBatch* batch, uint32_t length);
+// Calls the callbacks with the events (on the calling thread)
+void fe_send_to_callbacks(SFileEventSystem* hfes, const SEventBatch* batch);
+// Calls the callbacks with a part of a batch (the paths of the events are in strings)
+void fe_send_to_callbacks(SFileEventSystem* hfes, const SFileEvent* events, uint32_t count, const char* strings);
+// Removes the last event of the batch
+void fe_batch_pop(SEventBatch* batch);
+void fe_batch_clear(SEventBatch* batch);
+
+// Sends the events to the user (or holds on to them, see m_CoalesceMs). It must be called without holding m_Lock.
+void fe_dispatch(SFileEventSystem* hfes, const SEventBatch* batch);
+// Sends the held back events once their time is up (or right away if force is set).
+// Returns the number of milliseconds until it needs to be called again, or -1 if there are no events waiting.
+int fe_flush_events(SFileEventSystem* hfes, bool force);
+
+// A monotonic clock, in milliseconds
+uint64_t fe_get_time_ms();
+
+// Is the path the directory itself, or something inside it? (only directly inside it, unless recursive is set)
+bool fe_is_in_dir(const std::string& path, const std::string& dir, bool recursive);
+
+// Adds the watches of fe_add_watches_async() and calls their callbacks. Called by the platform thread when it's woken up (without holding m_Lock).
+void fe_add_pending_watches(SFileEventSystem* hfes);
+
+// Finds a registered watch (the caller holds m_Lock). Returns 0 if it's not found.
+SWatch* fe_find_watch(SFileEventSystem* hfes, HFESWatchID watchid);
 
 // Used by the unit test to check if the system is up and running yet
 bool fe_is_running(const SFileEventSystem* hfes);
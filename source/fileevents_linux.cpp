@@ -1,184 +1,2486 @@
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <algorithm>
 #include <map>
+#include <set>
 #include <string>
+#include <vector>
 #include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
 
 #include "fileevents.h"
 #include "fileevents_internal.h"
+#include "fileevents_fanotify.h"
+#include "fileevents_snapshot.h"
+#include "fileevents_filter.h"
+#include "fileevents_pathtree.h"
+#include "fileevents_uring.h"
+#include "fileevents_statpoll.h"
 
 #define EVENT_SIZE  	( sizeof (struct inotify_event) )
-#define EVENT_BUF_LEN   ( 1024 * ( EVENT_SIZE + 16 ) )
+// Room for a few thousand events with full length names, so a burst is drained in as few reads as possible
+#define EVENT_BUF_LEN   ( 4096 * ( EVENT_SIZE + NAME_MAX + 1 ) )
+
+// The getdents64() buffer used by each crawler thread
+#define CRAWL_BUF_LEN		( 64 * 1024 )
+#define CRAWL_MAX_THREADS	8
+// The number of stats each crawler thread submits at once (with m_IoUring)
+#define CRAWL_URING_ENTRIES	256
+
+// The requests kept posted on the io_uring of the platform thread (the user data of the requests)
+enum EUringRequest
+{
+	URING_INOTIFY = 1,
+	URING_WAKEUP,
+	URING_CANCEL,
+};
+
+// The content of the written files is read in chunks of this size (see m_ContentHash)
+#define CONTENT_BUF_LEN			( 64 * 1024 )
+// Larger files are always reported, since hashing them would hold up the other events
+#define CONTENT_HASH_MAX_SIZE	( 64 * 1024 * 1024 )
+// The coarsest modification times of the usual file systems (FAT). A file modified this close to when it was hashed
+// may be written again with the same modification time and size, so its mtime and size don't tell if it changed.
+#define CONTENT_MTIME_TICK_NS	( 2 * 1000000000LL )
+
+// The events held back while the watches are rescanned after an overflow. If there are more, they're dropped,
+// and it's treated as another overflow.
+#define RESCAN_DEFERRED_MAX_LEN	( 16 * EVENT_BUF_LEN )
+// A rescan doesn't start until this long after the last one finished. The overflows meanwhile (and during a rescan)
+// are all covered by the one rescan that follows.
+#define RESCAN_INTERVAL_MS		1000
+
+// How long the first half of a rename waits for its second half, before it's reported as removed.
+// Both halves are queued by the same rename() call, so it's only a problem when a read ends between them.
+#define RENAME_TIMEOUT_MS	20
+
+// All the events we can ask the kernel for
+static const uint32_t s_InotifyMask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB |
+									  IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+// The sub directories found when crawling are never symlinks
+static const uint32_t s_InotifyDirFlags = IN_ONLYDIR | IN_DONT_FOLLOW;
+
+// The kernel events needed for the events in the mask of a watch, so that e.g. a watch
+// that only wants FE_CREATED isn't woken up by every write
+static uint32_t to_inotify_mask(const SFileEventSystem* hfes, uint32_t mask)
+{
+	uint32_t out = IN_DELETE_SELF;
+	if( hfes->m_Snapshot )
+	{
+		// The snapshot is kept up to date with every change
+		out = s_InotifyMask;
+	}
+	else
+	{
+		if( mask & FE_CREATED ) 	out |= IN_CREATE | IN_MOVED_TO;
+		if( mask & FE_REMOVED ) 	out |= IN_DELETE | IN_MOVED_FROM;
+		if( mask & FE_RENAMED ) 	out |= IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF;
+		if( mask & FE_MODIFIED ) 	out |= IN_MODIFY;
+		if( mask & FE_ATTRIBUTE ) 	out |= IN_ATTRIB;
+		// The new directories (and the ones moved in or out) change which directories are watched
+		if( mask & FE_RECURSIVE ) 	out |= IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO;
+	}
+
+	// The writes are only looked at once the file is closed, and the hashes follow the files that are renamed or removed
+	if( hfes->m_ContentHash && (out & IN_MODIFY) )
+		out = (out & ~(uint32_t)IN_MODIFY) | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+	return out;
+}
+
+// A kernel watch (a watch descriptor) and the watches that are interested in it
+struct SWatchDir
+{
+	std::vector<HFESWatchID> 	m_Owners;
+	uint32_t 					m_Path;		// A node in SFileEventSystem::m_WatchPaths
+	int 						m_Wd;
+	bool 						m_IsDir;
+	bool 						m_Filtered;	// Does any of the owners have include/exclude patterns?
+	bool 						_padding[6];
+};
+
+// A registered watch, and the kernel watches it owns (more than one if it's recursive)
+struct SWatchInfo
+{
+	std::string 		m_Root;
+	std::set<int> 		m_Wds;
+	const SFileFilter* 	m_Filter;	// Owned by the SWatch
+	uint32_t 			m_Mask;
+	int 				m_RootWd;
+
+	SWatchInfo() : m_Filter(0), m_Mask(0), m_RootWd(-1) {}
+};
+
+// The first half of a rename (IN_MOVED_FROM), waiting for the second half with the same cookie
+struct SPendingMove
+{
+	HFESWatchID m_WatchID;
+	uint64_t 	m_Deadline;	// When it's reported as removed instead (ms)
+	uint32_t 	m_PathOffset;	// The old path, in m_MovePaths
+	uint32_t 	m_PathLength;
+	uint32_t 	m_Cookie;
+	uint32_t 	m_Flags;	// The type of the file (FE_IS_FILE/FE_IS_DIR)
+};
+
+// One inotify instance and one thread, shared by all the systems created with m_SharedEngine.
+// The kernel returns the same watch descriptor for the same inode, so the kernel watches are reference counted,
+// with one reference per system that uses it.
+struct SInotifyEngine
+{
+	std::thread 	m_Thread;
+
+	// The systems attached to the engine. The lock isn't held while a system is serviced (the callbacks may attach or detach
+	// other systems), but a system isn't detached while the engine thread is busy with it (see service_systems()).
+	std::mutex 						m_Lock;
+	std::condition_variable 		m_Idle;		// Signalled when the engine thread is done with a system
+	std::vector<SFileEventSystem*> 	m_Systems;
+	std::vector<SFileEventSystem*> 	m_Serviced;	// The systems the engine thread is going through (the detached ones are cleared)
+	SFileEventSystem* 				m_Busy;		// The system the engine thread is servicing right now
+
+	std::mutex 			m_WdLock;
+	std::map<int, int> 	m_WdRefs;	// Protected by m_WdLock
+
+	char* 	m_Buffer;	// The read buffer (EVENT_BUF_LEN bytes)
+	int 	m_Fd;		// The inotify instance
+	int 	m_EpollFd;	// Waits for the inotify instance and the wakeup fd
+	int 	m_WakeupFd;
+	int 	m_RefCount;	// The number of attached systems, protected by s_EngineLock
+
+	std::atomic<bool> m_Stop;
+	std::atomic<bool> m_IsRunning;
+	bool _padding[6];
+};
+
+static std::mutex 		s_EngineLock;
+static SInotifyEngine* 	s_Engine = 0;
+
+// A kernel watch that was added by the crawler
+struct SCrawlResult
+{
+	std::string m_Path;
+	int 		m_Wd;
+	int 		_pad;
+};
+
+// A file or directory found by the crawler
+struct SCrawlEntry
+{
+	std::string 	m_Path;
+	SSnapshotInfo 	m_Info;
+	bool 			m_IsDir;
+	bool 			_padding[7];
+};
+
+// A watch that's rescanned after the kernel queue overflowed (see rescan_watches())
+struct SRescan
+{
+	std::string 				m_Root;
+	SFileFilter 				m_Filter;	// A copy, since the watch may be removed while it's scanned
+	std::vector<SCrawlResult> 	m_Results;
+	std::vector<SCrawlEntry> 	m_Entries;	// The root comes first
+	HFESWatchID 				m_WatchID;
+	uint32_t 					m_InotifyMask;
+	uint32_t 					m_Source;	// The rescan whose crawl covers this watch (its own index, if it's crawled itself)
+	int 						m_Wd;		// The kernel watch of the root
+	bool 						m_IsDir;
+	bool 						m_Recursive;
+	bool 						m_Filtered;
+	bool 						_padding[1];
+};
+
+// The content of a written file, the last time it was hashed (see m_ContentHash)
+struct SFileContent
+{
+	int64_t 	m_MTime;	// ns
+	int64_t 	m_Size;
+	int64_t 	m_Checked;	// ns. When it was hashed (the wall clock, like the modification times)
+	uint64_t 	m_Hash;
+};
 
 struct SPlatformData
 {
-	int	m_Fd;	// the inotify instance
+	int	m_Fd;		// the inotify instance (the engine's, if it's shared)
+	int m_EpollFd;	// waits for the inotify instance and the wakeup fd (-1 if the engine is shared)
+	int m_WakeupFd;	// eventfd, signalled by fe_platform_wakeup() (the engine's, if it's shared)
+	int _pad;
+
+	// Set if the inotify instance and the thread are shared with other systems
+	SInotifyEngine* m_Engine;
+
+	// Set if the fanotify backend is used instead of inotify
+	SFanotifyData* m_Fanotify;
+
+	// The watches that are polled instead (see FE_BACKEND_POLL)
+	SStatPollData* m_StatPoll;
+
+	// Set if the events are read with io_uring instead of epoll (see wait_uring())
+	SUring* 	m_Uring;
+	uint64_t 	m_WakeupValue;	// Where the posted read of the wakeup fd goes
+
+	// Maps watch id to file handles
+	std::map<HFESWatchID, SWatchInfo> m_WatchHandles;
+
+	// The kernel watches, with an index by file handle
+	std::vector<SWatchDir> 	m_Dirs;
+	SHashIndex 				m_DirsByWd;
+	// The paths of the kernel watches, in SFileEventSystem::m_WatchPaths (the directories of a recursive watch share their parents)
+	SPathTree* 				m_Paths;
+
+	// The read buffer (EVENT_BUF_LEN bytes)
+	char* m_Buffer;
+
+	// Events decoded while holding the lock, sent once the lock is released
+	SEventBatch m_Batch;
+	// Scratch space for apply_masks()
+	std::vector<SFileEvent> m_Masked;
+
+	// Paths reported as created by a scan of a new directory, since the queue was last empty
+	std::set<std::string> m_Synthetic;
+
+	// The changes since the journal was saved, found by fe_platform_add_watch(). Protected by hfes->m_Lock.
+	SEventBatch m_Replay;
+
+	// The renames waiting for their second half, and their paths. Only used by the platform thread.
+	std::vector<SPendingMove> m_Moves;
+	std::vector<char> 		m_MovePaths;
+
+	// Scratch buffers for the decoding (so that a steady stream of events doesn't allocate anything)
+	std::string m_Path;
+	std::string m_Target;
+	std::string m_DirPath;
+	std::vector<char> m_ContentBuffer;	// CONTENT_BUF_LEN bytes, if m_ContentHash is set
+
+	// The content of the written files, by path (see m_ContentHash). Only used by the platform thread, so that the files
+	// are hashed without holding the lock.
+	std::map<std::string, SFileContent> m_Contents;
+
+	// After an overflow, the watches are rescanned on a thread of their own. The events read meanwhile are held back
+	// (they're newer than the scan), and they're decoded once the differences have been sent. Only used by the platform thread.
+	std::thread 			m_RescanThread;
+	std::vector<SRescan> 	m_Rescans;
+	std::vector<char> 		m_Deferred;
+	uint64_t 				m_RescanEnd;	// ms. When the last rescan finished
+
+	std::atomic<bool> m_IsRunning;
+	std::atomic<bool> m_RescanDone;	// Set by the rescan thread when it's done
+	std::atomic<bool> m_Closing;	// Stops the crawls
+	bool m_ReadPosted;		// Is there a read of the inotify queue on m_Uring?
+	bool m_WakeupPosted;	// Is there a read of the wakeup fd on m_Uring?
+	bool m_CrawlUring;		// Do the crawls stat the files with io_uring?
+	bool m_Rescanning;		// Is the rescan thread running?
+	bool m_RescanPending;	// Is another rescan due? The events are dropped until it starts (see start_pending_rescan())
+};
+
+static void _print_flags(uint32_t mask)
+{
+	if( mask & IN_CREATE ) 			printf("Create, ");
+	if( mask & IN_DELETE ) 			printf("Delete, ");
+	if( mask & IN_MODIFY ) 			printf("Modify, ");
+	if( mask & IN_CLOSE_WRITE ) 	printf("CloseWrite, ");
+	if( mask & IN_ATTRIB ) 			printf("Attrib, ");
+	if( mask & IN_MOVED_FROM ) 		printf("MovedFrom, ");
+	if( mask & IN_MOVED_TO ) 		printf("MovedTo, ");
+	if( mask & IN_DELETE_SELF ) 	printf("DeleteSelf, ");
+	if( mask & IN_MOVE_SELF ) 		printf("MoveSelf, ");
+	if( mask & IN_ISDIR ) 			printf("IsDir, ");
+
+	if( mask & IN_IGNORED ) 		printf("Ignored, ");
+	if( mask & IN_Q_OVERFLOW ) 		printf("QueueOverflow, ");
+	if( mask & IN_UNMOUNT ) 		printf("Unmount, ");
+
+	printf("\n");
+}
+
+static EFileEvents convert_flags(uint32_t mask, bool isdir)
+{
+	uint64_t out = 0;
+	if( mask & IN_CREATE ) 			out |= FE_CREATED;
+	if( mask & IN_DELETE ) 			out |= FE_REMOVED;
+	if( mask & IN_DELETE_SELF ) 	out |= FE_REMOVED;
+	if( mask & IN_MOVED_FROM ) 		out |= FE_RENAMED;
+	if( mask & IN_MOVED_TO ) 		out |= FE_RENAMED;
+	if( mask & IN_MOVE_SELF ) 		out |= FE_RENAMED;
+	if( mask & IN_MODIFY ) 			out |= FE_MODIFIED;
+
+	if( mask & IN_ATTRIB ) 			out |= FE_ATTRIBUTE;
+
+	if( isdir )						out |= FE_IS_DIR;
+	else							out |= FE_IS_FILE;
+
+	return (EFileEvents)out;
+}
+
+// Removes the trailing separators, but keeps the root "/"
+static std::string normalize_path(const char* path)
+{
+	std::string out(path);
+	while( out.size() > 1 && out[out.size()-1] == '/' )
+		out.erase(out.size()-1);
+	return out;
+}
+
+static void join_path(std::string& out, const std::string& dir, const char* name)
+{
+	out = dir;
+	if( out.empty() || out[out.size()-1] != '/' )
+		out += '/';
+	out += name;
+}
+
+static void set_snapshot_info(SSnapshotInfo& info, const struct stat& st)
+{
+	info.m_Inode = (uint64_t)st.st_ino;
+	info.m_MTime = (int64_t)st.st_mtim.tv_sec * 1000000000 + (int64_t)st.st_mtim.tv_nsec;
+	info.m_Size = (int64_t)st.st_size;
+	info.m_Mode = (uint32_t)st.st_mode;
+	info.m_Generation = 0;
+}
+
+// The include/exclude patterns of the watches that a scan is for. An entry is skipped if all of them exclude it.
+struct SCrawlFilter
+{
+	std::vector<std::pair<const SFileFilter*, size_t> > m_Filters;	// The filter, and the length of the root of its watch
+};
+
+// The offset of the path, relative to the root of a watch (the path is inside the root)
+static uint32_t relative_offset(const std::string& path, size_t rootlength)
+{
+	if( path.size() <= rootlength )
+		return (uint32_t)path.size();
+	return (uint32_t)rootlength + (path[rootlength] == '/' ? 1 : 0);
+}
+
+static bool is_excluded(const SCrawlFilter* filter, const std::string& dir, const char* name, bool isdir)
+{
+	for( const std::pair<const SFileFilter*, size_t>& item : filter->m_Filters )
+	{
+		if( !item.first )
+			return false;
+		uint32_t offset = relative_offset(dir, item.second);
+		if( fe_filter_match(item.first, dir.c_str() + offset, (uint32_t)dir.size() - offset, name, (uint32_t)strlen(name), isdir) )
+			return false;
+	}
+	return !filter->m_Filters.empty();
+}
+
+// A recursive directory scan, shared by the crawler threads
+struct SCrawl
+{
+	std::mutex 					m_Lock;
+	std::condition_variable 	m_Cond;
+	std::vector<std::string>	m_Queue;	// Directories left to scan
+	std::vector<SCrawlResult>	m_Results;
+	std::vector<SCrawlEntry>*	m_Entries;	// If set, receives every entry found
+	const SCrawlFilter* 		m_Filter;	// If set, the entries it excludes are skipped
+	SInotifyEngine* 			m_Engine;	// Set if the kernel watches are shared
+	const std::atomic<bool>* 	m_Abort;	// Leaves the rest of the directories unscanned, when set
+	int 						m_Fd;		// The inotify instance
+	int 						m_Busy;		// Number of threads scanning a directory right now
+	uint32_t 					m_InotifyMask;
+	bool 						m_Uring;	// Stat the entries with io_uring
+	bool 						_padding[3];
+};
+
+// The stats of a directory listing, submitted to io_uring together (instead of one fstatat() each)
+struct SCrawlStats
+{
+	SUring* 							m_Ring;
+	std::vector<const struct dirent64*> m_Entries;	// Into the getdents64() buffer
+	std::vector<struct statx> 			m_Stats;
+	std::vector<int32_t> 				m_Results;
+};
+
+// Adds a kernel watch. With a shared engine, the caller gets a reference to it, which is either
+// kept by a SWatchDir, or dropped by add_owner() if the system already has that kernel watch
+// The mask is added to the mask the kernel watch already has (the kernel watch is shared by all the watches of the inode).
+// It's never narrowed again, but the events are checked against the masks of the watches anyway (see apply_masks()).
+static int add_kernel_watch(SInotifyEngine* engine, int inotifyfd, const char* path, uint32_t mask)
+{
+	if( !engine )
+		return inotify_add_watch(inotifyfd, path, mask | IN_MASK_ADD);
+
+	// Under the lock, so that another system can't remove it before the reference is taken
+	std::lock_guard<std::mutex> lock(engine->m_WdLock);
+	int wd = inotify_add_watch(inotifyfd, path, mask | IN_MASK_ADD);
+	if( wd >= 0 )
+		engine->m_WdRefs[wd]++;
+	return wd;
+}
+
+// Drops a reference to a kernel watch, and removes it when nobody uses it anymore (unless the kernel already removed it)
+static void remove_kernel_watch(SInotifyEngine* engine, int inotifyfd, int wd, bool ignored)
+{
+	if( !engine )
+	{
+		if( !ignored )
+			inotify_rm_watch(inotifyfd, wd);
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(engine->m_WdLock);
+	std::map<int, int>::iterator it = engine->m_WdRefs.find(wd);
+	if( it != engine->m_WdRefs.end() && --it->second > 0 )
+		return;
+	if( it != engine->m_WdRefs.end() )
+		engine->m_WdRefs.erase(it);
+	if( !ignored )
+		inotify_rm_watch(inotifyfd, wd);
+}
+
+static void add_dir_entry(const std::string& path, const char* name, bool isdir, const struct stat* st, const SCrawlFilter* filter, std::vector<std::string>& subdirs, std::vector<SCrawlEntry>* entries)
+{
+	// An excluded directory isn't watched, nor scanned
+	if( filter && is_excluded(filter, path, name, isdir) )
+		return;
+
+	if( isdir )
+	{
+		subdirs.push_back(std::string());
+		join_path(subdirs.back(), path, name);
+	}
+
+	if( entries && st )
+	{
+		entries->push_back(SCrawlEntry());
+		entries->back().m_IsDir = isdir;
+		set_snapshot_info(entries->back().m_Info, *st);
+		join_path(entries->back().m_Path, path, name);
+	}
+}
+
+// Stats the queued entries with one io_uring_enter(), and adds them
+static void flush_dir_stats(SCrawlStats* stats, int fd, const std::string& path, const SCrawlFilter* filter, std::vector<std::string>& subdirs, std::vector<SCrawlEntry>* entries)
+{
+	uint32_t count = (uint32_t)stats->m_Entries.size();
+	if( count == 0 )
+		return;
+
+	uint32_t done = 0;
+	while( done < count )
+	{
+		int result = fe_uring_submit(stats->m_Ring, count - done, -1);
+		if( result < 0 && result != -EINTR )
+		{
+			fprintf(stderr, "io_uring_enter failed: %s\n", strerror(-result));
+			break;
+		}
+		uint64_t index;
+		int32_t res;
+		while( fe_uring_complete(stats->m_Ring, &index, &res) )
+		{
+			stats->m_Results[index] = res;
+			done++;
+		}
+	}
+
+	for( uint32_t i = 0; i < count; ++i )
+	{
+		const struct dirent64* ent = stats->m_Entries[i];
+		struct stat st;
+		bool hasstat;
+		if( stats->m_Results[i] <= 0 )
+		{
+			hasstat = stats->m_Results[i] == 0;
+			const struct statx& stx = stats->m_Stats[i];
+			memset(&st, 0, sizeof(st));
+			st.st_ino = (ino_t)stx.stx_ino;
+			st.st_mode = (mode_t)stx.stx_mode;
+			st.st_size = (off_t)stx.stx_size;
+			st.st_mtim.tv_sec = (time_t)stx.stx_mtime.tv_sec;
+			st.st_mtim.tv_nsec = (long)stx.stx_mtime.tv_nsec;
+		}
+		else
+		{
+			// It never got submitted
+			hasstat = fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+		}
+		bool isdir = ent->d_type == DT_UNKNOWN ? hasstat && S_ISDIR(st.st_mode) : ent->d_type == DT_DIR;
+		add_dir_entry(path, ent->d_name, isdir, hasstat ? &st : 0, filter, subdirs, entries);
+	}
+	stats->m_Entries.clear();
+}
+
+// Adds a kernel watch for the directory, and then lists its sub directories (and optionally all the entries).
+// With stats set, the entries are stat'ed with io_uring.
+static int scan_dir(SInotifyEngine* engine, int inotifyfd, const std::string& path, uint32_t inotifymask, const SCrawlFilter* filter, char* buffer, std::vector<std::string>& subdirs, std::vector<SCrawlEntry>* entries, SCrawlStats* stats)
+{
+	// The watch is added before the listing, so that nothing created in between goes unnoticed
+	int wd = add_kernel_watch(engine, inotifyfd, path.c_str(), inotifymask);
+	if( wd < 0 )
+		return -1;
+
+	int fd = openat(AT_FDCWD, path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if( fd < 0 )
+		return wd;
+
+	while( true )
+	{
+		long length = syscall(SYS_getdents64, fd, buffer, CRAWL_BUF_LEN);
+		if( length <= 0 )
+			break;
+
+		long i = 0;
+		while( i < length )
+		{
+			const struct dirent64* ent = (const struct dirent64*)&buffer[i];
+			i += ent->d_reclen;
+
+			const char* name = ent->d_name;
+			if( name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)) )
+				continue;
+
+			bool isdir = ent->d_type == DT_DIR;
+			struct stat st;
+			bool hasstat = false;
+			if( ent->d_type == DT_UNKNOWN || entries )
+			{
+				if( stats )
+				{
+					// Stat'ed when the ring is full, or when the buffer is done (the names point into it)
+					if( stats->m_Entries.size() == stats->m_Stats.size() )
+						flush_dir_stats(stats, fd, path, filter, subdirs, entries);
+					uint32_t index = (uint32_t)stats->m_Entries.size();
+					stats->m_Entries.push_back(ent);
+					stats->m_Results[index] = 1;
+					fe_uring_statx(stats->m_Ring, fd, name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &stats->m_Stats[index], index);
+					continue;
+				}
+
+				// Some file systems don't fill in the type (and the entries need all of the info)
+				hasstat = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+				if( ent->d_type == DT_UNKNOWN )
+					isdir = hasstat && S_ISDIR(st.st_mode);
+			}
+			add_dir_entry(path, name, isdir, hasstat ? &st : 0, filter, subdirs, entries);
+		}
+		if( stats )
+			flush_dir_stats(stats, fd, path, filter, subdirs, entries);
+	}
+	close(fd);
+	return wd;
+}
+
+static void crawl_worker(SCrawl* crawl)
+{
+	std::vector<char> buffer(CRAWL_BUF_LEN);
+	std::vector<std::string> subdirs;
+	std::vector<SCrawlResult> results;
+	std::vector<SCrawlEntry> entries;
+	std::string path;
+
+	// The entries are only stat'ed if they're listed. The ring is created when there's a directory to scan.
+	SCrawlStats stats;
+	stats.m_Ring = 0;
+	bool uring = crawl->m_Uring && crawl->m_Entries;
+
+	std::unique_lock<std::mutex> lock(crawl->m_Lock);
+	while( true )
+	{
+		while( crawl->m_Queue.empty() && crawl->m_Busy > 0 )
+			crawl->m_Cond.wait(lock);
+
+		// Nothing left to scan, and nobody that can add more
+		if( crawl->m_Queue.empty() || *crawl->m_Abort )
+			break;
+
+		path.swap(crawl->m_Queue.back());
+		crawl->m_Queue.pop_back();
+		crawl->m_Busy++;
+		lock.unlock();
+
+		if( uring && !stats.m_Ring )
+		{
+			uring = false;
+			stats.m_Ring = fe_uring_create(CRAWL_URING_ENTRIES);
+			if( stats.m_Ring )
+			{
+				stats.m_Stats.resize(fe_uring_size(stats.m_Ring));
+				stats.m_Results.resize(fe_uring_size(stats.m_Ring));
+			}
+		}
+
+		subdirs.clear();
+		int wd = scan_dir(crawl->m_Engine, crawl->m_Fd, path, crawl->m_InotifyMask | s_InotifyDirFlags, crawl->m_Filter, &buffer[0], subdirs, crawl->m_Entries ? &entries : 0, stats.m_Ring ? &stats : 0);
+		if( wd >= 0 )
+		{
+			results.push_back(SCrawlResult());
+			results.back().m_Wd = wd;
+			results.back().m_Path.swap(path);
+		}
+
+		lock.lock();
+		crawl->m_Busy--;
+		for( std::string& subdir : subdirs )
+		{
+			crawl->m_Queue.push_back(std::string());
+			crawl->m_Queue.back().swap(subdir);
+		}
+		if( !subdirs.empty() || crawl->m_Busy == 0 )
+			crawl->m_Cond.notify_all();
+	}
+
+	crawl->m_Results.insert(crawl->m_Results.end(), results.begin(), results.end());
+	if( crawl->m_Entries )
+		crawl->m_Entries->insert(crawl->m_Entries->end(), entries.begin(), entries.end());
+	lock.unlock();
+	fe_uring_destroy(stats.m_Ring);
+}
+
+// Adds kernel watches for a directory and all its sub directories.
+// The initial crawl of a watch is spread over a few threads, while new directories
+// found by the event thread are usually small, and are scanned on the calling thread.
+static int crawl_tree(SPlatformData* pfdata, const std::string& root, bool parallel, uint32_t inotifymask, const SCrawlFilter* filter, std::vector<SCrawlResult>& results, std::vector<SCrawlEntry>* entries)
+{
+	SCrawl crawl;
+	crawl.m_Engine = pfdata->m_Engine;
+	crawl.m_Abort = &pfdata->m_Closing;
+	crawl.m_Fd = pfdata->m_Fd;
+	crawl.m_Busy = 0;
+	crawl.m_Entries = entries;
+	crawl.m_Filter = filter;
+	crawl.m_InotifyMask = inotifymask;
+	crawl.m_Uring = pfdata->m_CrawlUring;
+
+	std::vector<char> buffer(CRAWL_BUF_LEN);
+	int wd = scan_dir(pfdata->m_Engine, pfdata->m_Fd, root, inotifymask, filter, &buffer[0], crawl.m_Queue, entries, 0);
+	if( wd < 0 )
+		return -1;
+
+	crawl.m_Results.push_back(SCrawlResult());
+	crawl.m_Results.back().m_Wd = wd;
+	crawl.m_Results.back().m_Path = root;
+
+	unsigned int numthreads = 1;
+	if( parallel && crawl.m_Queue.size() > 1 )
+		numthreads = std::max(1u, std::min(std::thread::hardware_concurrency(), (unsigned int)CRAWL_MAX_THREADS));
+
+	std::vector<std::thread> threads;
+	for( unsigned int i = 1; i < numthreads; ++i )
+		threads.push_back( std::thread(crawl_worker, &crawl) );
+	crawl_worker(&crawl);
+	for( std::thread& thread : threads )
+		thread.join();
+
+	results.swap(crawl.m_Results);
+	return wd;
+}
+
+// Adds the kernel watches for a watch (for the whole tree if it's recursive), and optionally lists everything in it, including the root
+static int scan_watch(SPlatformData* pfdata, const std::string& root, bool isdir, bool recursive, bool parallel, uint32_t inotifymask, const SFileFilter* filter, std::vector<SCrawlResult>& results, std::vector<SCrawlEntry>* entries)
+{
+	struct stat st;
+	if( entries && lstat(root.c_str(), &st) == 0 )
+	{
+		entries->push_back(SCrawlEntry());
+		entries->back().m_Path = root;
+		entries->back().m_IsDir = S_ISDIR(st.st_mode);
+		set_snapshot_info(entries->back().m_Info, st);
+	}
+
+	SCrawlFilter crawlfilter;
+	if( filter )
+		crawlfilter.m_Filters.push_back(std::make_pair(filter, root.size()));
+
+	if( isdir && recursive )
+		return crawl_tree(pfdata, root, parallel, inotifymask, filter ? &crawlfilter : 0, results, entries);
+
+	int wd;
+	if( isdir && entries )
+	{
+		std::vector<char> buffer(CRAWL_BUF_LEN);
+		std::vector<std::string> subdirs;
+		wd = scan_dir(pfdata->m_Engine, pfdata->m_Fd, root, inotifymask, filter ? &crawlfilter : 0, &buffer[0], subdirs, entries, 0);
+	}
+	else
+	{
+		wd = add_kernel_watch(pfdata->m_Engine, pfdata->m_Fd, root.c_str(), inotifymask);
+	}
+
+	if( wd >= 0 )
+	{
+		results.push_back(SCrawlResult());
+		results.back().m_Wd = wd;
+		results.back().m_Path = root;
+	}
+	return wd;
+}
+
+static uint32_t find_dir(const SPlatformData* pfdata, int wd)
+{
+	return pfdata->m_DirsByWd.find(fe_hash_int((uint64_t)wd), [=](uint32_t index) { return pfdata->m_Dirs[index].m_Wd == wd; });
+}
+
+static void erase_dir(SPlatformData* pfdata, uint32_t index)
+{
+	int wd = pfdata->m_Dirs[index].m_Wd;
+	pfdata->m_Paths->release(pfdata->m_Dirs[index].m_Path);
+	pfdata->m_DirsByWd.erase(fe_hash_int((uint64_t)wd), [=](uint32_t i) { return i == index; });
+
+	// Move the last one into the hole
+	uint32_t last = (uint32_t)pfdata->m_Dirs.size() - 1;
+	if( index != last )
+	{
+		pfdata->m_DirsByWd.replace(fe_hash_int((uint64_t)pfdata->m_Dirs[last].m_Wd), last, index);
+		std::swap(pfdata->m_Dirs[index], pfdata->m_Dirs[last]);
+	}
+	pfdata->m_Dirs.pop_back();
+}
+
+static void add_owner(SPlatformData* pfdata, int wd, const std::string& path, bool isdir, HFESWatchID watchid)
+{
+	// The kernel returns the same descriptor for the same inode
+	uint32_t index = find_dir(pfdata, wd);
+	if( index == FE_HASH_INVALID )
+	{
+		index = (uint32_t)pfdata->m_Dirs.size();
+		pfdata->m_Dirs.push_back(SWatchDir());
+		pfdata->m_Dirs.back().m_Wd = wd;
+		pfdata->m_Dirs.back().m_Path = FE_PATH_NONE;
+		pfdata->m_DirsByWd.insert(fe_hash_int((uint64_t)wd), index);
+	}
+	else if( pfdata->m_Engine )
+	{
+		// The system already holds a reference to it
+		remove_kernel_watch(pfdata->m_Engine, pfdata->m_Fd, wd, false);
+	}
+
+	SWatchDir& dir = pfdata->m_Dirs[index];
+	if( dir.m_Owners.empty() || dir.m_Path != pfdata->m_Paths->find(path) )
+	{
+		// The new path is interned before the old one is released, since they usually share their parents
+		uint32_t node = pfdata->m_Paths->intern(path);
+		if( dir.m_Path != FE_PATH_NONE )
+			pfdata->m_Paths->release(dir.m_Path);
+		dir.m_Path = node;
+		dir.m_IsDir = isdir;
+	}
+	if( dir.m_Owners.empty() )
+		dir.m_Filtered = false;
+	if( std::find(dir.m_Owners.begin(), dir.m_Owners.end(), watchid) == dir.m_Owners.end() )
+		dir.m_Owners.push_back(watchid);
+
+	SWatchInfo& info = pfdata->m_WatchHandles[watchid];
+	info.m_Wds.insert(wd);
+	if( info.m_Filter )
+		dir.m_Filtered = true;
+}
+
+// Removes the owner from the kernel watch, and removes the kernel watch when nobody is interested anymore
+static void release_wd(SPlatformData* pfdata, int wd, HFESWatchID watchid)
+{
+	uint32_t index = find_dir(pfdata, wd);
+	if( index == FE_HASH_INVALID )
+		return;
+
+	std::vector<HFESWatchID>& owners = pfdata->m_Dirs[index].m_Owners;
+	for( size_t i = 0; i < owners.size(); ++i )
+	{
+		if( owners[i] == watchid )
+		{
+			owners.erase(owners.begin() + (ptrdiff_t)i);
+			break;
+		}
+	}
+
+	if( owners.empty() )
+	{
+		remove_kernel_watch(pfdata->m_Engine, pfdata->m_Fd, wd, false);
+		erase_dir(pfdata, index);
+	}
+}
+
+// Does the watch want the path (and all the directories between it and the root of the watch)?
+static bool wants_path(SPlatformData* pfdata, HFESWatchID watchid, const std::string& path, bool isdir)
+{
+	const SWatchInfo& info = pfdata->m_WatchHandles[watchid];
+	if( !info.m_Filter )
+		return true;
+	uint32_t offset = relative_offset(path, info.m_Root.size());
+	return fe_filter_match_path(info.m_Filter, path.c_str() + offset, (uint32_t)path.size() - offset, isdir);
+}
+
+// The first of the owners of the kernel watch that wants the entry (preferably one that also wants the type of event),
+// or -1 if the patterns of all of them exclude it
+static HFESWatchID find_wanted_owner(const SPlatformData* pfdata, const SWatchDir& dir, const std::string& dirpath, const char* name, uint32_t namelength, bool isdir, uint32_t types)
+{
+	HFESWatchID found = -1;
+	for( HFESWatchID owner : dir.m_Owners )
+	{
+		std::map<HFESWatchID, SWatchInfo>::const_iterator info = pfdata->m_WatchHandles.find(owner);
+		if( info == pfdata->m_WatchHandles.end() )
+			continue;
+		const SFileFilter* filter = info->second.m_Filter;
+		if( filter && namelength )
+		{
+			uint32_t offset = relative_offset(dirpath, info->second.m_Root.size());
+			if( !fe_filter_match(filter, dirpath.c_str() + offset, (uint32_t)dirpath.size() - offset, name, namelength, isdir) )
+				continue;
+		}
+		if( info->second.m_Mask & types )
+			return owner;
+		if( found < 0 )
+			found = owner;
+	}
+	return found;
+}
+
+// A kernel watch that was added again, or that a scan added but none of the watches want
+static void drop_kernel_watch(SPlatformData* pfdata, int wd)
+{
+	// If the system already uses it, only the extra reference is dropped
+	if( find_dir(pfdata, wd) != FE_HASH_INVALID && !pfdata->m_Engine )
+		return;
+	remove_kernel_watch(pfdata->m_Engine, pfdata->m_Fd, wd, false);
+}
+
+// Is the kernel watch the root of any of the watches?
+static bool is_root_wd(const SPlatformData* pfdata, const SWatchDir& dir, int wd)
+{
+	for( HFESWatchID owner : dir.m_Owners )
+	{
+		std::map<HFESWatchID, SWatchInfo>::const_iterator info = pfdata->m_WatchHandles.find(owner);
+		if( info != pfdata->m_WatchHandles.end() && info->second.m_RootWd == wd )
+			return true;
+	}
+	return false;
+}
+
+// Keeps the kernel watches of the recursive watches in sync when a directory appears or disappears
+// (the owners and the path are copies, since both the kernel watches and the batch change)
+static void update_sub_dirs(SFileEventSystem* hfes, const std::vector<HFESWatchID> owners, uint32_t mask, const std::string path)
+{
+	SPlatformData* pfdata = hfes->m_PlatformData;
+
+	std::vector<HFESWatchID> recursive;
+	for( HFESWatchID owner : owners )
+	{
+		std::map<HFESWatchID, SWatchInfo>::const_iterator info = pfdata->m_WatchHandles.find(owner);
+		if( info != pfdata->m_WatchHandles.end() && (info->second.m_Mask & FE_RECURSIVE) )
+			recursive.push_back(owner);
+	}
+	if( recursive.empty() )
+		return;
+
+	if( mask & IN_MOVED_FROM )
+	{
+		// The kernel watches follow the directory, wherever it's moved to. If it's moved
+		// within the tree, the directories are added again (with the new paths) by IN_MOVED_TO
+		// (any kernel watch inside the directory has it as a parent in the path tree)
+		std::vector<int> moved;
+		uint32_t node = pfdata->m_Paths->find(path);
+		for( const SWatchDir& dir : pfdata->m_Dirs )
+		{
+			if( node != FE_PATH_NONE && pfdata->m_Paths->is_in(dir.m_Path, node) )
+				moved.push_back(dir.m_Wd);
+		}
+
+		for( int wd : moved )
+		{
+			for( HFESWatchID owner : recursive )
+			{
+				release_wd(pfdata, wd, owner);
+				pfdata->m_WatchHandles[owner].m_Wds.erase(wd);
+			}
+		}
+		return;
+	}
+
+	// A new directory may already have content (e.g. "mkdir -p" followed by a burst of writes).
+	// Its watch is added first, and then it's listed, and anything found is reported as created.
+	// The kernel events for the entries created after the watch was added are already queued,
+	// and they're dropped when they arrive (see m_Synthetic)
+	SCrawlFilter filter;
+	bool filtered = false;
+	uint32_t watchmask = 0;
+	for( HFESWatchID owner : recursive )
+	{
+		const SWatchInfo& info = pfdata->m_WatchHandles[owner];
+		filter.m_Filters.push_back(std::make_pair(info.m_Filter, info.m_Root.size()));
+		filtered = filtered || info.m_Filter;
+		watchmask |= info.m_Mask;
+	}
+
+	std::vector<SCrawlEntry> entries;
+	std::vector<SCrawlResult> results;
+	bool listentries = (mask & IN_CREATE) && ((watchmask & FE_CREATED) || hfes->m_Snapshot);
+	crawl_tree(pfdata, path, false, to_inotify_mask(hfes, watchmask), filtered ? &filter : 0, results, listentries ? &entries : 0);
+	for( const SCrawlResult& result : results )
+	{
+		bool owned = false;
+		for( HFESWatchID owner : recursive )
+		{
+			if( !filtered || wants_path(pfdata, owner, result.m_Path, true) )
+			{
+				add_owner(pfdata, result.m_Wd, result.m_Path, true, owner);
+				owned = true;
+			}
+		}
+		if( !owned )
+			drop_kernel_watch(pfdata, result.m_Wd);
+	}
+
+	for( SCrawlEntry& entry : entries )
+	{
+		HFESWatchID owner = recursive[0];
+		if( filtered )
+		{
+			owner = -1;
+			for( size_t i = 0; i < recursive.size() && owner < 0; ++i )
+			{
+				if( wants_path(pfdata, recursive[i], entry.m_Path, entry.m_IsDir) )
+					owner = recursive[i];
+			}
+			if( owner < 0 )
+				continue;
+		}
+		uint32_t flags = FE_CREATED | (entry.m_IsDir ? FE_IS_DIR : FE_IS_FILE);
+		fe_batch_add(&pfdata->m_Batch, owner, flags, entry.m_Path.c_str());
+		pfdata->m_Synthetic.insert(entry.m_Path);
+	}
+}
+
+static void snapshot_stat(SSnapshot* snapshot, const std::string& path)
+{
+	struct stat st;
+	if( lstat(path.c_str(), &st) != 0 )
+	{
+		snapshot->remove_path(path);
+		return;
+	}
+	SSnapshotInfo info;
+	set_snapshot_info(info, st);
+	snapshot->set_path(path, info);
+}
+
+// Reads a file, and hashes its content
+static bool hash_file(SPlatformData* pfdata, const char* path, uint64_t* out)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if( fd < 0 )
+		return false;
+
+	if( pfdata->m_ContentBuffer.empty() )
+		pfdata->m_ContentBuffer.resize(CONTENT_BUF_LEN);
+	char* buffer = &pfdata->m_ContentBuffer[0];
+
+	SContentHash hash;
+	while( true )
+	{
+		ssize_t length = read(fd, buffer, CONTENT_BUF_LEN);
+		if( length < 0 && errno == EINTR )
+			continue;
+		if( length < 0 )
+		{
+			close(fd);
+			return false;
+		}
+		if( length == 0 )
+			break;
+		hash.update(buffer, (size_t)length);
+	}
+	close(fd);
+	*out = hash.digest();
+	return true;
+}
+
+// A file was written and closed. Has its content changed since it was last hashed?
+// The hash is only computed when the modification time or the size differs from the last time, or when the last
+// hash was taken within a timestamp tick of the modification time ("racily clean", as git calls it).
+static bool has_new_content(SPlatformData* pfdata, const std::string& path)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	struct stat st;
+	if( lstat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) )
+		return true;
+
+	SFileContent content;
+	content.m_MTime = (int64_t)st.st_mtim.tv_sec * 1000000000 + (int64_t)st.st_mtim.tv_nsec;
+	content.m_Size = (int64_t)st.st_size;
+	content.m_Checked = (int64_t)now.tv_sec * 1000000000 + (int64_t)now.tv_nsec;
+	content.m_Hash = 0;
+
+	std::map<std::string, SFileContent>::iterator old = pfdata->m_Contents.find(path);
+	if( old != pfdata->m_Contents.end() && old->second.m_MTime == content.m_MTime && old->second.m_Size == content.m_Size &&
+		old->second.m_MTime + CONTENT_MTIME_TICK_NS < old->second.m_Checked )
+		return false;
+
+	if( content.m_Size > CONTENT_HASH_MAX_SIZE || !hash_file(pfdata, path.c_str(), &content.m_Hash) )
+		return true;
+
+	// A new file gets its entry now, so that the next write can be compared with this one
+	if( old == pfdata->m_Contents.end() )
+	{
+		pfdata->m_Contents.insert(std::make_pair(path, content));
+		return true;
+	}
+	bool changed = old->second.m_Size != content.m_Size || old->second.m_Hash != content.m_Hash;
+	old->second = content;
+	return changed;
+}
+
+// Drops the writes that left the content of the files as it was (see m_ContentHash).
+// The files are read after the lock is released, so that a large file doesn't hold up the other threads.
+static void check_contents(SFileEventSystem* hfes, SEventBatch* batch)
+{
+	SPlatformData* pfdata = hfes->m_PlatformData;
+	std::string path;
+	uint32_t dropped = 0;
+	size_t kept = 0;
+	for( size_t i = 0; i < batch->m_Events.size(); ++i )
+	{
+		SFileEvent event = batch->m_Events[i];
+		if( (event.m_Flags & FE_MODIFIED) && (event.m_Flags & FE_IS_FILE) && !has_new_content(pfdata, path.assign(&batch->m_Strings[event.m_PathOffset], event.m_PathLength)) )
+		{
+			event.m_Flags &= ~(uint32_t)FE_MODIFIED;
+			if( !(event.m_Flags & FE_EVENT_TYPES) )
+			{
+				++dropped;
+				continue;
+			}
+		}
+		batch->m_Events[kept++] = event;
+	}
+	batch->m_Events.resize(kept);
+	fe_stats_add(hfes->m_Stats.m_EventsFiltered, dropped);
+}
+
+// Forgets the hashes of a path, and of everything under it
+static void forget_contents(std::map<std::string, SFileContent>& contents, const std::string& path)
+{
+	std::map<std::string, SFileContent>::iterator it = contents.lower_bound(path);
+	while( it != contents.end() && it->first.compare(0, path.size(), path) == 0 )
+	{
+		if( it->first.size() == path.size() || it->first[path.size()] == '/' )
+			it = contents.erase(it);
+		else
+			++it;
+	}
+}
+
+// Keeps the hashes of the written files with their paths, as they're renamed or removed
+static void update_contents(SPlatformData* pfdata, const SEventBatch* batch)
+{
+	std::map<std::string, SFileContent>& contents = pfdata->m_Contents;
+	if( contents.empty() )
+		return;
+	std::string& path = pfdata->m_Path;
+	std::string& target = pfdata->m_Target;
+	for( const SFileEvent& event : batch->m_Events )
+	{
+		if( !event.m_TargetLength && !(event.m_Flags & FE_REMOVED) )
+			continue;
+		path.assign(&batch->m_Strings[event.m_PathOffset], event.m_PathLength);
+		if( !event.m_TargetLength )
+		{
+			forget_contents(contents, path);
+			continue;
+		}
+
+		target.assign(&batch->m_Strings[event.m_TargetOffset], event.m_TargetLength);
+		forget_contents(contents, target);
+		std::map<std::string, SFileContent>::iterator it = contents.lower_bound(path);
+		while( it != contents.end() && it->first.compare(0, path.size(), path) == 0 )
+		{
+			if( it->first.size() != path.size() && it->first[path.size()] != '/' )
+			{
+				++it;
+				continue;
+			}
+			contents.insert(std::make_pair(target + it->first.substr(path.size()), it->second));
+			it = contents.erase(it);
+		}
+	}
+}
+
+// Keeps the snapshot up to date with the events
+static void update_snapshot(SSnapshot* snapshot, const SEventBatch* batch, std::string& path, std::string& target)
+{
+	for( const SFileEvent& event : batch->m_Events )
+	{
+		path.assign(&batch->m_Strings[event.m_PathOffset], event.m_PathLength);
+		if( event.m_TargetLength )
+		{
+			target.assign(&batch->m_Strings[event.m_TargetOffset], event.m_TargetLength);
+			snapshot->move_path(path, target);
+			snapshot_stat(snapshot, target);
+		}
+		else if( event.m_Flags & FE_REMOVED )
+			snapshot->remove_path(path);
+		else
+			snapshot_stat(snapshot, path);
+	}
+}
+
+// Compares a fresh scan of a watch (the root comes first in the entries) with the snapshot, and updates the snapshot.
+// If batch is set, it receives the differences as events.
+static void diff_snapshot(SSnapshot* snapshot, HFESWatchID watchid, const std::string& root, bool recursive, const std::vector<SCrawlEntry>& entries, SEventBatch* batch)
+{
+	if( entries.empty() || entries[0].m_Path != root )
+	{
+		// The root itself is gone
+		uint32_t index = snapshot->find_path(root);
+		if( index != FE_SNAPSHOT_NONE )
+		{
+			if( batch )
+				fe_batch_add(batch, watchid, FE_REMOVED | (fe_snapshot_is_dir(snapshot->m_Entries[index].m_Info.m_Mode) ? FE_IS_DIR : FE_IS_FILE), root.c_str());
+			snapshot->remove(index);
+		}
+		return;
+	}
+
+	// The crawler threads find the entries in any order, so the parents are added before their children
+	std::vector<std::pair<uint32_t, uint32_t> > order;
+	order.reserve(entries.size());
+	for( uint32_t i = 1; i < (uint32_t)entries.size(); ++i )
+		order.push_back(std::make_pair((uint32_t)std::count(entries[i].m_Path.begin(), entries[i].m_Path.end(), '/'), i));
+	std::stable_sort(order.begin(), order.end());
+
+	SSnapshot scan;
+	uint32_t scanroot = scan.add_root(root, entries[0].m_Info);
+	std::string dir;
+	uint32_t parent = FE_SNAPSHOT_NONE;
+	for( const std::pair<uint32_t, uint32_t>& item : order )
+	{
+		const SCrawlEntry& entry = entries[item.second];
+		size_t slash = entry.m_Path.rfind('/');
+		if( parent == FE_SNAPSHOT_NONE || dir.size() != slash || entry.m_Path.compare(0, slash, dir) != 0 )
+		{
+			dir.assign(entry.m_Path, 0, slash);
+			parent = scan.find_path(dir);
+			if( parent == FE_SNAPSHOT_NONE )
+				continue;
+		}
+		scan.add(parent, entry.m_Path.c_str() + slash + 1, (uint32_t)(entry.m_Path.size() - slash - 1), entry.m_Info);
+	}
+
+	uint32_t index = snapshot->find_path(root);
+	if( index == FE_SNAPSHOT_NONE )
+	{
+		if( batch )
+			fe_batch_add(batch, watchid, FE_CREATED | (entries[0].m_IsDir ? FE_IS_DIR : FE_IS_FILE), root.c_str());
+		index = snapshot->add_root(root, entries[0].m_Info);
+	}
+	fe_snapshot_diff(snapshot, index, &scan, scanroot, recursive, watchid, batch);
+}
+
+// Crawls the watches that are rescanned (on a thread of its own), and then wakes up the platform thread
+static void rescan_thread_run(SPlatformData* pfdata)
+{
+	std::vector<SRescan>& rescans = pfdata->m_Rescans;
+	for( uint32_t i = 0; i < (uint32_t)rescans.size(); ++i )
+	{
+		SRescan& rescan = rescans[i];
+		if( rescan.m_Source != i )
+			continue;
+		struct stat st;
+		rescan.m_IsDir = stat(rescan.m_Root.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+		rescan.m_Wd = scan_watch(pfdata, rescan.m_Root, rescan.m_IsDir, rescan.m_Recursive, true, rescan.m_InotifyMask, rescan.m_Filtered ? &rescan.m_Filter : 0, rescan.m_Results, &rescan.m_Entries);
+	}
+
+	// The watches inside another one pick out their part of its crawl. Each of them gets its own reference to the shared kernel watches.
+	for( SRescan& rescan : rescans )
+	{
+		if( &rescan == &rescans[rescan.m_Source] )
+			continue;
+		const SRescan& source = rescans[rescan.m_Source];
+		for( const SCrawlEntry& entry : source.m_Entries )
+		{
+			if( entry.m_Path == rescan.m_Root )
+			{
+				rescan.m_Entries.push_back(entry);
+				rescan.m_IsDir = entry.m_IsDir;
+			}
+		}
+		if( rescan.m_Entries.empty() )
+			continue;
+		for( const SCrawlEntry& entry : source.m_Entries )
+		{
+			if( entry.m_Path != rescan.m_Root && fe_is_in_dir(entry.m_Path, rescan.m_Root, rescan.m_Recursive) )
+				rescan.m_Entries.push_back(entry);
+		}
+		for( const SCrawlResult& result : source.m_Results )
+		{
+			if( rescan.m_Recursive ? !fe_is_in_dir(result.m_Path, rescan.m_Root, true) : result.m_Path != rescan.m_Root )
+				continue;
+			rescan.m_Results.push_back(result);
+			if( result.m_Path == rescan.m_Root )
+				rescan.m_Wd = result.m_Wd;
+			if( pfdata->m_Engine )
+			{
+				std::lock_guard<std::mutex> lock(pfdata->m_Engine->m_WdLock);
+				pfdata->m_Engine->m_WdRefs[result.m_Wd]++;
+			}
+		}
+	}
+
+	pfdata->m_RescanDone = true;
+	uint64_t value = 1;
+	ssize_t result = write(pfdata->m_WakeupFd, &value, sizeof(value));
+	(void)result;
+}
+
+// The kernel queue overflowed, and the events that were lost can't be recovered. Each watch is reported as overflowed,
+// and then it's rescanned, and the differences to the snapshot are reported (see finish_rescan()).
+// The crawl runs on its own thread, so the queue is still drained meanwhile, and it doesn't overflow again.
+static void rescan_watches(SFileEventSystem* hfes)
+{
+	SPlatformData* pfdata = hfes->m_PlatformData;
+
+	for( std::map<HFESWatchID, SWatchInfo>::iterator it = pfdata->m_WatchHandles.begin(); it != pfdata->m_WatchHandles.end(); ++it )
+		fe_batch_add(&pfdata->m_Batch, it->first, FE_OVERFLOW, it->second.m_Root.c_str());
+	// The events are held back while it's rescanning, so an overflow can't be seen until it's done
+	if( !hfes->m_RescanOnOverflow || pfdata->m_WatchHandles.empty() )
+		return;
+
+	// New directories may have been missed as well, so the kernel watches are updated too
+	std::vector<SRescan>& rescans = pfdata->m_Rescans;
+	for( std::map<HFESWatchID, SWatchInfo>::iterator it = pfdata->m_WatchHandles.begin(); it != pfdata->m_WatchHandles.end(); ++it )
+	{
+		const SWatchInfo& info = it->second;
+		rescans.push_back(SRescan());
+		SRescan& rescan = rescans.back();
+		rescan.m_Root = info.m_Root;
+		if( info.m_Filter )
+			rescan.m_Filter = *info.m_Filter;
+		rescan.m_WatchID = it->first;
+		rescan.m_InotifyMask = to_inotify_mask(hfes, info.m_Mask);
+		rescan.m_Source = (uint32_t)rescans.size() - 1;
+		rescan.m_Wd = -1;
+		rescan.m_IsDir = false;
+		rescan.m_Recursive = (info.m_Mask & FE_RECURSIVE) != 0;
+		rescan.m_Filtered = info.m_Filter != 0;
+	}
+
+	// The watches inside a recursive watch aren't crawled again, as long as none of them have patterns,
+	// and the kernel watches of the outer one get all the events they need. The outermost one is crawled.
+	for( uint32_t self = 0; self < (uint32_t)rescans.size(); ++self )
+	{
+		SRescan& rescan = rescans[self];
+		uint32_t index = find_dir(pfdata, pfdata->m_WatchHandles[rescan.m_WatchID].m_RootWd);
+		if( rescan.m_Filtered || index == FE_HASH_INVALID || !pfdata->m_Dirs[index].m_IsDir )
+			continue;
+		for( uint32_t i = 0; i < (uint32_t)rescans.size(); ++i )
+		{
+			const SRescan& outer = rescans[i];
+			if( i == self || !outer.m_Recursive || outer.m_Filtered || (rescan.m_InotifyMask & ~outer.m_InotifyMask) || !fe_is_in_dir(rescan.m_Root, outer.m_Root, true) )
+				continue;
+			const SRescan& best = rescans[rescan.m_Source];
+			if( outer.m_Root.size() < best.m_Root.size() || (outer.m_Root.size() == best.m_Root.size() && i < rescan.m_Source) )
+				rescan.m_Source = i;
+		}
+	}
+
+	pfdata->m_RescanDone = false;
+	pfdata->m_Rescanning = true;
+	pfdata->m_RescanThread = std::thread(rescan_thread_run, pfdata);
+}
+
+// Updates the kernel watches and the snapshot of a watch with its rescan, and adds the differences to the batch
+static void apply_rescan(SFileEventSystem* hfes, const SRescan& rescan)
+{
+	SPlatformData* pfdata = hfes->m_PlatformData;
+	std::map<HFESWatchID, SWatchInfo>::iterator it = pfdata->m_WatchHandles.find(rescan.m_WatchID);
+	if( it == pfdata->m_WatchHandles.end() )
+	{
+		// It was removed while it was rescanned
+		for( const SCrawlResult& result : rescan.m_Results )
+			drop_kernel_watch(pfdata, result.m_Wd);
+		return;
+	}
+
+	SWatchInfo& info = it->second;
+	if( rescan.m_Wd >= 0 )
+		info.m_RootWd = rescan.m_Wd;
+
+	std::set<int> found;
+	for( const SCrawlResult& result : rescan.m_Results )
+	{
+		add_owner(pfdata, result.m_Wd, result.m_Path, result.m_Wd == rescan.m_Wd ? rescan.m_IsDir : true, rescan.m_WatchID);
+		found.insert(result.m_Wd);
+	}
+
+	// The directories that are gone (their IN_IGNORED may have been lost too)
+	std::vector<int> stale;
+	for( int owned : info.m_Wds )
+	{
+		if( found.find(owned) == found.end() )
+			stale.push_back(owned);
+	}
+	for( int owned : stale )
+	{
+		release_wd(pfdata, owned, rescan.m_WatchID);
+		info.m_Wds.erase(owned);
+	}
+
+	diff_snapshot(hfes->m_Snapshot, rescan.m_WatchID, info.m_Root, rescan.m_Recursive, rescan.m_Entries, &pfdata->m_Batch);
+}
+
+// Stops the rescan (the system is closed), and drops the kernel watches it added
+static void cancel_rescan(SPlatformData* pfdata)
+{
+	if( !pfdata->m_Rescanning )
+		return;
+	pfdata->m_Closing = true;
+	pfdata->m_RescanThread.join();
+	pfdata->m_Rescanning = false;
+	for( const SRescan& rescan : pfdata->m_Rescans )
+	{
+		for( const SCrawlResult& result : rescan.m_Results )
+			drop_kernel_watch(pfdata, result.m_Wd);
+	}
+	pfdata->m_Rescans.clear();
+}
+
+// Returns the index of the pending rename with the cookie, or the number of pending renames if there is none
+static size_t find_move(const SPlatformData* pfdata, uint32_t cookie)
+{
+	// The first half is almost always the last one that came in
+	for( size_t i = pfdata->m_Moves.size(); i > 0; --i )
+	{
+		if( pfdata->m_Moves[i-1].m_Cookie == cookie )
+			return i-1;
+	}
+	return pfdata->m_Moves.size();
+}
+
+// The old path of a rename that's still waiting for its second half has a newer event (e.g. "mv a /elsewhere; touch a").
+// The rename went somewhere that isn't watched, so it's sent as removed, before the newer event.
+// Returns where the path of the newer event (the last one in the batch) is now.
+static char* flush_move(SPlatformData* pfdata, char* path, uint32_t length, uint32_t cookie)
+{
+	size_t i = 0;
+	for( ; i < pfdata->m_Moves.size(); ++i )
+	{
+		const SPendingMove& move = pfdata->m_Moves[i];
+		if( move.m_Cookie != cookie && move.m_PathLength == length && memcmp(&pfdata->m_MovePaths[move.m_PathOffset], path, length) == 0 )
+			break;
+	}
+	if( i == pfdata->m_Moves.size() )
+		return path;
+
+	const SPendingMove& move = pfdata->m_Moves[i];
+	const char* oldpath = &pfdata->m_MovePaths[move.m_PathOffset];
+	SFileEvent newer = pfdata->m_Batch.m_Events.back();
+	fe_batch_pop(&pfdata->m_Batch);
+	memcpy(fe_batch_add(&pfdata->m_Batch, move.m_WatchID, FE_REMOVED | move.m_Flags, length), oldpath, length);
+	path = fe_batch_add(&pfdata->m_Batch, newer.m_WatchID, newer.m_Flags, length);
+	memcpy(path, oldpath, length);
+
+	pfdata->m_Moves.erase(pfdata->m_Moves.begin() + (ptrdiff_t)i);
+	if( pfdata->m_Moves.empty() )
+		pfdata->m_MovePaths.clear();
+	return path;
+}
+
+static void decode_event(SFileEventSystem* hfes, const struct inotify_event* event)
+{
+	SPlatformData* pfdata = hfes->m_PlatformData;
+
+	if( hfes->m_Verbose )
+	{
+		printf("inotify wd: %d  name: %s  cookie: %u   ", event->wd, event->len ? event->name : "", event->cookie);
+		_print_flags(event->mask);
+	}
+
+	if( event->mask & IN_Q_OVERFLOW )
+	{
+		fe_stats_add(hfes->m_Stats.m_Overflows, 1);
+		if( hfes->m_RescanOnOverflow && !pfdata->m_WatchHandles.empty() && fe_get_time_ms() < pfdata->m_RescanEnd + RESCAN_INTERVAL_MS )
+			pfdata->m_RescanPending = true;
+		else
+			rescan_watches(hfes);
+		return;
+	}
+
+	uint32_t index = find_dir(pfdata, event->wd);
+	if( index == FE_HASH_INVALID )
+		return;
+
+	// The kernel removed the watch (the path was deleted or unmounted)
+	if( event->mask & IN_IGNORED )
+	{
+		for( HFESWatchID owner : pfdata->m_Dirs[index].m_Owners )
+		{
+			std::map<HFESWatchID, SWatchInfo>::iterator info = pfdata->m_WatchHandles.find(owner);
+			if( info == pfdata->m_WatchHandles.end() )
+				continue;
+			info->second.m_Wds.erase(event->wd);
+			if( info->second.m_Wds.empty() )
+				pfdata->m_WatchHandles.erase(info);
+		}
+		remove_kernel_watch(pfdata->m_Engine, pfdata->m_Fd, event->wd, true);
+		erase_dir(pfdata, index);
+		return;
+	}
+
+	const SWatchDir& dir = pfdata->m_Dirs[index];
+
+	// A sub directory of a recursive watch is also reported by its parent directory
+	if( event->len == 0 && !is_root_wd(pfdata, dir, event->wd) )
+		return;
+
+	bool isdir = event->len ? (event->mask & IN_ISDIR) != 0 : dir.m_IsDir;
+	EFileEvents flags = convert_flags(event->mask, isdir);
+	// The writes are reported when the file is closed (the kernel watch may be shared with a system that wants every write)
+	if( hfes->m_ContentHash && (event->mask & IN_MODIFY) )
+		flags = (EFileEvents)(flags & ~(uint32_t)FE_MODIFIED);
+	if( hfes->m_ContentHash && (event->mask & IN_CLOSE_WRITE) )
+		flags = (EFileEvents)(flags | FE_MODIFIED);
+	uint32_t namelen = event->len ? (uint32_t)strlen(event->name) : 0;
+
+	// The patterns are matched against the name from the kernel, before the path is put together
+	HFESWatchID owner = dir.m_Owners[0];
+	if( dir.m_Filtered || dir.m_Owners.size() > 1 )
+	{
+		uint32_t types = flags & FE_EVENT_TYPES;
+		if( event->mask & IN_MOVED_FROM )	types |= FE_REMOVED;
+		if( event->mask & IN_MOVED_TO )		types |= FE_CREATED;
+		// The path of the directory is only put together if there are patterns to match
+		if( dir.m_Filtered )
+			pfdata->m_Paths->get_path(dir.m_Path, pfdata->m_DirPath);
+		owner = find_wanted_owner(pfdata, dir, pfdata->m_DirPath, event->name, namelen, isdir, types);
+		if( owner < 0 )
+		{
+			fe_stats_add(hfes->m_Stats.m_EventsFiltered, 1);
+			return;
+		}
+	}
+
+	// The path is written straight into the string arena of the batch, from the path tree
+	uint32_t length = pfdata->m_Paths->path_length(dir.m_Path, namelen);
+	char* path = fe_batch_add(&pfdata->m_Batch, owner, flags, length);
+	pfdata->m_Paths->write_path(dir.m_Path, event->name, namelen, path);
+	if( !pfdata->m_Moves.empty() )
+		path = flush_move(pfdata, path, length, event->cookie);
+
+	// Already reported when its parent directory was created. Once it's removed, the next entry with the same name is a new one.
+	if( !pfdata->m_Synthetic.empty() && (event->mask & (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)) &&
+		pfdata->m_Synthetic.erase(pfdata->m_Path.assign(path, length)) && (event->mask & (IN_CREATE | IN_MOVED_TO)) )
+	{
+		fe_batch_pop(&pfdata->m_Batch);
+
+		// Moved in from the watched paths: the new path was reported, so only the old one is left
+		size_t i = (event->mask & IN_MOVED_TO) ? find_move(pfdata, event->cookie) : pfdata->m_Moves.size();
+		if( i != pfdata->m_Moves.size() )
+		{
+			const SPendingMove& move = pfdata->m_Moves[i];
+			memcpy(fe_batch_add(&pfdata->m_Batch, move.m_WatchID, FE_REMOVED | move.m_Flags, move.m_PathLength), &pfdata->m_MovePaths[move.m_PathOffset], move.m_PathLength);
+			pfdata->m_Moves.erase(pfdata->m_Moves.begin() + (ptrdiff_t)i);
+			if( pfdata->m_Moves.empty() )
+				pfdata->m_MovePaths.clear();
+		}
+		return;
+	}
+
+	// The two halves of a rename are paired by their cookie
+	if( event->mask & IN_MOVED_FROM )
+	{
+		pfdata->m_Moves.push_back(SPendingMove());
+		SPendingMove& move = pfdata->m_Moves.back();
+		move.m_PathOffset = (uint32_t)pfdata->m_MovePaths.size();
+		move.m_PathLength = length;
+		move.m_WatchID = owner;
+		move.m_Deadline = fe_get_time_ms() + RENAME_TIMEOUT_MS;
+		move.m_Cookie = event->cookie;
+		move.m_Flags = flags & (FE_IS_FILE | FE_IS_DIR);
+		pfdata->m_MovePaths.insert(pfdata->m_MovePaths.end(), path, path + length);
+		fe_batch_pop(&pfdata->m_Batch);
+
+		if( event->mask & IN_ISDIR )
+			update_sub_dirs(hfes, dir.m_Owners, event->mask, pfdata->m_Path.assign(path, length));
+		return;
+	}
+
+	if( event->mask & IN_MOVED_TO )
+	{
+		std::string& target = pfdata->m_Target;
+		target.assign(path, length);
+		fe_batch_pop(&pfdata->m_Batch);
+
+		uint32_t type = flags & (FE_IS_FILE | FE_IS_DIR);
+		size_t i = find_move(pfdata, event->cookie);
+		if( i != pfdata->m_Moves.size() )
+		{
+			const SPendingMove& move = pfdata->m_Moves[i];
+			memcpy(fe_batch_add(&pfdata->m_Batch, owner, FE_RENAMED | type, move.m_PathLength), &pfdata->m_MovePaths[move.m_PathOffset], move.m_PathLength);
+			memcpy(fe_batch_add_target(&pfdata->m_Batch, length), target.c_str(), length);
+			pfdata->m_Moves.erase(pfdata->m_Moves.begin() + (ptrdiff_t)i);
+			if( pfdata->m_Moves.empty() )
+				pfdata->m_MovePaths.clear();
+		}
+		else
+		{
+			// Moved in from somewhere that isn't watched
+			memcpy(fe_batch_add(&pfdata->m_Batch, owner, FE_CREATED | type, length), target.c_str(), length);
+		}
+
+		if( event->mask & IN_ISDIR )
+			update_sub_dirs(hfes, dir.m_Owners, event->mask, target);
+		return;
+	}
+
+	// The mask of the watch is checked by apply_masks()
+	bool wanted = (flags & FE_EVENT_TYPES) != 0;
+
+	if( event->len && (event->mask & IN_ISDIR) && (event->mask & IN_CREATE) )
+	{
+		pfdata->m_Path.assign(path, length);
+		if( !wanted )
+			fe_batch_pop(&pfdata->m_Batch);
+		update_sub_dirs(hfes, dir.m_Owners, event->mask, pfdata->m_Path);
+	}
+	else if( !wanted )
+	{
+		// Attribute changes aren't reported by default, but e.g. a touch changes the modification time
+		if( hfes->m_Snapshot && (event->mask & IN_ATTRIB) )
+			snapshot_stat(hfes->m_Snapshot, pfdata->m_Path.assign(path, length));
+		fe_batch_pop(&pfdata->m_Batch);
+	}
+}
+
+// Drops the events (and the event types) that the watches didn't ask for. A rename is split into the removal of the
+// old path and the creation of the new one, if the watch only wants those. The caller holds hfes->m_Lock.
+// Returns the number of events that were dropped.
+static uint32_t apply_masks(SPlatformData* pfdata, SEventBatch* batch)
+{
+	std::vector<SFileEvent>& kept = pfdata->m_Masked;
+	kept.clear();
 
-	// Maps watch id to file handle
-	std::map<HFESWatchID, int> m_WatchHandles;
+	uint32_t dropped = 0;
+	HFESWatchID watchid = -1;
+	uint32_t mask = 0;
+	bool looked = false;
+	for( const SFileEvent& event : batch->m_Events )
+	{
+		if( event.m_Flags & FE_OVERFLOW )
+		{
+			kept.push_back(event);
+			continue;
+		}
 
-	bool m_IsRunning;
-	bool _padding[7];
-};
+		// The events usually come in runs for the same watch
+		if( !looked || event.m_WatchID != watchid )
+		{
+			looked = true;
+			std::map<HFESWatchID, SWatchInfo>::const_iterator info = pfdata->m_WatchHandles.find(event.m_WatchID);
+			watchid = event.m_WatchID;
+			mask = info != pfdata->m_WatchHandles.end() ? info->second.m_Mask : 0;
+		}
 
-static void _print_flags(FSEventStreamEventFlags flags)
-{
-	/*
-	if( flags & kFSEventStreamEventFlagItemCreated ) 		printf("Created, ");
-	if( flags & kFSEventStreamEventFlagItemRemoved ) 		printf("Removed, ");
-	if( flags & kFSEventStreamEventFlagItemInodeMetaMod ) 	printf("InodeMetaMod, ");
-	if( flags & kFSEventStreamEventFlagItemRenamed ) 		printf("Renamed, ");
-	if( flags & kFSEventStreamEventFlagItemModified ) 		printf("Modified, ");
-	if( flags & kFSEventStreamEventFlagItemFinderInfoMod ) 	printf("FinderInfoMod, ");
-	if( flags & kFSEventStreamEventFlagItemChangeOwner ) 	printf("ChangeOwner, ");
-	if( flags & kFSEventStreamEventFlagItemXattrMod ) 		printf("XattrMod, ");
-	if( flags & kFSEventStreamEventFlagItemIsFile ) 		printf("IsFile, ");
-	if( flags & kFSEventStreamEventFlagItemIsDir ) 			printf("IsDir, ");
-	if( flags & kFSEventStreamEventFlagItemIsSymlink ) 		printf("IsSymlink, ");
-
-	if( flags & kFSEventStreamEventFlagMustScanSubDirs ) 	printf("MustScanSubdirs, ");
-	if( flags & kFSEventStreamEventFlagUserDropped ) 		printf("UserDropped, ");
-	if( flags & kFSEventStreamEventFlagKernelDropped ) 		printf("KernelDropped, ");
-	if( flags & kFSEventStreamEventFlagEventIdsWrapped ) 	printf("EventIdsWrapped, ");
-	if( flags & kFSEventStreamEventFlagHistoryDone ) 		printf("HistoryDone, ");
-	if( flags & kFSEventStreamEventFlagRootChanged ) 		printf("RootChanged, ");
-	if( flags & kFSEventStreamEventFlagMount ) 				printf("Mount, ");
-	if( flags & kFSEventStreamEventFlagUnmount ) 			printf("Unmount, ");*/
+		uint32_t type = event.m_Flags & ~(uint32_t)FE_EVENT_TYPES;
+		if( event.m_TargetLength && !(mask & FE_RENAMED) )
+		{
+			if( mask & FE_REMOVED )
+			{
+				kept.push_back(event);
+				kept.back().m_Flags = FE_REMOVED | type;
+				kept.back().m_TargetOffset = 0;
+				kept.back().m_TargetLength = 0;
+			}
+			if( mask & FE_CREATED )
+			{
+				kept.push_back(event);
+				kept.back().m_Flags = FE_CREATED | type;
+				kept.back().m_PathOffset = event.m_TargetOffset;
+				kept.back().m_PathLength = event.m_TargetLength;
+				kept.back().m_TargetOffset = 0;
+				kept.back().m_TargetLength = 0;
+			}
+			if( !(mask & (FE_REMOVED | FE_CREATED)) )
+				++dropped;
+			continue;
+		}
 
-	printf("\n");
+		uint32_t types = event.m_Flags & mask & FE_EVENT_TYPES;
+		if( types )
+		{
+			kept.push_back(event);
+			kept.back().m_Flags = types | type;
+		}
+		else
+		{
+			++dropped;
+		}
+	}
+
+	// The paths stay where they are in the string arena
+	batch->m_Events.swap(kept);
+	return dropped;
 }
 
-static EFileEvents convert_flags(FSEventStreamEventFlags flags)
+// Holds back the events read while the watches are rescanned. If the queue overflows again, or too many events pile up,
+// the watches are rescanned once more after this rescan. The events held back are dropped then, and so is everything
+// that's read until the next rescan starts, since it covers them.
+static void defer_events(SFileEventSystem* hfes, const char* buffer, ssize_t length)
 {
-	uint64_t out = 0;
-	/*
-	if( flags & kFSEventStreamEventFlagItemCreated ) 		out |= FE_CREATED;
-	if( flags & kFSEventStreamEventFlagItemRemoved ) 		out |= FE_REMOVED;
-	if( flags & kFSEventStreamEventFlagItemRenamed ) 		out |= FE_RENAMED;
-	if( flags & kFSEventStreamEventFlagItemModified ) 		out |= FE_MODIFIED;
-
-	if( flags & kFSEventStreamEventFlagItemInodeMetaMod ) 	out |= FE_ATTRIBUTE;
-	if( flags & kFSEventStreamEventFlagItemFinderInfoMod ) 	out |= FE_ATTRIBUTE;
-	if( flags & kFSEventStreamEventFlagItemChangeOwner ) 	out |= FE_ATTRIBUTE;
-	if( flags & kFSEventStreamEventFlagItemXattrMod ) 		out |= FE_ATTRIBUTE;
-
-	if( flags & kFSEventStreamEventFlagItemIsFile ) 		out |= FE_IS_FILE;
-	if( flags & kFSEventStreamEventFlagItemIsDir ) 			out |= FE_IS_DIR;
-	if( flags & kFSEventStreamEventFlagItemIsSymlink ) 		out |= FE_IS_SYMLINK;
-*/
-	return (EFileEvents)out;
+	SPlatformData* pfdata = hfes->m_PlatformData;
+	if( pfdata->m_RescanPending )
+		return;
+	std::vector<char>& deferred = pfdata->m_Deferred;
+	bool overflow = deferred.size() + (size_t)length > RESCAN_DEFERRED_MAX_LEN;
+	for( ssize_t i = 0; i < length && !overflow; i += (ssize_t)(EVENT_SIZE + ((const struct inotify_event*)&buffer[i])->len) )
+		overflow = (((const struct inotify_event*)&buffer[i])->mask & IN_Q_OVERFLOW) != 0;
+	if( !overflow )
+	{
+		deferred.insert(deferred.end(), buffer, buffer + length);
+		return;
+	}
+
+	fe_stats_add(hfes->m_Stats.m_Overflows, 1);
+	deferred.clear();
+	pfdata->m_RescanPending = true;
+}
+
+// Decodes the events read from the inotify instance, and sends them
+static void decode_events(SFileEventSystem* hfes, const char* buffer, ssize_t length)
+{
+	SPlatformData* pfdata = hfes->m_PlatformData;
+	if( pfdata->m_Rescanning || pfdata->m_RescanPending )
+	{
+		defer_events(hfes, buffer, length);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(hfes->m_Lock);
+
+		uint32_t count = 0;
+		ssize_t i = 0;
+		while( i < length )
+		{
+			const struct inotify_event* event = (const struct inotify_event*)&buffer[i];
+			decode_event(hfes, event);
+			i += (ssize_t)(EVENT_SIZE + event->len);
+			++count;
+		}
+		fe_stats_add(hfes->m_Stats.m_Reads, 1);
+		fe_stats_add(hfes->m_Stats.m_BytesRead, (uint64_t)length);
+		fe_stats_add(hfes->m_Stats.m_EventsRead, count);
+
+		if( hfes->m_Snapshot )
+			update_snapshot(hfes->m_Snapshot, &pfdata->m_Batch, pfdata->m_Path, pfdata->m_Target);
+		if( hfes->m_ContentHash )
+			update_contents(pfdata, &pfdata->m_Batch);
+		fe_stats_add(hfes->m_Stats.m_EventsFiltered, apply_masks(pfdata, &pfdata->m_Batch));
+	}
+
+	// Only the writes the watches asked for are left, and they're checked without holding the lock
+	if( hfes->m_ContentHash )
+		check_contents(hfes, &pfdata->m_Batch);
+
+	// The callbacks are called without holding the lock, so that they may add/remove watches
+	fe_dispatch(hfes, &pfdata->m_Batch);
+	fe_batch_clear(&pfdata->m_Batch);
+}
+
+// The queue is empty (EAGAIN). Any kernel event for an entry that was reported by a directory scan has been seen by now
+// (unless the events are held back by a rescan).
+static void end_of_queue(SFileEventSystem* hfes)
+{
+	if( hfes->m_PlatformData->m_Rescanning )
+		return;
+	std::lock_guard<std::mutex> lock(hfes->m_Lock);
+	hfes->m_PlatformData->m_Synthetic.clear();
 }
 
-// taken from http://womble.decadent.org.uk/readdir_r-advisory.html
-size_t dirent_buf_size(DIR * dirp)
+// Drains the inotify queue
+static void read_events(SFileEventSystem* hfes)
 {
-    long name_max;
-    size_t name_end;
-#   if defined(HAVE_FPATHCONF) && defined(HAVE_DIRFD) \
-       && defined(_PC_NAME_MAX)
-        name_max = fpathconf(dirfd(dirp), _PC_NAME_MAX);
-        if (name_max == -1)
-#           if defined(NAME_MAX)
-                name_max = (NAME_MAX > 255) ? NAME_MAX : 255;
-#           else
-                return (size_t)(-1);
-#           endif
-#   else
-#       if defined(NAME_MAX)
-            name_max = (NAME_MAX > 255) ? NAME_MAX : 255;
-#       else
-#           error "buffer size for readdir_r cannot be determined"
-#       endif
-#   endif
-    name_end = (size_t)offsetof(struct dirent, d_name) + name_max + 1;
-    return (name_end > sizeof(struct dirent) ? name_end : sizeof(struct dirent));
+	SPlatformData* pfdata = hfes->m_PlatformData;
+	while( true )
+	{
+		ssize_t length = read(pfdata->m_Fd, pfdata->m_Buffer, EVENT_BUF_LEN);
+		if( length < 0 && errno == EINTR )
+			continue;
+		if( length <= 0 )
+		{
+			end_of_queue(hfes);
+			break;
+		}
+		decode_events(hfes, pfdata->m_Buffer, length);
+	}
 }
 
+// Sends the renames that never got their second half (i.e. they were moved somewhere that isn't watched) as removed.
+// Returns the number of milliseconds until the next one expires, or -1 if there are none.
+static int expire_moves(SFileEventSystem* hfes, bool force)
+{
+	SPlatformData* pfdata = hfes->m_PlatformData;
+	if( pfdata->m_Moves.empty() )
+		return -1;
+
+	uint64_t now = fe_get_time_ms();
+	int timeout = -1;
+	size_t kept = 0;
+	for( size_t i = 0; i < pfdata->m_Moves.size(); ++i )
+	{
+		SPendingMove& move = pfdata->m_Moves[i];
+		const char* path = &pfdata->m_MovePaths[move.m_PathOffset];
+		if( force || now >= move.m_Deadline )
+		{
+			memcpy(fe_batch_add(&pfdata->m_Batch, move.m_WatchID, FE_REMOVED | move.m_Flags, move.m_PathLength), path, move.m_PathLength);
+			if( hfes->m_ContentHash )
+				forget_contents(pfdata->m_Contents, pfdata->m_Path.assign(path, move.m_PathLength));
+			if( hfes->m_Snapshot )
+			{
+				std::lock_guard<std::mutex> lock(hfes->m_Lock);
+				hfes->m_Snapshot->remove_path(pfdata->m_Path.assign(path, move.m_PathLength));
+			}
+			continue;
+		}
+
+		int left = (int)(move.m_Deadline - now);
+		if( timeout < 0 || left < timeout )
+			timeout = left;
+		pfdata->m_Moves[kept++] = move;
+	}
+	pfdata->m_Moves.resize(kept);
+
+	// The paths of the renames that are still waiting are moved to the front (they're in the same order as the renames)
+	uint32_t used = 0;
+	for( SPendingMove& move : pfdata->m_Moves )
+	{
+		if( move.m_PathOffset != used )
+			memmove(&pfdata->m_MovePaths[used], &pfdata->m_MovePaths[move.m_PathOffset], move.m_PathLength);
+		move.m_PathOffset = used;
+		used += move.m_PathLength;
+	}
+	pfdata->m_MovePaths.resize(used);
+
+	if( pfdata->m_Batch.m_Events.empty() )
+		return timeout;
+	{
+		std::lock_guard<std::mutex> lock(hfes->m_Lock);
+		fe_stats_add(hfes->m_Stats.m_EventsFiltered, apply_masks(pfdata, &pfdata->m_Batch));
+	}
+	fe_dispatch(hfes, &pfdata->m_Batch);
+	fe_batch_clear(&pfdata->m_Batch);
+	return timeout;
+}
 
-static void add_dir(SFileEventSystem* hfes, const char* path)
+// Sends the changes that happened while the process wasn't running
+static void send_replay(SFileEventSystem* hfes)
 {
-	// scan dir, and for each item, send callback event
-	// for sub directories, recurse!
+	SPlatformData* pfdata = hfes->m_PlatformData;
+	SEventBatch batch;
+	{
+		std::lock_guard<std::mutex> lock(hfes->m_Lock);
+		if( pfdata->m_Replay.m_Events.empty() )
+			return;
+		apply_masks(pfdata, &pfdata->m_Replay);
+		std::swap(batch, pfdata->m_Replay);
+	}
+	fe_dispatch(hfes, &batch);
+}
 
-	DIR* dir = opendir(path);
-	if( !dir )
+// Sends the differences found by the rescan, once it's done, and then the events that were held back meanwhile
+static void finish_rescan(SFileEventSystem* hfes)
+{
+	SPlatformData* pfdata = hfes->m_PlatformData;
+	if( !pfdata->m_Rescanning || !pfdata->m_RescanDone )
 		return;
-	size_t size = dirent_buf_size(dir);
-	struct dirent* buf = (struct dirent*)alloca(size);
-	struct dirent* ent;
+	pfdata->m_RescanThread.join();
+	pfdata->m_Rescanning = false;
 
-	printf("dir %s\n", path);
-	while( readdir_r(dir, buf, &ent) == 0 && ent != 0 )
 	{
-		printf("name %s", ent->d_name);
-
-		struct stat st;
-		lstat(ent->d_name, &st);
-		if(S_ISDIR(st.st_mode))
-		   printf("\t DIRECTORY\n");
-		else
-		   printf("\t FILE\n");
+		std::lock_guard<std::mutex> lock(hfes->m_Lock);
+		for( const SRescan& rescan : pfdata->m_Rescans )
+			apply_rescan(hfes, rescan);
+		pfdata->m_Rescans.clear();
+		fe_stats_add(hfes->m_Stats.m_EventsFiltered, apply_masks(pfdata, &pfdata->m_Batch));
 	}
+	fe_dispatch(hfes, &pfdata->m_Batch);
+	fe_batch_clear(&pfdata->m_Batch);
+	pfdata->m_RescanEnd = fe_get_time_ms();
 
-	closedir(dir);
+	// They're decoded a read buffer at a time, as they came in (there are none if there's another rescan to do)
+	std::vector<char> deferred;
+	deferred.swap(pfdata->m_Deferred);
+	size_t start = 0;
+	while( start < deferred.size() )
+	{
+		size_t end = start;
+		while( end < deferred.size() )
+		{
+			size_t size = EVENT_SIZE + ((const struct inotify_event*)&deferred[end])->len;
+			if( end + size - start > EVENT_BUF_LEN )
+				break;
+			end += size;
+		}
+		decode_events(hfes, &deferred[start], (ssize_t)(end - start));
+		start = end;
+	}
 }
 
-static void remove_dir(SFileEventSystem* hfes, const char* path)
+// Starts the rescan that was asked for during the last one (or too soon after it), once RESCAN_INTERVAL_MS has passed.
+// Returns the number of milliseconds until it's due, or -1 if there's none waiting.
+static int start_pending_rescan(SFileEventSystem* hfes)
 {
+	SPlatformData* pfdata = hfes->m_PlatformData;
+	if( !pfdata->m_RescanPending || pfdata->m_Rescanning )
+		return -1;
+	uint64_t now = fe_get_time_ms();
+	if( now < pfdata->m_RescanEnd + RESCAN_INTERVAL_MS )
+		return (int)(pfdata->m_RescanEnd + RESCAN_INTERVAL_MS - now);
+
+	pfdata->m_RescanPending = false;
+	{
+		std::lock_guard<std::mutex> lock(hfes->m_Lock);
+		rescan_watches(hfes);
+		fe_stats_add(hfes->m_Stats.m_EventsFiltered, apply_masks(pfdata, &pfdata->m_Batch));
+	}
+	fe_dispatch(hfes, &pfdata->m_Batch);
+	fe_batch_clear(&pfdata->m_Batch);
+	return -1;
+}
 
+// Sends what's due (and polls the directories that are due), and returns the number of milliseconds until something else is due, or -1 if nothing is waiting
+static int service_timers(SFileEventSystem* hfes)
+{
+	finish_rescan(hfes);
+	int rescantimeout = start_pending_rescan(hfes);
+	int polltimeout = fe_statpoll_service(hfes, hfes->m_PlatformData->m_StatPoll);
+	int movetimeout = expire_moves(hfes, false);
+	int timeout = fe_flush_events(hfes, false);
+	if( movetimeout >= 0 && (timeout < 0 || movetimeout < timeout) )
+		timeout = movetimeout;
+	if( polltimeout >= 0 && (timeout < 0 || polltimeout < timeout) )
+		timeout = polltimeout;
+	if( rescantimeout >= 0 && (timeout < 0 || rescantimeout < timeout) )
+		timeout = rescantimeout;
+	return timeout;
 }
 
-static void start_stream(SFileEventSystem* hfes)
+// The io_uring version of the epoll_wait() below. A read is kept posted on the inotify queue and on the wakeup fd,
+// and one io_uring_enter() both posts the next read and waits for the completions. Returns false if the ring failed.
+static bool wait_uring(SFileEventSystem* hfes, int timeout)
 {
+	SPlatformData* pfdata = hfes->m_PlatformData;
+	SUring* ring = pfdata->m_Uring;
+	if( !pfdata->m_ReadPosted )
+		pfdata->m_ReadPosted = fe_uring_read(ring, pfdata->m_Fd, pfdata->m_Buffer, EVENT_BUF_LEN, URING_INOTIFY);
+	if( !pfdata->m_WakeupPosted )
+		pfdata->m_WakeupPosted = fe_uring_read(ring, pfdata->m_WakeupFd, &pfdata->m_WakeupValue, sizeof(pfdata->m_WakeupValue), URING_WAKEUP);
+
+	int result = fe_uring_submit(ring, 1, timeout);
+	if( result < 0 && result != -ETIME && result != -EINTR )
+	{
+		fprintf(stderr, "io_uring_enter failed: %s\n", strerror(-result));
+		pfdata->m_ReadPosted = false;
+		pfdata->m_WakeupPosted = false;
+		return false;
+	}
+
+	uint64_t request;
+	int32_t length;
+	while( fe_uring_complete(ring, &request, &length) )
+	{
+		if( request == URING_WAKEUP )
+		{
+			pfdata->m_WakeupPosted = false;
+			fe_add_pending_watches(hfes);
+			send_replay(hfes);
+		}
+		else if( request == URING_INOTIFY )
+		{
+			pfdata->m_ReadPosted = false;
+			if( length > 0 )
+				decode_events(hfes, pfdata->m_Buffer, length);
+			// A read only stops early if the next event doesn't fit, so if there was room for one more, the queue is empty
+			if( length <= 0 || (size_t)length <= EVENT_BUF_LEN - (EVENT_SIZE + NAME_MAX + 1) )
+				end_of_queue(hfes);
+		}
+	}
+	return true;
 }
 
-static void stop_stream(SFileEventSystem* hfes)
+// Cancels the posted reads, and waits until they're done (they write into m_Buffer and m_WakeupValue).
+// Returns the length of an inotify read that completed meanwhile (the events are in m_Buffer), or 0.
+static int32_t close_uring(SPlatformData* pfdata)
 {
+	int32_t length = 0;
+	SUring* ring = pfdata->m_Uring;
+	if( pfdata->m_ReadPosted )
+		fe_uring_cancel(ring, URING_INOTIFY, URING_CANCEL);
+	if( pfdata->m_WakeupPosted )
+		fe_uring_cancel(ring, URING_WAKEUP, URING_CANCEL);
+
+	for( int i = 0; i < 10 && (pfdata->m_ReadPosted || pfdata->m_WakeupPosted); ++i )
+	{
+		fe_uring_submit(ring, 1, 100);
+		uint64_t request;
+		int32_t result;
+		while( fe_uring_complete(ring, &request, &result) )
+		{
+			if( request == URING_INOTIFY )
+			{
+				pfdata->m_ReadPosted = false;
+				length = result > 0 ? result : 0;
+			}
+			else if( request == URING_WAKEUP )
+				pfdata->m_WakeupPosted = false;
+		}
+	}
+	fe_uring_destroy(ring);
+	pfdata->m_Uring = 0;
+	return length;
 }
 
 void platform_thread_run(SFileEventSystem* hfes)
 {
+	SPlatformData* pfdata = hfes->m_PlatformData;
+
+	pfdata->m_IsRunning = true;
 	while( !hfes->m_Cancel )
 	{
-		if( hfes->m_Updated )
+		// The kernel watches are updated directly in fe_platform_add_watch/fe_platform_remove_watch
+		hfes->m_Updated = false;
+
+		// Block until there's something to do. No timeout (unless there are renames or coalesced events waiting, or
+		// directories to poll), so an idle watcher costs nothing.
+		int timeout = service_timers(hfes);
+
+		if( pfdata->m_Uring )
 		{
-			std::lock_guard<std::mutex> lock(hfes->m_Lock);
+			if( wait_uring(hfes, timeout) )
+				continue;
+
+			// The inotify and wakeup fds are still registered with epoll, so it carries on with that instead
+			fprintf(stderr, "io_uring failed, using epoll instead\n");
+			int32_t length = close_uring(pfdata);
+			if( length > 0 )
+				decode_events(hfes, pfdata->m_Buffer, length);
+			// A wakeup may have been consumed by the cancelled read
+			fe_add_pending_watches(hfes);
+			send_replay(hfes);
+			continue;
+		}
 
-			stop_stream(hfes);
-			start_stream(hfes);
-			hfes->m_Updated = false;
+		struct epoll_event events[3];
+		int count = epoll_wait(pfdata->m_EpollFd, events, 3, timeout);
+		if( count < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+			fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+			break;
 		}
 
-		CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.1, false);
+		for( int i = 0; i < count; ++i )
+		{
+			if( events[i].data.fd == pfdata->m_WakeupFd )
+			{
+				uint64_t value;
+				ssize_t result = read(pfdata->m_WakeupFd, &value, sizeof(value));
+				(void)result;
+				fe_add_pending_watches(hfes);
+				send_replay(hfes);
+			}
+			else if( events[i].data.fd == pfdata->m_Fd )
+			{
+				read_events(hfes);
+			}
+			else if( pfdata->m_Fanotify )
+			{
+				fe_fanotify_read_events(hfes, pfdata->m_Fanotify);
+			}
+		}
 	}
-	CFRunLoopStop(CFRunLoopGetCurrent());
-	std::lock_guard<std::mutex> lock(hfes->m_Lock);
-	stop_stream(hfes);
+	expire_moves(hfes, true);
+	fe_flush_events(hfes, true);
+	pfdata->m_IsRunning = false;
+}
+
+// Calls fn for each of the systems attached to the engine. The lock is released while a system is serviced, so that
+// its callbacks may attach or detach systems, and a system that's detached meanwhile is skipped.
+template<typename Fn>
+static void service_systems(SInotifyEngine* engine, Fn fn)
+{
+	std::unique_lock<std::mutex> lock(engine->m_Lock);
+	engine->m_Serviced = engine->m_Systems;
+	for( size_t i = 0; i < engine->m_Serviced.size(); ++i )
+	{
+		SFileEventSystem* hfes = engine->m_Serviced[i];
+		if( !hfes )
+			continue;
+		engine->m_Busy = hfes;
+		lock.unlock();
+		fn(hfes);
+		lock.lock();
+		engine->m_Busy = 0;
+		engine->m_Idle.notify_all();
+	}
+	engine->m_Serviced.clear();
+}
+
+// Drains the shared inotify queue. Each system picks out the events for its own kernel watches.
+static void read_shared_events(SInotifyEngine* engine)
+{
+	while( true )
+	{
+		ssize_t length = read(engine->m_Fd, engine->m_Buffer, EVENT_BUF_LEN);
+		if( length < 0 && errno == EINTR )
+			continue;
+		const char* buffer = engine->m_Buffer;
+		service_systems(engine, [=](SFileEventSystem* hfes) {
+			if( length <= 0 )
+				end_of_queue(hfes);
+			else
+				decode_events(hfes, buffer, length);
+		});
+		if( length <= 0 )
+			break;
+	}
+}
+
+// The thread of the shared engine. It does what platform_thread_run() does, for each of the attached systems.
+static void engine_thread_run(SInotifyEngine* engine)
+{
+	engine->m_IsRunning = true;
+	while( !engine->m_Stop )
+	{
+		int timeout = -1;
+		service_systems(engine, [&](SFileEventSystem* hfes) {
+			int next = service_timers(hfes);
+			if( next >= 0 && (timeout < 0 || next < timeout) )
+				timeout = next;
+		});
+
+		struct epoll_event events[2];
+		int count = epoll_wait(engine->m_EpollFd, events, 2, timeout);
+		if( count < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+			fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+			break;
+		}
+
+		for( int i = 0; i < count; ++i )
+		{
+			if( events[i].data.fd == engine->m_WakeupFd )
+			{
+				uint64_t value;
+				ssize_t result = read(engine->m_WakeupFd, &value, sizeof(value));
+				(void)result;
+				service_systems(engine, [](SFileEventSystem* hfes) {
+					fe_add_pending_watches(hfes);
+					send_replay(hfes);
+				});
+			}
+			else
+			{
+				read_shared_events(engine);
+			}
+		}
+	}
+	engine->m_IsRunning = false;
+}
+
+static void epoll_add(int epollfd, int fd)
+{
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if( epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) != 0 )
+		fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+}
+
+// Attaches the system to the shared engine (and creates the engine if it's the first one)
+static SInotifyEngine* attach_engine(SFileEventSystem* hfes)
+{
+	std::lock_guard<std::mutex> lock(s_EngineLock);
+	if( !s_Engine )
+	{
+		int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if( fd < 0 )
+		{
+			fprintf(stderr, "inotify_init1 failed: %s\n", strerror(errno));
+			return 0;
+		}
+
+		SInotifyEngine* engine = new SInotifyEngine;
+		engine->m_Fd = fd;
+		engine->m_WakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		engine->m_EpollFd = epoll_create1(EPOLL_CLOEXEC);
+		epoll_add(engine->m_EpollFd, engine->m_Fd);
+		epoll_add(engine->m_EpollFd, engine->m_WakeupFd);
+		engine->m_Buffer = new char[EVENT_BUF_LEN];
+		engine->m_RefCount = 0;
+		engine->m_Busy = 0;
+		engine->m_Stop = false;
+		engine->m_IsRunning = false;
+		engine->m_Thread = std::thread(engine_thread_run, engine);
+		s_Engine = engine;
+	}
+
+	SPlatformData* pfdata = hfes->m_PlatformData;
+	pfdata->m_Engine = s_Engine;
+	pfdata->m_Fd = s_Engine->m_Fd;
+	pfdata->m_WakeupFd = s_Engine->m_WakeupFd;
+
+	s_Engine->m_RefCount++;
+	std::lock_guard<std::mutex> systemslock(s_Engine->m_Lock);
+	s_Engine->m_Systems.push_back(hfes);
+	return s_Engine;
+}
+
+// Detaches the system from the shared engine, and releases its kernel watches (and the engine, if it was the last one)
+static void detach_engine(SFileEventSystem* hfes)
+{
+	SPlatformData* pfdata = hfes->m_PlatformData;
+	SInotifyEngine* engine = pfdata->m_Engine;
+	{
+		std::unique_lock<std::mutex> lock(engine->m_Lock);
+		engine->m_Systems.erase(std::remove(engine->m_Systems.begin(), engine->m_Systems.end(), hfes), engine->m_Systems.end());
+		std::replace(engine->m_Serviced.begin(), engine->m_Serviced.end(), hfes, (SFileEventSystem*)0);
+		// Waits for the engine thread to be done with it (unless it's closed by one of the callbacks of another system,
+		// from the engine thread. As with a system of its own, it can't be closed from its own callbacks.)
+		if( std::this_thread::get_id() != engine->m_Thread.get_id() )
+			engine->m_Idle.wait(lock, [=]() { return engine->m_Busy != hfes; });
+	}
+	cancel_rescan(pfdata);
+
+	// What the thread would have done when it stopped
+	expire_moves(hfes, true);
+	fe_flush_events(hfes, true);
+
+	for( const SWatchDir& dir : pfdata->m_Dirs )
+		remove_kernel_watch(engine, engine->m_Fd, dir.m_Wd, false);
+
+	std::lock_guard<std::mutex> lock(s_EngineLock);
+	if( --engine->m_RefCount > 0 )
+		return;
+
+	engine->m_Stop = true;
+	uint64_t value = 1;
+	ssize_t result = write(engine->m_WakeupFd, &value, sizeof(value));
+	(void)result;
+	engine->m_Thread.join();
+	close(engine->m_Fd);
+	close(engine->m_WakeupFd);
+	close(engine->m_EpollFd);
+	delete[] engine->m_Buffer;
+	delete engine;
+	s_Engine = 0;
 }
 
 SPlatformData* fe_platform_init(const SFileEventSystem* hfes)
 {
-	(void)hfes;
 	SPlatformData* pfdata = new SPlatformData;
-	pfdata->m_Fd = inotify_init();
+	pfdata->m_Engine = 0;
+	pfdata->m_Fanotify = 0;
+	pfdata->m_StatPoll = fe_statpoll_init(hfes);
+	pfdata->m_Paths = &const_cast<SFileEventSystem*>(hfes)->m_WatchPaths;
+	pfdata->m_Buffer = 0;
 	pfdata->m_IsRunning = false;
+	pfdata->m_Uring = 0;
+	pfdata->m_WakeupValue = 0;
+	pfdata->m_ReadPosted = false;
+	pfdata->m_WakeupPosted = false;
+	pfdata->m_RescanDone = false;
+	pfdata->m_Closing = false;
+	pfdata->m_Rescanning = false;
+	pfdata->m_RescanPending = false;
+	pfdata->m_RescanEnd = 0;
+	// The crawls use io_uring if the kernel has it (they create their own rings)
+	pfdata->m_CrawlUring = false;
+	if( hfes->m_IoUring )
+	{
+		SUring* probe = fe_uring_create(1);
+		pfdata->m_CrawlUring = probe != 0;
+		fe_uring_destroy(probe);
+	}
+
+	if( hfes->m_SharedEngine )
+	{
+		// It's attached to the shared engine when the first watch is added, since events may be sent as soon as it's attached
+		pfdata->m_Fd = -1;
+		pfdata->m_WakeupFd = -1;
+		pfdata->m_EpollFd = -1;
+		return pfdata;
+	}
+
+	pfdata->m_Fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if( pfdata->m_Fd < 0 )
+		fprintf(stderr, "inotify_init1 failed: %s\n", strerror(errno));
+	pfdata->m_WakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pfdata->m_EpollFd = epoll_create1(EPOLL_CLOEXEC);
+	epoll_add(pfdata->m_EpollFd, pfdata->m_Fd);
+	epoll_add(pfdata->m_EpollFd, pfdata->m_WakeupFd);
+
+	if( hfes->m_Backend == FE_BACKEND_FANOTIFY )
+	{
+		pfdata->m_Fanotify = fe_fanotify_init(hfes);
+		if( pfdata->m_Fanotify )
+			epoll_add(pfdata->m_EpollFd, fe_fanotify_get_fd(pfdata->m_Fanotify));
+		else
+			fprintf(stderr, "fanotify isn't available, using inotify instead\n");
+	}
+
+	if( hfes->m_IoUring && !pfdata->m_Fanotify )
+	{
+		pfdata->m_Uring = fe_uring_create(4);
+		if( !pfdata->m_Uring )
+			fprintf(stderr, "io_uring isn't available, using epoll instead\n");
+	}
+
+	pfdata->m_Buffer = new char[EVENT_BUF_LEN];
 	return pfdata;
 }
 
+// The journal keeps the trees of this run's watches. The other roots it was loaded with (and the trees of the polled
+// watches) weren't kept up to date, so they're dropped rather than replayed later on.
+static void prune_journal(const SFileEventSystem* hfes)
+{
+	const SPlatformData* pfdata = hfes->m_PlatformData;
+	SSnapshot* snapshot = hfes->m_Snapshot;
+	std::vector<uint32_t> stale;
+	std::string root;
+	for( uint32_t index : snapshot->m_Roots )
+	{
+		snapshot->get_path(index, root);
+		bool watched = false;
+		for( std::map<HFESWatchID, SWatchInfo>::const_iterator it = pfdata->m_WatchHandles.begin(); it != pfdata->m_WatchHandles.end() && !watched; ++it )
+			watched = fe_is_in_dir(it->second.m_Root, root, true);
+		if( !watched )
+			stale.push_back(index);
+	}
+	for( uint32_t index : stale )
+		snapshot->remove(index);
+}
+
 void fe_platform_close(const SFileEventSystem* hfes)
 {
-	close(hfes->m_PlatformData->m_Fd);
-	delete hfes->m_PlatformData;
+	SPlatformData* pfdata = hfes->m_PlatformData;
+	if( !hfes->m_JournalPath.empty() )
+		prune_journal(hfes);
+	if( pfdata->m_Uring )
+		close_uring(pfdata);
+	if( pfdata->m_Engine )
+	{
+		detach_engine(const_cast<SFileEventSystem*>(hfes));
+	}
+	else
+	{
+		cancel_rescan(pfdata);
+		if( pfdata->m_Fd >= 0 )
+			close(pfdata->m_Fd);
+		if( pfdata->m_WakeupFd >= 0 )
+			close(pfdata->m_WakeupFd);
+		if( pfdata->m_EpollFd >= 0 )
+			close(pfdata->m_EpollFd);
+	}
+	if( pfdata->m_Fanotify )
+		fe_fanotify_close(pfdata->m_Fanotify);
+	fe_statpoll_close(pfdata->m_StatPoll);
+	delete[] pfdata->m_Buffer;
+	delete pfdata;
+}
+
+void fe_platform_wakeup(const SFileEventSystem* hfes)
+{
+	// A shared system is attached by its first watch, unless the watch is added asynchronously (by the engine thread)
+	if( hfes->m_PlatformData->m_WakeupFd < 0 && hfes->m_SharedEngine && !hfes->m_PendingWatches.empty() )
+		attach_engine(const_cast<SFileEventSystem*>(hfes));
+	// A shared system that isn't attached yet has nothing to wake up
+	if( hfes->m_PlatformData->m_WakeupFd < 0 )
+		return;
+	uint64_t value = 1;
+	ssize_t result = write(hfes->m_PlatformData->m_WakeupFd, &value, sizeof(value));
+	(void)result;
 }
 
 bool fe_is_running(const SFileEventSystem* hfes)
 {
-	return hfes->m_PlatformData->m_IsRunning;
+	const SPlatformData* pfdata = hfes->m_PlatformData;
+	if( pfdata->m_Engine )
+		return pfdata->m_Engine->m_IsRunning;
+	return pfdata->m_IsRunning;
 }
 
-int fe_platform_add_watch(const SFileEventSystem* hfes, HFESWatchID watchid, const char* path, uint32_t mask)
+int fe_platform_add_watch(const SFileEventSystem* hfes, HFESWatchID watchid, const char* path, uint32_t mask, const SFileFilter* filter)
 {
+	SPlatformData* pfdata = hfes->m_PlatformData;
+
+	// The file systems where inotify misses changes are polled, whatever the backend
+	bool poll = hfes->m_Backend == FE_BACKEND_POLL || fe_statpoll_is_needed(path);
+	if( pfdata->m_Fanotify && !poll )
+		return fe_fanotify_add_watch(pfdata->m_Fanotify, watchid, path, mask, filter);
+
+	if( hfes->m_SharedEngine && !pfdata->m_Engine && !attach_engine(const_cast<SFileEventSystem*>(hfes)) )
+		return -1;
+
+	if( poll )
+	{
+		if( hfes->m_Verbose )
+			printf("Polling '%s'\n", path);
+		return fe_statpoll_add_watch(pfdata->m_StatPoll, watchid, path, mask, filter);
+	}
+
+	std::string root = normalize_path(path);
+
+	struct stat st;
+	bool isdir = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+
+	std::vector<SCrawlResult> results;
+	std::vector<SCrawlEntry> entries;
+	int wd = scan_watch(pfdata, root, isdir, (mask & FE_RECURSIVE) != 0, true, to_inotify_mask(hfes, mask), filter, results, hfes->m_Snapshot ? &entries : 0);
+	if( wd < 0 )
+	{
+		fprintf(stderr, "inotify_add_watch failed for '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	SWatchInfo& info = pfdata->m_WatchHandles[watchid];
+	info.m_Root = root;
+	info.m_Filter = filter;
+	info.m_Mask = mask;
+	info.m_RootWd = wd;
+
+	for( const SCrawlResult& result : results )
+		add_owner(pfdata, result.m_Wd, result.m_Path, result.m_Wd == wd ? isdir : true, watchid);
 
+	if( hfes->m_Snapshot )
+	{
+		// If the path was in the journal, whatever changed since it was saved is sent once the lock is released
+		bool replay = !hfes->m_JournalPath.empty() && hfes->m_Snapshot->find_path(root) != FE_SNAPSHOT_NONE;
+		diff_snapshot(hfes->m_Snapshot, watchid, root, (mask & FE_RECURSIVE) != 0, entries, replay ? &pfdata->m_Replay : 0);
+	}
+
+	if( hfes->m_Verbose )
+		printf("Added %u kernel watches for '%s'\n", (uint32_t)results.size(), path);
 	return 0;
 }
 
+// The watch was made recursive, or not recursive. It's crawled again, as if it was added: the sub directories it has
+// now are watched, and the kernel watches it doesn't need any more are released. Nothing is sent for what's found.
+static void recrawl_watch(const SFileEventSystem* hfes, HFESWatchID watchid, SWatchInfo& info)
+{
+	SPlatformData* pfdata = hfes->m_PlatformData;
+	bool recursive = (info.m_Mask & FE_RECURSIVE) != 0;
+
+	struct stat st;
+	bool isdir = stat(info.m_Root.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+	std::vector<SCrawlResult> results;
+	std::vector<SCrawlEntry> entries;
+	int wd = scan_watch(pfdata, info.m_Root, isdir, recursive, true, to_inotify_mask(hfes, info.m_Mask), info.m_Filter, results, hfes->m_Snapshot ? &entries : 0);
+	if( wd >= 0 )
+		info.m_RootWd = wd;
+
+	std::set<int> found;
+	for( const SCrawlResult& result : results )
+	{
+		add_owner(pfdata, result.m_Wd, result.m_Path, result.m_Wd == wd ? isdir : true, watchid);
+		found.insert(result.m_Wd);
+	}
+	std::vector<int> stale;
+	for( int owned : info.m_Wds )
+	{
+		if( found.find(owned) == found.end() )
+			stale.push_back(owned);
+	}
+	for( int owned : stale )
+	{
+		release_wd(pfdata, owned, watchid);
+		info.m_Wds.erase(owned);
+	}
+
+	if( hfes->m_Snapshot )
+		diff_snapshot(hfes->m_Snapshot, watchid, info.m_Root, recursive, entries, 0);
+}
+
+void fe_platform_update_watch(const SFileEventSystem* hfes, HFESWatchID watchid, uint32_t mask)
+{
+	SPlatformData* pfdata = hfes->m_PlatformData;
+	if( fe_statpoll_update_watch(pfdata->m_StatPoll, watchid, mask) )
+		return;
+	if( pfdata->m_Fanotify )
+	{
+		fe_fanotify_update_watch(pfdata->m_Fanotify, watchid, mask);
+		return;
+	}
+
+	std::map<HFESWatchID, SWatchInfo>::iterator it = pfdata->m_WatchHandles.find(watchid);
+	if( it == pfdata->m_WatchHandles.end() )
+		return;
+
+	SWatchInfo& info = it->second;
+	bool recursive = ((mask ^ info.m_Mask) & FE_RECURSIVE) != 0;
+	info.m_Mask = mask;
+	if( recursive )
+	{
+		recrawl_watch(hfes, watchid, info);
+		return;
+	}
+
+	// The kernel watches of the tree stay the same, but they may need more events
+	uint32_t inotifymask = to_inotify_mask(hfes, info.m_Mask);
+	for( int wd : info.m_Wds )
+	{
+		uint32_t index = find_dir(pfdata, wd);
+		if( index == FE_HASH_INVALID )
+			continue;
+		pfdata->m_Paths->get_path(pfdata->m_Dirs[index].m_Path, pfdata->m_DirPath);
+		uint32_t flags = wd == info.m_RootWd ? 0 : s_InotifyDirFlags;
+		int added = add_kernel_watch(pfdata->m_Engine, pfdata->m_Fd, pfdata->m_DirPath.c_str(), inotifymask | flags);
+		if( added >= 0 )
+			drop_kernel_watch(pfdata, added);
+	}
+}
+
+void fe_platform_remove_watch(const SFileEventSystem* hfes, HFESWatchID watchid)
+{
+	SPlatformData* pfdata = hfes->m_PlatformData;
+	if( fe_statpoll_remove_watch(pfdata->m_StatPoll, watchid) )
+		return;
+	if( pfdata->m_Fanotify )
+	{
+		fe_fanotify_remove_watch(pfdata->m_Fanotify, watchid);
+		return;
+	}
+
+	std::map<HFESWatchID, SWatchInfo>::iterator it = pfdata->m_WatchHandles.find(watchid);
+	if( it == pfdata->m_WatchHandles.end() )
+		return;
+
+	for( int wd : it->second.m_Wds )
+		release_wd(pfdata, wd, watchid);
+	std::string root = it->second.m_Root;
+	pfdata->m_WatchHandles.erase(it);
+
+	// The root is dropped from the snapshot (and the journal), unless another watch is inside it
+	if( hfes->m_Snapshot )
+	{
+		uint32_t index = hfes->m_Snapshot->find_path(root);
+		if( index == FE_SNAPSHOT_NONE || hfes->m_Snapshot->m_Entries[index].m_Parent != FE_SNAPSHOT_NONE )
+			return;
+		for( std::map<HFESWatchID, SWatchInfo>::const_iterator other = pfdata->m_WatchHandles.begin(); other != pfdata->m_WatchHandles.end(); ++other )
+		{
+			if( fe_is_in_dir(other->second.m_Root, root, true) )
+				return;
+		}
+		hfes->m_Snapshot->remove(index);
+	}
+}
+
+uint32_t fe_platform_num_kernel_watches(const SFileEventSystem* hfes)
+{
+	const SPlatformData* pfdata = hfes->m_PlatformData;
+	if( pfdata->m_Fanotify )
+		return fe_fanotify_num_marks(pfdata->m_Fanotify);
+	return (uint32_t)pfdata->m_Dirs.size();
+}
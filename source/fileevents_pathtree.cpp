@@ -0,0 +1,251 @@
+#include <string.h>
+#include <algorithm>
+
+#include "fileevents_pathtree.h"
+
+static uint32_t node_hash(uint32_t parent, const char* name, uint32_t length)
+{
+	return fe_hash_int((uint64_t)parent << 32 | (uint64_t)fe_hash_string(name, length));
+}
+
+// Is the root a prefix of the path? The remainder of the path (after the separator) starts at *pos
+static bool is_prefix(const char* root, uint32_t rootlength, const char* path, uint32_t length, uint32_t* pos)
+{
+	if( length < rootlength || memcmp(root, path, rootlength) != 0 )
+		return false;
+	if( length == rootlength || (rootlength > 0 && root[rootlength - 1] == '/') )
+	{
+		*pos = rootlength;
+		return true;
+	}
+	if( path[rootlength] != '/' )
+		return false;
+	*pos = rootlength + 1;
+	return true;
+}
+
+uint32_t SPathTree::alloc_node()
+{
+	m_Count++;
+	if( !m_Free.empty() )
+	{
+		uint32_t node = m_Free.back();
+		m_Free.pop_back();
+		return node;
+	}
+	m_Nodes.push_back(SNode());
+	return (uint32_t)m_Nodes.size() - 1;
+}
+
+void SPathTree::set_name(uint32_t node, const char* name, uint32_t length)
+{
+	// The old name is left as garbage in the arena, until there's more garbage than names
+	m_NamesUsed += length;
+	if( m_Names.size() > 4096 && m_NamesUsed < m_Names.size() / 2 )
+		compact_names();
+
+	m_Nodes[node].m_Name = (uint32_t)m_Names.size();
+	m_Nodes[node].m_NameLength = length;
+	m_Names.insert(m_Names.end(), name, name + length);
+}
+
+void SPathTree::compact_names()
+{
+	std::vector<char> names;
+	names.reserve(m_NamesUsed * 2);
+	for( SNode& node : m_Nodes )
+	{
+		if( node.m_Name == FE_PATH_NONE )
+			continue;
+		uint32_t offset = (uint32_t)names.size();
+		names.insert(names.end(), m_Names.begin() + node.m_Name, m_Names.begin() + node.m_Name + node.m_NameLength);
+		node.m_Name = offset;
+	}
+	m_Names.swap(names);
+}
+
+// Is there a separator between the node and its children? (not if the node is the root "/")
+bool SPathTree::has_separator(uint32_t parent) const
+{
+	const SNode& dir = m_Nodes[parent];
+	return dir.m_NameLength == 0 || m_Names[dir.m_Name + dir.m_NameLength - 1] != '/';
+}
+
+// Also finds the roots (their parent is FE_PATH_NONE)
+uint32_t SPathTree::find_child(uint32_t parent, const char* name, uint32_t length) const
+{
+	return m_Index.find(node_hash(parent, name, length), [&](uint32_t i) {
+		const SNode& node = m_Nodes[i];
+		return node.m_Parent == parent && node.m_NameLength == length && memcmp(&m_Names[node.m_Name], name, length) == 0;
+	});
+}
+
+uint32_t SPathTree::add_child(uint32_t parent, const char* name, uint32_t length)
+{
+	uint32_t node = alloc_node();
+	m_Nodes[node].m_Parent = parent;
+	m_Nodes[node].m_RefCount = 0;
+	set_name(node, name, length);
+	m_Nodes[node].m_PathLength = m_Nodes[parent].m_PathLength + (has_separator(parent) ? 1 : 0) + length;
+	m_Nodes[parent].m_RefCount++;
+	m_Index.insert(node_hash(parent, name, length), node);
+	return node;
+}
+
+// Walks (and adds) the segments of the path below the node. There's always at least one segment (which may be empty).
+uint32_t SPathTree::add_below(uint32_t node, const char* path, uint32_t length)
+{
+	uint32_t pos = 0;
+	for( ; ; )
+	{
+		const char* end = (const char*)memchr(path + pos, '/', length - pos);
+		uint32_t segment = end ? (uint32_t)(end - path) - pos : length - pos;
+		uint32_t child = find_child(node, path + pos, segment);
+		node = child != FE_PATH_NONE ? child : add_child(node, path + pos, segment);
+		if( !end )
+			return node;
+		pos += segment + 1;
+	}
+}
+
+uint32_t SPathTree::add_root(const char* path, uint32_t length)
+{
+	uint32_t root = alloc_node();
+	m_Nodes[root].m_Parent = FE_PATH_NONE;
+	m_Nodes[root].m_RefCount = 0;
+	m_Nodes[root].m_PathLength = length;
+	set_name(root, path, length);
+	m_Index.insert(node_hash(FE_PATH_NONE, path, length), root);
+	m_Roots.push_back(root);
+	return root;
+}
+
+// The root of a path is its first segment: "/" for an absolute path, and the first name of a relative one
+static uint32_t root_length(const char* path, uint32_t length)
+{
+	if( length > 0 && path[0] == '/' )
+		return 1;
+	const char* end = (const char*)memchr(path, '/', length);
+	return end ? (uint32_t)(end - path) : length;
+}
+
+uint32_t SPathTree::find_root(const char* path, uint32_t length) const
+{
+	return find_child(FE_PATH_NONE, path, root_length(path, length));
+}
+
+uint32_t SPathTree::intern(const char* path, uint32_t length)
+{
+	uint32_t rootlength = root_length(path, length);
+	uint32_t node = find_child(FE_PATH_NONE, path, rootlength);
+	if( node == FE_PATH_NONE )
+		node = add_root(path, rootlength);
+	if( length != rootlength )
+	{
+		uint32_t pos;
+		is_prefix(&m_Names[m_Nodes[node].m_Name], m_Nodes[node].m_NameLength, path, length, &pos);
+		node = add_below(node, path + pos, length - pos);
+	}
+	m_Nodes[node].m_RefCount++;
+	return node;
+}
+
+void SPathTree::free_node(uint32_t node)
+{
+	SNode& n = m_Nodes[node];
+	if( n.m_Parent == FE_PATH_NONE )
+		m_Roots.erase(std::remove(m_Roots.begin(), m_Roots.end(), node), m_Roots.end());
+	m_Index.erase(node_hash(n.m_Parent, &m_Names[n.m_Name], n.m_NameLength), [=](uint32_t i) { return i == node; });
+	m_NamesUsed -= n.m_NameLength;
+	n.m_Name = FE_PATH_NONE;
+	n.m_NameLength = 0;
+	m_Free.push_back(node);
+	m_Count--;
+}
+
+void SPathTree::release(uint32_t node)
+{
+	// A node without references has no children, so it goes away, and so may its parent
+	while( node != FE_PATH_NONE && --m_Nodes[node].m_RefCount == 0 )
+	{
+		uint32_t parent = m_Nodes[node].m_Parent;
+		free_node(node);
+		node = parent;
+	}
+}
+
+uint32_t SPathTree::find(const char* path, uint32_t length) const
+{
+	uint32_t node = find_root(path, length);
+	if( node == FE_PATH_NONE || length == m_Nodes[node].m_NameLength )
+		return node;
+
+	uint32_t pos;
+	is_prefix(&m_Names[m_Nodes[node].m_Name], m_Nodes[node].m_NameLength, path, length, &pos);
+	for( ; ; )
+	{
+		const char* end = (const char*)memchr(path + pos, '/', length - pos);
+		uint32_t segment = end ? (uint32_t)(end - path) - pos : length - pos;
+		node = find_child(node, path + pos, segment);
+		if( !end || node == FE_PATH_NONE )
+			return node;
+		pos += segment + 1;
+	}
+}
+
+uint32_t SPathTree::path_length(uint32_t node, uint32_t namelength) const
+{
+	uint32_t length = m_Nodes[node].m_PathLength;
+	if( namelength )
+		length += (has_separator(node) ? 1 : 0) + namelength;
+	return length;
+}
+
+void SPathTree::write_path(uint32_t node, const char* name, uint32_t namelength, char* out) const
+{
+	// The path is written backwards, from the name up to the root
+	uint32_t length = path_length(node, namelength);
+	if( namelength )
+	{
+		length -= namelength;
+		memcpy(out + length, name, namelength);
+		if( has_separator(node) )
+			out[--length] = '/';
+	}
+	for( uint32_t i = node; i != FE_PATH_NONE; i = m_Nodes[i].m_Parent )
+	{
+		const SNode& n = m_Nodes[i];
+		length -= n.m_NameLength;
+		memcpy(out + length, &m_Names[n.m_Name], n.m_NameLength);
+		if( n.m_Parent != FE_PATH_NONE && has_separator(n.m_Parent) )
+			out[--length] = '/';
+	}
+}
+
+void SPathTree::get_path(uint32_t node, std::string& out) const
+{
+	out.resize(m_Nodes[node].m_PathLength);
+	if( !out.empty() )
+		write_path(node, 0, 0, &out[0]);
+}
+
+bool SPathTree::is_in(uint32_t node, uint32_t dir) const
+{
+	for( ; node != FE_PATH_NONE; node = m_Nodes[node].m_Parent )
+	{
+		if( node == dir )
+			return true;
+	}
+	return false;
+}
+
+void SPathTree::clear()
+{
+	m_Nodes.clear();
+	m_Names.clear();
+	m_Free.clear();
+	m_Roots.clear();
+	m_Index.clear();
+	m_Count = 0;
+	m_NamesUsed = 0;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "fileevents_hash.h"
+
+#define FE_PATH_NONE	0xFFFFFFFF
+
+/** Interned paths, as a tree of names with parent links.
+ *
+ * Each node only holds its own name, so the directories of a large tree don't repeat their common prefixes.
+ * The roots are the first segments of the paths ("/" for all the absolute paths), so the parent directories that
+ * the paths have in common are interned too, and each path has exactly one node. Every node, the roots included,
+ * is found by a hash lookup of (parent, name). The full path of a node is only put together when it's needed
+ * (see write_path()).
+ *
+ * The nodes are reference counted: intern() adds a reference and release() drops it, and a node also holds
+ * a reference to its parent. A node is 20 bytes, plus its name and its slot in the index.
+ *
+ * There's one per system (SFileEventSystem::m_WatchPaths), guarded by its lock. It holds the paths of the
+ * registered watches, of the Linux kernel watches and of the polled directories, which share their nodes.
+ * The snapshot (SSnapshot) is a tree of the same shape, but it isn't built on this one: its entries carry the stat
+ * info of every file, they're created and removed with the files rather than with the watches, and it's saved
+ * to the journal on its own.
+ */
+struct SPathTree
+{
+	struct SNode
+	{
+		uint32_t 	m_Parent;		// FE_PATH_NONE for a root
+		uint32_t 	m_Name;			// The offset of the name in m_Names (FE_PATH_NONE for an unused node)
+		uint32_t 	m_NameLength;
+		uint32_t 	m_PathLength;	// The length of the full path
+		uint32_t 	m_RefCount;		// The references from intern() and from the children
+	};
+
+	std::vector<SNode> 		m_Nodes;
+	std::vector<char> 		m_Names;
+	std::vector<uint32_t> 	m_Free;		// The unused nodes
+	std::vector<uint32_t> 	m_Roots;
+	SHashIndex 				m_Index;	// (parent, name) -> node
+	uint32_t 				m_Count;	// The number of nodes in use
+	uint32_t 				m_NamesUsed;	// The number of bytes in m_Names that are in use
+
+	SPathTree() : m_Count(0), m_NamesUsed(0) {}
+
+	// Returns the node of the path (adding it, and the directories above it, if needed), with a new reference
+	uint32_t intern(const char* path, uint32_t length);
+	uint32_t intern(const std::string& path)	{ return intern(path.c_str(), (uint32_t)path.size()); }
+	void release(uint32_t node);
+
+	// Returns FE_PATH_NONE if the path hasn't been interned
+	uint32_t find(const char* path, uint32_t length) const;
+	uint32_t find(const std::string& path) const	{ return find(path.c_str(), (uint32_t)path.size()); }
+
+	// The length of the path of the node, joined with a name (if it's set)
+	uint32_t path_length(uint32_t node, uint32_t namelength) const;
+	// Writes the path of the node, joined with a name (if it's set). The output is path_length() bytes, and it's not null terminated.
+	void write_path(uint32_t node, const char* name, uint32_t namelength, char* out) const;
+	void get_path(uint32_t node, std::string& out) const;
+
+	// Is the node the directory, or inside it?
+	bool is_in(uint32_t node, uint32_t dir) const;
+
+	void clear();
+
+private:
+	uint32_t find_root(const char* path, uint32_t length) const;
+	uint32_t find_child(uint32_t parent, const char* name, uint32_t length) const;
+	uint32_t add_child(uint32_t parent, const char* name, uint32_t length);
+	uint32_t add_below(uint32_t node, const char* path, uint32_t length);
+	uint32_t add_root(const char* path, uint32_t length);
+	bool has_separator(uint32_t parent) const;
+	void free_node(uint32_t node);
+	uint32_t alloc_node();
+	void set_name(uint32_t node, const char* name, uint32_t length);
+	void compact_names();
+};
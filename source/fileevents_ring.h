@@ -0,0 +1,158 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+#include "fileevents.h"
+
+/** A lock free single producer/single consumer ring buffer of events.
+ * Each record is a header followed by the null terminated path (and the null terminated new path of a rename), padded to 32 bytes.
+ * A record never wraps around the end of the buffer, the unused space at the end is filled
+ * with a padding record instead.
+ *
+ * The producer only writes m_Head, and the consumer only writes m_Tail. They're
+ * on separate cache lines so the two threads don't fight over them.
+ */
+struct SEventRing
+{
+	struct SRecord
+	{
+		HFESWatchID m_WatchID;
+		uint32_t 	m_Flags;	// 0 means it's a padding record
+		uint32_t 	m_Length;	// The length of the path (or of the padding)
+		uint32_t 	m_TargetLength;	// The length of the new path of a rename, or 0
+		uint32_t 	_pad;
+	};
+
+	char* 					m_Buffer;
+	uint32_t 				m_Size;		// Power of two
+	uint32_t 				_pad0;
+	char 					_pad1[48];
+	std::atomic<uint64_t> 	m_Head;		// The total number of bytes written
+	char 					_pad2[56];
+	std::atomic<uint64_t> 	m_Tail;		// The total number of bytes read
+	char 					_pad3[56];
+
+	explicit SEventRing(uint32_t size)
+	{
+		m_Size = 32 * 1024; // Room for at least one rename with two paths of FE_MAX_PATH
+		while( m_Size < size || m_Size < 2 * FE_POLL_MIN_STRINGS_SIZE )
+			m_Size *= 2;
+		m_Buffer = new char[m_Size];
+		m_Head = 0;
+		m_Tail = 0;
+	}
+
+	~SEventRing()
+	{
+		delete[] m_Buffer;
+	}
+
+	// The records are aligned so that a padding record header always fits at the end
+	static uint32_t record_size(uint32_t length, uint32_t targetlength)
+	{
+		return (uint32_t)(sizeof(SRecord) + length + 1 + targetlength + 1 + 31) & ~31u;
+	}
+
+	// Called by the producer. Returns false if the ring is full.
+	bool push(HFESWatchID watchid, uint32_t flags, const char* path, uint32_t length, const char* target, uint32_t targetlength)
+	{
+		const uint32_t size = record_size(length, targetlength);
+		const uint64_t head = m_Head.load(std::memory_order_relaxed);
+		const uint64_t tail = m_Tail.load(std::memory_order_acquire);
+		const uint64_t available = m_Size - (head - tail);
+
+		uint32_t pos = (uint32_t)head & (m_Size - 1);
+		uint32_t contiguous = m_Size - pos;
+		uint32_t padding = size > contiguous ? contiguous : 0;
+		if( (uint64_t)size + padding > available )
+			return false;
+
+		if( padding )
+		{
+			SRecord* pad = (SRecord*)(m_Buffer + pos);
+			pad->m_Flags = 0;
+			pad->m_Length = contiguous;
+			pos = 0;
+		}
+
+		SRecord* record = (SRecord*)(m_Buffer + pos);
+		record->m_WatchID = watchid;
+		record->m_Flags = flags;
+		record->m_Length = length;
+		record->m_TargetLength = targetlength;
+		char* strings = (char*)(record + 1);
+		memcpy(strings, path, length);
+		strings[length] = 0;
+		memcpy(strings + length + 1, target, targetlength);
+		strings[length + 1 + targetlength] = 0;
+
+		m_Head.store(head + padding + size, std::memory_order_release);
+		return true;
+	}
+
+	bool empty() const
+	{
+		return m_Head.load(std::memory_order_acquire) == m_Tail.load(std::memory_order_relaxed);
+	}
+
+	/** Called by the consumer. Copies as many events as fits into the buffers.
+	 * An event whose paths don't fit in the strings buffer even on their own is dropped (and counted in dropped),
+	 * and an FE_OVERFLOW event with an empty path is returned in its place, so that the reader always makes progress.
+	 * @return The number of events
+	 */
+	uint32_t pop(SFileEvent* events, uint32_t max, char* strings, uint32_t stringssize, uint32_t* dropped)
+	{
+		const uint64_t head = m_Head.load(std::memory_order_acquire);
+		uint64_t tail = m_Tail.load(std::memory_order_relaxed);
+
+		uint32_t count = 0;
+		uint32_t offset = 0;
+		while( tail != head && count < max )
+		{
+			uint32_t pos = (uint32_t)tail & (m_Size - 1);
+			const SRecord* record = (const SRecord*)(m_Buffer + pos);
+			if( record->m_Flags == 0 )
+			{
+				tail += record->m_Length;
+				continue;
+			}
+
+			const uint32_t length = record->m_Length + 1 + (record->m_TargetLength ? record->m_TargetLength + 1 : 0);
+			if( length > stringssize && stringssize > 0 )
+			{
+				if( offset + 1 > stringssize )
+					break;
+				SFileEvent& overflow = events[count++];
+				memset(&overflow, 0, sizeof(overflow));
+				overflow.m_WatchID = -1;
+				overflow.m_Flags = FE_OVERFLOW;
+				overflow.m_PathOffset = offset;
+				strings[offset] = 0;
+				offset += 1;
+				(*dropped)++;
+				tail += record_size(record->m_Length, record->m_TargetLength);
+				continue;
+			}
+			if( offset + length > stringssize )
+				break;
+
+			SFileEvent& event = events[count++];
+			event.m_WatchID = record->m_WatchID;
+			event.m_Flags = record->m_Flags;
+			event.m_PathOffset = offset;
+			event.m_PathLength = record->m_Length;
+			event.m_TargetOffset = record->m_TargetLength ? offset + record->m_Length + 1 : 0;
+			event.m_TargetLength = record->m_TargetLength;
+			event._pad = 0;
+			memcpy(strings + offset, record + 1, length);
+			offset += length;
+
+			tail += record_size(record->m_Length, record->m_TargetLength);
+		}
+
+		m_Tail.store(tail, std::memory_order_release);
+		return count;
+	}
+};
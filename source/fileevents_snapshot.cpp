@@ -0,0 +1,595 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#if !defined(_WIN32)
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+#include "fileevents.h"
+#include "fileevents_internal.h"
+#include "fileevents_snapshot.h"
+
+static uint32_t entry_hash(uint32_t parent, const char* name, uint32_t length)
+{
+	return fe_hash_int((uint64_t)parent << 32 | (uint64_t)fe_hash_string(name, length));
+}
+
+uint32_t SSnapshot::alloc_entry()
+{
+	m_Count++;
+	if( !m_Free.empty() )
+	{
+		uint32_t index = m_Free.back();
+		m_Free.pop_back();
+		return index;
+	}
+	m_Entries.push_back(SEntry());
+	return (uint32_t)m_Entries.size() - 1;
+}
+
+void SSnapshot::set_name(uint32_t index, const char* name, uint32_t length)
+{
+	// The old name is left as garbage in the arena, until there's more garbage than names
+	SEntry& entry = m_Entries[index];
+	m_NamesUsed += length;
+	if( m_Names.size() > 4096 && m_NamesUsed < m_Names.size() / 2 )
+		compact_names();
+
+	entry.m_Name = (uint32_t)m_Names.size();
+	entry.m_NameLength = length;
+	m_Names.insert(m_Names.end(), name, name + length);
+}
+
+void SSnapshot::compact_names()
+{
+	std::vector<char> names;
+	names.reserve(m_NamesUsed * 2);
+	for( SEntry& entry : m_Entries )
+	{
+		if( entry.m_Info.m_Mode == 0 )
+			continue;
+		uint32_t offset = (uint32_t)names.size();
+		names.insert(names.end(), m_Names.begin() + entry.m_Name, m_Names.begin() + entry.m_Name + entry.m_NameLength);
+		entry.m_Name = offset;
+	}
+	m_Names.swap(names);
+}
+
+void SSnapshot::link(uint32_t index, uint32_t parent)
+{
+	SEntry& entry = m_Entries[index];
+	entry.m_Parent = parent;
+	entry.m_PrevSibling = FE_SNAPSHOT_NONE;
+	entry.m_NextSibling = FE_SNAPSHOT_NONE;
+	if( parent == FE_SNAPSHOT_NONE )
+		return;
+
+	SEntry& dir = m_Entries[parent];
+	entry.m_NextSibling = dir.m_FirstChild;
+	if( dir.m_FirstChild != FE_SNAPSHOT_NONE )
+		m_Entries[dir.m_FirstChild].m_PrevSibling = index;
+	dir.m_FirstChild = index;
+	m_Index.insert(entry_hash(parent, &m_Names[entry.m_Name], entry.m_NameLength), index);
+}
+
+void SSnapshot::unlink(uint32_t index)
+{
+	SEntry& entry = m_Entries[index];
+	if( entry.m_Parent == FE_SNAPSHOT_NONE )
+	{
+		m_Roots.erase(std::remove(m_Roots.begin(), m_Roots.end(), index), m_Roots.end());
+		return;
+	}
+
+	m_Index.erase(entry_hash(entry.m_Parent, &m_Names[entry.m_Name], entry.m_NameLength), [=](uint32_t i) { return i == index; });
+	if( entry.m_PrevSibling != FE_SNAPSHOT_NONE )
+		m_Entries[entry.m_PrevSibling].m_NextSibling = entry.m_NextSibling;
+	else
+		m_Entries[entry.m_Parent].m_FirstChild = entry.m_NextSibling;
+	if( entry.m_NextSibling != FE_SNAPSHOT_NONE )
+		m_Entries[entry.m_NextSibling].m_PrevSibling = entry.m_PrevSibling;
+}
+
+uint32_t SSnapshot::add_root(const std::string& path, const SSnapshotInfo& info)
+{
+	uint32_t index = find_path(path);
+	if( index == FE_SNAPSHOT_NONE )
+	{
+		index = alloc_entry();
+		m_Entries[index].m_FirstChild = FE_SNAPSHOT_NONE;
+		set_name(index, path.c_str(), (uint32_t)path.size());
+		link(index, FE_SNAPSHOT_NONE);
+		m_Roots.push_back(index);
+	}
+	m_Entries[index].m_Info = info;
+	return index;
+}
+
+uint32_t SSnapshot::add(uint32_t parent, const char* name, uint32_t length, const SSnapshotInfo& info)
+{
+	uint32_t index = find(parent, name, length);
+	if( index == FE_SNAPSHOT_NONE )
+	{
+		index = alloc_entry();
+		m_Entries[index].m_FirstChild = FE_SNAPSHOT_NONE;
+		set_name(index, name, length);
+		link(index, parent);
+	}
+	m_Entries[index].m_Info = info;
+	return index;
+}
+
+void SSnapshot::remove(uint32_t index)
+{
+	unlink(index);
+
+	// The entries inside it don't have to be unlinked, since they all go away
+	std::vector<uint32_t> stack;
+	stack.push_back(index);
+	while( !stack.empty() )
+	{
+		uint32_t i = stack.back();
+		stack.pop_back();
+
+		SEntry& entry = m_Entries[i];
+		for( uint32_t child = entry.m_FirstChild; child != FE_SNAPSHOT_NONE; child = m_Entries[child].m_NextSibling )
+		{
+			const SEntry& c = m_Entries[child];
+			m_Index.erase(entry_hash(i, &m_Names[c.m_Name], c.m_NameLength), [=](uint32_t v) { return v == child; });
+			stack.push_back(child);
+		}
+
+		m_NamesUsed -= entry.m_NameLength;
+		entry.m_Info.m_Mode = 0;
+		entry.m_FirstChild = FE_SNAPSHOT_NONE;
+		m_Free.push_back(i);
+		m_Count--;
+	}
+}
+
+uint32_t SSnapshot::find(uint32_t parent, const char* name, uint32_t length) const
+{
+	return m_Index.find(entry_hash(parent, name, length), [&](uint32_t i) {
+		const SEntry& entry = m_Entries[i];
+		return entry.m_Parent == parent && entry.m_NameLength == length && memcmp(&m_Names[entry.m_Name], name, length) == 0;
+	});
+}
+
+uint32_t SSnapshot::find_path(const std::string& path) const
+{
+	// The roots may overlap, so the longest one that has the path wins
+	uint32_t found = FE_SNAPSHOT_NONE;
+	uint32_t foundlength = 0;
+	for( uint32_t root : m_Roots )
+	{
+		const SEntry& entry = m_Entries[root];
+		const uint32_t rootlength = entry.m_NameLength;
+		if( found != FE_SNAPSHOT_NONE && rootlength <= foundlength )
+			continue;
+		if( path.size() < rootlength || memcmp(path.c_str(), &m_Names[entry.m_Name], rootlength) != 0 )
+			continue;
+
+		size_t pos = rootlength;
+		if( pos < path.size() && (rootlength == 0 || m_Names[entry.m_Name + rootlength - 1] != '/') )
+		{
+			if( path[pos] != '/' )
+				continue;
+			pos++;
+		}
+
+		uint32_t index = root;
+		while( pos < path.size() && index != FE_SNAPSHOT_NONE )
+		{
+			size_t end = path.find('/', pos);
+			if( end == std::string::npos )
+				end = path.size();
+			index = find(index, path.c_str() + pos, (uint32_t)(end - pos));
+			pos = end + 1;
+		}
+
+		if( index != FE_SNAPSHOT_NONE )
+		{
+			found = index;
+			foundlength = rootlength;
+		}
+	}
+	return found;
+}
+
+// Is there a separator between the entry and its parent? (not if the parent is the root "/")
+static bool has_separator(const SSnapshot* snapshot, uint32_t index)
+{
+	uint32_t parent = snapshot->m_Entries[index].m_Parent;
+	if( parent == FE_SNAPSHOT_NONE )
+		return false;
+	const SSnapshot::SEntry& dir = snapshot->m_Entries[parent];
+	return dir.m_NameLength == 0 || snapshot->m_Names[dir.m_Name + dir.m_NameLength - 1] != '/';
+}
+
+void SSnapshot::get_path(uint32_t index, std::string& out) const
+{
+	// The path is written backwards, from the entry up to its root
+	size_t length = 0;
+	for( uint32_t i = index; i != FE_SNAPSHOT_NONE; i = m_Entries[i].m_Parent )
+		length += m_Entries[i].m_NameLength + (has_separator(this, i) ? 1 : 0);
+
+	out.resize(length);
+	for( uint32_t i = index; i != FE_SNAPSHOT_NONE; i = m_Entries[i].m_Parent )
+	{
+		const SEntry& entry = m_Entries[i];
+		length -= entry.m_NameLength;
+		memcpy(&out[length], &m_Names[entry.m_Name], entry.m_NameLength);
+		if( has_separator(this, i) )
+			out[--length] = '/';
+	}
+}
+
+// Splits the path into the directory and the name
+static bool split_path(const std::string& path, std::string& dir, const char** name, uint32_t* length)
+{
+	size_t slash = path.rfind('/');
+	if( slash == std::string::npos || slash + 1 == path.size() )
+		return false;
+	dir.assign(path, 0, slash == 0 ? 1 : slash);
+	*name = path.c_str() + slash + 1;
+	*length = (uint32_t)(path.size() - slash - 1);
+	return true;
+}
+
+void SSnapshot::set_path(const std::string& path, const SSnapshotInfo& info)
+{
+	uint32_t index = find_path(path);
+	if( index != FE_SNAPSHOT_NONE )
+	{
+		m_Entries[index].m_Info = info;
+		return;
+	}
+
+	std::string dir;
+	const char* name;
+	uint32_t length;
+	if( !split_path(path, dir, &name, &length) )
+		return;
+	uint32_t parent = find_path(dir);
+	if( parent != FE_SNAPSHOT_NONE )
+		add(parent, name, length, info);
+}
+
+void SSnapshot::remove_path(const std::string& path)
+{
+	uint32_t index = find_path(path);
+	if( index != FE_SNAPSHOT_NONE )
+		remove(index);
+}
+
+void SSnapshot::move_path(const std::string& src, const std::string& dst)
+{
+	uint32_t index = find_path(src);
+	if( index == FE_SNAPSHOT_NONE )
+		return;
+
+	std::string dir;
+	const char* name;
+	uint32_t length;
+	uint32_t parent = split_path(dst, dir, &name, &length) ? find_path(dir) : FE_SNAPSHOT_NONE;
+	if( parent == FE_SNAPSHOT_NONE || m_Entries[index].m_Parent == FE_SNAPSHOT_NONE )
+	{
+		// Moved out of the snapshot (or it's a root)
+		remove(index);
+		return;
+	}
+
+	uint32_t replaced = find(parent, name, length);
+	if( replaced == index )
+		return;
+	if( replaced != FE_SNAPSHOT_NONE )
+		remove(replaced);
+
+	unlink(index);
+	m_NamesUsed -= m_Entries[index].m_NameLength;
+	set_name(index, name, length);
+	link(index, parent);
+}
+
+void SSnapshot::clear()
+{
+	m_Entries.clear();
+	m_Names.clear();
+	m_Free.clear();
+	m_Roots.clear();
+	m_Index.clear();
+	m_Count = 0;
+	m_NamesUsed = 0;
+}
+
+static uint32_t get_type_flags(uint32_t mode)
+{
+	return fe_snapshot_is_dir(mode) ? FE_IS_DIR : FE_IS_FILE;
+}
+
+// Reports the entry, and everything inside it, as removed
+static void add_removed(const SSnapshot* snapshot, uint32_t index, HFESWatchID watchid, SEventBatch* batch, std::string& path, std::vector<uint32_t>& stack)
+{
+	stack.push_back(index);
+	while( !stack.empty() )
+	{
+		uint32_t i = stack.back();
+		stack.pop_back();
+		const SSnapshot::SEntry& entry = snapshot->m_Entries[i];
+		snapshot->get_path(i, path);
+		fe_batch_add(batch, watchid, FE_REMOVED | get_type_flags(entry.m_Info.m_Mode), path.c_str());
+		for( uint32_t child = entry.m_FirstChild; child != FE_SNAPSHOT_NONE; child = snapshot->m_Entries[child].m_NextSibling )
+			stack.push_back(child);
+	}
+}
+
+void fe_snapshot_diff(SSnapshot* snapshot, uint32_t root, const SSnapshot* scan, uint32_t scanroot, bool recursive, HFESWatchID watchid, SEventBatch* batch)
+{
+	const uint32_t generation = ++snapshot->m_Generation;
+	std::string path;
+	std::vector<uint32_t> removed;
+
+	// Walks the scan, and looks up each of its entries in the snapshot (the parent is always looked up before its children)
+	struct SPair
+	{
+		uint32_t m_Scan;
+		uint32_t m_Snapshot;
+	};
+	std::vector<SPair> stack;
+	SPair first = { scanroot, root };
+	stack.push_back(first);
+	snapshot->m_Entries[root].m_Info.m_Generation = generation;
+
+	while( !stack.empty() )
+	{
+		SPair pair = stack.back();
+		stack.pop_back();
+
+		const SSnapshot::SEntry& dir = scan->m_Entries[pair.m_Scan];
+		for( uint32_t child = dir.m_FirstChild; child != FE_SNAPSHOT_NONE; child = scan->m_Entries[child].m_NextSibling )
+		{
+			const SSnapshot::SEntry& entry = scan->m_Entries[child];
+			const SSnapshotInfo& info = entry.m_Info;
+			const char* name = &scan->m_Names[entry.m_Name];
+
+			uint32_t index = snapshot->find(pair.m_Snapshot, name, entry.m_NameLength);
+			if( index != FE_SNAPSHOT_NONE )
+			{
+				const SSnapshotInfo& old = snapshot->m_Entries[index].m_Info;
+				if( old.m_Inode != info.m_Inode || (old.m_Mode & 0170000) != (info.m_Mode & 0170000) )
+				{
+					// Replaced by something else
+					if( batch )
+						add_removed(snapshot, index, watchid, batch, path, removed);
+					snapshot->remove(index);
+					index = FE_SNAPSHOT_NONE;
+				}
+				else if( batch && (old.m_MTime != info.m_MTime || old.m_Size != info.m_Size) )
+				{
+					scan->get_path(child, path);
+					fe_batch_add(batch, watchid, FE_MODIFIED | get_type_flags(info.m_Mode), path.c_str());
+				}
+			}
+
+			if( index == FE_SNAPSHOT_NONE && batch )
+			{
+				scan->get_path(child, path);
+				fe_batch_add(batch, watchid, FE_CREATED | get_type_flags(info.m_Mode), path.c_str());
+			}
+
+			index = snapshot->add(pair.m_Snapshot, name, entry.m_NameLength, info);
+			snapshot->m_Entries[index].m_Info.m_Generation = generation;
+
+			if( recursive && entry.m_FirstChild != FE_SNAPSHOT_NONE )
+			{
+				SPair next = { child, index };
+				stack.push_back(next);
+			}
+		}
+	}
+
+	// Whatever wasn't found is gone
+	std::vector<uint32_t> gone;
+	std::vector<uint32_t> dirs;
+	dirs.push_back(root);
+	while( !dirs.empty() )
+	{
+		uint32_t i = dirs.back();
+		dirs.pop_back();
+		for( uint32_t child = snapshot->m_Entries[i].m_FirstChild; child != FE_SNAPSHOT_NONE; child = snapshot->m_Entries[child].m_NextSibling )
+		{
+			if( snapshot->m_Entries[child].m_Info.m_Generation != generation )
+				gone.push_back(child);
+			else if( recursive )
+				dirs.push_back(child);
+		}
+	}
+
+	for( uint32_t index : gone )
+	{
+		if( batch )
+			add_removed(snapshot, index, watchid, batch, path, removed);
+		snapshot->remove(index);
+	}
+}
+
+#define FE_JOURNAL_MAGIC	0x314A4546	// "FEJ1"
+#define FE_JOURNAL_VERSION	1
+
+struct SJournalHeader
+{
+	uint32_t 	m_Magic;
+	uint32_t 	m_Version;
+	uint32_t 	m_NumEntries;
+	uint32_t 	m_NamesSize;
+	uint32_t 	m_Hash;		// Of everything after the header
+	uint32_t 	_pad;
+};
+
+struct SJournalEntry
+{
+	SSnapshotInfo 	m_Info;
+	uint32_t 		m_Parent;		// The index of the parent in the journal, FE_SNAPSHOT_NONE for a root
+	uint32_t 		m_NameLength;
+};
+
+#if !defined(_WIN32)
+
+bool fe_snapshot_save(const SSnapshot* snapshot, const char* path)
+{
+	const size_t size = sizeof(SJournalHeader) + snapshot->m_Count * sizeof(SJournalEntry) + snapshot->m_NamesUsed;
+	std::string tmppath = std::string(path) + ".tmp";
+	int fd = open(tmppath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if( fd < 0 )
+	{
+		fprintf(stderr, "Failed to create journal '%s': %s\n", tmppath.c_str(), strerror(errno));
+		return false;
+	}
+	if( ftruncate(fd, (off_t)size) != 0 )
+	{
+		fprintf(stderr, "Failed to resize journal '%s': %s\n", tmppath.c_str(), strerror(errno));
+		close(fd);
+		unlink(tmppath.c_str());
+		return false;
+	}
+	uint8_t* data = (uint8_t*)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if( data == MAP_FAILED )
+	{
+		fprintf(stderr, "Failed to map journal '%s': %s\n", tmppath.c_str(), strerror(errno));
+		close(fd);
+		unlink(tmppath.c_str());
+		return false;
+	}
+
+	SJournalEntry* entries = (SJournalEntry*)(data + sizeof(SJournalHeader));
+	char* names = (char*)(entries + snapshot->m_Count);
+	uint32_t count = 0;
+	uint32_t namesize = 0;
+
+	// Depth first, so that each parent is written before its children
+	std::vector<std::pair<uint32_t, uint32_t> > stack; // (entry, parent in the journal)
+	for( uint32_t root : snapshot->m_Roots )
+		stack.push_back(std::make_pair(root, (uint32_t)FE_SNAPSHOT_NONE));
+	while( !stack.empty() )
+	{
+		std::pair<uint32_t, uint32_t> item = stack.back();
+		stack.pop_back();
+
+		const SSnapshot::SEntry& entry = snapshot->m_Entries[item.first];
+		SJournalEntry& out = entries[count];
+		out.m_Info = entry.m_Info;
+		out.m_Info.m_Generation = 0;
+		out.m_Parent = item.second;
+		out.m_NameLength = entry.m_NameLength;
+		memcpy(names + namesize, &snapshot->m_Names[entry.m_Name], entry.m_NameLength);
+		namesize += entry.m_NameLength;
+
+		for( uint32_t child = entry.m_FirstChild; child != FE_SNAPSHOT_NONE; child = snapshot->m_Entries[child].m_NextSibling )
+			stack.push_back(std::make_pair(child, count));
+		count++;
+	}
+
+	SJournalHeader* header = (SJournalHeader*)data;
+	header->m_Magic = FE_JOURNAL_MAGIC;
+	header->m_Version = FE_JOURNAL_VERSION;
+	header->m_NumEntries = count;
+	header->m_NamesSize = namesize;
+	header->m_Hash = fe_hash_string((const char*)entries, size - sizeof(SJournalHeader));
+	header->_pad = 0;
+
+	bool ok = msync(data, size, MS_SYNC) == 0;
+	munmap(data, size);
+	close(fd);
+	if( ok )
+		ok = rename(tmppath.c_str(), path) == 0;
+	if( !ok )
+	{
+		fprintf(stderr, "Failed to write journal '%s': %s\n", path, strerror(errno));
+		unlink(tmppath.c_str());
+	}
+	return ok;
+}
+
+bool fe_snapshot_load(SSnapshot* snapshot, const char* path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if( fd < 0 )
+		return false; // It's created by the first fe_close()
+
+	struct stat st;
+	if( fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SJournalHeader) )
+	{
+		fprintf(stderr, "Invalid journal '%s'\n", path);
+		close(fd);
+		return false;
+	}
+	const size_t size = (size_t)st.st_size;
+	const uint8_t* data = (const uint8_t*)mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if( data == MAP_FAILED )
+	{
+		fprintf(stderr, "Failed to map journal '%s': %s\n", path, strerror(errno));
+		return false;
+	}
+
+	const SJournalHeader* header = (const SJournalHeader*)data;
+	const SJournalEntry* entries = (const SJournalEntry*)(data + sizeof(SJournalHeader));
+	if( header->m_Magic != FE_JOURNAL_MAGIC || header->m_Version != FE_JOURNAL_VERSION ||
+		size != sizeof(SJournalHeader) + (size_t)header->m_NumEntries * sizeof(SJournalEntry) + header->m_NamesSize ||
+		header->m_Hash != fe_hash_string((const char*)entries, size - sizeof(SJournalHeader)) )
+	{
+		fprintf(stderr, "Invalid journal '%s'\n", path);
+		munmap((void*)data, size);
+		return false;
+	}
+
+	// Maps the journal entries to the snapshot entries
+	std::vector<uint32_t> indices(header->m_NumEntries, FE_SNAPSHOT_NONE);
+	const char* names = (const char*)(entries + header->m_NumEntries);
+	uint32_t nameoffset = 0;
+	bool ok = true;
+	for( uint32_t i = 0; i < header->m_NumEntries; ++i )
+	{
+		const SJournalEntry& entry = entries[i];
+		if( entry.m_NameLength > header->m_NamesSize - nameoffset || (entry.m_Parent != FE_SNAPSHOT_NONE && entry.m_Parent >= i) )
+		{
+			ok = false;
+			break;
+		}
+		const char* name = names + nameoffset;
+		nameoffset += entry.m_NameLength;
+
+		if( entry.m_Parent == FE_SNAPSHOT_NONE )
+			indices[i] = snapshot->add_root(std::string(name, entry.m_NameLength), entry.m_Info);
+		else
+			indices[i] = snapshot->add(indices[entry.m_Parent], name, entry.m_NameLength, entry.m_Info);
+	}
+	munmap((void*)data, size);
+
+	if( !ok )
+	{
+		fprintf(stderr, "Invalid journal '%s'\n", path);
+		snapshot->clear();
+	}
+	return ok;
+}
+
+#else
+
+bool fe_snapshot_save(const SSnapshot*, const char* path)
+{
+	fprintf(stderr, "Journals aren't supported on this platform: '%s'\n", path);
+	return false;
+}
+
+bool fe_snapshot_load(SSnapshot*, const char* path)
+{
+	fprintf(stderr, "Journals aren't supported on this platform: '%s'\n", path);
+	return false;
+}
+
+#endif
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "fileevents.h"
+#include "fileevents_hash.h"
+
+struct SEventBatch;
+
+#define FE_SNAPSHOT_NONE	0xFFFFFFFF
+
+// The state of a file, as given by lstat()
+struct SSnapshotInfo
+{
+	uint64_t 	m_Inode;
+	int64_t 	m_MTime;	// ns
+	int64_t 	m_Size;
+	uint32_t 	m_Mode;		// st_mode. 0 means the entry is unused.
+	uint32_t 	m_Generation;	// Used by fe_snapshot_diff()
+};
+
+/** A snapshot of one or more directory trees.
+ *
+ * The entries are kept in a flat array, and each entry links to its parent, its first child and its siblings (a path trie),
+ * so only the name of an entry is stored, and moving a directory only touches one entry. The roots hold their full path.
+ * A hash index maps (parent, name) to the entry.
+ *
+ * An entry is 56 bytes, plus its name and its slot in the index (8 bytes, at a load factor of at most 0.75)
+ */
+struct SSnapshot
+{
+	struct SEntry
+	{
+		SSnapshotInfo 	m_Info;
+		uint32_t 		m_Parent;		// FE_SNAPSHOT_NONE for a root
+		uint32_t 		m_FirstChild;
+		uint32_t 		m_NextSibling;
+		uint32_t 		m_PrevSibling;
+		uint32_t 		m_Name;			// The offset of the name in m_Names
+		uint32_t 		m_NameLength;
+	};
+
+	std::vector<SEntry> 	m_Entries;
+	std::vector<char> 		m_Names;
+	std::vector<uint32_t> 	m_Free;		// The unused entries
+	std::vector<uint32_t> 	m_Roots;
+	SHashIndex 				m_Index;	// (parent, name) -> entry (except for the roots)
+	uint32_t 				m_Count;	// The number of entries in use
+	uint32_t 				m_NamesUsed;	// The number of bytes in m_Names that are in use
+	uint32_t 				m_Generation;
+	uint32_t 				_pad;
+
+	SSnapshot() : m_Count(0), m_NamesUsed(0), m_Generation(0), _pad(0) {}
+
+	// Adds a root, or updates it if the path is already in the snapshot. Returns the entry.
+	uint32_t add_root(const std::string& path, const SSnapshotInfo& info);
+	// Adds an entry to a directory, or updates it if it already exists. Returns the entry.
+	uint32_t add(uint32_t parent, const char* name, uint32_t length, const SSnapshotInfo& info);
+	// Removes an entry, and everything inside it
+	void remove(uint32_t index);
+
+	uint32_t find(uint32_t parent, const char* name, uint32_t length) const;
+	// Returns FE_SNAPSHOT_NONE if the path isn't in the snapshot
+	uint32_t find_path(const std::string& path) const;
+	void get_path(uint32_t index, std::string& out) const;
+
+	// Updates the entry of the path, or adds it if its directory is in the snapshot
+	void set_path(const std::string& path, const SSnapshotInfo& info);
+	void remove_path(const std::string& path);
+	// Moves the entry (and everything inside it) to a new path
+	void move_path(const std::string& src, const std::string& dst);
+
+	void clear();
+
+private:
+	uint32_t alloc_entry();
+	void set_name(uint32_t index, const char* name, uint32_t length);
+	void link(uint32_t index, uint32_t parent);
+	void unlink(uint32_t index);
+	void compact_names();
+};
+
+static inline bool fe_snapshot_is_dir(uint32_t mode)
+{
+	return (mode & 0170000) == 0040000;
+}
+
+/** Compares the tree at 'scanroot' in a fresh scan with the tree at 'root' in the snapshot, adds the differences
+ * to the batch (if it's set) as events, and updates the snapshot to match the scan.
+ * It's linear in the size of the two trees (one hash lookup per entry in the scan).
+ *
+ * @param recursive	If false, only the entries directly inside the root are compared
+ */
+void fe_snapshot_diff(SSnapshot* snapshot, uint32_t root, const SSnapshot* scan, uint32_t scanroot, bool recursive, HFESWatchID watchid, SEventBatch* batch);
+
+/** Writes the snapshot to a journal file. The file is written next to the old one, and then renamed, so
+ * a crash never leaves a half written journal behind.
+ *
+ * The format is a header, the entries (parents before children) and then their names.
+ */
+bool fe_snapshot_save(const SSnapshot* snapshot, const char* path);
+
+/** Adds the entries in a journal file to the snapshot. Returns false if there is no journal, or if it's invalid.
+ */
+bool fe_snapshot_load(SSnapshot* snapshot, const char* path);
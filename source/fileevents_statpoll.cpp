@@ -0,0 +1,510 @@
+#include <mutex>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+
+#include "fileevents.h"
+#include "fileevents_internal.h"
+#include "fileevents_statpoll.h"
+#include "fileevents_snapshot.h"
+#include "fileevents_pathtree.h"
+#include "fileevents_filter.h"
+
+#define STATPOLL_DEFAULT_INTERVAL_MS		500
+#define STATPOLL_DEFAULT_STATS_PER_SECOND	20000
+// A directory that hasn't changed for a while is polled up to this many times less often
+#define STATPOLL_MAX_BACKOFF				64u
+// The most entries stat'ed while holding the lock, before the events are sent and the other file descriptors are serviced
+#define STATPOLL_PASS_ENTRIES				1024
+
+// The file systems that don't report the changes made by other machines (the magic numbers from statfs())
+static const uint32_t s_PolledFileSystems[] =
+{
+	0x00006969,	// NFS
+	0x0000517B,	// SMB
+	0xFF534D42,	// CIFS
+	0xFE534D42,	// SMB2
+	0x65735546,	// FUSE
+	0x01021997,	// 9P
+	0x00C36400,	// Ceph
+	0x73757245,	// Coda
+	0x5346414F,	// AFS
+	0x6B414653,	// AFS (kAFS)
+	0x47504653,	// GPFS
+	0x0BD00BD0,	// Lustre
+};
+
+// A polled watch, with what its tree looked like at the last scan of each directory
+struct SStatPollWatch
+{
+	std::string 		m_Root;
+	SSnapshot 			m_Tree;
+	const SFileFilter* 	m_Filter;	// Owned by the watch
+	HFESWatchID 		m_ID;
+	uint32_t 			m_Mask;
+	uint32_t 			_pad;
+};
+
+// A directory of a polled watch (the root, or any of its sub directories if the watch is recursive)
+struct SStatPollDir
+{
+	HFESWatchID m_WatchID;
+	uint64_t 	m_Inode;		// The directory that was found (0 for the root). If the path is replaced, the new directory gets a new entry.
+	uint32_t 	m_Path;			// A node in SFileEventSystem::m_WatchPaths, FE_PATH_NONE if the entry is unused
+	uint32_t 	m_Interval;		// The time between two scans (ms)
+	uint32_t 	m_Generation;	// Bumped when the entry is freed, so that its old place in the queue is ignored
+	bool 		m_Initial;		// Not listed yet by the first pass of the watch (its scan only fills in the tree, and sends nothing)
+	bool 		_padding[3];
+};
+
+// When a directory is scanned next
+struct SStatPollDue
+{
+	uint64_t 	m_Due;	// ms
+	uint32_t 	m_Dir;
+	uint32_t 	m_Generation;
+};
+
+struct SStatPollData
+{
+	std::map<HFESWatchID, SStatPollWatch> m_Watches;
+
+	// The directories, and a heap of them, ordered by when they're due
+	std::vector<SStatPollDir> 	m_Dirs;
+	std::vector<uint32_t> 		m_FreeDirs;
+	std::vector<SStatPollDue> 	m_Queue;
+	SPathTree* 					m_Paths;	// SFileEventSystem::m_WatchPaths
+
+	// Scanning costs one credit per entry. The credits are refilled at m_StatsPerSecond (up to one second's worth),
+	// and a scan may leave the balance negative, and then nothing is scanned until it's paid back.
+	int64_t 	m_Credit;
+	uint64_t 	m_RefillTime;	// ms
+	uint32_t 	m_IntervalMs;
+	uint32_t 	m_StatsPerSecond;
+
+	// Scratch space for the scans
+	SSnapshot 	m_Scan;
+	SEventBatch m_Changes;	// The differences found by a scan, before the mask of the watch is applied
+	SEventBatch m_Batch;	// The events to send
+	std::vector<std::pair<std::string, uint64_t> > m_NewDirs;	// The sub directories found by a scan (and their inodes)
+	std::string m_Path;
+	std::string m_Child;
+};
+
+static void set_info(SSnapshotInfo& info, const struct stat& st)
+{
+	info.m_Inode = (uint64_t)st.st_ino;
+	info.m_Mode = (uint32_t)st.st_mode;
+	info.m_Generation = 0;
+	// A directory's time and size change with its entries, which are compared one by one instead
+	bool isdir = S_ISDIR(st.st_mode);
+	info.m_MTime = isdir ? 0 : (int64_t)st.st_mtim.tv_sec * 1000000000 + (int64_t)st.st_mtim.tv_nsec;
+	info.m_Size = isdir ? 0 : (int64_t)st.st_size;
+}
+
+static uint32_t type_flags(uint32_t mode)
+{
+	return fe_snapshot_is_dir(mode) ? FE_IS_DIR : FE_IS_FILE;
+}
+
+// The queue is a heap, with the earliest directory first
+static bool is_later(const SStatPollDue& a, const SStatPollDue& b)
+{
+	return a.m_Due > b.m_Due;
+}
+
+static void schedule_dir(SStatPollData* data, uint32_t index, uint64_t due)
+{
+	SStatPollDue item;
+	item.m_Due = due;
+	item.m_Dir = index;
+	item.m_Generation = data->m_Dirs[index].m_Generation;
+	data->m_Queue.push_back(item);
+	std::push_heap(data->m_Queue.begin(), data->m_Queue.end(), is_later);
+}
+
+static void add_dir(SStatPollData* data, HFESWatchID watchid, const std::string& path, uint64_t inode, uint64_t due, bool initial)
+{
+	uint32_t index;
+	if( !data->m_FreeDirs.empty() )
+	{
+		index = data->m_FreeDirs.back();
+		data->m_FreeDirs.pop_back();
+	}
+	else
+	{
+		index = (uint32_t)data->m_Dirs.size();
+		data->m_Dirs.push_back(SStatPollDir());
+		data->m_Dirs.back().m_Generation = 0;
+		memset(data->m_Dirs.back()._padding, 0, sizeof(data->m_Dirs.back()._padding));
+	}
+	SStatPollDir& dir = data->m_Dirs[index];
+	dir.m_WatchID = watchid;
+	dir.m_Inode = inode;
+	dir.m_Path = data->m_Paths->intern(path);
+	dir.m_Interval = data->m_IntervalMs;
+	dir.m_Initial = initial;
+	schedule_dir(data, index, due);
+}
+
+static void free_dir(SStatPollData* data, uint32_t index)
+{
+	SStatPollDir& dir = data->m_Dirs[index];
+	data->m_Paths->release(dir.m_Path);
+	dir.m_Path = FE_PATH_NONE;
+	dir.m_Generation++;
+	data->m_FreeDirs.push_back(index);
+}
+
+// Is the entry wanted by the patterns of the watch? The directory is the full path.
+static bool is_wanted(const SStatPollWatch& watch, const std::string& dir, const char* name, uint32_t namelength, bool isdir)
+{
+	if( !watch.m_Filter )
+		return true;
+	size_t offset = dir.size();
+	if( dir.size() > watch.m_Root.size() )
+		offset = watch.m_Root.size() + (dir[watch.m_Root.size()] == '/' ? 1 : 0);
+	return fe_filter_match(watch.m_Filter, dir.c_str() + offset, (uint32_t)(dir.size() - offset), name, namelength, isdir);
+}
+
+// The root of a watch: is it still there, and has it changed? Returns its entry in the tree, or FE_SNAPSHOT_NONE if it's gone.
+static uint32_t scan_root(SStatPollWatch& watch, SEventBatch* changes)
+{
+	SSnapshot& tree = watch.m_Tree;
+	uint32_t index = tree.find_path(watch.m_Root);
+
+	struct stat st;
+	if( stat(watch.m_Root.c_str(), &st) != 0 )
+	{
+		if( index != FE_SNAPSHOT_NONE )
+		{
+			if( changes )
+				fe_batch_add(changes, watch.m_ID, FE_REMOVED | type_flags(tree.m_Entries[index].m_Info.m_Mode), watch.m_Root.c_str());
+			tree.remove(index);
+		}
+		return FE_SNAPSHOT_NONE;
+	}
+
+	SSnapshotInfo info;
+	set_info(info, st);
+	if( index != FE_SNAPSHOT_NONE )
+	{
+		const SSnapshotInfo& old = tree.m_Entries[index].m_Info;
+		if( (old.m_Mode & 0170000) != (info.m_Mode & 0170000) )
+		{
+			// Replaced by something else (a file by a directory, or the other way around)
+			if( changes )
+				fe_batch_add(changes, watch.m_ID, FE_REMOVED | type_flags(old.m_Mode), watch.m_Root.c_str());
+			tree.remove(index);
+			index = FE_SNAPSHOT_NONE;
+		}
+		else if( changes && (old.m_Inode != info.m_Inode || old.m_MTime != info.m_MTime || old.m_Size != info.m_Size) && !S_ISDIR(st.st_mode) )
+		{
+			fe_batch_add(changes, watch.m_ID, FE_MODIFIED | FE_IS_FILE, watch.m_Root.c_str());
+		}
+	}
+	if( index == FE_SNAPSHOT_NONE && changes )
+		fe_batch_add(changes, watch.m_ID, FE_CREATED | type_flags(info.m_Mode), watch.m_Root.c_str());
+	return tree.add_root(watch.m_Root, info);
+}
+
+/** Lists a directory of a watch (and stats its entries), and compares it with the tree. The differences are added to
+ * changes (if it's set), and the sub directories that weren't in the tree are added to m_NewDirs.
+ * Returns the number of entries that were stat'ed, including the directory itself.
+ *
+ * @param inode		The directory that's expected at the path (0 for the root of the watch)
+ * @param stale		Set if the directory isn't in the tree any more (it was removed or replaced, and the scan of its parent saw it)
+ */
+static uint32_t scan_dir(SStatPollData* data, SStatPollWatch& watch, const std::string& path, uint64_t inode, SEventBatch* changes, bool* stale)
+{
+	SSnapshot& tree = watch.m_Tree;
+	uint32_t index;
+	if( inode == 0 )
+	{
+		index = scan_root(watch, changes);
+		if( index == FE_SNAPSHOT_NONE || !fe_snapshot_is_dir(tree.m_Entries[index].m_Info.m_Mode) )
+			return 1;
+	}
+	else
+	{
+		index = tree.find_path(path);
+		if( index == FE_SNAPSHOT_NONE || tree.m_Entries[index].m_Info.m_Inode != inode )
+		{
+			*stale = true;
+			return 0;
+		}
+	}
+
+	// If it can't be listed, it's about to go away (and its parent will see that)
+	DIR* dir = opendir(path.c_str());
+	if( !dir )
+		return 1;
+
+	SSnapshot& scan = data->m_Scan;
+	scan.clear();
+	uint32_t scanroot = scan.add_root(path, tree.m_Entries[index].m_Info);
+	bool recursive = (watch.m_Mask & FE_RECURSIVE) != 0;
+	uint32_t count = 1;
+
+	struct dirent* entry;
+	while( (entry = readdir(dir)) != 0 )
+	{
+		const char* name = entry->d_name;
+		if( name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)) )
+			continue;
+		uint32_t namelength = (uint32_t)strlen(name);
+
+		// The patterns are checked before the stat, if the type is known
+		bool known = entry->d_type != DT_UNKNOWN;
+		if( known && !is_wanted(watch, path, name, namelength, entry->d_type == DT_DIR) )
+			continue;
+
+		struct stat st;
+		if( fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0 )
+			continue;
+		++count;
+		bool isdir = S_ISDIR(st.st_mode);
+		if( !known && !is_wanted(watch, path, name, namelength, isdir) )
+			continue;
+
+		SSnapshotInfo info;
+		set_info(info, st);
+		scan.add(scanroot, name, namelength, info);
+
+		if( recursive && isdir )
+		{
+			uint32_t old = tree.find(index, name, namelength);
+			if( old == FE_SNAPSHOT_NONE || tree.m_Entries[old].m_Info.m_Inode != info.m_Inode || !fe_snapshot_is_dir(tree.m_Entries[old].m_Info.m_Mode) )
+			{
+				data->m_Child = path;
+				if( data->m_Child[data->m_Child.size()-1] != '/' )
+					data->m_Child += '/';
+				data->m_Child.append(name, namelength);
+				data->m_NewDirs.push_back(std::make_pair(data->m_Child, info.m_Inode));
+			}
+		}
+	}
+	closedir(dir);
+
+	fe_snapshot_diff(&tree, index, &scan, scanroot, false, watch.m_ID, changes);
+	return count;
+}
+
+// Moves the changes to the batch, keeping the ones the watch asked for. Returns the number of events that were dropped.
+static uint32_t apply_mask(SStatPollData* data, const SStatPollWatch& watch)
+{
+	uint32_t dropped = 0;
+	for( const SFileEvent& event : data->m_Changes.m_Events )
+	{
+		uint32_t types = event.m_Flags & watch.m_Mask & FE_EVENT_TYPES;
+		if( types )
+			fe_batch_add(&data->m_Batch, watch.m_ID, types | (event.m_Flags & ~(uint32_t)FE_EVENT_TYPES), &data->m_Changes.m_Strings[event.m_PathOffset]);
+		else
+			++dropped;
+	}
+	fe_batch_clear(&data->m_Changes);
+	return dropped;
+}
+
+static void refill_credit(SStatPollData* data, uint64_t now)
+{
+	uint64_t added = (now - data->m_RefillTime) * data->m_StatsPerSecond / 1000;
+	if( added == 0 )
+		return;
+	data->m_RefillTime = now;
+	data->m_Credit = std::min(data->m_Credit + (int64_t)added, (int64_t)data->m_StatsPerSecond);
+}
+
+SStatPollData* fe_statpoll_init(const SFileEventSystem* hfes)
+{
+	SStatPollData* data = new SStatPollData;
+	data->m_Paths = &const_cast<SFileEventSystem*>(hfes)->m_WatchPaths;
+	data->m_IntervalMs = hfes->m_PollIntervalMs ? hfes->m_PollIntervalMs : STATPOLL_DEFAULT_INTERVAL_MS;
+	data->m_StatsPerSecond = hfes->m_PollStatsPerSecond ? hfes->m_PollStatsPerSecond : STATPOLL_DEFAULT_STATS_PER_SECOND;
+	data->m_Credit = data->m_StatsPerSecond;
+	data->m_RefillTime = fe_get_time_ms();
+	return data;
+}
+
+void fe_statpoll_close(SStatPollData* data)
+{
+	delete data;
+}
+
+bool fe_statpoll_is_needed(const char* path)
+{
+	struct statfs st;
+	if( statfs(path, &st) != 0 )
+		return false;
+	for( uint32_t type : s_PolledFileSystems )
+	{
+		if( (uint32_t)st.f_type == type )
+			return true;
+	}
+	return false;
+}
+
+int fe_statpoll_add_watch(SStatPollData* data, HFESWatchID watchid, const char* path, uint32_t mask, const SFileFilter* filter)
+{
+	std::string root(path);
+	while( root.size() > 1 && root[root.size()-1] == '/' )
+		root.erase(root.size()-1);
+
+	struct stat st;
+	if( stat(root.c_str(), &st) != 0 )
+	{
+		fprintf(stderr, "stat failed for '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	SStatPollWatch& watch = data->m_Watches[watchid];
+	watch.m_Root = root;
+	watch.m_Filter = filter;
+	watch.m_ID = watchid;
+	watch.m_Mask = mask;
+	watch._pad = 0;
+
+	// The tree is listed by fe_statpoll_service(), within the budget, by a first pass that sends nothing.
+	// The later polls only report what changed.
+	add_dir(data, watchid, root, 0, fe_get_time_ms(), true);
+	return 0;
+}
+
+// Drops the directories of the watch, and their places in the queue
+static void free_dirs(SStatPollData* data, HFESWatchID watchid)
+{
+	for( uint32_t i = 0; i < (uint32_t)data->m_Dirs.size(); ++i )
+	{
+		if( data->m_Dirs[i].m_Path != FE_PATH_NONE && data->m_Dirs[i].m_WatchID == watchid )
+			free_dir(data, i);
+	}
+
+	// The queue is rebuilt without the directories of the watch
+	size_t kept = 0;
+	for( const SStatPollDue& item : data->m_Queue )
+	{
+		if( item.m_Generation == data->m_Dirs[item.m_Dir].m_Generation )
+			data->m_Queue[kept++] = item;
+	}
+	data->m_Queue.resize(kept);
+	std::make_heap(data->m_Queue.begin(), data->m_Queue.end(), is_later);
+}
+
+bool fe_statpoll_update_watch(SStatPollData* data, HFESWatchID watchid, uint32_t mask)
+{
+	std::map<HFESWatchID, SStatPollWatch>::iterator it = data->m_Watches.find(watchid);
+	if( it == data->m_Watches.end() )
+		return false;
+	SStatPollWatch& watch = it->second;
+	bool recursive = ((mask ^ watch.m_Mask) & FE_RECURSIVE) != 0;
+	watch.m_Mask = mask;
+
+	// Made recursive, or not recursive: the tree is listed again by a first pass, as when the watch was added
+	if( recursive )
+	{
+		free_dirs(data, watchid);
+		watch.m_Tree.clear();
+		add_dir(data, watchid, watch.m_Root, 0, fe_get_time_ms(), true);
+	}
+	return true;
+}
+
+bool fe_statpoll_remove_watch(SStatPollData* data, HFESWatchID watchid)
+{
+	std::map<HFESWatchID, SStatPollWatch>::iterator it = data->m_Watches.find(watchid);
+	if( it == data->m_Watches.end() )
+		return false;
+	data->m_Watches.erase(it);
+	free_dirs(data, watchid);
+	return true;
+}
+
+int fe_statpoll_service(SFileEventSystem* hfes, SStatPollData* data)
+{
+	int timeout = -1;
+	{
+		std::lock_guard<std::mutex> lock(hfes->m_Lock);
+		if( data->m_Queue.empty() )
+			return -1;
+
+		uint64_t now = fe_get_time_ms();
+		refill_credit(data, now);
+
+		uint32_t scanned = 0;
+		while( !data->m_Queue.empty() && data->m_Queue.front().m_Due <= now && data->m_Credit > 0 && scanned < STATPOLL_PASS_ENTRIES )
+		{
+			SStatPollDue item = data->m_Queue.front();
+			std::pop_heap(data->m_Queue.begin(), data->m_Queue.end(), is_later);
+			data->m_Queue.pop_back();
+
+			const SStatPollDir& dir = data->m_Dirs[item.m_Dir];
+			if( dir.m_Path == FE_PATH_NONE || dir.m_Generation != item.m_Generation )
+				continue;
+			std::map<HFESWatchID, SStatPollWatch>::iterator it = data->m_Watches.find(dir.m_WatchID);
+			if( it == data->m_Watches.end() )
+			{
+				free_dir(data, item.m_Dir);
+				continue;
+			}
+			SStatPollWatch& watch = it->second;
+
+			data->m_Paths->get_path(dir.m_Path, data->m_Path);
+			data->m_NewDirs.clear();
+			bool initial = dir.m_Initial;
+			bool stale = false;
+			uint32_t count = scan_dir(data, watch, data->m_Path, dir.m_Inode, initial ? 0 : &data->m_Changes, &stale);
+			if( stale )
+			{
+				free_dir(data, item.m_Dir);
+				continue;
+			}
+			scanned += count;
+			data->m_Credit -= count;
+
+			bool changed = !data->m_Changes.m_Events.empty();
+			fe_stats_add(hfes->m_Stats.m_EventsRead, data->m_Changes.m_Events.size());
+			fe_stats_add(hfes->m_Stats.m_EventsFiltered, apply_mask(data, watch));
+
+			// The new directories are scanned right away, so that what's already in them is reported too
+			// (or, during the first pass, so that the rest of the tree is listed)
+			for( const std::pair<std::string, uint64_t>& newdir : data->m_NewDirs )
+				add_dir(data, watch.m_ID, newdir.first, newdir.second, now, initial);
+
+			// A directory that changed is polled often, and one that didn't backs off
+			SStatPollDir& polled = data->m_Dirs[item.m_Dir];
+			if( initial )
+				polled.m_Initial = false;
+			else
+				polled.m_Interval = changed ? data->m_IntervalMs : std::min(polled.m_Interval * 2, data->m_IntervalMs * STATPOLL_MAX_BACKOFF);
+			schedule_dir(data, item.m_Dir, now + polled.m_Interval);
+		}
+
+		if( !data->m_Queue.empty() )
+		{
+			uint64_t due = data->m_Queue.front().m_Due;
+			if( due > now )
+				timeout = (int)std::min(due - now, (uint64_t)INT_MAX);
+			else if( data->m_Credit <= 0 )
+				timeout = (int)(((uint64_t)-data->m_Credit * 1000) / data->m_StatsPerSecond + 1);
+			else
+				timeout = 0;
+		}
+	}
+
+	// The callbacks are called without holding the lock, so that they may add/remove watches
+	if( !data->m_Batch.m_Events.empty() )
+	{
+		fe_dispatch(hfes, &data->m_Batch);
+		fe_batch_clear(&data->m_Batch);
+	}
+	return timeout;
+}
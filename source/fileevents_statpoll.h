@@ -0,0 +1,28 @@
+#pragma once
+
+#include "fileevents.h"
+
+struct SFileEventSystem;
+struct SStatPollData;
+struct SFileFilter;
+
+/** The polling backend, for the file systems where inotify only sees the changes made by this machine
+ * (NFS, SMB, FUSE...). Each directory is listed and stat'ed on its own schedule, and compared with a snapshot.
+ * It's driven by the Linux backend, from the same thread as the inotify events (see fe_statpoll_service()).
+ */
+
+SStatPollData* fe_statpoll_init(const SFileEventSystem* hfes);
+void fe_statpoll_close(SStatPollData* data);
+
+// Is the path on a file system that has to be polled? (decided by the file system type, from statfs())
+bool fe_statpoll_is_needed(const char* path);
+
+// The calls below are made while holding hfes->m_Lock. The filter is owned by the watch, and outlives it.
+int fe_statpoll_add_watch(SStatPollData* data, HFESWatchID watchid, const char* path, uint32_t mask, const SFileFilter* filter);
+// They return false if the watch isn't polled
+bool fe_statpoll_update_watch(SStatPollData* data, HFESWatchID watchid, uint32_t mask);
+bool fe_statpoll_remove_watch(SStatPollData* data, HFESWatchID watchid);
+
+// Scans the directories that are due, and dispatches the changes (it takes hfes->m_Lock itself).
+// Returns the number of milliseconds until it needs to be called again, or -1 if nothing is polled.
+int fe_statpoll_service(SFileEventSystem* hfes, SStatPollData* data);
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include "fileevents_uring.h"
+
+struct SUring
+{
+	int 				m_Fd;
+	uint32_t 			m_Entries;
+
+	// The submission queue
+	uint32_t* 			m_SqHead;
+	uint32_t* 			m_SqTail;
+	uint32_t* 			m_SqArray;
+	struct io_uring_sqe* m_Sqes;
+	uint32_t 			m_SqMask;
+
+	// The completion queue
+	uint32_t 			m_CqMask;
+	uint32_t* 			m_CqHead;
+	uint32_t* 			m_CqTail;
+	struct io_uring_cqe* m_Cqes;
+
+	// The mapped memory
+	void* 				m_SqRing;
+	void* 				m_CqRing;	// The same as m_SqRing if the kernel maps them together
+	size_t 				m_SqRingSize;
+	size_t 				m_CqRingSize;
+	size_t 				m_SqesSize;
+};
+
+static int uring_setup(uint32_t entries, struct io_uring_params* params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, uint32_t tosubmit, uint32_t mincomplete, uint32_t flags, const void* arg, size_t argsize)
+{
+	int result = (int)syscall(__NR_io_uring_enter, fd, tosubmit, mincomplete, flags, arg, argsize);
+	return result < 0 ? -errno : result;
+}
+
+SUring* fe_uring_create(uint32_t entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = uring_setup(entries, &params);
+	if( fd < 0 )
+		return 0;
+
+	// The timeouts are passed to io_uring_enter() (IORING_ENTER_EXT_ARG)
+	if( !(params.features & IORING_FEAT_EXT_ARG) )
+	{
+		close(fd);
+		return 0;
+	}
+
+	SUring* ring = new SUring;
+	memset(ring, 0, sizeof(*ring));
+	ring->m_Fd = fd;
+	ring->m_Entries = params.sq_entries;
+	ring->m_SqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	ring->m_CqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if( params.features & IORING_FEAT_SINGLE_MMAP )
+	{
+		if( ring->m_CqRingSize > ring->m_SqRingSize )
+			ring->m_SqRingSize = ring->m_CqRingSize;
+		ring->m_CqRingSize = ring->m_SqRingSize;
+	}
+
+	ring->m_SqRing = mmap(0, ring->m_SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if( ring->m_SqRing == MAP_FAILED )
+	{
+		ring->m_SqRing = 0;
+		fe_uring_destroy(ring);
+		return 0;
+	}
+	ring->m_CqRing = ring->m_SqRing;
+	if( !(params.features & IORING_FEAT_SINGLE_MMAP) )
+	{
+		ring->m_CqRing = mmap(0, ring->m_CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if( ring->m_CqRing == MAP_FAILED )
+		{
+			ring->m_CqRing = 0;
+			fe_uring_destroy(ring);
+			return 0;
+		}
+	}
+	ring->m_SqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	void* sqes = mmap(0, ring->m_SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if( sqes == MAP_FAILED )
+	{
+		fe_uring_destroy(ring);
+		return 0;
+	}
+
+	char* sq = (char*)ring->m_SqRing;
+	ring->m_SqHead = (uint32_t*)(sq + params.sq_off.head);
+	ring->m_SqTail = (uint32_t*)(sq + params.sq_off.tail);
+	ring->m_SqArray = (uint32_t*)(sq + params.sq_off.array);
+	ring->m_SqMask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+	ring->m_Sqes = (struct io_uring_sqe*)sqes;
+
+	char* cq = (char*)ring->m_CqRing;
+	ring->m_CqHead = (uint32_t*)(cq + params.cq_off.head);
+	ring->m_CqTail = (uint32_t*)(cq + params.cq_off.tail);
+	ring->m_CqMask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+	ring->m_Cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	return ring;
+}
+
+void fe_uring_destroy(SUring* ring)
+{
+	if( !ring )
+		return;
+	if( ring->m_Sqes )
+		munmap(ring->m_Sqes, ring->m_SqesSize);
+	if( ring->m_CqRing && ring->m_CqRing != ring->m_SqRing )
+		munmap(ring->m_CqRing, ring->m_CqRingSize);
+	if( ring->m_SqRing )
+		munmap(ring->m_SqRing, ring->m_SqRingSize);
+	close(ring->m_Fd);
+	delete ring;
+}
+
+uint32_t fe_uring_size(const SUring* ring)
+{
+	return ring->m_Entries;
+}
+
+// The next free submission entry (cleared), or 0 if the queue is full
+static struct io_uring_sqe* get_sqe(SUring* ring)
+{
+	uint32_t tail = *ring->m_SqTail;
+	uint32_t head = __atomic_load_n(ring->m_SqHead, __ATOMIC_ACQUIRE);
+	if( tail - head >= ring->m_Entries )
+		return 0;
+	struct io_uring_sqe* sqe = &ring->m_Sqes[tail & ring->m_SqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+// Makes the entry visible to the kernel (it's picked up by the next io_uring_enter())
+static void push_sqe(SUring* ring)
+{
+	uint32_t tail = *ring->m_SqTail;
+	ring->m_SqArray[tail & ring->m_SqMask] = tail & ring->m_SqMask;
+	__atomic_store_n(ring->m_SqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+bool fe_uring_read(SUring* ring, int fd, void* buffer, uint32_t length, uint64_t userdata)
+{
+	struct io_uring_sqe* sqe = get_sqe(ring);
+	if( !sqe )
+		return false;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buffer;
+	sqe->len = length;
+	sqe->off = (uint64_t)-1;	// The current position (inotify and eventfd don't have one anyway)
+	sqe->user_data = userdata;
+	push_sqe(ring);
+	return true;
+}
+
+bool fe_uring_statx(SUring* ring, int dirfd, const char* path, int flags, uint32_t mask, struct statx* out, uint64_t userdata)
+{
+	struct io_uring_sqe* sqe = get_sqe(ring);
+	if( !sqe )
+		return false;
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dirfd;
+	sqe->addr = (uint64_t)(uintptr_t)path;
+	sqe->len = mask;
+	sqe->off = (uint64_t)(uintptr_t)out;
+	sqe->statx_flags = (uint32_t)flags;
+	sqe->user_data = userdata;
+	push_sqe(ring);
+	return true;
+}
+
+bool fe_uring_cancel(SUring* ring, uint64_t target, uint64_t userdata)
+{
+	struct io_uring_sqe* sqe = get_sqe(ring);
+	if( !sqe )
+		return false;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = userdata;
+	push_sqe(ring);
+	return true;
+}
+
+int fe_uring_submit(SUring* ring, uint32_t count, int timeoutms)
+{
+	uint32_t flags = count ? IORING_ENTER_GETEVENTS : 0;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	if( count && timeoutms >= 0 )
+	{
+		ts.tv_sec = timeoutms / 1000;
+		ts.tv_nsec = (long long)(timeoutms % 1000) * 1000000;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+		flags |= IORING_ENTER_EXT_ARG;
+	}
+
+	// The kernel consumes the whole submission queue before it waits
+	uint32_t tosubmit = *ring->m_SqTail - __atomic_load_n(ring->m_SqHead, __ATOMIC_ACQUIRE);
+	int result = uring_enter(ring->m_Fd, tosubmit, count, flags, (flags & IORING_ENTER_EXT_ARG) ? &arg : 0, (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+	if( result < 0 && result != -ETIME && result != -EINTR )
+	{
+		// The requests the kernel didn't take are dropped, since their buffers may be gone by the next call
+		__atomic_store_n(ring->m_SqTail, __atomic_load_n(ring->m_SqHead, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+	}
+	return result < 0 ? result : 0;
+}
+
+bool fe_uring_complete(SUring* ring, uint64_t* userdata, int32_t* result)
+{
+	uint32_t head = *ring->m_CqHead;
+	if( head == __atomic_load_n(ring->m_CqTail, __ATOMIC_ACQUIRE) )
+		return false;
+	const struct io_uring_cqe* cqe = &ring->m_Cqes[head & ring->m_CqMask];
+	*userdata = cqe->user_data;
+	*result = cqe->res;
+	__atomic_store_n(ring->m_CqHead, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
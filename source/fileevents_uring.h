@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+/** A minimal io_uring, on top of the raw syscalls (so there's no dependency on liburing).
+ * A ring is only used by one thread at a time.
+ */
+struct SUring;
+
+// Creates a ring with room for (at least) this many requests. Returns 0 if the kernel doesn't have io_uring,
+// or if it's too old (Linux 5.11, for the timeouts) or it's disabled (/proc/sys/kernel/io_uring_disabled)
+SUring* fe_uring_create(uint32_t entries);
+void fe_uring_destroy(SUring* ring);
+
+// The number of requests that can be queued before they're submitted
+uint32_t fe_uring_size(const SUring* ring);
+
+// Queue the requests. They return false if the submission queue is full.
+bool fe_uring_read(SUring* ring, int fd, void* buffer, uint32_t length, uint64_t userdata);
+bool fe_uring_statx(SUring* ring, int dirfd, const char* path, int flags, uint32_t mask, struct statx* out, uint64_t userdata);
+// Cancels the request with the given userdata. The request completes with -ECANCELED (unless it was already done).
+bool fe_uring_cancel(SUring* ring, uint64_t target, uint64_t userdata);
+
+// Submits the queued requests, and waits until at least count requests are done (at most timeoutms milliseconds, -1 is forever).
+// Returns 0 on success, -ETIME if it timed out, or another negative errno (and then the requests that weren't submitted are dropped).
+int fe_uring_submit(SUring* ring, uint32_t count, int timeoutms);
+
+// Takes the next completed request. Returns false if there are none.
+bool fe_uring_complete(SUring* ring, uint64_t* userdata, int32_t* result);
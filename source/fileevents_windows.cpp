@@ -39,6 +39,7 @@ struct SWatchInfo
 
 		// The filter mask that was passed in when the request was added
 		uint64_t    m_Mask;
+		HFESWatchID m_ID;
 
 		// The path to watch
 		std::string m_DirPath;
@@ -110,23 +111,26 @@ static std::string get_file_name(const std::string& path)
 	return path.substr(found == std::string::npos ? 0 : found);
 }
 
+// The changes needed for the events in the mask of a watch
+static DWORD get_notify_filter(uint64_t mask)
+{
+	DWORD filter = 0;
+	if( mask & (FE_CREATED | FE_REMOVED | FE_RENAMED) )
+		filter |= FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_FILE_NAME;
+	if( mask & FE_MODIFIED )
+		filter |= FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_LAST_ACCESS | FILE_NOTIFY_CHANGE_CREATION;
+	if( mask & FE_ATTRIBUTE )
+		filter |= FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_SECURITY;
+	return filter;
+}
+
 static bool start_request(SWatchInfo* info)
 {
 	bool result = ::ReadDirectoryChangesW(  info->m_Directory,
 											info->m_Buffer,
 											info->m_BufferSize,
 											true,
-
-											FILE_NOTIFY_CHANGE_SIZE |
-											FILE_NOTIFY_CHANGE_DIR_NAME |
-											FILE_NOTIFY_CHANGE_FILE_NAME |
-
-											FILE_NOTIFY_CHANGE_ATTRIBUTES |
-											FILE_NOTIFY_CHANGE_LAST_WRITE |
-											FILE_NOTIFY_CHANGE_LAST_ACCESS |
-											FILE_NOTIFY_CHANGE_CREATION |
-											FILE_NOTIFY_CHANGE_SECURITY,
-
+											get_notify_filter(info->m_Mask),
 											0,
 											&info->m_Overlapped,
 											readdirectory_callback);
@@ -222,10 +226,12 @@ static void process_request(SWatchInfo* info)
 	const FILE_NOTIFY_INFORMATION* entry = info->m_Buffer;
 	std::string last_path = "";
 	uint32_t last_flags;
+	SEventBatch batch;
 
 	while(true)
 	{
 		const FILE_NOTIFY_INFORMATION& fni = *entry;
+		fe_stats_add(info->m_FES->m_Stats.m_EventsRead, 1);
 
 		std::wstring wpath(fni.FileName, fni.FileName + fni.FileNameLength/sizeof(fni.FileName[0]));
 
@@ -256,7 +262,9 @@ static void process_request(SWatchInfo* info)
 			{
 				// now, check if the user wanted the event, then send it
 				if( last_flags & info->m_Mask )
-					info->m_FES->m_Callback( last_path.c_str(), (EFileEvents)last_flags, info->m_FES->m_CallbackCtx );
+					fe_batch_add(&batch, info->m_ID, last_flags, last_path.c_str());
+				else
+					fe_stats_add(info->m_FES->m_Stats.m_EventsFiltered, 1);
 			}
 
 			last_flags = convert_flags(fni.Action) | get_filetype_flags(path.c_str());
@@ -273,8 +281,12 @@ static void process_request(SWatchInfo* info)
 	{
 		// now, check if the user wanted the event, then send it
 		if( last_flags & info->m_Mask )
-			info->m_FES->m_Callback( last_path.c_str(), (EFileEvents)last_flags, info->m_FES->m_CallbackCtx );
+			fe_batch_add(&batch, info->m_ID, last_flags, last_path.c_str());
+		else
+			fe_stats_add(info->m_FES->m_Stats.m_EventsFiltered, 1);
 	}
+
+	fe_dispatch(info->m_FES, &batch);
 }
 
 static void CALLBACK readdirectory_callback(  DWORD dwErrorCode,
@@ -305,6 +317,9 @@ static void CALLBACK readdirectory_callback(  DWORD dwErrorCode,
 		// In my case, it just returned 0, and then nothing else
 	}
 
+	fe_stats_add(info->m_FES->m_Stats.m_Reads, 1);
+	fe_stats_add(info->m_FES->m_Stats.m_BytesRead, dwNumberOfBytesTransfered);
+
 	if( dwNumberOfBytesTransfered )
 		memcpy(info->m_DoubleBuffer, info->m_Buffer, dwNumberOfBytesTransfered);
 
@@ -331,9 +346,13 @@ void platform_thread_run(SFileEventSystem* hfes)
 	static int i = 0;
 	while( !hfes->m_Cancel )
 	{
+		fe_add_pending_watches(hfes);
+		int timeout = fe_flush_events(hfes, false);
+
 		// Need to put the thread in an alertable state
-		::SleepEx(1000, TRUE);
+		::SleepEx(timeout < 0 || timeout > 1000 ? 1000 : (DWORD)timeout, TRUE);
 	}
+	fe_flush_events(hfes, true);
 }
 
 SPlatformData* fe_platform_init(const SFileEventSystem* hfes)
@@ -353,8 +372,11 @@ void fe_platform_close(const SFileEventSystem* hfes)
 	delete hfes->m_PlatformData;
 }
 
-int fe_platform_add_watch(const SFileEventSystem* hfes, HFESWatchID watchid, const char* path, uint32_t mask)
+int fe_platform_add_watch(const SFileEventSystem* hfes, HFESWatchID watchid, const char* path, uint32_t mask, const SFileFilter* filter)
 {
+	if( filter )
+		fprintf(stderr, "The include/exclude patterns aren't supported on this platform: '%s'\n", path);
+
 	// Check if it already exists, then update the mask
 	int i = 0;
     for(const auto &pair : hfes->m_PlatformData->m_Watchers)
@@ -371,6 +393,7 @@ int fe_platform_add_watch(const SFileEventSystem* hfes, HFESWatchID watchid, con
 
     SWatchInfo* info = new SWatchInfo;
     info->m_Mask = mask;
+    info->m_ID = watchid;
 	info->m_DirPath = path;
 	info->m_Path = path;
 	info->m_IsDir = is_dir(path);
@@ -405,6 +428,14 @@ int fe_platform_add_watch(const SFileEventSystem* hfes, HFESWatchID watchid, con
 	return 0;
 }
 
+void fe_platform_update_watch(const SFileEventSystem* hfes, HFESWatchID watchid, uint32_t mask)
+{
+	// The new filter is used from the next request on
+	std::map< HFESWatchID, SWatchInfo* >::iterator it = hfes->m_PlatformData->m_Watchers.find( watchid );
+	if( it != hfes->m_PlatformData->m_Watchers.end() )
+		it->second->m_Mask = mask;
+}
+
 void fe_platform_remove_watch(const SFileEventSystem* hfes, HFESWatchID id)
 {
 	std::map< HFESWatchID, SWatchInfo* >::iterator it = hfes->m_PlatformData->m_Watchers.find( id );
@@ -416,8 +447,25 @@ void fe_platform_remove_watch(const SFileEventSystem* hfes, HFESWatchID id)
 	}
 }
 
+static void CALLBACK wakeup( ULONG_PTR param )
+{
+	(void)param;
+}
+
+void fe_platform_wakeup(const SFileEventSystem* hfes)
+{
+	// Any queued APC takes the thread out of the alertable sleep
+	::QueueUserAPC( (PAPCFUNC)wakeup, const_cast<SFileEventSystem*>(hfes)->m_Thread.native_handle(), 0 );
+}
+
 bool fe_is_running(const SFileEventSystem* hfes)
 {
 	return hfes != 0 && hfes->m_PlatformData != 0;
 }
+
+uint32_t fe_platform_num_kernel_watches(const SFileEventSystem* hfes)
+{
+	// One directory handle per watch
+	return (uint32_t)hfes->m_PlatformData->m_Watchers.size();
+}
 #endif //
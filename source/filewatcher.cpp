@@ -4,6 +4,7 @@
 #include <signal.h>
 #include <thread>
 #include <chrono>
+#include <vector>
 
 #include "fileevents.h"
 
@@ -29,6 +30,14 @@ static int fileevents_callback(const char* path, EFileEvents flags, void* ctx)
 	return 0;
 }
 
+static int fileevents_rename_callback(const char* srcpath, const char* dstpath, EFileEvents flags, void* ctx)
+{
+	(void)ctx;
+	printf("%s -> %s ", srcpath, dstpath);
+	_print_flags(flags);
+	return 0;
+}
+
 static bool forever = true;
 
 static void sighandler(int sig)
@@ -39,23 +48,56 @@ static void sighandler(int sig)
 
 static void print_usage()
 {
-	printf("Usage: events [-h] [<paths>]\n");
+	printf("Usage: events [-h] [--stats] [<paths>]\n");
 	printf("    Monitors one or more paths for file events.\n");
 	printf("    If no paths are specified, if monitors the current directory.\n");
 	printf("\n");
 	printf("    -h, --help  Prints this message\n");
+	printf("    --stats     Prints the counters of the system every second\n");
 	printf("\n");
 }
 
+static void print_stats(HFES hfes)
+{
+	SFileEventsStats stats;
+	if( fe_get_stats(hfes, &stats) != 0 )
+		return;
+
+	// The median callback time, from the histogram
+	uint64_t half = (stats.m_CallbackCalls + 1) / 2;
+	uint64_t sum = 0;
+	uint32_t median = 0;
+	for( ; median < FE_STATS_HISTOGRAM_SIZE - 1; ++median )
+	{
+		sum += stats.m_CallbackHistogram[median];
+		if( sum >= half )
+			break;
+	}
+
+	printf("stats: read: %llu  dispatched: %llu  filtered: %llu  coalesced: %llu  dropped: %llu  overflows: %llu  watches: %u  queued: %u  ring: %u bytes  bytes/read: %llu  callbacks: %llu (%llu us total, median < %u us)\n",
+		(unsigned long long)stats.m_EventsRead, (unsigned long long)stats.m_EventsDispatched, (unsigned long long)stats.m_EventsFiltered,
+		(unsigned long long)stats.m_EventsCoalesced, (unsigned long long)stats.m_EventsDropped, (unsigned long long)stats.m_Overflows,
+		stats.m_KernelWatches, stats.m_QueuedEvents, stats.m_RingBytes,
+		(unsigned long long)(stats.m_Reads ? stats.m_BytesRead / stats.m_Reads : 0),
+		(unsigned long long)stats.m_CallbackCalls, (unsigned long long)stats.m_CallbackTimeUs, 1u << median);
+	fflush(stdout);
+}
+
 int main(int argc, char** argv)
 {
-	if( argc == 2 )
+	bool showstats = false;
+	std::vector<const char*> paths;
+	for( int i = 1; i < argc; ++i )
 	{
-		if( strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0 )
+		if( strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0 )
 		{
 			print_usage();
 			return 0;
 		}
+		if( strcmp(argv[i], "--stats") == 0 )
+			showstats = true;
+		else
+			paths.push_back(argv[i]);
 	}
 
 	signal(SIGABRT, &sighandler);
@@ -63,17 +105,17 @@ int main(int argc, char** argv)
 	signal(SIGINT, &sighandler);
 	SFileEventsCreateParams params;
 	params.m_Callback = fileevents_callback;
+	params.m_RenameCallback = fileevents_rename_callback;
 	HFES hfes = fe_init(params);
 
-	if( argc < 2 )
+	if( paths.empty() )
 	{
 		fe_add_watch(hfes, ".", FE_ALL);
 	}
 	else
 	{
-		for( int i = 1; i < argc; ++i )
+		for( const char* path : paths )
 		{
-			const char* path = argv[i];
 			struct stat sb;
 
 			if( stat(path, &sb) == -1 )
@@ -96,6 +138,8 @@ int main(int argc, char** argv)
 	while(forever)
 	{
 		std::this_thread::sleep_for( std::chrono::milliseconds(1000) );
+		if( showstats && forever )
+			print_stats(hfes);
 	}
 
 	fe_close(hfes);
@@ -0,0 +1,747 @@
+/*
+ * Drives a synthetic workload (create, modify, rename and delete) against a watched tree, and measures
+ * the latency from the syscall to the callback, the sustained throughput, the CPU time and the memory used.
+ * The heap allocations are counted (by replacing operator new), to check that the event path doesn't allocate
+ * once it's warmed up.
+ *
+ * The results are written as JSON to stdout (or to --output), and a summary to stderr.
+ *
+ * With --compare-io-uring, it instead watches an existing tree (e.g. the one genfile.py creates) twice, reading the
+ * events with epoll and then with io_uring, and compares the crawl, the latency and the throughput of the two.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "fileevents.h"
+
+// All the allocations in the process, on any thread
+static std::atomic<uint64_t> g_Allocations(0);
+
+// Not inlined, so that the compiler doesn't pair the free() with a new expression
+static void __attribute__((noinline)) bench_free(void* p)
+{
+	free(p);
+}
+
+void* operator new(size_t size)
+{
+	g_Allocations.fetch_add(1, std::memory_order_relaxed);
+	void* p = malloc(size ? size : 1);
+	if( !p )
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+	bench_free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	bench_free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	bench_free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+	bench_free(p);
+}
+
+struct SBenchOptions
+{
+	const char* m_Dir;
+	const char* m_Output;
+	const char* m_CompareTree;	// Compares epoll and io_uring on this tree, instead of the normal run
+	uint32_t 	m_Width;		// Sub directories per directory
+	uint32_t 	m_Depth;		// Levels of sub directories
+	uint32_t 	m_FilesPerDir;
+	uint32_t 	m_Rate;			// Operations per second in the latency phases (0 means as fast as possible)
+	uint32_t 	m_FloodOps;		// Operations per round in the throughput search
+	uint32_t 	m_MaxRate;
+	uint32_t 	m_TimeoutMs;	// How long to wait for the events after the last operation
+	uint32_t 	m_Backend;
+	uint32_t 	m_DispatchThreads;
+	bool 		m_SharedEngine;
+	bool 		m_IoUring;
+	bool 		_padding[2];
+};
+
+// One phase of the workload: one operation per file, and the event it should give
+struct SPhase
+{
+	const char* 	m_Name;
+	uint32_t 		m_Flag;		// The expected event
+	uint32_t 		m_NumOps;
+	uint32_t 		m_Received;
+	uint32_t 		_pad;
+	double 			m_ElapsedMs;
+	double 			m_CpuMs;	// The CPU time of the library (everything but the thread doing the operations)
+	uint64_t 		m_Events;	// All the events received during the phase
+	uint64_t 		m_Allocations;
+	std::vector<uint64_t> m_Latencies;	// ns
+};
+
+// A round of the throughput search
+struct SRound
+{
+	uint32_t 	m_Rate;
+	uint32_t 	m_Sent;
+	uint32_t 	m_Received;
+	uint32_t 	m_Overflows;
+	uint64_t 	m_Allocations;
+	double 		m_EventsPerSec;
+	double 		m_CpuMs;
+};
+
+// Shared with the callback
+struct SBench
+{
+	// The paths that the events of the current phase are reported for, and when their operations were done
+	const std::unordered_map<std::string, uint32_t>* m_Index;
+	std::atomic<uint64_t>* 	m_Sent;		// ns, 0 once the event has been received
+	std::atomic<uint32_t> 	m_Flag;		// The event the current phase waits for (0 means none)
+
+	std::mutex 				m_Lock;
+	std::vector<uint64_t> 	m_Latencies;	// Protected by m_Lock
+
+	std::atomic<uint32_t> 	m_Matched;	// The events of the current phase that were received
+	std::atomic<uint32_t> 	m_Flagged;	// All the events with m_Flag
+	std::atomic<uint32_t> 	m_Overflows;
+	std::atomic<uint64_t> 	m_Events;
+	std::string 			m_Key;		// Only used by the callback
+};
+
+static uint64_t get_time_ns()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double get_cpu_ms(int who)
+{
+	struct rusage usage;
+	if( getrusage(who, &usage) != 0 )
+		return 0;
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+}
+
+// The CPU time of the process, minus the thread that does the operations
+static double get_library_cpu_ms()
+{
+#if defined(__linux__)
+	return get_cpu_ms(RUSAGE_SELF) - get_cpu_ms(RUSAGE_THREAD);
+#else
+	return get_cpu_ms(RUSAGE_SELF);
+#endif
+}
+
+static uint64_t get_rss_bytes()
+{
+#if defined(__linux__)
+	FILE* file = fopen("/proc/self/statm", "rb");
+	if( !file )
+		return 0;
+	unsigned long size = 0, resident = 0;
+	int count = fscanf(file, "%lu %lu", &size, &resident);
+	fclose(file);
+	return count == 2 ? (uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE) : 0;
+#else
+	return 0;
+#endif
+}
+
+static int BenchCallback( const SFileEvent* events, uint32_t count, const char* strings, void* _ctx )
+{
+	SBench* bench = (SBench*)_ctx;
+	uint64_t now = get_time_ns();
+	uint32_t flag = bench->m_Flag.load(std::memory_order_acquire);
+
+	bench->m_Events.fetch_add(count, std::memory_order_relaxed);
+
+	std::lock_guard<std::mutex> lock(bench->m_Lock);
+	for( uint32_t i = 0; i < count; ++i )
+	{
+		const SFileEvent& event = events[i];
+		if( event.m_Flags & FE_OVERFLOW )
+		{
+			bench->m_Overflows.fetch_add(1, std::memory_order_relaxed);
+			continue;
+		}
+		if( !flag || !(event.m_Flags & flag) )
+			continue;
+		bench->m_Flagged.fetch_add(1, std::memory_order_relaxed);
+		if( !bench->m_Index )
+			continue;
+
+		bench->m_Key.assign(strings + event.m_PathOffset, event.m_PathLength);
+		std::unordered_map<std::string, uint32_t>::const_iterator it = bench->m_Index->find(bench->m_Key);
+		if( it == bench->m_Index->end() )
+			continue;
+
+		// Only the first event for the operation counts
+		uint64_t sent = bench->m_Sent[it->second].exchange(0);
+		if( sent == 0 )
+			continue;
+		bench->m_Latencies.push_back(now - sent);
+		bench->m_Matched.fetch_add(1, std::memory_order_release);
+	}
+	return 0;
+}
+
+static void make_tree(const std::string& dir, uint32_t depth, const SBenchOptions& options, std::vector<std::string>& dirs)
+{
+	mkdir(dir.c_str(), 0755);
+	dirs.push_back(dir);
+	if( depth == 0 )
+		return;
+	char name[32];
+	for( uint32_t i = 0; i < options.m_Width; ++i )
+	{
+		snprintf(name, sizeof(name), "/dir%02u", i);
+		make_tree(dir + name, depth - 1, options, dirs);
+	}
+}
+
+// Waits for the expected number of events. Gives up once nothing has arrived for a while.
+static void wait_for(const std::atomic<uint32_t>& counter, uint32_t expected, uint32_t timeoutms)
+{
+	uint32_t last = counter.load(std::memory_order_acquire);
+	uint64_t deadline = get_time_ns() + (uint64_t)timeoutms * 1000000;
+	while( last < expected && get_time_ns() < deadline )
+	{
+		std::this_thread::sleep_for( std::chrono::microseconds(200) );
+		uint32_t current = counter.load(std::memory_order_acquire);
+		if( current != last )
+		{
+			last = current;
+			deadline = get_time_ns() + (uint64_t)timeoutms * 1000000;
+		}
+	}
+}
+
+// Paces the operations at the given rate
+static void pace(uint64_t start, uint32_t op, uint32_t rate)
+{
+	if( rate == 0 )
+		return;
+	uint64_t due = start + (uint64_t)op * 1000000000 / rate;
+	uint64_t now = get_time_ns();
+	if( due > now )
+		std::this_thread::sleep_for( std::chrono::nanoseconds(due - now) );
+}
+
+static void do_op(uint32_t flag, const std::string& path, const std::string& target)
+{
+	if( flag == FE_CREATED )
+	{
+		int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+		if( fd >= 0 )
+			close(fd);
+	}
+	else if( flag == FE_MODIFIED )
+	{
+		int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+		if( fd >= 0 )
+		{
+			ssize_t result = write(fd, "x", 1);
+			(void)result;
+			close(fd);
+		}
+	}
+	else if( flag == FE_RENAMED )
+		rename(path.c_str(), target.c_str());
+	else if( flag == FE_REMOVED )
+		unlink(path.c_str());
+}
+
+// Does one operation per file, and measures the latency of each of them
+static void run_phase(SBench* bench, SPhase& phase, const std::vector<std::string>& paths, const std::vector<std::string>& targets,
+						const std::unordered_map<std::string, uint32_t>& index, const SBenchOptions& options)
+{
+	uint32_t count = (uint32_t)paths.size();
+	std::vector<std::atomic<uint64_t> > sent(count);
+	for( uint32_t i = 0; i < count; ++i )
+		sent[i].store(0);
+
+	{
+		std::lock_guard<std::mutex> lock(bench->m_Lock);
+		bench->m_Latencies.clear();
+		bench->m_Latencies.reserve(count);	// The callback shouldn't allocate either
+		bench->m_Index = &index;
+		bench->m_Sent = &sent[0];
+		bench->m_Matched = 0;
+		bench->m_Flagged = 0;
+		bench->m_Flag.store(phase.m_Flag, std::memory_order_release);
+	}
+
+	uint64_t events = bench->m_Events.load();
+	uint64_t allocations = g_Allocations.load();
+	double cpu = get_library_cpu_ms();
+	uint64_t start = get_time_ns();
+	for( uint32_t i = 0; i < count; ++i )
+	{
+		pace(start, i, options.m_Rate);
+		sent[i].store(get_time_ns());
+		do_op(phase.m_Flag, paths[i], targets[i]);
+	}
+	wait_for(bench->m_Matched, count, options.m_TimeoutMs);
+
+	std::lock_guard<std::mutex> lock(bench->m_Lock);
+	bench->m_Flag = 0;
+	bench->m_Index = 0;
+	bench->m_Sent = 0;
+	phase.m_ElapsedMs = (double)(get_time_ns() - start) / 1000000.0;
+	phase.m_CpuMs = get_library_cpu_ms() - cpu;
+	phase.m_Events = bench->m_Events.load() - events;
+	phase.m_Allocations = g_Allocations.load() - allocations;
+	phase.m_NumOps = count;
+	phase.m_Received = bench->m_Matched.load();
+	phase.m_Latencies.swap(bench->m_Latencies);
+	std::sort(phase.m_Latencies.begin(), phase.m_Latencies.end());
+}
+
+// Modifies the files at a given rate, and counts the events that make it through
+static void run_round(SBench* bench, SRound& round, const std::vector<std::string>& files, const SBenchOptions& options)
+{
+	{
+		std::lock_guard<std::mutex> lock(bench->m_Lock);
+		bench->m_Flagged = 0;
+		bench->m_Overflows = 0;
+		bench->m_Flag.store(FE_MODIFIED, std::memory_order_release);
+	}
+
+	uint64_t allocations = g_Allocations.load();
+	double cpu = get_library_cpu_ms();
+	uint64_t start = get_time_ns();
+	for( uint32_t i = 0; i < options.m_FloodOps; ++i )
+	{
+		pace(start, i, round.m_Rate);
+		do_op(FE_MODIFIED, files[i % files.size()], files[i % files.size()]);
+	}
+	wait_for(bench->m_Flagged, options.m_FloodOps, options.m_TimeoutMs);
+
+	bench->m_Flag = 0;
+	round.m_Sent = options.m_FloodOps;
+	round.m_Received = bench->m_Flagged.load();
+	round.m_Overflows = bench->m_Overflows.load();
+	round.m_CpuMs = get_library_cpu_ms() - cpu;
+	round.m_Allocations = g_Allocations.load() - allocations;
+	double seconds = (double)(get_time_ns() - start) / 1000000000.0;
+	round.m_EventsPerSec = seconds > 0 ? round.m_Received / seconds : 0;
+}
+
+static double percentile_us(const std::vector<uint64_t>& sorted, double p)
+{
+	if( sorted.empty() )
+		return 0;
+	size_t i = std::min(sorted.size() - 1, (size_t)(p * (double)sorted.size()));
+	return (double)sorted[i] / 1000.0;
+}
+
+// The most files that are modified in the latency phase of the comparison (they're picked evenly from the tree)
+#define COMPARE_MAX_FILES	10000
+
+// One of the readers in the comparison
+struct SReaderResult
+{
+	const char* m_Name;
+	bool 		m_IoUring;
+	bool 		_padding[7];
+	double 		m_AddWatchMs;
+	double 		m_CrawlMs;		// With the snapshot, so every file is stat'ed
+	SPhase 		m_Modify;
+	SRound 		m_Flood;
+};
+
+static void list_tree(const std::string& dir, std::vector<std::string>& dirs, std::vector<std::string>& files)
+{
+	DIR* d = opendir(dir.c_str());
+	if( !d )
+		return;
+	dirs.push_back(dir);
+	std::vector<std::string> subdirs;
+	while( struct dirent* entry = readdir(d) )
+	{
+		if( strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 )
+			continue;
+		if( entry->d_type == DT_DIR )
+			subdirs.push_back(dir + "/" + entry->d_name);
+		else if( entry->d_type == DT_REG )
+			files.push_back(dir + "/" + entry->d_name);
+	}
+	closedir(d);
+	std::sort(subdirs.begin(), subdirs.end());
+	for( const std::string& subdir : subdirs )
+		list_tree(subdir, dirs, files);
+}
+
+static void run_reader(SBench* bench, SReaderResult& result, const char* root, const std::vector<std::string>& files,
+						const std::unordered_map<std::string, uint32_t>& index, const SBenchOptions& options)
+{
+	SFileEventsCreateParams params;
+	params.m_BatchCallback = BenchCallback;
+	params.m_CallbackCtx = bench;
+	params.m_IoUring = result.m_IoUring;
+	HFES hfes = fe_init(params);
+	uint64_t start = get_time_ns();
+	fe_add_watch(hfes, root, FE_ALL | FE_RECURSIVE);
+	result.m_AddWatchMs = (double)(get_time_ns() - start) / 1000000.0;
+
+	result.m_Modify.m_Name = "modify";
+	result.m_Modify.m_Flag = FE_MODIFIED;
+	run_phase(bench, result.m_Modify, files, files, index, options);
+	result.m_Flood.m_Rate = 0;
+	run_round(bench, result.m_Flood, files, options);
+	fe_close(hfes);
+
+	SFileEventsCreateParams crawlparams;
+	crawlparams.m_RescanOnOverflow = true;
+	crawlparams.m_IoUring = result.m_IoUring;
+	hfes = fe_init(crawlparams);
+	start = get_time_ns();
+	fe_add_watch(hfes, root, FE_ALL | FE_RECURSIVE);
+	result.m_CrawlMs = (double)(get_time_ns() - start) / 1000000.0;
+	fe_close(hfes);
+
+	fprintf(stderr, "%-8s add_watch %8.1fms  crawl %8.1fms  modify p50 %8.1fus  p99 %8.1fus  (%u of %u)  flood %.0f events/s\n", result.m_Name,
+			result.m_AddWatchMs, result.m_CrawlMs, percentile_us(result.m_Modify.m_Latencies, 0.5), percentile_us(result.m_Modify.m_Latencies, 0.99),
+			result.m_Modify.m_Received, result.m_Modify.m_NumOps, result.m_Flood.m_EventsPerSec);
+}
+
+// Watches the same tree with epoll and with io_uring, one after the other
+static int run_compare(SBench* bench, const SBenchOptions& options)
+{
+	char root[PATH_MAX];
+	if( !realpath(options.m_CompareTree, root) )
+	{
+		fprintf(stderr, "Failed to find '%s': %s\n", options.m_CompareTree, strerror(errno));
+		return 1;
+	}
+
+	std::vector<std::string> dirs, all;
+	list_tree(root, dirs, all);
+	if( all.empty() )
+	{
+		fprintf(stderr, "There are no files in '%s' (create them with genfile.py)\n", root);
+		return 1;
+	}
+	std::vector<std::string> files;
+	std::unordered_map<std::string, uint32_t> index;
+	size_t step = (all.size() + COMPARE_MAX_FILES - 1) / COMPARE_MAX_FILES;
+	for( size_t i = 0; i < all.size(); i += step )
+	{
+		index[all[i]] = (uint32_t)files.size();
+		files.push_back(all[i]);
+	}
+
+	SReaderResult readers[2];
+	readers[0].m_Name = "epoll";	readers[0].m_IoUring = false;
+	readers[1].m_Name = "io_uring";	readers[1].m_IoUring = true;
+	for( SReaderResult& reader : readers )
+		run_reader(bench, reader, root, files, index, options);
+
+	FILE* out = options.m_Output ? fopen(options.m_Output, "wb") : stdout;
+	if( !out )
+	{
+		fprintf(stderr, "Failed to open '%s': %s\n", options.m_Output, strerror(errno));
+		return 1;
+	}
+	fprintf(out, "{\n");
+	fprintf(out, "  \"config\": {\"tree\": \"%s\", \"dirs\": %u, \"files\": %u, \"modified_files\": %u, \"rate\": %u, \"flood_ops\": %u},\n",
+			root, (uint32_t)dirs.size(), (uint32_t)all.size(), (uint32_t)files.size(), options.m_Rate, options.m_FloodOps);
+	fprintf(out, "  \"readers\": [\n");
+	for( int i = 0; i < 2; ++i )
+	{
+		const SReaderResult& reader = readers[i];
+		const SPhase& phase = reader.m_Modify;
+		fprintf(out, "    {\"reader\": \"%s\", \"add_watch_ms\": %.3f, \"crawl_ms\": %.3f, \"received\": %u, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"cpu_us_per_1k_events\": %.1f, \"flood_events_per_sec\": %.0f, \"flood_cpu_us_per_1k_events\": %.1f}%s\n",
+				reader.m_Name, reader.m_AddWatchMs, reader.m_CrawlMs, phase.m_Received,
+				percentile_us(phase.m_Latencies, 0.5), percentile_us(phase.m_Latencies, 0.99), percentile_us(phase.m_Latencies, 0.999),
+				phase.m_Events ? phase.m_CpuMs * 1000000.0 / (double)phase.m_Events : 0.0, reader.m_Flood.m_EventsPerSec,
+				reader.m_Flood.m_Received ? reader.m_Flood.m_CpuMs * 1000000.0 / (double)reader.m_Flood.m_Received : 0.0, i < 1 ? "," : "");
+	}
+	fprintf(out, "  ]\n");
+	fprintf(out, "}\n");
+	if( out != stdout )
+		fclose(out);
+	return 0;
+}
+
+static void print_usage()
+{
+	printf("Usage: bench [options]\n");
+	printf("    Measures the latency and the throughput of the file events, and prints the results as JSON.\n");
+	printf("\n");
+	printf("    --dir <path>            Where to create the tree (default: bench_tree)\n");
+	printf("    --output <path>         Writes the JSON to a file instead of stdout\n");
+	printf("    --width <n>             Sub directories per directory (default: 4)\n");
+	printf("    --depth <n>             Levels of sub directories (default: 3)\n");
+	printf("    --files <n>             Files per directory (default: 20)\n");
+	printf("    --rate <n>              Operations per second in the latency phases, 0 is unlimited (default: 2000)\n");
+	printf("    --flood-ops <n>         Operations per round in the throughput search (default: 50000)\n");
+	printf("    --max-rate <n>          Highest rate in the throughput search (default: 1024000)\n");
+	printf("    --timeout <ms>          How long to wait for late events (default: 1000)\n");
+	printf("    --fanotify              Uses the fanotify backend\n");
+	printf("    --poll                  Uses the polling backend (the renames are reported as removed and created)\n");
+	printf("    --dispatch-threads <n>  Calls the callbacks from a pool of threads\n");
+	printf("    --shared                Uses the shared engine\n");
+	printf("    --io-uring              Reads the events (and stats the files in the crawl) with io_uring\n");
+	printf("    --compare-io-uring <path>  Compares epoll and io_uring on an existing tree (e.g. from genfile.py)\n");
+	printf("\n");
+}
+
+static bool parse_args(int argc, char** argv, SBenchOptions& options)
+{
+	for( int i = 1; i < argc; ++i )
+	{
+		const char* arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i+1] : 0;
+		if( strcmp(arg, "--fanotify") == 0 )
+			options.m_Backend = FE_BACKEND_FANOTIFY;
+		else if( strcmp(arg, "--poll") == 0 )
+			options.m_Backend = FE_BACKEND_POLL;
+		else if( strcmp(arg, "--shared") == 0 )
+			options.m_SharedEngine = true;
+		else if( strcmp(arg, "--io-uring") == 0 )
+			options.m_IoUring = true;
+		else if( !value )
+			return false;
+		else if( strcmp(arg, "--dir") == 0 )				{ options.m_Dir = value; ++i; }
+		else if( strcmp(arg, "--output") == 0 ) 			{ options.m_Output = value; ++i; }
+		else if( strcmp(arg, "--compare-io-uring") == 0 ) 	{ options.m_CompareTree = value; ++i; }
+		else if( strcmp(arg, "--width") == 0 ) 				{ options.m_Width = (uint32_t)atoi(value); ++i; }
+		else if( strcmp(arg, "--depth") == 0 ) 				{ options.m_Depth = (uint32_t)atoi(value); ++i; }
+		else if( strcmp(arg, "--files") == 0 ) 				{ options.m_FilesPerDir = (uint32_t)atoi(value); ++i; }
+		else if( strcmp(arg, "--rate") == 0 ) 				{ options.m_Rate = (uint32_t)atoi(value); ++i; }
+		else if( strcmp(arg, "--flood-ops") == 0 ) 			{ options.m_FloodOps = (uint32_t)atoi(value); ++i; }
+		else if( strcmp(arg, "--max-rate") == 0 ) 			{ options.m_MaxRate = (uint32_t)atoi(value); ++i; }
+		else if( strcmp(arg, "--timeout") == 0 ) 			{ options.m_TimeoutMs = (uint32_t)atoi(value); ++i; }
+		else if( strcmp(arg, "--dispatch-threads") == 0 ) 	{ options.m_DispatchThreads = (uint32_t)atoi(value); ++i; }
+		else
+			return false;
+	}
+	return options.m_FilesPerDir > 0 && options.m_FloodOps > 0;
+}
+
+int main(int argc, char** argv)
+{
+	SBenchOptions options;
+	memset(&options, 0, sizeof(options));
+	options.m_Dir = "bench_tree";
+	options.m_Width = 4;
+	options.m_Depth = 3;
+	options.m_FilesPerDir = 20;
+	options.m_Rate = 2000;
+	options.m_FloodOps = 50000;
+	options.m_MaxRate = 1024000;
+	options.m_TimeoutMs = 1000;
+
+	if( !parse_args(argc, argv, options) )
+	{
+		print_usage();
+		return 1;
+	}
+
+	SBench bench;
+	bench.m_Index = 0;
+	bench.m_Sent = 0;
+	bench.m_Flag = 0;
+	bench.m_Matched = 0;
+	bench.m_Flagged = 0;
+	bench.m_Overflows = 0;
+	bench.m_Events = 0;
+
+	if( options.m_CompareTree )
+		return run_compare(&bench, options);
+
+	char root[PATH_MAX];
+	mkdir(options.m_Dir, 0755);
+	if( !realpath(options.m_Dir, root) )
+	{
+		fprintf(stderr, "Failed to create '%s': %s\n", options.m_Dir, strerror(errno));
+		return 1;
+	}
+
+	// The tree, and the paths of the files before and after the renames
+	std::vector<std::string> dirs;
+	make_tree(root, options.m_Depth, options, dirs);
+	std::vector<std::string> files, renamed;
+	std::unordered_map<std::string, uint32_t> filesindex, renamedindex;
+	char name[32];
+	for( const std::string& dir : dirs )
+	{
+		for( uint32_t i = 0; i < options.m_FilesPerDir; ++i )
+		{
+			snprintf(name, sizeof(name), "/file%03u.txt", i);
+			filesindex[dir + name] = (uint32_t)files.size();
+			files.push_back(dir + name);
+			snprintf(name, sizeof(name), "/moved%03u.txt", i);
+			renamedindex[dir + name] = (uint32_t)renamed.size();
+			renamed.push_back(dir + name);
+		}
+	}
+
+	uint64_t rssbefore = get_rss_bytes();
+
+	SFileEventsCreateParams params;
+	params.m_BatchCallback = BenchCallback;
+	params.m_CallbackCtx = &bench;
+	params.m_Backend = options.m_Backend;
+	params.m_DispatchThreads = options.m_DispatchThreads;
+	params.m_SharedEngine = options.m_SharedEngine;
+	params.m_IoUring = options.m_IoUring;
+	HFES hfes = fe_init(params);
+
+	uint64_t watchstart = get_time_ns();
+	if( fe_add_watch(hfes, root, FE_ALL | FE_RECURSIVE) < 0 )
+	{
+		fprintf(stderr, "Failed to watch '%s'\n", root);
+		fe_close(hfes);
+		return 1;
+	}
+	double watchms = (double)(get_time_ns() - watchstart) / 1000000.0;
+	uint64_t rssafter = get_rss_bytes();
+
+	// Registering each directory as a watch of its own, one call per path and then as one batch (on systems of their own)
+	std::vector<const char*> dirpaths;
+	for( const std::string& dir : dirs )
+		dirpaths.push_back(dir.c_str());
+	std::vector<HFESWatchID> ids(dirs.size());
+	SFileEventsCreateParams idleparams;
+	idleparams.m_Backend = options.m_Backend;
+	idleparams.m_IoUring = options.m_IoUring;
+	HFES idle = fe_init(idleparams);
+	uint64_t eachstart = get_time_ns();
+	for( size_t i = dirs.size(); i > 0; --i )
+		fe_add_watch(idle, dirpaths[i-1], FE_ALL);
+	double eachms = (double)(get_time_ns() - eachstart) / 1000000.0;
+	fe_close(idle);
+	idle = fe_init(idleparams);
+	uint64_t batchstart = get_time_ns();
+	fe_add_watches(idle, dirpaths.data(), 0, (uint32_t)dirpaths.size(), ids.data());
+	double batchms = (double)(get_time_ns() - batchstart) / 1000000.0;
+	fe_close(idle);
+
+	// Latency, one phase per type of operation
+	SPhase phases[4];
+	phases[0].m_Name = "create"; 	phases[0].m_Flag = FE_CREATED;
+	phases[1].m_Name = "modify"; 	phases[1].m_Flag = FE_MODIFIED;
+	phases[2].m_Name = "rename"; 	phases[2].m_Flag = FE_RENAMED;
+	phases[3].m_Name = "delete"; 	phases[3].m_Flag = FE_REMOVED;
+	run_phase(&bench, phases[0], files, files, filesindex, options);
+	run_phase(&bench, phases[1], files, files, filesindex, options);
+	run_phase(&bench, phases[2], files, renamed, filesindex, options);
+	run_phase(&bench, phases[3], renamed, renamed, renamedindex, options);
+
+	// Throughput, doubling the rate until events are lost
+	for( const std::string& path : files )
+		do_op(FE_CREATED, path, path);
+	std::this_thread::sleep_for( std::chrono::milliseconds(options.m_TimeoutMs) );
+
+	// The initial crawl of the full tree, with the snapshot (so every file is stat'ed)
+	idleparams.m_RescanOnOverflow = true;
+	idle = fe_init(idleparams);
+	uint64_t crawlstart = get_time_ns();
+	fe_add_watch(idle, root, FE_ALL | FE_RECURSIVE);
+	double crawlms = (double)(get_time_ns() - crawlstart) / 1000000.0;
+	fe_close(idle);
+
+	std::vector<SRound> rounds;
+	double sustained = 0;
+	for( uint32_t rate = 1000; rate <= options.m_MaxRate; rate *= 2 )
+	{
+		rounds.push_back(SRound());
+		SRound& round = rounds.back();
+		round.m_Rate = rate;
+		run_round(&bench, round, files, options);
+		fprintf(stderr, "rate %u/s: %u of %u events, %u overflows, %.0f events/s, %llu allocations\n", rate, round.m_Received, round.m_Sent, round.m_Overflows, round.m_EventsPerSec, (unsigned long long)round.m_Allocations);
+		if( round.m_Overflows || round.m_Received < round.m_Sent )
+			break;
+		sustained = round.m_EventsPerSec;
+	}
+	rounds.push_back(SRound());
+	rounds.back().m_Rate = 0;
+	run_round(&bench, rounds.back(), files, options);
+
+	fe_close(hfes);
+
+	for( const std::string& path : files )
+		unlink(path.c_str());
+	for( size_t i = dirs.size(); i > 0; --i )
+		rmdir(dirs[i-1].c_str());
+
+	FILE* out = options.m_Output ? fopen(options.m_Output, "wb") : stdout;
+	if( !out )
+	{
+		fprintf(stderr, "Failed to open '%s': %s\n", options.m_Output, strerror(errno));
+		return 1;
+	}
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"config\": {\"width\": %u, \"depth\": %u, \"files_per_dir\": %u, \"rate\": %u, \"flood_ops\": %u, \"backend\": \"%s\", \"dispatch_threads\": %u, \"shared_engine\": %s, \"io_uring\": %s},\n",
+			options.m_Width, options.m_Depth, options.m_FilesPerDir, options.m_Rate, options.m_FloodOps,
+			options.m_Backend == FE_BACKEND_FANOTIFY ? "fanotify" : (options.m_Backend == FE_BACKEND_POLL ? "poll" : "default"), options.m_DispatchThreads, options.m_SharedEngine ? "true" : "false", options.m_IoUring ? "true" : "false");
+	fprintf(out, "  \"setup\": {\"dirs\": %u, \"files\": %u, \"add_watch_ms\": %.3f, \"rss_bytes\": %llu, \"rss_bytes_per_dir\": %.1f, \"add_watch_per_dir_ms\": %.3f, \"add_watches_ms\": %.3f, \"crawl_ms\": %.3f},\n",
+			(uint32_t)dirs.size(), (uint32_t)files.size(), watchms, (unsigned long long)(rssafter - rssbefore),
+			(double)(rssafter - rssbefore) / (double)dirs.size(), eachms, batchms, crawlms);
+
+	fprintf(out, "  \"latency\": [\n");
+	for( int i = 0; i < 4; ++i )
+	{
+		const SPhase& phase = phases[i];
+		fprintf(out, "    {\"phase\": \"%s\", \"ops\": %u, \"received\": %u, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f, \"elapsed_ms\": %.1f, \"cpu_ms\": %.3f, \"cpu_us_per_1k_events\": %.1f, \"allocations\": %llu}%s\n",
+				phase.m_Name, phase.m_NumOps, phase.m_Received,
+				percentile_us(phase.m_Latencies, 0.5), percentile_us(phase.m_Latencies, 0.99), percentile_us(phase.m_Latencies, 0.999),
+				phase.m_Latencies.empty() ? 0.0 : (double)phase.m_Latencies.back() / 1000.0,
+				phase.m_ElapsedMs, phase.m_CpuMs, phase.m_Events ? phase.m_CpuMs * 1000000.0 / (double)phase.m_Events : 0.0,
+				(unsigned long long)phase.m_Allocations, i < 3 ? "," : "");
+		fprintf(stderr, "%-7s p50 %8.1fus  p99 %8.1fus  p999 %8.1fus  (%u of %u)  %llu allocations\n", phase.m_Name,
+				percentile_us(phase.m_Latencies, 0.5), percentile_us(phase.m_Latencies, 0.99), percentile_us(phase.m_Latencies, 0.999),
+				phase.m_Received, phase.m_NumOps, (unsigned long long)phase.m_Allocations);
+	}
+	fprintf(out, "  ],\n");
+
+	fprintf(out, "  \"throughput\": {\"sustained_events_per_sec\": %.0f, \"rounds\": [\n", sustained);
+	for( size_t i = 0; i < rounds.size(); ++i )
+	{
+		const SRound& round = rounds[i];
+		fprintf(out, "    {\"rate\": %u, \"sent\": %u, \"received\": %u, \"overflows\": %u, \"events_per_sec\": %.0f, \"cpu_us_per_1k_events\": %.1f, \"allocations\": %llu}%s\n",
+				round.m_Rate, round.m_Sent, round.m_Received, round.m_Overflows, round.m_EventsPerSec,
+				round.m_Received ? round.m_CpuMs * 1000000.0 / (double)round.m_Received : 0.0,
+				(unsigned long long)round.m_Allocations, i + 1 < rounds.size() ? "," : "");
+	}
+	fprintf(out, "  ]}\n");
+	fprintf(out, "}\n");
+
+	if( out != stdout )
+		fclose(out);
+	return 0;
+}
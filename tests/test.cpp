@@ -8,15 +8,24 @@
 #if defined(_MSC_VER)
 	#include <direct.h>
 	#define PATH_MAX _MAX_PATH
+	#define mkdir(path, mode) _mkdir(path)
 #else
 	#include <unistd.h>
+	#include <limits.h>
+	#include <sys/stat.h>
 #endif
 #include "greatest.h"
 #include "fileevents.h"
 #include "fileevents_internal.h"
+#include "fileevents_snapshot.h"
+#include "fileevents_filter.h"
+#include "fileevents_pathtree.h"
 
 #include <thread>
 #include <chrono>
+#include <atomic>
+#include <mutex>
+#include <functional>
 
 
 struct SOperation
@@ -32,12 +41,91 @@ static void _print_flags(uint64_t flags)
 	if( flags & FE_RENAMED ) 		printf("Renamed, ");
 	if( flags & FE_MODIFIED ) 		printf("Modified, ");
 	if( flags & FE_ATTRIBUTE ) 		printf("Attribute, ");
+	if( flags & FE_OVERFLOW ) 		printf("Overflow, ");
 	if( flags & FE_IS_FILE ) 		printf("IsFile, ");
 	if( flags & FE_IS_DIR ) 		printf("IsDir, ");
 	if( flags & FE_IS_SYMLINK ) 	printf("IsSymlink, ");
 	printf("\n");
 }
 
+// How long the tests wait for the events they expect, before they give up
+#define WAIT_TIMEOUT_MS		5000
+
+// Checks the condition until it holds, or until the timeout. Returns the last result.
+static bool wait_until(const std::function<bool()>& condition, uint32_t timeoutms = WAIT_TIMEOUT_MS)
+{
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutms);
+	while( !condition() )
+	{
+		if( std::chrono::steady_clock::now() >= end )
+			return false;
+		std::this_thread::sleep_for( std::chrono::milliseconds(5) );
+	}
+	return true;
+}
+
+// The events are added by the event thread, while the test is waiting for them
+struct SBatchContext
+{
+	mutable std::mutex			m_Lock;
+	std::vector<SFileEvent>		m_Events;
+	std::vector<std::string>	m_Paths;
+	std::vector<std::string>	m_Targets;
+	uint32_t					m_NumBatches;
+	uint32_t					_pad;
+
+	SBatchContext() : m_NumBatches(0), _pad(0) {}
+};
+
+static int BatchCallback( const SFileEvent* events, uint32_t count, const char* strings, void* _ctx )
+{
+	SBatchContext* ctx = (SBatchContext*)_ctx;
+	std::lock_guard<std::mutex> lock(ctx->m_Lock);
+	ctx->m_NumBatches++;
+	for( uint32_t i = 0; i < count; ++i )
+	{
+		ctx->m_Events.push_back(events[i]);
+		ctx->m_Paths.push_back(std::string(strings + events[i].m_PathOffset, events[i].m_PathLength));
+		ctx->m_Targets.push_back(std::string(strings + events[i].m_TargetOffset, events[i].m_TargetLength));
+	}
+	return 0;
+}
+
+static size_t num_events(const SBatchContext& ctx)
+{
+	std::lock_guard<std::mutex> lock(ctx.m_Lock);
+	return ctx.m_Events.size();
+}
+
+static int find_event(const SBatchContext& ctx, size_t start, uint32_t flags, const char* path)
+{
+	std::lock_guard<std::mutex> lock(ctx.m_Lock);
+	for( size_t i = start; i < ctx.m_Events.size(); ++i )
+	{
+		if( ctx.m_Events[i].m_Flags == flags && ctx.m_Paths[i] == path )
+			return (int)i;
+	}
+	return -1;
+}
+
+static size_t count_events(const SBatchContext& ctx, uint32_t flags, const char* path)
+{
+	std::lock_guard<std::mutex> lock(ctx.m_Lock);
+	size_t count = 0;
+	for( size_t i = 0; i < ctx.m_Events.size(); ++i )
+	{
+		if( ctx.m_Events[i].m_Flags == flags && ctx.m_Paths[i] == path )
+			++count;
+	}
+	return count;
+}
+
+// Waits for an event, at or after the index 'start'
+static bool wait_event(const SBatchContext& ctx, uint32_t flags, const char* path, size_t start = 0)
+{
+	return wait_until([&]() { return find_event(ctx, start, flags, path) >= 0; });
+}
+
 class FileEventsTest
 {
 	std::vector<SOperation>	m_PerformedOperations;
@@ -49,14 +137,26 @@ class FileEventsTest
 	std::string				m_Cwd;
 
 	HFES m_FileEvents;
+	std::mutex m_Lock;	// For m_CallbackOperations
 
 public:
-	void SetUp()
+	// The events of the systems made by init()
+	SBatchContext m_Batch;
+
+	FileEventsTest() : m_FileEvents(0)
 	{
 		char cwd[PATH_MAX];
 		::getcwd(cwd, sizeof(cwd));
 		m_Cwd = cwd;
+	}
+
+	~FileEventsTest()
+	{
+		TearDown();
+	}
 
+	void SetUp()
+	{
 		SFileEventsCreateParams params;
 		params.m_Callback = FileEventsTest::FileCallback;
 		params.m_CallbackCtx = this;
@@ -73,33 +173,80 @@ public:
 		}
 		m_FileEvents = 0;
 
-		for(const auto path : m_CreatedFiles)
+		if( m_CreatedFiles.empty() && m_CreatedFolders.empty() )
+			return;
+
+		for(const auto& path : m_CreatedFiles)
 		{
 			printf("Cleaning up %s\n", path.c_str());
 			fflush(stdout);
 			remove(path.c_str());
 		}
 
-		for(const auto path : m_CreatedFolders)
+		// The sub directories come after their parents in the set, so going backwards removes them first
+		for(auto it = m_CreatedFolders.rbegin(); it != m_CreatedFolders.rend(); ++it)
 		{
-			printf("Cleaning up %s\n", path.c_str());
+			printf("Cleaning up %s\n", it->c_str());
 			fflush(stdout);
-			remove(path.c_str());
+			remove(it->c_str());
 		}
+		m_CreatedFiles.clear();
+		m_CreatedFolders.clear();
 
 		wait(100);
 	}
 
+	// Creates a system for the test, which is closed by TearDown(). Unless the params say otherwise, the events go to m_Batch.
+	HFES init(SFileEventsCreateParams params)
+	{
+		if( !params.m_Callback && !params.m_BatchCallback && !params.m_EventRingSize )
+		{
+			params.m_BatchCallback = BatchCallback;
+			params.m_CallbackCtx = &m_Batch;
+		}
+		m_FileEvents = fe_init(params);
+		return m_FileEvents;
+	}
+
+	// Closes the system, so that the events can be checked without it adding more
+	void close()
+	{
+		if( m_FileEvents )
+			fe_close(m_FileEvents);
+		m_FileEvents = 0;
+	}
+
+	// A directory (with the parents already there) that is removed by TearDown(), with everything the test left in it
+	std::string make_dir(const std::string& path)
+	{
+		mkdir(path.c_str(), 0755);
+		m_CreatedFolders.insert(path);
+		return path;
+	}
+
+	// A path that is removed by TearDown(), if the test left something there
+	std::string cleanup(const std::string& path)
+	{
+		m_CreatedFiles.insert(path);
+		return path;
+	}
+
 	const char* getcwd() const
 	{
 		return m_Cwd.c_str();
 	}
 
-	size_t get_num_callback_operations() const
+	size_t get_num_callback_operations()
 	{
+		std::lock_guard<std::mutex> lock(m_Lock);
 		return m_CallbackOperations.size();
 	}
 
+	bool wait_operations(size_t count)
+	{
+		return wait_until([&]() { return get_num_callback_operations() >= count; });
+	}
+
 	HFESWatchID add_watch(const char* path, uint32_t flags)
 	{
 		HFESWatchID id = fe_add_watch(m_FileEvents, path, flags);
@@ -161,6 +308,28 @@ public:
 		return 1;
 	}
 
+	uint32_t create_dir(const char* path, bool expect_event)
+	{
+		if( expect_event )
+		{
+			SOperation op;
+			op.m_Flags = FE_CREATED | FE_IS_DIR;
+			op.m_Path = path;
+			m_PerformedOperations.push_back(op);
+		}
+
+		if( mkdir(path, 0755) != 0 )
+		{
+			fprintf(stderr, "Failed creating directory %s\n", path);
+			return 0;
+		}
+
+		printf("Created directory %s\n", path);
+		fflush(stdout);
+		m_CreatedFolders.insert(path);
+		return 1;
+	}
+
 	uint32_t modify_file(const char* path, uint8_t* data, size_t size)
 	{
 		SOperation op;
@@ -206,7 +375,7 @@ public:
 		auto it = m_CreatedFiles.find(path);
 		if( it != m_CreatedFiles.end() )
 			m_CreatedFiles.erase(it);
-		m_CreatedFiles.insert(path);
+		m_CreatedFiles.insert(destpath);
 
 		return rename(path, destpath) == 0 ? 0 : 1;
 	}
@@ -247,6 +416,7 @@ public:
 		SOperation op;
 		op.m_Flags = flags;
 		op.m_Path = path;
+		std::lock_guard<std::mutex> lock(ctx->m_Lock);
 		ctx->m_CallbackOperations.push_back(op);
 		printf("path %s   flags %0X\n", path, flags);
 		return 0;
@@ -257,6 +427,10 @@ public:
 						FileEventsTest fe; \
 						fe.SetUp();
 
+// For the tests that make their own system(s) with init(), and check the events in fe.m_Batch
+#define FEBATCHTEST()	printf("%s:\n", __FUNCTION__); \
+						FileEventsTest fe;
+
 #define FETESTEND()		fe.TearDown(); \
 						return fe.validate();
 
@@ -311,7 +485,7 @@ TEST FE_OneCreateEvent()
 
 	fe.create_file( fe.get_path("foobar3.txt").c_str() );
 
-	fe.wait(3500);
+	fe.wait_operations(1);
 	ASSERT_EQ(1, fe.get_num_callback_operations());
 
 	int32_t result = fe.remove_watch(wid);
@@ -320,11 +494,1440 @@ TEST FE_OneCreateEvent()
 	FETESTEND();
 }
 
+TEST FE_RecursiveCreateEvent()
+{
+	FETEST();
+	// The sub directory exists before the watch is added
+	fe.create_dir( fe.get_path("subdir1").c_str(), false );
+
+	HFESWatchID wid = fe.add_watch(fe.getcwd(), FE_ALL | FE_RECURSIVE);
+	ASSERT_NE( -1, wid );
+
+	fe.wait_running();
+
+	fe.create_file( fe.get_path("subdir1/foobar4.txt").c_str() );
+
+	fe.wait_operations(1);
+	ASSERT_EQ(1, fe.get_num_callback_operations());
+
+	int32_t result = fe.remove_watch(wid);
+	ASSERT_EQ( 0, result );
+
+	FETESTEND();
+}
+
+TEST FE_RecursiveNewDirectory()
+{
+	FETEST();
+	HFESWatchID wid = fe.add_watch(fe.getcwd(), FE_ALL | FE_RECURSIVE);
+	ASSERT_NE( -1, wid );
+
+	fe.wait_running();
+
+	// The file is created before the watch of the new directory is added
+	fe.create_dir( fe.get_path("subdir2").c_str(), true );
+	fe.create_file( fe.get_path("subdir2/foobar5.txt").c_str() );
+
+	fe.wait_operations(2);
+	ASSERT_EQ(2, fe.get_num_callback_operations());
+
+	int32_t result = fe.remove_watch(wid);
+	ASSERT_EQ( 0, result );
+
+	FETESTEND();
+}
+
+TEST FE_HashIndex()
+{
+	// Keys are stored outside of the index, the values are indices into this array
+	std::vector<uint32_t> keys;
+	std::vector<bool> alive;
+	SHashIndex index;
+
+	const uint32_t count = 20000;
+	for( uint32_t i = 0; i < count; ++i )
+	{
+		uint32_t key = i * 7919;
+		keys.push_back(key);
+		alive.push_back(true);
+		index.insert(fe_hash_int(key) & 0xFFF, i); // Lots of collisions
+	}
+
+	// Remove every third
+	for( uint32_t i = 0; i < count; i += 3 )
+	{
+		ASSERT( index.erase(fe_hash_int(keys[i]) & 0xFFF, [&](uint32_t v) { return keys[v] == keys[i]; }) );
+		alive[i] = false;
+	}
+
+	for( uint32_t i = 0; i < count; ++i )
+	{
+		uint32_t found = index.find(fe_hash_int(keys[i]) & 0xFFF, [&](uint32_t v) { return keys[v] == keys[i]; });
+		ASSERT_EQ( alive[i] ? i : FE_HASH_INVALID, found );
+	}
+	ASSERT_EQ( count - (count + 2) / 3, index.m_Count );
+	PASS();
+}
+
+static std::string tree_path(const SPathTree& tree, uint32_t node, const char* name = "")
+{
+	std::string path(tree.path_length(node, (uint32_t)strlen(name)), '\0');
+	tree.write_path(node, name, (uint32_t)strlen(name), &path[0]);
+	return path;
+}
+
+TEST FE_PathTree()
+{
+	SPathTree tree;
+
+	// The paths come back exactly as they went in
+	const char* paths[] = { "/", "/tmp/a/b", "/tmp/a/b/c", "/tmp/a", "/tmp/a//d", "/tmp/a/e/", "rel/x" };
+	uint32_t nodes[7];
+	for( uint32_t i = 0; i < 7; ++i )
+	{
+		nodes[i] = tree.intern(paths[i], (uint32_t)strlen(paths[i]));
+		ASSERT_EQ( nodes[i], tree.find(paths[i], (uint32_t)strlen(paths[i])) );
+	}
+	for( uint32_t i = 0; i < 7; ++i )
+		ASSERT( tree_path(tree, nodes[i]) == paths[i] );
+	ASSERT( tree_path(tree, nodes[0], "file.txt") == "/file.txt" );
+	ASSERT( tree_path(tree, nodes[1], "file.txt") == "/tmp/a/b/file.txt" );
+
+	// "/" contains everything else that's absolute, so they're all below it
+	ASSERT_EQ( 2u, (uint32_t)tree.m_Roots.size() );
+	ASSERT( tree.is_in(nodes[2], nodes[3]) );
+	ASSERT( tree.is_in(nodes[3], nodes[0]) );
+	ASSERT( !tree.is_in(nodes[3], nodes[1]) );
+	ASSERT_EQ( FE_PATH_NONE, tree.find("/tmp/a/bb", 9) );
+	ASSERT( tree.find("/tmp", 4) != FE_PATH_NONE );
+
+	// Interning again only adds a reference
+	uint32_t count = tree.m_Count;
+	ASSERT_EQ( nodes[1], tree.intern("/tmp/a/b", 8) );
+	ASSERT_EQ( count, tree.m_Count );
+	tree.release(nodes[1]);
+
+	// A node stays while something below it is used
+	tree.release(nodes[1]);
+	ASSERT( tree_path(tree, nodes[2]) == "/tmp/a/b/c" );
+	tree.release(nodes[2]);
+	ASSERT_EQ( FE_PATH_NONE, tree.find("/tmp/a/b", 8) );
+
+	// The names of the released nodes are compacted away
+	uint32_t last = FE_PATH_NONE;
+	char path[64];
+	for( uint32_t i = 0; i < 2000; ++i )
+	{
+		snprintf(path, sizeof(path), "/tmp/a/churn_%u/file", i);
+		uint32_t node = tree.intern(path, (uint32_t)strlen(path));
+		if( last != FE_PATH_NONE )
+			tree.release(last);
+		last = node;
+	}
+	ASSERT( tree_path(tree, last) == path );
+	ASSERT( tree.m_Names.size() < 4096 * 2 );
+	tree.release(last);
+
+	for( uint32_t i = 0; i < 7; ++i )
+	{
+		if( i != 1 && i != 2 )
+			tree.release(nodes[i]);
+	}
+	ASSERT_EQ( 0u, tree.m_Count );
+	ASSERT_EQ( 0u, (uint32_t)tree.m_Roots.size() );
+	ASSERT_EQ( 0u, tree.m_Index.m_Count );
+	ASSERT_EQ( 0u, tree.m_NamesUsed );
+	PASS();
+}
+
+static SSnapshotInfo make_info(uint64_t inode, int64_t mtime, bool isdir)
+{
+	SSnapshotInfo info = { inode, mtime, 0, isdir ? 0040755u : 0100644u, 0 };
+	return info;
+}
+
+static uint32_t find_batch_event(const SEventBatch& batch, const char* path, uint32_t flags)
+{
+	for( const SFileEvent& event : batch.m_Events )
+	{
+		if( (event.m_Flags & flags) == flags && std::string(&batch.m_Strings[event.m_PathOffset], event.m_PathLength) == path )
+			return event.m_Flags;
+	}
+	return 0;
+}
+
+TEST FE_SnapshotDiff()
+{
+	SSnapshot snapshot;
+	uint32_t root = snapshot.add_root("/r", make_info(1, 0, true));
+	uint32_t a = snapshot.add(root, "a", 1, make_info(2, 0, true));
+	snapshot.add(a, "f", 1, make_info(3, 0, false));
+	snapshot.add(root, "g", 1, make_info(4, 0, false));
+	snapshot.add(root, "h", 1, make_info(5, 0, false));
+	ASSERT_EQ( 5u, snapshot.m_Count );
+
+	// g is modified, h is replaced with a directory, a/f is removed, and a/b/x is created
+	SSnapshot scan;
+	uint32_t scanroot = scan.add_root("/r", make_info(1, 0, true));
+	uint32_t scana = scan.add(scanroot, "a", 1, make_info(2, 0, true));
+	uint32_t scanb = scan.add(scana, "b", 1, make_info(6, 0, true));
+	scan.add(scanb, "x", 1, make_info(7, 0, false));
+	scan.add(scanroot, "g", 1, make_info(4, 1, false));
+	scan.add(scanroot, "h", 1, make_info(8, 0, true));
+
+	SEventBatch batch;
+	fe_snapshot_diff(&snapshot, root, &scan, scanroot, true, 1, &batch);
+	ASSERT_EQ( 6u, (uint32_t)batch.m_Events.size() );
+	ASSERT( find_batch_event(batch, "/r/g", FE_MODIFIED | FE_IS_FILE) );
+	ASSERT( find_batch_event(batch, "/r/h", FE_REMOVED | FE_IS_FILE) );
+	ASSERT( find_batch_event(batch, "/r/h", FE_CREATED | FE_IS_DIR) );
+	ASSERT( find_batch_event(batch, "/r/a/f", FE_REMOVED | FE_IS_FILE) );
+	ASSERT( find_batch_event(batch, "/r/a/b", FE_CREATED | FE_IS_DIR) );
+	ASSERT( find_batch_event(batch, "/r/a/b/x", FE_CREATED | FE_IS_FILE) );
+	ASSERT_EQ( scan.m_Count, snapshot.m_Count );
+
+	// Nothing changed since
+	batch.m_Events.clear();
+	batch.m_Strings.clear();
+	fe_snapshot_diff(&snapshot, root, &scan, scanroot, true, 1, &batch);
+	ASSERT_EQ( 0u, (uint32_t)batch.m_Events.size() );
+
+	// Moving a directory moves its contents with it
+	snapshot.move_path("/r/a", "/r/c");
+	ASSERT_EQ( FE_SNAPSHOT_NONE, snapshot.find_path("/r/a/b/x") );
+	uint32_t x = snapshot.find_path("/r/c/b/x");
+	ASSERT( x != FE_SNAPSHOT_NONE );
+	std::string path;
+	snapshot.get_path(x, path);
+	ASSERT_STR_EQ( "/r/c/b/x", path.c_str() );
+
+	snapshot.remove_path("/r/c");
+	ASSERT_EQ( FE_SNAPSHOT_NONE, snapshot.find_path("/r/c/b") );
+	ASSERT_EQ( 3u, snapshot.m_Count );
+	PASS();
+}
+
+TEST FE_BatchCallback()
+{
+	FEBATCHTEST();
+	SFileEventsCreateParams params;
+	fe.init(params);
+	HFESWatchID wid = fe.add_watch(fe.getcwd(), 0);
+	ASSERT_NE( -1, wid );
+
+	std::vector<std::string> paths;
+	for( int i = 0; i < 3; ++i )
+	{
+		std::string path = fe.cleanup(fe.get_path(("batch" + std::to_string(i) + ".txt").c_str()));
+		FILE* file = fopen(path.c_str(), "wb");
+		fclose(file);
+		paths.push_back(path);
+	}
+
+	ASSERT( wait_event(fe.m_Batch, FE_CREATED | FE_IS_FILE, paths.back().c_str()) );
+	fe.close();
+
+	const SBatchContext& ctx = fe.m_Batch;
+	ASSERT_EQ( 3, ctx.m_Events.size() );
+	ASSERT( ctx.m_NumBatches >= 1 );
+	for( size_t i = 0; i < ctx.m_Events.size(); ++i )
+	{
+		ASSERT_EQ( wid, ctx.m_Events[i].m_WatchID );
+		ASSERT_EQ( FE_CREATED | FE_IS_FILE, ctx.m_Events[i].m_Flags );
+		ASSERT_STR_EQ( paths[i].c_str(), ctx.m_Paths[i].c_str() );
+	}
+	PASS();
+}
+
+TEST FE_PollEvents()
+{
+	FEBATCHTEST();
+	SFileEventsCreateParams params;
+	params.m_EventRingSize = 64 * 1024;
+	HFES hfes = fe.init(params);
+	HFESWatchID wid = fe.add_watch(fe.getcwd(), 0);
+	ASSERT_NE( -1, wid );
+
+	std::string path = fe.cleanup(fe.get_path("polled.txt"));
+	FILE* file = fopen(path.c_str(), "wb");
+	fclose(file);
+
+	SFileEvent events[16];
+	char strings[4096];
+	uint32_t count = 0;
+	wait_until([&]() { count = fe_poll_events(hfes, events, 16, strings, sizeof(strings)); return count != 0; });
+	fe.close();
+
+	ASSERT_EQ( 1, count );
+	ASSERT_EQ( wid, events[0].m_WatchID );
+	ASSERT_EQ( FE_CREATED | FE_IS_FILE, events[0].m_Flags );
+	ASSERT_STR_EQ( path.c_str(), strings + events[0].m_PathOffset );
+	PASS();
+}
+
+TEST FE_PollEventsSmallBuffer()
+{
+	FEBATCHTEST();
+	SFileEventsCreateParams params;
+	params.m_EventRingSize = 64 * 1024;
+	HFES hfes = fe.init(params);
+	ASSERT_NE( -1, fe.add_watch(fe.getcwd(), 0) );
+
+	std::string path = fe.cleanup(fe.get_path((std::string(100, 'x') + ".txt").c_str()));
+	FILE* file = fopen(path.c_str(), "wb");
+	fclose(file);
+
+	// The path doesn't fit, so the event is dropped and reported as an overflow (instead of being stuck in the ring)
+	SFileEvent events[16];
+	char strings[64];
+	uint32_t count = 0;
+	wait_until([&]() { count = fe_poll_events(hfes, events, 16, strings, sizeof(strings)); return count != 0; });
+	uint64_t value;
+	ssize_t signalled = read(fe_get_event_fd(hfes), &value, sizeof(value));
+	SFileEventsStats stats;
+	fe_get_stats(hfes, &stats);
+	fe.close();
+
+	ASSERT_EQ( 1, count );
+	ASSERT_EQ( -1, events[0].m_WatchID );
+	ASSERT_EQ( FE_OVERFLOW, events[0].m_Flags );
+	ASSERT_STR_EQ( "", strings + events[0].m_PathOffset );
+	ASSERT_EQ( 1u, stats.m_EventsDropped );
+	// The ring is empty, so the event fd isn't signalled again
+	ASSERT_EQ( -1, signalled );
+	PASS();
+}
+
+TEST FE_CoalesceEvents()
+{
+	FEBATCHTEST();
+	SFileEventsCreateParams params;
+	params.m_CoalesceMs = 500;
+	fe.init(params);
+	HFESWatchID wid = fe.add_watch(fe.getcwd(), 0);
+	ASSERT_NE( -1, wid );
+
+	std::string path = fe.cleanup(fe.get_path("coalesced.txt"));
+	FILE* file = fopen(path.c_str(), "wb");
+	for( int i = 0; i < 100; ++i )
+	{
+		fwrite(path.c_str(), 1, path.size(), file);
+		fflush(file);
+	}
+	fclose(file);
+
+	// Comes and goes within the window
+	std::string temppath = fe.cleanup(fe.get_path("coalesced.tmp"));
+	file = fopen(temppath.c_str(), "wb");
+	fclose(file);
+	remove(temppath.c_str());
+
+	ASSERT( wait_event(fe.m_Batch, FE_CREATED | FE_MODIFIED | FE_IS_FILE, path.c_str()) );
+	fe.close();
+
+	const SBatchContext& ctx = fe.m_Batch;
+	ASSERT_EQ( 1, ctx.m_Events.size() );
+	ASSERT_EQ( FE_CREATED | FE_MODIFIED | FE_IS_FILE, ctx.m_Events[0].m_Flags );
+	ASSERT_STR_EQ( path.c_str(), ctx.m_Paths[0].c_str() );
+	PASS();
+}
+
+TEST FE_RenameEvent()
+{
+	FETEST();
+	HFESWatchID wid = fe.add_watch(fe.getcwd(), 0);
+	ASSERT_NE( -1, wid );
+
+	fe.wait_running();
+
+	fe.create_file( fe.get_path("renamed_src.txt").c_str() );
+	fe.rename_file( fe.get_path("renamed_src.txt").c_str(), fe.get_path("renamed_dst.txt").c_str() );
+
+	fe.wait_operations(3);
+	ASSERT_EQ(3, fe.get_num_callback_operations());
+
+	FETESTEND();
+}
+
+TEST FE_RenamePairing()
+{
+	FEBATCHTEST();
+	std::string dir = fe.make_dir(fe.get_path("renames"));
+	std::string src = fe.cleanup(dir + "/src.txt");
+	std::string dst = fe.cleanup(dir + "/dst.txt");
+	std::string outside = fe.cleanup(fe.get_path("renamed_outside.txt"));
+	FILE* file = fopen(src.c_str(), "wb");
+	fclose(file);
+
+	SFileEventsCreateParams params;
+	fe.init(params);
+	HFESWatchID wid = fe.add_watch(dir.c_str(), 0);
+	ASSERT_NE( -1, wid );
+
+	// Within the watched directory, and then out of it
+	rename(src.c_str(), dst.c_str());
+	rename(dst.c_str(), outside.c_str());
+
+	ASSERT( wait_event(fe.m_Batch, FE_REMOVED | FE_IS_FILE, dst.c_str()) );
+	fe.close();
+
+	const SBatchContext& ctx = fe.m_Batch;
+	ASSERT_EQ( 2, ctx.m_Events.size() );
+	ASSERT_EQ( FE_RENAMED | FE_IS_FILE, ctx.m_Events[0].m_Flags );
+	ASSERT_STR_EQ( src.c_str(), ctx.m_Paths[0].c_str() );
+	ASSERT_STR_EQ( dst.c_str(), ctx.m_Targets[0].c_str() );
+	ASSERT_EQ( FE_REMOVED | FE_IS_FILE, ctx.m_Events[1].m_Flags );
+	ASSERT_STR_EQ( dst.c_str(), ctx.m_Paths[1].c_str() );
+	ASSERT_EQ( 0, ctx.m_Events[1].m_TargetLength );
+	PASS();
+}
+
+TEST FE_RenameOutRecreated()
+{
+	FEBATCHTEST();
+	std::string dir = fe.make_dir(fe.get_path("renames"));
+	std::string path = fe.cleanup(dir + "/file.txt");
+	std::string outside = fe.cleanup(fe.get_path("renamed_outside.txt"));
+	fclose(fopen(path.c_str(), "wb"));
+
+	SFileEventsCreateParams params;
+	fe.init(params);
+	ASSERT_NE( -1, fe.add_watch(dir.c_str(), 0) );
+
+	// The rename out of the watched directory is reported before the new file with the same name
+	rename(path.c_str(), outside.c_str());
+	fclose(fopen(path.c_str(), "wb"));
+
+	ASSERT( wait_event(fe.m_Batch, FE_CREATED | FE_IS_FILE, path.c_str()) );
+	fe.close();
+
+	const SBatchContext& ctx = fe.m_Batch;
+	ASSERT( ctx.m_Events.size() >= 2 );
+	ASSERT_EQ( FE_REMOVED | FE_IS_FILE, ctx.m_Events[0].m_Flags );
+	ASSERT_STR_EQ( path.c_str(), ctx.m_Paths[0].c_str() );
+	ASSERT_EQ( FE_CREATED | FE_IS_FILE, ctx.m_Events[1].m_Flags );
+	ASSERT_STR_EQ( path.c_str(), ctx.m_Paths[1].c_str() );
+	for( size_t i = 2; i < ctx.m_Events.size(); ++i )
+		ASSERT_EQ( 0, ctx.m_Events[i].m_Flags & FE_REMOVED );
+	PASS();
+}
+
+struct SOverflowContext
+{
+	SBatchContext 		m_Batch;
+	std::atomic<bool> 	m_Blocked;
+	std::atomic<bool> 	m_Release;
+};
+
+// Holds up the event thread, so that the kernel queue fills up
+static int BlockingBatchCallback( const SFileEvent* events, uint32_t count, const char* strings, void* _ctx )
+{
+	SOverflowContext* ctx = (SOverflowContext*)_ctx;
+	ctx->m_Blocked = true;
+	wait_until([&]() { return ctx->m_Release.load(); });
+	return BatchCallback(events, count, strings, &ctx->m_Batch);
+}
+
+// Removes and creates the file again, as soon as it's reported (before the queue has been drained)
+struct SRecreateContext
+{
+	SBatchContext 	m_Batch;
+	std::string 	m_Path;
+	bool 			m_Recreated;
+	bool 			_padding[7];
+};
+
+static int RecreateBatchCallback( const SFileEvent* events, uint32_t count, const char* strings, void* _ctx )
+{
+	SRecreateContext* ctx = (SRecreateContext*)_ctx;
+	BatchCallback(events, count, strings, &ctx->m_Batch);
+	if( !ctx->m_Recreated && find_event(ctx->m_Batch, 0, FE_CREATED | FE_IS_FILE, ctx->m_Path.c_str()) >= 0 )
+	{
+		ctx->m_Recreated = true;
+		remove(ctx->m_Path.c_str());
+		fclose(fopen(ctx->m_Path.c_str(), "wb"));
+	}
+	return 0;
+}
+
+TEST FE_RecursiveRecreated()
+{
+	// Declared first, so that it outlives the system
+	SRecreateContext ctx;
+	FEBATCHTEST();
+	std::string root = fe.make_dir(fe.get_path("recreate"));
+	std::string dir = root + "/dir";
+
+	ctx.m_Path = dir + "/file.txt";
+	ctx.m_Recreated = false;
+	SFileEventsCreateParams params;
+	params.m_BatchCallback = RecreateBatchCallback;
+	params.m_CallbackCtx = &ctx;
+	fe.init(params);
+	ASSERT_NE( -1, fe.add_watch(root.c_str(), FE_ALL | FE_RECURSIVE) );
+
+	// The file is (usually) found by the listing of the new directory. The kernel events of the new file that
+	// replaces it aren't mistaken for the ones the listing already reported.
+	fe.make_dir(dir);
+	fe.cleanup(ctx.m_Path);
+	fclose(fopen(ctx.m_Path.c_str(), "wb"));
+	wait_until([&]() {
+		int removed = find_event(ctx.m_Batch, 0, FE_REMOVED | FE_IS_FILE, ctx.m_Path.c_str());
+		return removed >= 0 && find_event(ctx.m_Batch, (size_t)removed, FE_CREATED | FE_IS_FILE, ctx.m_Path.c_str()) > removed;
+	});
+	fe.close();
+
+	ASSERT( ctx.m_Recreated );
+	int last = -1;
+	for( size_t i = 0; i < ctx.m_Batch.m_Events.size(); ++i )
+	{
+		if( ctx.m_Batch.m_Paths[i] == ctx.m_Path )
+			last = (int)i;
+	}
+	ASSERT( last >= 0 );
+	ASSERT_EQ( (uint32_t)(FE_CREATED | FE_IS_FILE), ctx.m_Batch.m_Events[(size_t)last].m_Flags );
+	PASS();
+}
+
+TEST FE_OverflowRescan()
+{
+	// Declared first, so that it outlives the system
+	SOverflowContext ctx;
+	FEBATCHTEST();
+	ctx.m_Blocked = false;
+	ctx.m_Release = false;
+
+	std::string dir = fe.make_dir(fe.get_path("overflow"));
+	std::string trigger = fe.cleanup(dir + "/trigger.txt");
+	std::string a = fe.cleanup(dir + "/a.txt");
+	std::string b = fe.cleanup(dir + "/b.txt");
+	std::string gone = fe.cleanup(dir + "/gone.txt");
+	std::string added = fe.cleanup(dir + "/added.txt");
+	std::string sub = fe.make_dir(dir + "/sub");
+	std::string subgone = fe.cleanup(sub + "/gone.txt");
+	FILE* filea = fopen(a.c_str(), "wb");
+	FILE* fileb = fopen(b.c_str(), "wb");
+	fclose(fopen(gone.c_str(), "wb"));
+	fclose(fopen(subgone.c_str(), "wb"));
+
+	SFileEventsCreateParams params;
+	params.m_BatchCallback = BlockingBatchCallback;
+	params.m_CallbackCtx = &ctx;
+	params.m_RescanOnOverflow = true;
+	HFES hfes = fe.init(params);
+	HFESWatchID wid = fe.add_watch(dir.c_str(), FE_ALL | FE_RECURSIVE);
+	ASSERT_NE( -1, wid );
+	// Inside the recursive watch, so it's rescanned with it
+	ASSERT_NE( -1, fe.add_watch(sub.c_str(), 0) );
+
+	// The first event blocks the thread, then the queue fills up with (unique) modifications, and the rest is lost
+	fclose(fopen(trigger.c_str(), "wb"));
+	ASSERT( wait_until([&]() { return ctx.m_Blocked.load(); }) );
+	for( int i = 0; i < 20000; ++i )
+	{
+		FILE* file = (i & 1) ? fileb : filea;
+		fputc('x', file);
+		fflush(file);
+	}
+	fclose(filea);
+	fclose(fileb);
+	remove(gone.c_str());
+	remove(subgone.c_str());
+	fclose(fopen(added.c_str(), "wb"));
+
+	// The differences found by the rescan come after the overflow
+	ctx.m_Release = true;
+	const SBatchContext& batch = ctx.m_Batch;
+	wait_until([&]() {
+		int overflow = find_event(batch, 0, FE_OVERFLOW, dir.c_str());
+		return overflow >= 0 &&
+			find_event(batch, (size_t)overflow, FE_REMOVED | FE_IS_FILE, gone.c_str()) >= 0 &&
+			find_event(batch, (size_t)overflow, FE_CREATED | FE_IS_FILE, added.c_str()) >= 0 &&
+			find_event(batch, (size_t)overflow, FE_REMOVED | FE_IS_FILE, subgone.c_str()) >= 0;
+	});
+	SFileEventsStats stats;
+	fe_get_stats(hfes, &stats);
+	fe.close();
+
+	int overflow = find_event(batch, 0, FE_OVERFLOW, dir.c_str());
+	ASSERT( overflow >= 0 );
+	ASSERT_EQ( wid, batch.m_Events[(size_t)overflow].m_WatchID );
+	ASSERT( find_event(batch, (size_t)overflow, FE_REMOVED | FE_IS_FILE, gone.c_str()) >= 0 );
+	ASSERT( find_event(batch, (size_t)overflow, FE_CREATED | FE_IS_FILE, added.c_str()) >= 0 );
+	ASSERT( find_event(batch, (size_t)overflow, FE_REMOVED | FE_IS_FILE, subgone.c_str()) >= 0 );
+	ASSERT_EQ( 2, stats.m_KernelWatches );
+	PASS();
+}
+
+TEST FE_Journal()
+{
+	FEBATCHTEST();
+	std::string dir = fe.make_dir(fe.get_path("journal"));
+	std::string journal = fe.cleanup(fe.get_path("journal.bin"));
+	std::string modified = fe.cleanup(dir + "/modified.txt");
+	std::string gone = fe.cleanup(dir + "/gone.txt");
+	std::string added = fe.cleanup(dir + "/added.txt");
+	remove(journal.c_str());
+	fclose(fopen(modified.c_str(), "wb"));
+	fclose(fopen(gone.c_str(), "wb"));
+
+	SFileEventsCreateParams params;
+	params.m_JournalPath = journal.c_str();
+
+	// The first run only records what the directory looks like (the watch is scanned by fe_add_watch())
+	fe.init(params);
+	ASSERT_NE( -1, fe.add_watch(dir.c_str(), 0) );
+	fe.close();
+	ASSERT_EQ( 0u, (uint32_t)num_events(fe.m_Batch) );
+
+	// Changes while nobody is watching
+	FILE* file = fopen(modified.c_str(), "wb");
+	fputs("changed", file);
+	fclose(file);
+	remove(gone.c_str());
+	fclose(fopen(added.c_str(), "wb"));
+
+	fe.init(params);
+	HFESWatchID wid = fe.add_watch(dir.c_str(), 0);
+	ASSERT_NE( -1, wid );
+	wait_until([&]() { return num_events(fe.m_Batch) >= 3; });
+	fe.close();
+
+	const SBatchContext& ctx = fe.m_Batch;
+	ASSERT_EQ( 3u, (uint32_t)ctx.m_Events.size() );
+	ASSERT( find_event(ctx, 0, FE_MODIFIED | FE_IS_FILE, modified.c_str()) >= 0 );
+	ASSERT( find_event(ctx, 0, FE_REMOVED | FE_IS_FILE, gone.c_str()) >= 0 );
+	ASSERT( find_event(ctx, 0, FE_CREATED | FE_IS_FILE, added.c_str()) >= 0 );
+	ASSERT_EQ( wid, ctx.m_Events[0].m_WatchID );
+
+	// A run that doesn't watch the directory drops it from the journal, so there's nothing to replay after that
+	fe.init(params);
+	fe.close();
+	SSnapshot saved;
+	ASSERT( fe_snapshot_load(&saved, journal.c_str()) );
+	ASSERT_EQ( FE_SNAPSHOT_NONE, saved.find_path(dir) );
+	PASS();
+}
+
+struct SDispatchContext
+{
+	std::mutex 								m_Lock;
+	std::map<std::string, std::vector<uint32_t> > m_Flags;	// Per path, in the order they were delivered
+	std::set<std::thread::id> 				m_Threads;
+};
+
+static int DispatchCallback( const char* path, EFileEvents flags, void* _ctx )
+{
+	SDispatchContext* ctx = (SDispatchContext*)_ctx;
+	std::this_thread::sleep_for( std::chrono::milliseconds(1) ); // A slow callback
+	std::lock_guard<std::mutex> lock(ctx->m_Lock);
+	ctx->m_Flags[path].push_back(flags);
+	ctx->m_Threads.insert(std::this_thread::get_id());
+	return 0;
+}
+
+TEST FE_DispatchThreads()
+{
+	// Declared first, so that it outlives the system
+	SDispatchContext ctx;
+	FEBATCHTEST();
+	std::string dir = fe.make_dir(fe.get_path("dispatch"));
+
+	SFileEventsCreateParams params;
+	params.m_Callback = DispatchCallback;
+	params.m_CallbackCtx = &ctx;
+	params.m_DispatchThreads = 4;
+	fe.init(params);
+	ASSERT_NE( -1, fe.add_watch(dir.c_str(), 0) );
+
+	std::vector<std::string> paths;
+	for( int i = 0; i < 64; ++i )
+	{
+		std::string path = fe.cleanup(dir + "/file" + std::to_string(i) + ".txt");
+		paths.push_back(path);
+		FILE* file = fopen(path.c_str(), "wb");
+		fputs("data", file);
+		fclose(file);
+		remove(path.c_str());
+	}
+	wait_until([&]() {
+		std::lock_guard<std::mutex> lock(ctx.m_Lock);
+		for( const std::string& path : paths )
+		{
+			std::map<std::string, std::vector<uint32_t> >::const_iterator it = ctx.m_Flags.find(path);
+			if( it == ctx.m_Flags.end() || !(it->second.back() & FE_REMOVED) )
+				return false;
+		}
+		return true;
+	});
+	fe.close();
+
+	ASSERT( ctx.m_Threads.size() > 1 );
+	for( const std::string& path : paths )
+	{
+		const std::vector<uint32_t>& flags = ctx.m_Flags[path];
+		ASSERT( flags.size() >= 2 );
+		ASSERT( flags.front() & FE_CREATED );
+		ASSERT( flags.back() & FE_REMOVED );
+	}
+	PASS();
+}
+
+struct SOrderContext
+{
+	std::mutex 					m_Lock;
+	std::vector<uint32_t> 		m_Flags;
+	std::vector<std::string> 	m_Paths;
+	std::string 				m_Slow;	// The callback is held up when this path is modified
+};
+
+static int OrderBatchCallback( const SFileEvent* events, uint32_t count, const char* strings, void* _ctx )
+{
+	SOrderContext* ctx = (SOrderContext*)_ctx;
+	for( uint32_t i = 0; i < count; ++i )
+	{
+		const char* path = strings + events[i].m_PathOffset;
+		if( (events[i].m_Flags & FE_MODIFIED) && ctx->m_Slow == path )
+			std::this_thread::sleep_for( std::chrono::milliseconds(300) );
+		std::lock_guard<std::mutex> lock(ctx->m_Lock);
+		ctx->m_Flags.push_back(events[i].m_Flags);
+		ctx->m_Paths.push_back(path);
+	}
+	return 0;
+}
+
+// A rename is delivered by the thread of its new path, but after the events of the old path that came before it,
+// and before the ones that came after it
+TEST FE_DispatchRenameOrder()
+{
+	// Declared first, so that it outlives the system
+	SOrderContext ctx;
+	FEBATCHTEST();
+	std::string dir = fe.make_dir(fe.get_path("dispatch_order"));
+	std::string src = fe.cleanup(dir + "/src.txt");
+
+	// The old and the new path go to different threads
+	const uint32_t numthreads = 4;
+	std::string dst;
+	for( int i = 0; dst.empty() || fe_hash_string(dst.c_str()) % numthreads == fe_hash_string(src.c_str()) % numthreads; ++i )
+		dst = dir + "/dst" + std::to_string(i) + ".txt";
+	fe.cleanup(dst);
+	ctx.m_Slow = src;
+
+	SFileEventsCreateParams params;
+	params.m_BatchCallback = OrderBatchCallback;
+	params.m_CallbackCtx = &ctx;
+	params.m_DispatchThreads = numthreads;
+	fe.init(params);
+	ASSERT_NE( -1, fe.add_watch(dir.c_str(), FE_CREATED | FE_MODIFIED | FE_RENAMED) );
+
+	FILE* file = fopen(src.c_str(), "wb");
+	fputs("data", file);
+	fclose(file);
+	rename(src.c_str(), dst.c_str());
+	fclose(fopen(src.c_str(), "wb"));
+
+	// The new file is the last event of the old path
+	int modified = -1, renamed = -1, created = -1;
+	wait_until([&]() {
+		std::lock_guard<std::mutex> lock(ctx.m_Lock);
+		modified = renamed = created = -1;
+		for( size_t i = 0; i < ctx.m_Flags.size(); ++i )
+		{
+			if( ctx.m_Paths[i] != src )
+				continue;
+			if( ctx.m_Flags[i] & FE_MODIFIED )
+				modified = (int)i;
+			else if( ctx.m_Flags[i] & FE_RENAMED )
+				renamed = (int)i;
+			else if( (ctx.m_Flags[i] & FE_CREATED) && renamed >= 0 )
+				created = (int)i;
+		}
+		return created >= 0;
+	});
+	fe.close();
+
+	ASSERT( modified >= 0 );
+	ASSERT( renamed > modified );
+	ASSERT( created > renamed );
+	PASS();
+}
+
+TEST FE_SharedEngine()
+{
+	// Declared first, so that it outlives the system
+	SBatchContext ctxa;
+	FEBATCHTEST();
+	std::string dir = fe.make_dir(fe.get_path("shared"));
+	std::string first = fe.cleanup(dir + "/first.txt");
+	std::string second = fe.cleanup(dir + "/second.txt");
+
+	SFileEventsCreateParams params;
+	params.m_SharedEngine = true;
+	params.m_BatchCallback = BatchCallback;
+	params.m_CallbackCtx = &ctxa;
+	HFES a = fe_init(params);
+	params.m_BatchCallback = 0;
+	params.m_CallbackCtx = 0;
+	HFES b = fe.init(params);
+	const SBatchContext& ctxb = fe.m_Batch;
+
+	// Both use the same kernel watch
+	ASSERT_NE( -1, fe_add_watch(a, dir.c_str(), FE_RECURSIVE) );
+	ASSERT_NE( -1, fe_add_watch(b, dir.c_str(), 0) );
+
+	fclose(fopen(first.c_str(), "wb"));
+	bool firsta = wait_event(ctxa, FE_CREATED | FE_IS_FILE, first.c_str());
+	bool firstb = wait_event(ctxb, FE_CREATED | FE_IS_FILE, first.c_str());
+
+	// The kernel watch is still used by the other one
+	fe_close(a);
+	fclose(fopen(second.c_str(), "wb"));
+	bool secondb = wait_event(ctxb, FE_CREATED | FE_IS_FILE, second.c_str());
+	fe.close();
+
+	ASSERT( firsta );
+	ASSERT( firstb );
+	ASSERT( secondb );
+	ASSERT( find_event(ctxa, 0, FE_CREATED | FE_IS_FILE, second.c_str()) < 0 );
+	PASS();
+}
+
+// Creates a shared system and closes another one, from the engine thread
+struct SReopenContext
+{
+	HFES 			m_Close;
+	HFES 			m_Opened;
+	SBatchContext 	m_OpenedCtx;
+	std::string 	m_Dir;
+	std::atomic<uint32_t> m_NumEvents;
+	uint32_t 		_pad;
+};
+
+static int ReopenCallback( const SFileEvent* events, uint32_t count, const char* strings, void* _ctx )
+{
+	(void)events; (void)strings;
+	SReopenContext* ctx = (SReopenContext*)_ctx;
+	if( ctx->m_NumEvents == 0 )
+	{
+		fe_close(ctx->m_Close);
+		SFileEventsCreateParams params;
+		params.m_SharedEngine = true;
+		params.m_BatchCallback = BatchCallback;
+		params.m_CallbackCtx = &ctx->m_OpenedCtx;
+		ctx->m_Opened = fe_init(params);
+		fe_add_watch(ctx->m_Opened, ctx->m_Dir.c_str(), 0);
+	}
+	ctx->m_NumEvents += count;
+	return 0;
+}
+
+TEST FE_SharedEngineFromCallback()
+{
+	// Declared first, so that they outlive the systems
+	SBatchContext ctxb;
+	SReopenContext ctx;
+	FEBATCHTEST();
+	std::string dir = fe.make_dir(fe.get_path("reopen"));
+	std::string first = fe.cleanup(dir + "/first.txt");
+	std::string second = fe.cleanup(dir + "/second.txt");
+
+	SFileEventsCreateParams params;
+	params.m_SharedEngine = true;
+	params.m_BatchCallback = BatchCallback;
+	params.m_CallbackCtx = &ctxb;
+	HFES b = fe_init(params);
+
+	ctx.m_Close = b;
+	ctx.m_Opened = 0;
+	ctx.m_Dir = dir;
+	ctx.m_NumEvents = 0;
+	params.m_BatchCallback = ReopenCallback;
+	params.m_CallbackCtx = &ctx;
+	HFES a = fe.init(params);
+
+	ASSERT_NE( -1, fe_add_watch(b, dir.c_str(), 0) );
+	ASSERT_NE( -1, fe_add_watch(a, dir.c_str(), 0) );
+
+	// The callbacks run without the engine lock, so they don't deadlock
+	fclose(fopen(first.c_str(), "wb"));
+	ASSERT( wait_until([&]() { return ctx.m_NumEvents > 0; }) );
+	fclose(fopen(second.c_str(), "wb"));
+	bool opened = wait_event(ctx.m_OpenedCtx, FE_CREATED | FE_IS_FILE, second.c_str());
+	wait_until([&]() { return ctx.m_NumEvents >= 2; });
+
+	fe.close();
+	ASSERT( ctx.m_Opened != 0 );
+	fe_close(ctx.m_Opened);
+
+	ASSERT( opened );
+	ASSERT( ctx.m_NumEvents >= 2 );
+	ASSERT( find_event(ctxb, 0, FE_CREATED | FE_IS_FILE, second.c_str()) < 0 );
+	PASS();
+}
+
+TEST FE_WatchFilters()
+{
+	FEBATCHTEST();
+	const char* exclude[] = { "# build output", "build/", "*.o", "!keep.o", "/top.txt" };
+	SFileFilter* filter = fe_filter_create(0, 0, exclude, 5);
+	ASSERT( filter != 0 );
+	ASSERT( !fe_filter_match_path(filter, "build", 5, true) );
+	ASSERT( fe_filter_match_path(filter, "build", 5, false) );
+	ASSERT( !fe_filter_match_path(filter, "src/build/a.txt", 15, false) );
+	ASSERT( !fe_filter_match_path(filter, "src/a.o", 7, false) );
+	ASSERT( fe_filter_match_path(filter, "src/keep.o", 10, false) );
+	ASSERT( !fe_filter_match_path(filter, "top.txt", 7, false) );
+	ASSERT( fe_filter_match_path(filter, "src/top.txt", 11, false) );
+	fe_filter_destroy(filter);
+
+	std::string dir = fe.make_dir(fe.get_path("filtered"));
+	std::string build = fe.make_dir(dir + "/build");
+	std::string built = fe.cleanup(build + "/x.txt");
+	std::string object = fe.cleanup(dir + "/a.o");
+	std::string keep = fe.cleanup(dir + "/keep.txt");
+	std::string subdir = dir + "/src";
+	std::string subobject = fe.cleanup(subdir + "/b.o");
+	std::string subkeep = fe.cleanup(subdir + "/c.txt");
+
+	SFileEventsCreateParams params;
+	HFES hfes = fe.init(params);
+
+	SFileEventsWatchParams watchparams;
+	watchparams.m_Exclude = exclude;
+	watchparams.m_NumExclude = 5;
+	watchparams.m_Mask = FE_RECURSIVE;
+	ASSERT_NE( -1, fe_add_watch_ex(hfes, dir.c_str(), watchparams) );
+
+	const SBatchContext& ctx = fe.m_Batch;
+	fclose(fopen(built.c_str(), "wb"));
+	fclose(fopen(object.c_str(), "wb"));
+	fclose(fopen(keep.c_str(), "wb"));
+	fe.make_dir(subdir);
+	ASSERT( wait_event(ctx, FE_CREATED | FE_IS_DIR, subdir.c_str()) );
+	fclose(fopen(subobject.c_str(), "wb"));
+	fclose(fopen(subkeep.c_str(), "wb"));
+	// The excluded files were written before the last one, so they would have been reported by now
+	ASSERT( wait_event(ctx, FE_CREATED | FE_IS_FILE, subkeep.c_str()) );
+	fe.close();
+
+	ASSERT( find_event(ctx, 0, FE_CREATED | FE_IS_FILE, keep.c_str()) >= 0 );
+	for( size_t i = 0; i < ctx.m_Paths.size(); ++i )
+	{
+		ASSERT( ctx.m_Paths[i].find("/build") == std::string::npos );
+		ASSERT( ctx.m_Paths[i].find(".o") == std::string::npos );
+	}
+	PASS();
+}
+
+TEST FE_WatchMask()
+{
+	FEBATCHTEST();
+	std::string dir = fe.make_dir(fe.get_path("masked"));
+	std::string src = fe.cleanup(dir + "/src.txt");
+	std::string dst = fe.cleanup(dir + "/dst.txt");
+
+	SFileEventsCreateParams params;
+	fe.init(params);
+	HFESWatchID wid = fe.add_watch(dir.c_str(), FE_CREATED | FE_REMOVED);
+	ASSERT_NE( -1, wid );
+
+	// The writes aren't wanted, and the rename is reported as a removal and a creation
+	const SBatchContext& ctx = fe.m_Batch;
+	FILE* file = fopen(src.c_str(), "wb");
+	fwrite("data", 1, 4, file);
+	fclose(file);
+	rename(src.c_str(), dst.c_str());
+	ASSERT( wait_event(ctx, FE_CREATED | FE_IS_FILE, dst.c_str()) );
+	size_t start = num_events(ctx);
+
+	// Asking for the modifications too
+	ASSERT_EQ( wid, fe.add_watch(dir.c_str(), FE_ALL) );
+	file = fopen(dst.c_str(), "ab");
+	fwrite("data", 1, 4, file);
+	fclose(file);
+	ASSERT( wait_event(ctx, FE_MODIFIED | FE_IS_FILE, dst.c_str(), start) );
+	fe.close();
+
+	ASSERT( find_event(ctx, 0, FE_CREATED | FE_IS_FILE, src.c_str()) >= 0 );
+	ASSERT( find_event(ctx, 0, FE_REMOVED | FE_IS_FILE, src.c_str()) >= 0 );
+	for( size_t i = 0; i < start; ++i )
+		ASSERT_EQ( 0u, ctx.m_Events[i].m_Flags & (FE_MODIFIED | FE_RENAMED) );
+	PASS();
+}
+
+TEST FE_WatchRecursionToggled()
+{
+	FEBATCHTEST();
+	std::string dir = fe.make_dir(fe.get_path("toggled"));
+	std::string sub = fe.make_dir(dir + "/sub");
+	std::string first = fe.cleanup(sub + "/first.txt");
+	std::string second = fe.cleanup(sub + "/second.txt");
+	std::string flat = fe.cleanup(dir + "/flat.txt");
+
+	SFileEventsCreateParams params;
+	HFES hfes = fe.init(params);
+	HFESWatchID wid = fe.add_watch(dir.c_str(), FE_ALL);
+	ASSERT_NE( -1, wid );
+
+	// Made recursive: the existing sub directory is watched too
+	const SBatchContext& ctx = fe.m_Batch;
+	ASSERT_EQ( wid, fe.add_watch(dir.c_str(), FE_ALL | FE_RECURSIVE) );
+	SFileEventsStats stats;
+	fe_get_stats(hfes, &stats);
+	uint32_t recursivewatches = stats.m_KernelWatches;
+	fclose(fopen(first.c_str(), "wb"));
+	ASSERT( wait_event(ctx, FE_CREATED | FE_IS_FILE, first.c_str()) );
+
+	// And not recursive again: the sub directory is released (the file in the root is reported after it would have been)
+	ASSERT_EQ( wid, fe.add_watch(dir.c_str(), FE_ALL) );
+	fe_get_stats(hfes, &stats);
+	uint32_t flatwatches = stats.m_KernelWatches;
+	fclose(fopen(second.c_str(), "wb"));
+	fclose(fopen(flat.c_str(), "wb"));
+	ASSERT( wait_event(ctx, FE_CREATED | FE_IS_FILE, flat.c_str()) );
+	fe.close();
+
+	ASSERT_EQ( 2u, recursivewatches );
+	ASSERT_EQ( 1u, flatwatches );
+	ASSERT_EQ( -1, find_event(ctx, 0, FE_CREATED | FE_IS_FILE, second.c_str()) );
+	PASS();
+}
+
+struct SAddWatchesContext
+{
+	std::vector<HFESWatchID>	m_IDs;
+	std::atomic<int>			m_Done;
+};
+
+static void AddWatchesCallback( const HFESWatchID* ids, uint32_t count, void* _ctx )
+{
+	SAddWatchesContext* ctx = (SAddWatchesContext*)_ctx;
+	ctx->m_IDs.assign(ids, ids + count);
+	ctx->m_Done = 1;
+}
+
+TEST FE_AddWatches()
+{
+	// Declared first, so that it outlives the system
+	SAddWatchesContext added;
+	FEBATCHTEST();
+	std::string root = fe.make_dir(fe.get_path("batch"));
+	std::string dira = fe.make_dir(root + "/a");
+	std::string dirb = fe.make_dir(root + "/b");
+	std::string missing = root + "/missing";
+	std::string file = fe.cleanup(dirb + "/async.txt");
+
+	// Out of order, with a path that can't be watched
+	const char* paths[] = { dirb.c_str(), root.c_str(), missing.c_str(), dira.c_str() };
+	const uint32_t masks[] = { FE_CREATED, FE_CREATED | FE_RECURSIVE, FE_CREATED, FE_CREATED };
+	HFESWatchID ids[4];
+	SFileEventsCreateParams params;
+	HFES hfes = fe.init(params);
+	ASSERT_EQ( 3, fe_add_watches(hfes, paths, masks, 4, ids) );
+	ASSERT_EQ( -1, ids[2] );
+	ASSERT( ids[0] != -1 && ids[1] != -1 && ids[3] != -1 );
+	ASSERT( ids[0] != ids[1] && ids[1] != ids[3] && ids[0] != ids[3] );
+
+	// Adding them again only gives back the same ids
+	HFESWatchID again[4];
+	ASSERT_EQ( 3, fe_add_watches(hfes, paths, masks, 4, again) );
+	for( uint32_t i = 0; i < 4; ++i )
+		ASSERT_EQ( ids[i], again[i] );
+
+	// The nested paths are still found after the watch above them is removed (they share their parents)
+	ASSERT_EQ( 0, fe_remove_watch(hfes, ids[1]) );
+	ASSERT_EQ( ids[0], fe_add_watch(hfes, dirb.c_str(), FE_CREATED) );
+	ASSERT_EQ( ids[3], fe_add_watch(hfes, dira.c_str(), FE_CREATED) );
+	HFESWatchID readded = fe_add_watch(hfes, root.c_str(), FE_CREATED | FE_RECURSIVE);
+	ASSERT( readded != -1 && readded != ids[1] );
+	fe.close();
+
+	// Added by the platform thread
+	hfes = fe.init(params);
+	added.m_Done = 0;
+	ASSERT_EQ( 0, fe_add_watches_async(hfes, paths, masks, 4, AddWatchesCallback, &added) );
+	ASSERT( wait_until([&]() { return added.m_Done != 0; }) );
+	ASSERT_EQ( 4u, (uint32_t)added.m_IDs.size() );
+	ASSERT_EQ( -1, added.m_IDs[2] );
+	ASSERT( added.m_IDs[0] != -1 && added.m_IDs[1] != -1 && added.m_IDs[3] != -1 );
+
+	FILE* f = fopen(file.c_str(), "wb");
+	fwrite("data", 1, 4, f);
+	fclose(f);
+	ASSERT( wait_event(fe.m_Batch, FE_CREATED | FE_IS_FILE, file.c_str()) );
+	PASS();
+}
+
+TEST FE_Stats()
+{
+	FEBATCHTEST();
+	std::string dir = fe.make_dir(fe.get_path("stats"));
+	std::string path = fe.cleanup(dir + "/file.txt");
+	std::string excluded = fe.cleanup(dir + "/file.tmp");
+
+	SFileEventsCreateParams params;
+	HFES hfes = fe.init(params);
+	const char* exclude[] = { "*.tmp" };
+	SFileEventsWatchParams watchparams;
+	watchparams.m_Exclude = exclude;
+	watchparams.m_NumExclude = 1;
+	watchparams.m_Mask = FE_CREATED;
+	ASSERT_NE( -1, fe_add_watch_ex(hfes, dir.c_str(), watchparams) );
+
+	// The excluded file isn't wanted. The counters of a callback call are added once it returns.
+	const SBatchContext& ctx = fe.m_Batch;
+	fclose(fopen(excluded.c_str(), "wb"));
+	fclose(fopen(path.c_str(), "wb"));
+	SFileEventsStats stats;
+	uint32_t numbatches = 0;
+	wait_until([&]() {
+		fe_get_stats(hfes, &stats);
+		std::lock_guard<std::mutex> lock(ctx.m_Lock);
+		numbatches = ctx.m_NumBatches;
+		return numbatches > 0 && stats.m_CallbackCalls == numbatches;
+	});
+
+	ASSERT_EQ( -1, fe_get_stats(0, &stats) );
+	ASSERT_EQ( 0, fe_get_stats(hfes, &stats) );
+	fe.close();
+
+	ASSERT( find_event(ctx, 0, FE_CREATED | FE_IS_FILE, path.c_str()) >= 0 );
+	ASSERT( stats.m_Reads > 0 );
+	ASSERT( stats.m_BytesRead > 0 );
+	ASSERT( stats.m_EventsRead >= 2 );
+	ASSERT( stats.m_EventsDispatched >= 1 );
+	ASSERT( stats.m_EventsFiltered >= 1 );
+	ASSERT_EQ( 1u, stats.m_KernelWatches );
+	ASSERT_EQ( 0u, stats.m_QueuedEvents );
+	ASSERT_EQ( (uint64_t)ctx.m_NumBatches, stats.m_CallbackCalls );
+	uint64_t calls = 0;
+	for( uint32_t i = 0; i < FE_STATS_HISTOGRAM_SIZE; ++i )
+		calls += stats.m_CallbackHistogram[i];
+	ASSERT_EQ( stats.m_CallbackCalls, calls );
+	PASS();
+}
+
+static void write_file(const char* path, const char* mode, const char* data)
+{
+	FILE* file = fopen(path, mode);
+	fwrite(data, 1, strlen(data), file);
+	fclose(file);
+}
+
+TEST FE_ContentHash()
+{
+	FEBATCHTEST();
+
+	// XXH64 test vectors
+	SContentHash empty;
+	ASSERT_EQ( 0xEF46DB3751D8E999ull, empty.digest() );
+	SContentHash abc;
+	abc.update("ab", 2);
+	abc.update("c", 1);
+	ASSERT_EQ( 0x44BC2CF5AD770999ull, abc.digest() );
+
+	std::string dir = fe.make_dir(fe.get_path("hashed"));
+	std::string path = fe.cleanup(dir + "/file.txt");
+	std::string moved = fe.cleanup(dir + "/moved.txt");
+	std::string marker = fe.cleanup(dir + "/marker.txt");
+	write_file(path.c_str(), "wb", "aaaa");
+
+	SFileEventsCreateParams params;
+	params.m_ContentHash = true;
+	fe.init(params);
+	ASSERT_NE( -1, fe.add_watch(dir.c_str(), FE_MODIFIED) );
+
+	// Each step ends with new bytes in the marker. Once that's reported, so is whatever the step did before it.
+	const SBatchContext& ctx = fe.m_Batch;
+	const uint32_t modified = FE_MODIFIED | FE_IS_FILE;
+	size_t steps = 0;
+	auto step = [&]() -> bool {
+		write_file(marker.c_str(), "wb", std::to_string(++steps).c_str());
+		return wait_until([&]() { return count_events(ctx, modified, marker.c_str()) == steps; });
+	};
+
+	write_file(path.c_str(), "wb", "bbbb");
+	ASSERT( step() );
+	size_t changed = count_events(ctx, modified, path.c_str());
+	write_file(path.c_str(), "wb", "bbbb");		// The same bytes
+	ASSERT( step() );
+	size_t rewritten = count_events(ctx, modified, path.c_str());
+	write_file(path.c_str(), "ab", "");			// Opened for writing, but not written
+	ASSERT( step() );
+	size_t untouched = count_events(ctx, modified, path.c_str());
+	write_file(path.c_str(), "wb", "cccc");
+	ASSERT( step() );
+	size_t changedagain = count_events(ctx, modified, path.c_str());
+	// The hash follows the file when it's renamed
+	rename(path.c_str(), moved.c_str());
+	ASSERT( step() );
+	write_file(moved.c_str(), "wb", "cccc");
+	ASSERT( step() );
+	size_t movedrewritten = count_events(ctx, modified, moved.c_str());
+	// New bytes, with the size and modification time of the last write (as with coarse timestamps)
+	struct stat st;
+	stat(moved.c_str(), &st);
+	FILE* file = fopen(moved.c_str(), "wb");
+	fwrite("dddd", 1, 4, file);
+	fflush(file);
+	struct timespec times[2] = { st.st_atim, st.st_mtim };
+	futimens(fileno(file), times);
+	fclose(file);
+	ASSERT( step() );
+	size_t sametime = count_events(ctx, modified, moved.c_str());
+	fe.close();
+
+	ASSERT_EQ( 1u, changed );
+	ASSERT_EQ( 1u, rewritten );
+	ASSERT_EQ( 1u, untouched );
+	ASSERT_EQ( 2u, changedagain );
+	ASSERT_EQ( 0u, movedrewritten );
+	ASSERT_EQ( 1u, sametime );
+	PASS();
+}
+
+TEST FE_IoUring()
+{
+	FEBATCHTEST();
+	std::string root = fe.make_dir(fe.get_path("uring"));
+	std::vector<std::string> files;
+	for( int i = 0; i < 2; ++i )
+	{
+		std::string dir = fe.make_dir(root + "/sub" + std::to_string(i));
+		for( int j = 0; j < 3; ++j )
+		{
+			files.push_back(fe.cleanup(dir + "/file" + std::to_string(j) + ".txt"));
+			FILE* file = fopen(files.back().c_str(), "wb");
+			fwrite("datadata", 1, 4 + (size_t)j, file);
+			fclose(file);
+		}
+	}
+	std::string created = fe.cleanup(root + "/sub1/created.txt");
+
+	// Falls back to epoll (and fstatat) if the kernel doesn't have io_uring, so the results are the same either way
+	SFileEventsCreateParams params;
+	params.m_IoUring = true;
+	params.m_RescanOnOverflow = true;
+	HFES hfes = fe.init(params);
+	ASSERT_NE( -1, fe.add_watch(root.c_str(), FE_ALL | FE_RECURSIVE) );
+
+	// The crawl stat'ed every entry (the root, the two directories and the files)
+	{
+		std::lock_guard<std::mutex> lock(hfes->m_Lock);
+		ASSERT_EQ( 9u, hfes->m_Snapshot->m_Count );
+		uint32_t index = hfes->m_Snapshot->find_path(files[5]);
+		ASSERT( index != FE_SNAPSHOT_NONE );
+		ASSERT_EQ( 6, (int)hfes->m_Snapshot->m_Entries[index].m_Info.m_Size );
+	}
+
+	FILE* file = fopen(created.c_str(), "wb");
+	fclose(file);
+	ASSERT( wait_event(fe.m_Batch, FE_CREATED | FE_IS_FILE, created.c_str()) );
+	PASS();
+}
+
+TEST FE_StatPoll()
+{
+	FEBATCHTEST();
+	std::string root = fe.make_dir(fe.get_path("statpoll"));
+	std::string sub = fe.make_dir(root + "/sub");
+	std::string modified = fe.cleanup(sub + "/modified.txt");
+	std::string created = fe.cleanup(sub + "/created.txt");
+	std::string newdir = root + "/newdir";
+	std::string newfile = fe.cleanup(newdir + "/file.txt");
+	std::string deep = fe.make_dir(sub + "/deep");
+	std::string deepfile = fe.cleanup(deep + "/file.txt");
+	std::string probe = fe.cleanup(deep + "/probe.txt");
+	FILE* file = fopen(modified.c_str(), "wb");
+	fwrite("a", 1, 1, file);
+	fclose(file);
+	fclose(fopen(deepfile.c_str(), "wb"));
+	fclose(fopen(probe.c_str(), "wb"));
+
+	SFileEventsCreateParams params;
+	params.m_Backend = FE_BACKEND_POLL;
+	params.m_PollIntervalMs = 10;
+	HFES hfes = fe.init(params);
+	ASSERT_NE( -1, fe.add_watch(root.c_str(), FE_ALL | FE_RECURSIVE) );
+
+	// Nothing is watched by the kernel
+	SFileEventsStats stats;
+	ASSERT_EQ( 0, fe_get_stats(hfes, &stats) );
+	ASSERT_EQ( 0u, stats.m_KernelWatches );
+
+	// The first pass is done once it has reached the deepest directory, and a change there is reported
+	const SBatchContext& ctx = fe.m_Batch;
+	ASSERT( wait_until([&]() {
+		write_file(probe.c_str(), "ab", "x");
+		return find_event(ctx, 0, FE_MODIFIED | FE_IS_FILE, probe.c_str()) >= 0;
+	}) );
+
+	file = fopen(created.c_str(), "wb");
+	fclose(file);
+	file = fopen(modified.c_str(), "ab");
+	fwrite("bc", 1, 2, file);
+	fclose(file);
+	fe.make_dir(newdir);
+	file = fopen(newfile.c_str(), "wb");
+	fclose(file);
+	wait_until([&]() {
+		return find_event(ctx, 0, FE_CREATED | FE_IS_FILE, created.c_str()) >= 0 &&
+			find_event(ctx, 0, FE_MODIFIED | FE_IS_FILE, modified.c_str()) >= 0 &&
+			find_event(ctx, 0, FE_CREATED | FE_IS_FILE, newfile.c_str()) >= 0;
+	});
+
+	remove(modified.c_str());
+	wait_event(ctx, FE_REMOVED | FE_IS_FILE, modified.c_str());
+	fe.close();
+
+	// The files that were there from the start aren't reported as created (the first pass lists the tree after the watch
+	// is added, and it sends nothing)
+	ASSERT( find_event(ctx, 0, FE_CREATED | FE_IS_FILE, modified.c_str()) < 0 );
+	ASSERT( find_event(ctx, 0, FE_CREATED | FE_IS_DIR, deep.c_str()) < 0 );
+	ASSERT( find_event(ctx, 0, FE_CREATED | FE_IS_FILE, deepfile.c_str()) < 0 );
+	ASSERT( find_event(ctx, 0, FE_CREATED | FE_IS_FILE, created.c_str()) >= 0 );
+	ASSERT( find_event(ctx, 0, FE_MODIFIED | FE_IS_FILE, modified.c_str()) >= 0 );
+	int dir = find_event(ctx, 0, FE_CREATED | FE_IS_DIR, newdir.c_str());
+	ASSERT( dir >= 0 );
+	ASSERT( find_event(ctx, (size_t)dir, FE_CREATED | FE_IS_FILE, newfile.c_str()) > dir );
+	ASSERT( find_event(ctx, 0, FE_REMOVED | FE_IS_FILE, modified.c_str()) >= 0 );
+	PASS();
+}
+
+TEST FE_FanotifyBackend()
+{
+	FEBATCHTEST();
+	// The events have the path the watch was registered with, not the real one
+	std::string realdir = fe.make_dir(fe.get_path("fanotify"));
+	std::string dir = fe.cleanup(fe.get_path("fanotify_link"));
+	symlink(realdir.c_str(), dir.c_str());
+	std::string subdir = dir + "/sub";
+	std::string src = subdir + "/src.txt";
+	std::string dst = subdir + "/dst.txt";
+	std::string outside = fe.cleanup(fe.get_path("fanotify_outside.txt"));
+	fe.make_dir(realdir + "/sub");
+	fe.cleanup(realdir + "/sub/src.txt");
+	fe.cleanup(realdir + "/sub/dst.txt");
+
+	// Falls back to inotify if the process isn't allowed to use fanotify, and the events should be the same
+	SFileEventsCreateParams params;
+	params.m_Backend = FE_BACKEND_FANOTIFY;
+	fe.init(params);
+	HFESWatchID wid = fe.add_watch(dir.c_str(), FE_ALL | FE_RECURSIVE);
+	ASSERT_NE( -1, wid );
+
+	fclose(fopen(outside.c_str(), "wb"));
+	fclose(fopen(src.c_str(), "wb"));
+	rename(src.c_str(), dst.c_str());
+	remove(dst.c_str());
+
+	ASSERT( wait_event(fe.m_Batch, FE_REMOVED | FE_IS_FILE, dst.c_str()) );
+	fe.close();
+
+	const SBatchContext& ctx = fe.m_Batch;
+	ASSERT_EQ( 3, ctx.m_Events.size() );
+	ASSERT_EQ( FE_CREATED | FE_IS_FILE, ctx.m_Events[0].m_Flags );
+	ASSERT_STR_EQ( src.c_str(), ctx.m_Paths[0].c_str() );
+	ASSERT_EQ( FE_RENAMED | FE_IS_FILE, ctx.m_Events[1].m_Flags );
+	ASSERT_STR_EQ( src.c_str(), ctx.m_Paths[1].c_str() );
+	ASSERT_STR_EQ( dst.c_str(), ctx.m_Targets[1].c_str() );
+	ASSERT_EQ( FE_REMOVED | FE_IS_FILE, ctx.m_Events[2].m_Flags );
+	ASSERT_STR_EQ( dst.c_str(), ctx.m_Paths[2].c_str() );
+	PASS();
+}
+
+// With fanotify, the events for a path are sent to every watch of it (inotify sends them to one of the watches of the directory)
+
+// With fanotify, the events for a path are sent to every watch of it (inotify sends them to one of the watches of the directory)
+TEST FE_FanotifyOverlappingWatches()
+{
+	FEBATCHTEST();
+	std::string dir = fe.make_dir(fe.get_path("fanotify_overlap"));
+	std::string subdir = fe.make_dir(dir + "/sub");
+	std::string file = fe.cleanup(subdir + "/file.txt");
+
+	SFileEventsCreateParams params;
+	params.m_Backend = FE_BACKEND_FANOTIFY;
+	HFES hfes = fe.init(params);
+	HFESWatchID outer = fe.add_watch(dir.c_str(), FE_ALL | FE_RECURSIVE);
+	HFESWatchID inner = fe.add_watch(subdir.c_str(), FE_CREATED);
+	ASSERT_NE( -1, outer );
+	ASSERT_NE( -1, inner );
+
+	// One mark for the file system, or one kernel watch per directory if it fell back to inotify
+	SFileEventsStats stats;
+	fe_get_stats(hfes, &stats);
+	bool fanotify = stats.m_KernelWatches == 1;
+	if( !fanotify )
+		SKIPm("fanotify isn't available");
+
+	fclose(fopen(file.c_str(), "wb"));
+	remove(file.c_str());
+
+	// The kernel may merge the two events of the file into one
+	const SBatchContext& ctx = fe.m_Batch;
+	wait_until([&]() {
+		std::lock_guard<std::mutex> lock(ctx.m_Lock);
+		for( size_t i = 0; i < ctx.m_Events.size(); ++i )
+		{
+			if( ctx.m_Events[i].m_WatchID == outer && (ctx.m_Events[i].m_Flags & FE_REMOVED) )
+				return true;
+		}
+		return false;
+	});
+	fe.close();
+
+	uint32_t outerflags = 0;
+	uint32_t innerflags = 0;
+	for( size_t i = 0; i < ctx.m_Events.size(); ++i )
+	{
+		ASSERT_STR_EQ( file.c_str(), ctx.m_Paths[i].c_str() );
+		if( ctx.m_Events[i].m_WatchID == outer )
+			outerflags |= ctx.m_Events[i].m_Flags;
+		else if( ctx.m_Events[i].m_WatchID == inner )
+			innerflags |= ctx.m_Events[i].m_Flags;
+	}
+	ASSERT_EQ( FE_CREATED | FE_REMOVED | FE_IS_FILE, outerflags );
+	// The inner watch only wants the creations
+	ASSERT_EQ( FE_CREATED | FE_IS_FILE, innerflags );
+	PASS();
+}
+
 static SUITE(the_suite) {
     //RUN_TEST(FE_CreateDestroy);
     //RUN_TEST(FE_NoWatchers);
     //RUN_TEST(FE_EventAfterWatchWasRemoved);
+    RUN_TEST(FE_HashIndex);
+    RUN_TEST(FE_SnapshotDiff);
+    RUN_TEST(FE_PathTree);
     RUN_TEST(FE_OneCreateEvent);
+    RUN_TEST(FE_RecursiveCreateEvent);
+    RUN_TEST(FE_RecursiveNewDirectory);
+    RUN_TEST(FE_BatchCallback);
+    RUN_TEST(FE_PollEvents);
+    RUN_TEST(FE_PollEventsSmallBuffer);
+    RUN_TEST(FE_CoalesceEvents);
+    RUN_TEST(FE_RenameEvent);
+    RUN_TEST(FE_RenamePairing);
+    RUN_TEST(FE_RenameOutRecreated);
+    RUN_TEST(FE_RecursiveRecreated);
+    RUN_TEST(FE_OverflowRescan);
+    RUN_TEST(FE_FanotifyBackend);
+    RUN_TEST(FE_FanotifyOverlappingWatches);
+    RUN_TEST(FE_IoUring);
+    RUN_TEST(FE_StatPoll);
+    RUN_TEST(FE_Journal);
+    RUN_TEST(FE_DispatchThreads);
+    RUN_TEST(FE_DispatchRenameOrder);
+    RUN_TEST(FE_SharedEngine);
+    RUN_TEST(FE_SharedEngineFromCallback);
+    RUN_TEST(FE_WatchFilters);
+    RUN_TEST(FE_WatchMask);
+    RUN_TEST(FE_WatchRecursionToggled);
+    RUN_TEST(FE_AddWatches);
+    RUN_TEST(FE_Stats);
+    RUN_TEST(FE_ContentHash);
 }
 
 GREATEST_MAIN_DEFS();